@@ -0,0 +1,255 @@
+#pragma once
+
+#include <sys/stat.h>
+
+#include <atomic>
+#include <cstdint>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <vector>
+
+#include <Magick++.h>
+
+#include "asset_pack.hpp"
+#include "lru_cache.hpp"
+#include "magick_raster.hpp"
+#include "raster.hpp"
+#include "resample.hpp"
+#include "scratch.hpp"
+#include "stage_timer.hpp"
+
+namespace Sayobot {
+    // 文件的修改时间和大小，用于判断缓存是否过期
+    struct FileStamp {
+        int64_t mtime = 0;
+        int64_t fsize = 0;
+
+        bool operator==(const FileStamp& other) const {
+            return mtime == other.mtime && fsize == other.fsize;
+        }
+
+        // 文件不存在时返回 false
+        static bool Of(const std::string& path, FileStamp& stamp) {
+            struct stat st;
+            if (stat(path.c_str(), &st) != 0) return false;
+            stamp.mtime = static_cast<int64_t>(st.st_mtime);
+            stamp.fsize = static_cast<int64_t>(st.st_size);
+            return true;
+        }
+    };
+
+    /*
+     * 进程内共享的素材缓存
+     * 保存已经解码并缩放好的预乘 RGBA8 位图，键为 (路径, 宽, 高, 修改时间)
+     * 超出字节预算时按 LRU 淘汰
+     * 设置了素材包时，包中已有的图片直接引用映射的像素，不再解码、缩放和复制
+     */
+    class AssetCache {
+    public:
+        static AssetCache& Instance() {
+            static AssetCache instance;
+            return instance;
+        }
+
+        /*
+         * 路径固定的图片的句柄，在布局编译时取得（见 Layout::Compile）
+         * 路径和缓存键预先拼好，绘制时不再格式化；
+         * 记住上一次取得的位图，文件没有修改、缓存没有失效时不再查找缓存
+         */
+        class Handle {
+        public:
+            Handle(const std::string& path, size_t width, size_t height)
+                : path(path), width(width), height(height) {
+                MakeKey(path, width, height, key);
+            }
+
+            const std::string path;
+            const size_t width, height;
+
+        private:
+            friend class AssetCache;
+            std::string key;
+            std::mutex mutex; // 保护以下成员
+            FileStamp stamp;
+            uint64_t generation = 0;
+            SharedBitmap bitmap;
+        };
+
+        /*
+         * 取得缩放好的图片，未命中时读取文件
+         * 参数列表:
+         *** path (const std::string&) 图片路径
+         *** width, height (size_t) 缩放尺寸，都为 0 时保持原尺寸
+         * 文件不存在或无法解码时抛出 Magick::Exception
+         */
+        SharedBitmap Get(const std::string& path, size_t width = 0, size_t height = 0) {
+            FileStamp stamp;
+            if (!FileStamp::Of(path, stamp)) {
+                // 文件不存在时不缓存，交给 Magick 抛出异常
+                return Decode(path, width, height);
+            }
+            Scratch<std::string> scratch;
+            const std::string& key = MakeKey(path, width, height, *scratch);
+            return Lookup(path, width, height, key, stamp);
+        }
+
+        // 以句柄取得图片，与 Get(handle.path, handle.width, handle.height) 相同
+        SharedBitmap Get(Handle& handle) {
+            FileStamp stamp;
+            if (!FileStamp::Of(handle.path, stamp))
+                return Decode(handle.path, handle.width, handle.height);
+            const uint64_t current = generation.load(std::memory_order_acquire);
+            {
+                std::lock_guard<std::mutex> lock(handle.mutex);
+                if (handle.bitmap && handle.generation == current && handle.stamp == stamp) {
+                    Metrics::Instance().asset_cache.Hit();
+                    return handle.bitmap;
+                }
+            }
+            const SharedBitmap bitmap =
+                Lookup(handle.path, handle.width, handle.height, handle.key, stamp);
+            std::lock_guard<std::mutex> lock(handle.mutex);
+            handle.stamp = stamp;
+            handle.generation = current;
+            handle.bitmap = bitmap;
+            return bitmap;
+        }
+
+        // 使以 prefix 开头的路径对应的缓存失效，prefix 为空时清空全部
+        void Invalidate(const std::string& prefix = "") {
+            generation.fetch_add(1, std::memory_order_acq_rel);
+            if (prefix.empty()) {
+                cache.Clear();
+                return;
+            }
+            // 键以路径开头
+            cache.EraseIf([&prefix](const std::string& key, const Entry&) {
+                return !key.compare(0, prefix.size(), prefix);
+            });
+        }
+
+        /*
+         * 设置素材包，pack 为空时取消
+         * 参数列表:
+         *** pack 已打开的素材包
+         *** root (const std::string&) 素材目录，包中的路径相对于这个目录
+         */
+        void SetPack(std::shared_ptr<const AssetPack> pack, const std::string& root) {
+            {
+                std::lock_guard<std::mutex> lock(pack_mutex);
+                this->pack = std::move(pack);
+                pack_root = root;
+            }
+            generation.fetch_add(1, std::memory_order_acq_rel);
+            cache.Clear();
+        }
+
+        void SetLimit(size_t bytes) {
+            cache.SetLimit(bytes);
+        }
+
+        size_t Limit() {
+            return cache.Limit();
+        }
+
+        size_t Usage() {
+            return cache.Usage();
+        }
+
+    private:
+        // 命中时整个复制出来，不放字符串
+        struct Entry {
+            FileStamp stamp;
+            SharedBitmap bitmap;
+            bool mapped = false; // 像素在素材包中
+        };
+
+        AssetCache() : cache(256u << 20) {
+        }
+
+        static const std::string& MakeKey(const std::string& path, size_t width,
+                                          size_t height, std::string& key) {
+            key.assign(path);
+            key += '\n';
+            AppendInt(key, (long long)width);
+            key += 'x';
+            AppendInt(key, (long long)height);
+            return key;
+        }
+
+        // 按拼好的键查找缓存，未命中或文件已修改时读取文件
+        SharedBitmap Lookup(const std::string& path, size_t width, size_t height,
+                            const std::string& key, const FileStamp& stamp) {
+            Entry entry;
+            if (cache.Get(key, entry)) {
+                if (entry.stamp == stamp) {
+                    Metrics::Instance().asset_cache.Hit();
+                    return entry.bitmap;
+                }
+                // 文件已被修改，丢弃旧的解码结果
+                cache.Erase(key);
+            }
+
+            Metrics::Instance().asset_cache.Miss();
+            // 解码时不持有锁，避免不同素材互相阻塞
+            entry.stamp = stamp;
+            entry.bitmap = Load(path, width, height, stamp, entry.mapped);
+            // 引用素材包的条目只占很少的内存
+            cache.Put(key,
+                      entry,
+                      entry.mapped ? 64 : entry.bitmap.view.height * entry.bitmap.view.stride);
+            return entry.bitmap;
+        }
+
+        SharedBitmap Load(const std::string& path, size_t width, size_t height,
+                          const FileStamp& stamp, bool& mapped) {
+            std::shared_ptr<const AssetPack> pack;
+            std::string root;
+            {
+                std::lock_guard<std::mutex> lock(pack_mutex);
+                pack = this->pack;
+                root = pack_root;
+            }
+            BitmapView bitmap;
+            if (pack && !path.compare(0, root.size(), root)
+                && pack->Find(path.substr(root.size()),
+                              width,
+                              height,
+                              stamp.mtime,
+                              stamp.fsize,
+                              bitmap)) {
+                // 素材包保持映射，位图直接指向包中的像素
+                SharedBitmap shared;
+                shared.view = bitmap;
+                shared.owner = pack;
+                mapped = true;
+                return shared;
+            }
+            mapped = false;
+            return Decode(path, width, height);
+        }
+
+        static SharedBitmap Decode(const std::string& path, size_t width, size_t height) {
+            Magick::Image image;
+            {
+                ScopedStage timer(
+                    StageDecode, &path, &Metrics::Instance().decode[ClassifyAsset(path)]);
+                image.read(path);
+            }
+            Raster raster = RasterFromMagick(image);
+            if (width && height) {
+                ScopedStage timer(StageResize, &path);
+                Raster resized = Resampler::Instance().ResizeToFit(raster.View(), width, height);
+                if (!resized.Empty()) raster = std::move(resized);
+            }
+            return SharedBitmap::Of(std::move(raster));
+        }
+
+        LruCache<Entry> cache;
+        std::atomic<uint64_t> generation{0}; // Invalidate、SetPack 时增加，使句柄记住的位图失效
+        std::mutex pack_mutex;
+        std::shared_ptr<const AssetPack> pack;
+        std::string pack_root;
+    };
+} // namespace Sayobot
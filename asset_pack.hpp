@@ -0,0 +1,255 @@
+#pragma once
+
+#include <fcntl.h>
+#include <sys/stat.h>
+#ifndef WIN32
+#include <sys/mman.h>
+#include <unistd.h>
+#endif
+
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <stdexcept>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+#include "bitmap.hpp"
+
+#define SAYOBOT_ASSET_PACK_MAGIC 0x4b505953u // "SYPK"
+#define SAYOBOT_ASSET_PACK_VERSION 1
+
+namespace Sayobot {
+    /*
+     * 素材包文件格式（小端）
+     * PackHeader，之后是 count 个 PackEntry，再之后是路径字符串和像素数据
+     * 像素为预乘的 RGBA8，每张图从 64 字节对齐的位置开始，行之间没有填充
+     * 路径相对于素材目录（如 "/tk/default.png"），requested 为布局要求的缩放尺寸，
+     * 都为 0 时为原尺寸；width/height 为按比例缩放后的实际尺寸
+     */
+#pragma pack(push, 1)
+    struct PackHeader {
+        uint32_t magic;
+        uint32_t version;
+        uint32_t count;
+        uint32_t reserved;
+        uint64_t file_size;
+    };
+
+    struct PackEntry {
+        uint64_t path_offset;
+        uint32_t path_length;
+        uint32_t requested_width, requested_height;
+        uint32_t width, height;
+        uint32_t reserved;
+        uint64_t pixel_offset;
+        int64_t mtime, fsize; // 打包时源文件的修改时间和大小
+    };
+#pragma pack(pop)
+    static_assert(sizeof(PackHeader) == 24, "PackHeader layout");
+    static_assert(sizeof(PackEntry) == 56, "PackEntry layout");
+
+    /*
+     * 只读映射的素材包
+     * 多个进程映射同一个文件时共享同一份页缓存
+     */
+    class AssetPack {
+    public:
+        AssetPack(const AssetPack&) = delete;
+        AssetPack& operator=(const AssetPack&) = delete;
+
+        // 打开并校验素材包，失败时抛出 std::runtime_error
+        explicit AssetPack(const std::string& path) {
+            Map(path);
+            try {
+                Index(path);
+            } catch (...) {
+                Unmap();
+                throw;
+            }
+        }
+
+        ~AssetPack() {
+            Unmap();
+        }
+
+        /*
+         * 查找 path 按 (width, height) 缩放后的图片
+         * 源文件的修改时间或大小与打包时不同时视为不存在
+         */
+        bool Find(const std::string& path, size_t width, size_t height,
+                  int64_t mtime, int64_t fsize, BitmapView& out) const {
+            auto it = index.find(Key(path, width, height));
+            if (it == index.end()) return false;
+            const PackEntry& e = *it->second;
+            if (e.mtime != mtime || e.fsize != fsize) return false;
+            out.width = e.width;
+            out.height = e.height;
+            out.stride = (size_t)e.width * 4;
+            out.pixels = data + e.pixel_offset;
+            return true;
+        }
+
+        size_t Count() const {
+            return index.size();
+        }
+
+        static std::string Key(const std::string& path, size_t width, size_t height) {
+            return path + '\n' + std::to_string(width) + 'x' + std::to_string(height);
+        }
+
+    private:
+        void Map(const std::string& path) {
+#ifndef WIN32
+            const int fd = open(path.c_str(), O_RDONLY);
+            if (fd < 0) throw std::runtime_error("Cannot open asset pack: " + path);
+            struct stat st;
+            if (fstat(fd, &st) != 0 || st.st_size < (off_t)sizeof(PackHeader)) {
+                close(fd);
+                throw std::runtime_error("Bad asset pack: " + path);
+            }
+            size = (size_t)st.st_size;
+            void* mapped = mmap(nullptr, size, PROT_READ, MAP_SHARED, fd, 0);
+            close(fd);
+            if (mapped == MAP_FAILED) throw std::runtime_error("Cannot map asset pack: " + path);
+            data = static_cast<const uint8_t*>(mapped);
+#else
+            FILE* file = fopen(path.c_str(), "rb");
+            if (!file) throw std::runtime_error("Cannot open asset pack: " + path);
+            fseek(file, 0, SEEK_END);
+            buffer.resize((size_t)ftell(file));
+            fseek(file, 0, SEEK_SET);
+            const bool ok = fread(buffer.data(), 1, buffer.size(), file) == buffer.size();
+            fclose(file);
+            if (!ok || buffer.size() < sizeof(PackHeader))
+                throw std::runtime_error("Bad asset pack: " + path);
+            size = buffer.size();
+            data = buffer.data();
+#endif
+        }
+
+        void Unmap() {
+#ifndef WIN32
+            if (data) munmap(const_cast<uint8_t*>(data), size);
+#endif
+            data = nullptr;
+        }
+
+        void Index(const std::string& path) {
+            PackHeader header;
+            memcpy(&header, data, sizeof(header));
+            if (header.magic != SAYOBOT_ASSET_PACK_MAGIC
+                || header.version != SAYOBOT_ASSET_PACK_VERSION || header.file_size != size
+                || (size - sizeof(PackHeader)) / sizeof(PackEntry) < header.count)
+                throw std::runtime_error("Bad asset pack: " + path);
+            const PackEntry* entries =
+                reinterpret_cast<const PackEntry*>(data + sizeof(PackHeader));
+            for (uint32_t i = 0; i < header.count; ++i) {
+                const PackEntry& e = entries[i];
+                const uint64_t pixels = (uint64_t)e.width * e.height * 4;
+                if (e.path_offset + e.path_length > size || e.pixel_offset > size
+                    || pixels > size - e.pixel_offset)
+                    throw std::runtime_error("Bad asset pack entry: " + path);
+                const std::string name(reinterpret_cast<const char*>(data + e.path_offset),
+                                       e.path_length);
+                index[Key(name, e.requested_width, e.requested_height)] = &e;
+            }
+        }
+
+        const uint8_t* data = nullptr;
+        size_t size = 0;
+#ifdef WIN32
+        std::vector<uint8_t> buffer;
+#endif
+        std::unordered_map<std::string, const PackEntry*> index;
+    };
+
+    /*
+     * 写入素材包
+     * 先 Add 所有图片，再 Write；Write 写入临时文件后改名
+     */
+    class AssetPackWriter {
+    public:
+        // pixels 为预乘的 RGBA8，行之间没有填充
+        void Add(const std::string& path, size_t requested_width, size_t requested_height,
+                 size_t width, size_t height, int64_t mtime, int64_t fsize,
+                 std::vector<uint8_t> pixels) {
+            items.push_back(Item{path,
+                                 (uint32_t)requested_width,
+                                 (uint32_t)requested_height,
+                                 (uint32_t)width,
+                                 (uint32_t)height,
+                                 mtime,
+                                 fsize,
+                                 std::move(pixels)});
+        }
+
+        size_t Count() const {
+            return items.size();
+        }
+
+        void Write(const std::string& path) const {
+            std::vector<PackEntry> entries(items.size());
+            uint64_t offset = sizeof(PackHeader) + sizeof(PackEntry) * items.size();
+            for (size_t i = 0; i < items.size(); ++i) {
+                entries[i].path_offset = offset;
+                entries[i].path_length = (uint32_t)items[i].path.size();
+                offset += items[i].path.size();
+            }
+            for (size_t i = 0; i < items.size(); ++i) {
+                offset = (offset + 63) & ~uint64_t(63);
+                PackEntry& e = entries[i];
+                e.requested_width = items[i].requested_width;
+                e.requested_height = items[i].requested_height;
+                e.width = items[i].width;
+                e.height = items[i].height;
+                e.reserved = 0;
+                e.pixel_offset = offset;
+                e.mtime = items[i].mtime;
+                e.fsize = items[i].fsize;
+                offset += items[i].pixels.size();
+            }
+            const PackHeader header{SAYOBOT_ASSET_PACK_MAGIC,
+                                    SAYOBOT_ASSET_PACK_VERSION,
+                                    (uint32_t)items.size(),
+                                    0,
+                                    offset};
+
+            const std::string temp = path + ".tmp";
+            FILE* file = fopen(temp.c_str(), "wb");
+            if (!file) throw std::runtime_error("Cannot write asset pack: " + path);
+            bool ok = fwrite(&header, sizeof(header), 1, file) == 1;
+            if (!entries.empty())
+                ok = ok
+                     && fwrite(entries.data(), sizeof(PackEntry), entries.size(), file)
+                            == entries.size();
+            for (const Item& item : items)
+                ok = ok
+                     && fwrite(item.path.data(), 1, item.path.size(), file)
+                            == item.path.size();
+            static const char zeros[64] = {};
+            for (size_t i = 0; ok && i < items.size(); ++i) {
+                const long position = ftell(file);
+                const size_t pad = (size_t)entries[i].pixel_offset - (size_t)position;
+                ok = fwrite(zeros, 1, pad, file) == pad
+                     && fwrite(items[i].pixels.data(), 1, items[i].pixels.size(), file)
+                            == items[i].pixels.size();
+            }
+            ok = fclose(file) == 0 && ok;
+            if (!ok || rename(temp.c_str(), path.c_str()) != 0) {
+                remove(temp.c_str());
+                throw std::runtime_error("Cannot write asset pack: " + path);
+            }
+        }
+
+    private:
+        struct Item {
+            std::string path;
+            uint32_t requested_width, requested_height, width, height;
+            int64_t mtime, fsize;
+            std::vector<uint8_t> pixels;
+        };
+        std::vector<Item> items;
+    };
+} // namespace Sayobot
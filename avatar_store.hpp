@@ -0,0 +1,249 @@
+#pragma once
+
+#include <cstdint>
+#include <cstdio>
+#include <memory>
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+#include <Magick++.h>
+
+#include "asset_cache.hpp"
+#include "bitmap.hpp"
+#include "lru_cache.hpp"
+#include "magick_raster.hpp"
+#include "resample.hpp"
+#include "scratch.hpp"
+#include "stage_timer.hpp"
+
+#define SAYOBOT_AVATAR_MAGIC 0x56415953u // "SYAV"
+#define SAYOBOT_AVATAR_VERSION 1
+#define SAYOBOT_AVATAR_SIZE 350
+
+namespace Sayobot {
+    // 解码好的头像缩略图，预乘 RGBA8
+    struct AvatarBitmap {
+        size_t width = 0, height = 0;
+        std::vector<uint8_t> pixels;
+
+        BitmapView View() const {
+            BitmapView view;
+            view.width = width;
+            view.height = height;
+            view.stride = width * 4;
+            view.pixels = pixels.data();
+            return view;
+        }
+    };
+
+    /*
+     * 头像库
+     * 下载的头像经 Ingest 校验、解码并缩放到 350x350 以内后，
+     * 以预乘 RGBA8 保存为 avatars/<uid>.avatar，渲染时直接读取，不需要解码
+     * 最近用过的头像保存在内存中的 LRU 里
+     * 只有旧的 <uid>.png 时，第一次用到会自动转换；无法解码的文件会被记住，
+     * 文件被替换前不再尝试
+     */
+    class AvatarStore {
+    public:
+        static AvatarStore& Instance() {
+            static AvatarStore instance;
+            return instance;
+        }
+
+        /*
+         * 校验并保存头像
+         * 参数列表:
+         *** png (const std::string&) 素材目录
+         *** user_id (int64_t) 用户 ID
+         *** data, length 下载得到的图片，格式由内容判断（PNG、JPEG、GIF 等）
+         * 无法解码时抛出异常，不修改已有的头像
+         */
+        void Ingest(const std::string& png, int64_t user_id, const void* data,
+                    size_t length) {
+            if (!data || !length) throw std::invalid_argument("Empty avatar");
+            Magick::Image image;
+            {
+                const std::string label = "avatar " + std::to_string(user_id);
+                ScopedStage timer(
+                    StageDecode, &label, &Metrics::Instance().decode[AssetAvatar]);
+                image.read(Magick::Blob(data, length));
+            }
+            Store(png, user_id, image);
+        }
+
+        // 由图片文件校验并保存头像
+        void IngestFile(const std::string& png, int64_t user_id, const std::string& path) {
+            Magick::Image image;
+            {
+                ScopedStage timer(StageDecode, &path, &Metrics::Instance().decode[AssetAvatar]);
+                image.read(path);
+            }
+            Store(png, user_id, image);
+        }
+
+        /*
+         * 取得头像，没有可用的头像时返回空指针，不抛出异常
+         */
+        std::shared_ptr<const AvatarBitmap> Get(const std::string& png, int64_t user_id) {
+            Scratch<std::string> path_scratch, key_scratch;
+            std::string& path = *path_scratch;
+            std::string& key = *key_scratch;
+            AvatarPath(png, user_id, path);
+            key.clear();
+            AppendInt(key, user_id);
+            key += '\n';
+            key += png;
+            Entry entry;
+            FileStamp stamp;
+            if (FileStamp::Of(path, stamp)) {
+                if (cache.Get(key, entry) && !entry.legacy && entry.stamp == stamp) {
+                    Metrics::Instance().avatar_cache.Hit();
+                    return entry.bitmap;
+                }
+                Metrics::Instance().avatar_cache.Miss();
+                entry.legacy = false;
+                entry.stamp = stamp;
+                entry.bitmap = Read(path);
+                Put(key, entry);
+                if (entry.bitmap) return entry.bitmap;
+            }
+
+            // 旧的头像文件，转换一次
+            Scratch<std::string> legacy_scratch;
+            std::string& legacy = *legacy_scratch;
+            LegacyPath(png, user_id, legacy);
+            if (!FileStamp::Of(legacy, stamp)) return nullptr;
+            if (cache.Get(key, entry) && entry.legacy && entry.stamp == stamp)
+                return entry.bitmap;
+            entry.legacy = true;
+            entry.stamp = stamp;
+            try {
+                IngestFile(png, user_id, legacy);
+                entry.bitmap = Read(path);
+            } catch (...) {
+                entry.bitmap = nullptr;
+            }
+            Put(key, entry);
+            return entry.bitmap;
+        }
+
+        void SetLimit(size_t bytes) {
+            cache.SetLimit(bytes);
+        }
+
+        void Clear() {
+            cache.Clear();
+        }
+
+        static std::string AvatarPath(const std::string& png, int64_t user_id) {
+            std::string path;
+            AvatarPath(png, user_id, path);
+            return path;
+        }
+
+        static std::string LegacyPath(const std::string& png, int64_t user_id) {
+            std::string path;
+            LegacyPath(png, user_id, path);
+            return path;
+        }
+
+        // 写入 out，复用它的容量
+        static void AvatarPath(const std::string& png, int64_t user_id, std::string& out) {
+            MakePath(png, user_id, ".avatar", out);
+        }
+
+        static void LegacyPath(const std::string& png, int64_t user_id, std::string& out) {
+            MakePath(png, user_id, ".png", out);
+        }
+
+        // 读取 .avatar 文件，格式不对时返回空指针
+        static std::shared_ptr<const AvatarBitmap> Read(const std::string& path) {
+            FILE* file = fopen(path.c_str(), "rb");
+            if (!file) return nullptr;
+            FileHeader header;
+            std::shared_ptr<AvatarBitmap> bitmap;
+            if (fread(&header, sizeof(header), 1, file) == 1
+                && header.magic == SAYOBOT_AVATAR_MAGIC
+                && header.version == SAYOBOT_AVATAR_VERSION && header.width
+                && header.height && header.width <= SAYOBOT_AVATAR_SIZE
+                && header.height <= SAYOBOT_AVATAR_SIZE) {
+                bitmap = std::make_shared<AvatarBitmap>();
+                bitmap->width = header.width;
+                bitmap->height = header.height;
+                bitmap->pixels.resize((size_t)header.width * header.height * 4);
+                if (fread(bitmap->pixels.data(), 1, bitmap->pixels.size(), file)
+                    != bitmap->pixels.size())
+                    bitmap = nullptr;
+            }
+            fclose(file);
+            return bitmap;
+        }
+
+    private:
+#pragma pack(push, 1)
+        struct FileHeader {
+            uint32_t magic;
+            uint16_t version;
+            uint16_t reserved;
+            uint32_t width, height;
+        };
+#pragma pack(pop)
+
+        // 命中时整个复制出来，不放字符串；键中已有用户和素材目录，来源只需区分新旧文件
+        struct Entry {
+            bool legacy = false; // 读取的是旧的 .png 头像
+            FileStamp stamp;
+            std::shared_ptr<const AvatarBitmap> bitmap; // 为空表示文件无法使用
+        };
+
+        AvatarStore() : cache(64u << 20) {
+        }
+
+        // png/avatars/<user_id><ext>
+        static void MakePath(const std::string& png, int64_t user_id, const char* ext,
+                             std::string& out) {
+            out.assign(png);
+            out += "/avatars/";
+            AppendInt(out, user_id);
+            out += ext;
+        }
+
+        void Put(const std::string& key, const Entry& entry) {
+            cache.Put(key, entry, entry.bitmap ? entry.bitmap->pixels.size() + 64 : 64);
+        }
+
+        // 缩放到 350x350 以内并写入 .avatar 文件（先写临时文件再改名）
+        void Store(const std::string& png, int64_t user_id, Magick::Image& image) {
+            Raster raster = RasterFromMagick(image);
+            if (raster.Empty()) throw std::runtime_error("Empty avatar");
+            {
+                ScopedStage timer(StageResize);
+                Raster resized = Resampler::Instance().ResizeToFit(
+                    raster.View(), SAYOBOT_AVATAR_SIZE, SAYOBOT_AVATAR_SIZE);
+                if (!resized.Empty()) raster = std::move(resized);
+            }
+            const size_t width = raster.Width(), height = raster.Height();
+
+            const std::string path = AvatarPath(png, user_id);
+            const std::string temp = path + ".tmp";
+            FILE* file = fopen(temp.c_str(), "wb");
+            if (!file) throw std::runtime_error("Cannot write avatar: " + path);
+            const FileHeader header{SAYOBOT_AVATAR_MAGIC,
+                                    SAYOBOT_AVATAR_VERSION,
+                                    0,
+                                    (uint32_t)width,
+                                    (uint32_t)height};
+            bool ok = fwrite(&header, sizeof(header), 1, file) == 1
+                      && fwrite(raster.Data(), 1, raster.Bytes(), file) == raster.Bytes();
+            ok = fclose(file) == 0 && ok;
+            if (!ok || rename(temp.c_str(), path.c_str()) != 0) {
+                remove(temp.c_str());
+                throw std::runtime_error("Cannot write avatar: " + path);
+            }
+        }
+
+        LruCache<Entry> cache;
+    };
+} // namespace Sayobot
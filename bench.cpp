@@ -0,0 +1,432 @@
+/*
+ * 渲染基准测试
+ * 生成一套合成的素材目录，用不同的参数反复调用 MakePersonalCard，
+ * 输出吞吐量、延迟分位数、各阶段耗时和峰值内存
+ *
+ * 用法: ./sayobot_bench [--iterations N] [--threads 1,2,4] [--warmup N]
+ *                       [--png 素材目录] [--font 字体文件] [--batch 列数]
+ *                       [--incremental 轮数]
+ * 不指定 --png 时在临时目录中生成素材
+ * 指定 --batch 时另外通过 Sayobot_RenderBatch 渲染一次，并拼成排行榜图
+ * 指定 --incremental 时另外比较同一用户再次刷新时增量绘制与完整绘制的耗时
+ * 最后统计 MakePersonalCard 每张卡片的堆分配次数（单线程与分带绘制各一遍），
+ * 除编码以外有分配时返回 1
+ */
+#include <sys/resource.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <new>
+#include <random>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "core.cpp"
+
+// 计数的全局分配函数，统计渲染路径上的堆分配（new[] 也经过这里）
+std::atomic<uint64_t> g_allocations{0};
+
+void* operator new(size_t size) {
+    g_allocations.fetch_add(1, std::memory_order_relaxed);
+    if (void* p = malloc(size ? size : 1)) return p;
+    throw std::bad_alloc();
+}
+
+void operator delete(void* p) noexcept {
+    free(p);
+}
+
+void operator delete(void* p, size_t) noexcept {
+    free(p);
+}
+
+namespace {
+    struct BenchOptions {
+        int iterations = 200;
+        int warmup = 10;
+        std::vector<int> threads = {1};
+        int batch_columns = 0; // 不为 0 时另外测试批量渲染接口，并按这个列数拼图
+        int incremental = 0;   // 不为 0 时另外比较增量绘制与完整绘制，为重复的轮数
+        std::string png;
+        std::string font = "/usr/share/fonts/truetype/dejavu/DejaVuSans.ttf";
+    };
+
+    const char* const kCountries[] = {"CN", "US", "JP", ""};
+
+    void MakeDir(const std::string& path) {
+        mkdir(path.c_str(), 0755);
+    }
+
+    // 生成一张渐变图，alpha 为 0 时不透明
+    void MakeAsset(const std::string& path, size_t width, size_t height,
+                   const std::string& from, const std::string& to, int alpha = 0) {
+        Magick::Image image;
+        image.size(Magick::Geometry(width, height));
+        image.read("gradient:" + from + "-" + to);
+        if (alpha) {
+            image.alpha(true);
+            image.evaluate(MagickCore::AlphaChannel,
+                           MagickCore::MultiplyEvaluateOperator,
+                           alpha / 100.0);
+        }
+        image.write(path);
+    }
+
+    // 按默认布局用到的路径生成素材目录，返回目录路径
+    std::string MakeAssetTree() {
+        char dir[] = "/tmp/sayobot-bench-XXXXXX";
+        if (!mkdtemp(dir)) {
+            perror("mkdtemp");
+            exit(1);
+        }
+        const std::string root = dir;
+        for (const char* sub : {"/stat", "/tk", "/rank", "/rank/sakura miku", "/world",
+                                "/country", "/avatars"})
+            MakeDir(root + sub);
+        MakeAsset(root + "/stat/bench.png", 1080, 1920, "#203040", "#8090a0");
+        MakeAsset(root + "/fx60.png", 1080, 1920, "#ffffff", "#000000", 60);
+        MakeAsset(root + "/tk/bench.png", 970, 600, "#ff8080", "#8080ff", 80);
+        for (const char* rank : {"X", "XH", "S", "SH", "A"})
+            MakeAsset(root + "/rank/sakura miku/ranking-" + rank + "-small.png",
+                      82, 98, "#ffd700", "#ff8c00");
+        for (const char* mode : {"osu", "taiko", "fruits", "mania"})
+            MakeAsset(root + "/rank/sakura miku/mode-" + mode + "-med.png",
+                      80, 80, "#ff66aa", "#ffffff");
+        MakeAsset(root + "/world/s.png", 100, 100, "#3399ff", "#66ff99");
+        for (const char* country : {"CN", "US", "JP", "__"})
+            MakeAsset(root + "/country/" + country + ".png", 80, 80, "#ff0000", "#ffff00");
+        MakeAsset(root + "/no-avatar.png", 256, 256, "#cccccc", "#333333");
+        // 只有一部分用户有头像，其余走 no-avatar.png
+        for (int uid = 1; uid <= 16; ++uid)
+            MakeAsset(root + "/avatars/" + std::to_string(uid) + ".png",
+                      256, 256, "#" + std::to_string(100000 + uid * 37), "#000000");
+        return root;
+    }
+
+    /*
+     * 生成第 i 组参数
+     * 每 4 组有一组 user_id == -1（没有对比数据），每 3 组有一组 days == 0
+     * visit 为同一用户第几次刷新，每次刷新第一个资料数字加 1
+     */
+    std::string MakeArgs(int i, int visit = 0) {
+        std::mt19937 random(i);
+        auto n = [&random](int lo, int hi) {
+            return std::to_string(std::uniform_int_distribution<int>(lo, hi)(random));
+        };
+        const bool no_stat = i % 4 == 0;
+        std::vector<std::string> f = {
+            "#ffffff", "#000000", "#333333", std::to_string(i % 4),
+            no_stat ? "-1" : std::to_string(i % 32 + 1), kCountries[i % 4],
+            "bench_user_" + std::to_string(i), n(10000, 99999999),
+            "sign of user " + std::to_string(i), "bench", "bench", "bench", "bench",
+            "60",
+            // user_info
+            n(0, 9999999), n(0, 999999), n(0, 99999), n(0, 99999),
+            n(0, 2000000000), n(0, 2000000000), n(0, 20000000), n(0, 15000) + ".37",
+            n(1, 50000), n(1, 1000000), n(0, 500), n(0, 500), n(0, 500), n(0, 500),
+            n(0, 5000), n(0, 9999999), n(1, 120) + ".55", n(60, 99) + ".1234",
+            // user_stat
+            n(0, 2000000000), n(0, 2000000000), n(0, 20000000), n(60, 99) + ".5",
+            n(0, 15000) + ".2", n(1, 120) + ".25", n(1, 1000000), n(1, 50000),
+            n(0, 99999), n(0, 500), n(0, 500), n(0, 500), n(0, 500), n(0, 5000),
+            i % 3 == 0 ? "0" : n(1, 30),
+            ""};
+        f[14] = std::to_string(std::stoll(f[14]) + visit);
+        std::string args;
+        for (size_t k = 0; k < f.size(); ++k) {
+            if (k) args += '\n';
+            args += f[k];
+        }
+        return args;
+    }
+
+    double Percentile(std::vector<double>& sorted, double p) {
+        if (sorted.empty()) return 0;
+        const size_t index = std::min(sorted.size() - 1, (size_t)(p * sorted.size()));
+        return sorted[index];
+    }
+
+    long PeakRssKb() {
+        struct rusage usage;
+        getrusage(RUSAGE_SELF, &usage);
+        return usage.ru_maxrss;
+    }
+
+    void Run(const BenchOptions& options, int threads,
+             const std::vector<std::string>& args) {
+        std::vector<std::vector<double>> latencies(threads);
+        std::vector<Sayobot::StageTimes> stages(threads);
+        std::atomic<int> next{0};
+        std::atomic<int> errors{0};
+        std::string first_error;
+        std::mutex error_mutex;
+
+        const auto begin = std::chrono::steady_clock::now();
+        std::vector<std::thread> workers;
+        for (int t = 0; t < threads; ++t) {
+            workers.emplace_back([&, t] {
+                const Sayobot::StageTimes before = Sayobot::ThreadStageTimes();
+                for (int i; (i = next++) < options.iterations;) {
+                    const auto start = std::chrono::steady_clock::now();
+                    const char* error = MakePersonalCard(args[i % args.size()].c_str());
+                    const auto end = std::chrono::steady_clock::now();
+                    latencies[t].push_back(
+                        std::chrono::duration<double, std::milli>(end - start).count());
+                    if (*error) {
+                        std::lock_guard<std::mutex> lock(error_mutex);
+                        if (!errors++) first_error = error;
+                    }
+                }
+                const Sayobot::StageTimes& after = Sayobot::ThreadStageTimes();
+                for (int s = 0; s < Sayobot::StageCount; ++s)
+                    stages[t].ns[s] = after.ns[s] - before.ns[s];
+            });
+        }
+        for (std::thread& worker : workers) worker.join();
+        const double seconds =
+            std::chrono::duration<double>(std::chrono::steady_clock::now() - begin).count();
+
+        std::vector<double> all;
+        for (const auto& l : latencies) all.insert(all.end(), l.begin(), l.end());
+        std::sort(all.begin(), all.end());
+        printf("threads %d: %d cards in %.2fs, %.1f cards/s, p50 %.2fms, p99 %.2fms\n",
+               threads,
+               options.iterations,
+               seconds,
+               options.iterations / seconds,
+               Percentile(all, 0.5),
+               Percentile(all, 0.99));
+        printf("  per card:");
+        for (int s = 0; s < Sayobot::StageCount; ++s) {
+            uint64_t total = 0;
+            for (const auto& st : stages) total += st.ns[s];
+            printf(" %s %.2fms", Sayobot::StageName(s), total / 1e6 / options.iterations);
+        }
+        printf("\n  peak rss %.1f MB\n", PeakRssKb() / 1024.0);
+        Sayobot::BufferPool& pool = Sayobot::BufferPool::Instance();
+        printf("  buffer pool: %llu hits, %llu misses (large allocations)\n",
+               (unsigned long long)pool.hits.load(),
+               (unsigned long long)pool.misses.load());
+        if (errors) printf("  %d errors, first: %s\n", errors.load(), first_error.c_str());
+    }
+
+    // 通过批量接口在线程池上渲染 iterations 张卡片
+    void RunBatch(const BenchOptions& options, const std::vector<std::string>& args) {
+        Sayobot_Batch* batch = Sayobot_CreateBatch();
+        for (int i = 0; i < options.iterations; ++i)
+            Sayobot_BatchAdd(batch, args[i % args.size()].c_str());
+        Sayobot_BatchSetTile(batch, options.batch_columns, 270, 0);
+        const auto begin = std::chrono::steady_clock::now();
+        const int status = Sayobot_RenderBatch(batch, 0);
+        const double seconds =
+            std::chrono::duration<double>(std::chrono::steady_clock::now() - begin).count();
+        printf("batch (%zu pool threads): %d cards in %.2fs, %.1f cards/s, tile %zu bytes\n",
+               Sayobot::ThreadPool::Shared().Size(),
+               options.iterations,
+               seconds,
+               options.iterations / seconds,
+               Sayobot_GetOutputSize(Sayobot_BatchTile(batch)));
+        if (status != SAYOBOT_OK)
+            printf("  %s\n", Sayobot_GetError(Sayobot_BatchTile(batch)));
+        printf("  peak rss %.1f MB\n", PeakRssKb() / 1024.0);
+        Sayobot_DestroyBatch(batch);
+    }
+
+    /*
+     * 比较同一用户再次刷新时增量绘制与完整绘制的每张耗时（不含编码）
+     * 每次刷新只有一个数字变化；关闭未编码的卡片缓存，两边都实际绘制
+     */
+    void RunIncremental(const BenchOptions& options) {
+        const int users = 16, rounds = options.incremental;
+        std::vector<std::vector<std::string>> visits(rounds + 1);
+        for (int v = 0; v <= rounds; ++v)
+            for (int i = 0; i < users; ++i) visits[v].push_back(MakeArgs(i, v));
+        Sayobot_Context ctx;
+        const auto render = [&ctx](const std::string& a) {
+            const auto start = std::chrono::steady_clock::now();
+            Sayobot::Render(
+                ctx,
+                [&a](Sayobot::CardArgs& out) {
+                    Sayobot::ParseCardArgs(a.c_str(), out);
+                },
+                nullptr,
+                false);
+            if (!ctx.error.empty()) fprintf(stderr, "render failed: %s\n", ctx.error.c_str());
+            return std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now()
+                                                             - start)
+                .count();
+        };
+        const size_t undated = Sayobot::UndatedCards().Limit();
+        const size_t previous = Sayobot::PreviousCards().Limit();
+        Sayobot::UndatedCards().SetLimit(0);
+        Sayobot::UndatedCards().Clear();
+
+        // 完整绘制：不保存上一张卡片
+        Sayobot::PreviousCards().SetLimit(0);
+        Sayobot::PreviousCards().Clear();
+        double full = 0;
+        for (int v = 1; v <= rounds; ++v)
+            for (const std::string& a : visits[v]) full += render(a);
+
+        // 增量绘制：第一次刷新只留下标记，第二次保存卡片，之后的刷新计时
+        Sayobot::PreviousCards().SetLimit(previous ? previous : 64u << 20);
+        for (const std::string& a : visits[0]) {
+            render(a);
+            render(a);
+        }
+        const uint64_t hits = Sayobot::Metrics::Instance().incremental.hits.load();
+        double incremental = 0;
+        for (int v = 1; v <= rounds; ++v)
+            for (const std::string& a : visits[v]) incremental += render(a);
+        const uint64_t hit =
+            Sayobot::Metrics::Instance().incremental.hits.load() - hits;
+
+        Sayobot::PreviousCards().SetLimit(previous);
+        Sayobot::PreviousCards().Clear();
+        Sayobot::UndatedCards().SetLimit(undated);
+        const int cards = users * rounds;
+        printf("incremental: full %.2fms, incremental %.2fms per card "
+               "(%llu/%d drawn incrementally)\n",
+               full / cards,
+               incremental / cards,
+               (unsigned long long)hit,
+               cards);
+    }
+
+    // 执行 f 期间的堆分配次数
+    template <typename F>
+    uint64_t CountAllocations(F f) {
+        const uint64_t before = g_allocations.load();
+        f();
+        return g_allocations.load() - before;
+    }
+
+    /*
+     * 统计 MakePersonalCard 每张卡片的堆分配次数，所有缓存先用同样的参数预热几遍
+     * 编码的分配为同一张卡片编码与不编码两次渲染之差，测出后扣除；
+     * 余下的部分（包括解析参数）应当为 0，不为 0 时返回 false
+     * 时间跨过整秒时字体会缓存新出现的字偶距，取几轮中最少的一轮
+     * label 为输出中这一遍的说明
+     */
+    bool CheckAllocations(const std::vector<std::string>& args, const char* label) {
+        Sayobot_Context ctx;
+        const auto render = [&ctx](const std::string& a, bool encode) {
+            // 不编码时 Render 会清空上一次的输出，这次分配算在编码里，先在计数以外清空
+            if (!encode) ctx.output = Magick::Blob();
+            return CountAllocations([&] {
+                Sayobot::Render(
+                    ctx,
+                    [&a](Sayobot::CardArgs& out) {
+                        Sayobot::ParseCardArgs(a.c_str(), out);
+                    },
+                    nullptr,
+                    encode);
+            });
+        };
+        for (int round = 0; round < 4; ++round)
+            for (const std::string& a : args) MakePersonalCard(a.c_str());
+
+        int64_t best = -1, best_total = 0;
+        for (int round = 0; round < 3; ++round) {
+            int64_t total = 0, encode = 0;
+            for (const std::string& a : args) {
+                total += CountAllocations([&] { MakePersonalCard(a.c_str()); });
+                const int64_t encoded = render(a, true), unencoded = render(a, false);
+                encode += encoded - unencoded;
+            }
+            const int64_t rest = total - encode;
+            if (best < 0 || rest < best) best = rest, best_total = total;
+        }
+        printf("allocations per card (%s): %.2f excluding encoding%s, %.2f in total\n",
+               label,
+               best / (double)args.size(),
+               best ? " (FAILED, expected 0)" : "",
+               best_total / (double)args.size());
+        return best == 0;
+    }
+
+    BenchOptions ParseOptions(int argc, char** argv) {
+        BenchOptions options;
+        for (int i = 1; i < argc; ++i) {
+            const std::string arg = argv[i];
+            if (i + 1 >= argc) {
+                fprintf(stderr, "missing value for %s\n", arg.c_str());
+                exit(2);
+            }
+            const std::string value = argv[++i];
+            if (arg == "--iterations") {
+                options.iterations = atoi(value.c_str());
+            } else if (arg == "--warmup") {
+                options.warmup = atoi(value.c_str());
+            } else if (arg == "--threads") {
+                options.threads.clear();
+                for (size_t p = 0; p < value.size();) {
+                    size_t q = value.find(',', p);
+                    if (q == std::string::npos) q = value.size();
+                    options.threads.push_back(std::max(1, atoi(value.substr(p, q - p).c_str())));
+                    p = q + 1;
+                }
+            } else if (arg == "--batch") {
+                options.batch_columns = atoi(value.c_str());
+            } else if (arg == "--incremental") {
+                options.incremental = atoi(value.c_str());
+            } else if (arg == "--png") {
+                options.png = value;
+            } else if (arg == "--font") {
+                options.font = value;
+            } else {
+                fprintf(stderr, "unknown option %s\n", arg.c_str());
+                exit(2);
+            }
+        }
+        return options;
+    }
+} // namespace
+
+int main(int argc, char** argv) {
+    Magick::InitializeMagick(*argv);
+    BenchOptions options = ParseOptions(argc, argv);
+    if (options.png.empty()) {
+        options.png = MakeAssetTree();
+        printf("synthetic assets in %s\n", options.png.c_str());
+    }
+    Sayobot_SetPath("png", options.png.c_str());
+    Sayobot_SetPath("font", "");
+    for (const char* key : {"profile", "data", "sign", "time", "arrow", "name"})
+        Sayobot_SetFont(key, options.font.c_str());
+
+    std::vector<std::string> args;
+    for (int i = 0; i < 64; ++i) args.push_back(MakeArgs(i));
+
+    for (int i = 0; i < options.warmup; ++i) {
+        const char* error = MakePersonalCard(args[i % args.size()].c_str());
+        if (*error) {
+            fprintf(stderr, "warmup failed: %s\n", error);
+            return 1;
+        }
+    }
+    printf("warm rss %.1f MB\n", PeakRssKb() / 1024.0);
+    for (int threads : options.threads) Run(options, threads, args);
+    if (options.batch_columns) RunBatch(options, args);
+    if (options.incremental) RunIncremental(options);
+    bool ok = CheckAllocations(args, "1 thread");
+
+    // 分带只用于完整绘制，关闭两级卡片缓存，每张都按横带并行绘制
+    const size_t undated = Sayobot::UndatedCards().Limit();
+    const size_t previous = Sayobot::PreviousCards().Limit();
+    Sayobot::UndatedCards().SetLimit(0);
+    Sayobot::UndatedCards().Clear();
+    Sayobot::PreviousCards().SetLimit(0);
+    Sayobot::PreviousCards().Clear();
+    Sayobot_SetBandThreads(4);
+    ok = CheckAllocations(args, "4 band threads") && ok;
+    Sayobot_SetBandThreads(1);
+    Sayobot::PreviousCards().SetLimit(previous);
+    Sayobot::UndatedCards().SetLimit(undated);
+    return ok ? 0 : 1;
+}
@@ -0,0 +1,46 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+
+namespace Sayobot {
+    // 预乘 RGBA8 像素的只读视图，不持有内存
+    struct BitmapView {
+        size_t width = 0, height = 0;
+        size_t stride = 0; // 每行的字节数
+        const uint8_t* pixels = nullptr;
+
+        const uint8_t* Row(size_t y) const {
+            return pixels + y * stride;
+        }
+    };
+
+    // a * b / 255，四舍五入
+    inline uint32_t Mul255(uint32_t a, uint32_t b) {
+        const uint32_t t = a * b + 128;
+        return (t + (t >> 8)) >> 8;
+    }
+
+    // 非预乘 RGBA8 转为预乘，原地转换
+    inline void Premultiply(uint8_t* pixels, size_t count) {
+        for (size_t i = 0; i < count; ++i, pixels += 4) {
+            const uint32_t a = pixels[3];
+            if (a == 255) continue;
+            pixels[0] = (uint8_t)Mul255(pixels[0], a);
+            pixels[1] = (uint8_t)Mul255(pixels[1], a);
+            pixels[2] = (uint8_t)Mul255(pixels[2], a);
+        }
+    }
+
+    // 预乘 RGBA8 转为非预乘，原地转换
+    inline void Unpremultiply(uint8_t* pixels, size_t count) {
+        for (size_t i = 0; i < count; ++i, pixels += 4) {
+            const uint32_t a = pixels[3];
+            if (!a || a == 255) continue;
+            for (int c = 0; c < 3; ++c) {
+                const uint32_t v = (pixels[c] * 255 + a / 2) / a;
+                pixels[c] = (uint8_t)(v > 255 ? 255 : v);
+            }
+        }
+    }
+} // namespace Sayobot
@@ -0,0 +1,151 @@
+#pragma once
+
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <mutex>
+#include <new>
+#include <utility>
+#include <vector>
+
+namespace Sayobot {
+    // resize 时不清零新元素的分配器，缓冲区的内容总会被完整写入
+    template <typename T>
+    struct DefaultInitAllocator : std::allocator<T> {
+        template <typename U>
+        struct rebind {
+            using other = DefaultInitAllocator<U>;
+        };
+
+        DefaultInitAllocator() = default;
+
+        template <typename U>
+        DefaultInitAllocator(const DefaultInitAllocator<U>&) noexcept {
+        }
+
+        template <typename U>
+        void construct(U* p) {
+            ::new (static_cast<void*>(p)) U;
+        }
+
+        template <typename U, typename... Args>
+        void construct(U* p, Args&&... args) {
+            ::new (static_cast<void*>(p)) U(std::forward<Args>(args)...);
+        }
+    };
+
+    typedef std::vector<uint8_t, DefaultInitAllocator<uint8_t>> PoolBytes;
+
+    /*
+     * 大块内存的复用池
+     * 画布、缩放的中间结果和编码时的暂存区都从这里取得，用完归还，
+     * 稳定运行时渲染不再分配（和缺页）数 MB 的内存
+     * 小于 kMinBytes 的缓冲区不进入池；池中的总字节数超过 limit 时直接释放
+     */
+    class BufferPool {
+    public:
+        static const size_t kMinBytes = 256u << 10;
+
+        // 不析构：静态缓存中的画布在退出时仍会归还内存
+        static BufferPool& Instance() {
+            static BufferPool* instance = new BufferPool();
+            return *instance;
+        }
+
+        BufferPool(const BufferPool&) = delete;
+        BufferPool& operator=(const BufferPool&) = delete;
+
+        // 取得容量不小于 bytes 的空缓冲区，优先取容量最接近的一个
+        PoolBytes Take(size_t bytes) {
+            PoolBytes buffer;
+            if (bytes >= kMinBytes) {
+                std::lock_guard<std::mutex> lock(mutex);
+                size_t best = free.size();
+                for (size_t i = 0; i < free.size(); ++i) {
+                    const size_t capacity = free[i].capacity();
+                    // 不用大出两倍以上的缓冲区，免得小图占着整张画布
+                    if (capacity < bytes || capacity / 2 > bytes) continue;
+                    if (best == free.size() || capacity < free[best].capacity()) best = i;
+                }
+                if (best != free.size()) {
+                    buffer.swap(free[best]);
+                    free[best].swap(free.back());
+                    free.pop_back();
+                    pooled -= buffer.capacity();
+                    hits.fetch_add(1, std::memory_order_relaxed);
+                    buffer.clear();
+                    return buffer;
+                }
+                misses.fetch_add(1, std::memory_order_relaxed);
+            }
+            buffer.reserve(bytes);
+            return buffer;
+        }
+
+        void Give(PoolBytes buffer) {
+            const size_t capacity = buffer.capacity();
+            if (capacity < kMinBytes) return;
+            std::lock_guard<std::mutex> lock(mutex);
+            if (pooled + capacity > limit) return;
+            pooled += capacity;
+            free.push_back(std::move(buffer));
+        }
+
+        void SetLimit(size_t limit) {
+            std::lock_guard<std::mutex> lock(mutex);
+            this->limit = limit;
+            while (pooled > limit && !free.empty()) {
+                pooled -= free.back().capacity();
+                free.pop_back();
+            }
+        }
+
+        size_t Usage() {
+            std::lock_guard<std::mutex> lock(mutex);
+            return pooled;
+        }
+
+        size_t Limit() {
+            std::lock_guard<std::mutex> lock(mutex);
+            return limit;
+        }
+
+        std::atomic<uint64_t> hits{0};
+        std::atomic<uint64_t> misses{0};
+
+    private:
+        BufferPool() = default;
+
+        std::mutex mutex;
+        std::vector<PoolBytes> free;
+        size_t pooled = 0;
+        size_t limit = 128u << 20;
+    };
+
+    // 在作用域内借用池中的缓冲区，析构时归还
+    class ScratchBuffer {
+    public:
+        explicit ScratchBuffer(size_t bytes) : buffer(BufferPool::Instance().Take(bytes)) {
+            buffer.resize(bytes);
+        }
+
+        ~ScratchBuffer() {
+            BufferPool::Instance().Give(std::move(buffer));
+        }
+
+        ScratchBuffer(const ScratchBuffer&) = delete;
+        ScratchBuffer& operator=(const ScratchBuffer&) = delete;
+
+        uint8_t* Data() {
+            return buffer.data();
+        }
+
+        size_t Size() const {
+            return buffer.size();
+        }
+
+    private:
+        PoolBytes buffer;
+    };
+} // namespace Sayobot
@@ -0,0 +1 @@
+g++-7 bench.cpp -o sayobot_bench -O3 -pthread `/usr/local/bin/Magick++-config --cppflags --cxxflags --ldflags --libs` `pkg-config --cflags --libs freetype2 zlib` --std=c++17
\ No newline at end of file
@@ -0,0 +1 @@
+g++-7 client.cpp -o sayobot_client.so -shared -fPIC -O3 -pthread -lrt --std=c++17
\ No newline at end of file
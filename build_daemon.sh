@@ -0,0 +1 @@
+g++-7 daemon.cpp -o sayobot_daemon -O3 -pthread `/usr/local/bin/Magick++-config --cppflags --cxxflags --ldflags --libs` `pkg-config --cflags --libs freetype2 zlib` -lrt --std=c++17
\ No newline at end of file
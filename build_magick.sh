@@ -1,4 +1,4 @@
-apt-get install libfreetype-dev libpng-dev libjpeg-dev -y
+apt-get install libfreetype-dev zlib1g-dev libpng-dev libjpeg-dev -y
 cd ImageMagick
 ./configure --without-xml
 make
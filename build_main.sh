@@ -1 +1 @@
-g++-7 core.cpp -o sayobot.so -shared -fPIC -O3 `/usr/local/bin/Magick++-config --cppflags --cxxflags --ldflags --libs` --std=c++17
\ No newline at end of file
+g++-7 core.cpp -o sayobot.so -shared -fPIC -O3 -pthread `/usr/local/bin/Magick++-config --cppflags --cxxflags --ldflags --libs` `pkg-config --cflags --libs freetype2 zlib` --std=c++17
\ No newline at end of file
@@ -0,0 +1,219 @@
+#pragma once
+
+#include <cstdint>
+#include <cstdlib>
+#include <cstring>
+#include <stdexcept>
+#include <string>
+
+namespace Sayobot {
+    /*
+     * 一次制作资料卡所需的全部参数
+     * 字段顺序与 main.ts 传入的顺序一致
+     */
+    struct CardArgs {
+        std::string dataColor, profileColor, signColor;
+        int mode = 0, user_id = 0;
+        std::string country, username, qq;
+
+        // user_config
+        std::string sign, background, profileEdge, dataEdge, signEdge;
+        int opacity = 0;
+
+        // user_info
+        int count300 = 0, count100 = 0, count50 = 0, playcount = 0;
+        long long total_score = 0, ranked_score = 0, total_hits = 0;
+        float pp_raw = 0;
+        int pp_country_rank = 0, pp_rank = 0, count_ssh = 0, count_ss = 0,
+            count_sh = 0, count_s = 0, count_a = 0, total_seconds_played = 0;
+        float level = 0;
+        double accuracy = 0;
+
+        // user_stat
+        long long stat_total_score = 0, stat_ranked_score = 0;
+        int stat_total_hits = 0;
+        double stat_accuracy = 0;
+        float stat_pp_raw = 0, stat_level = 0;
+        int stat_pp_rank = 0, stat_pp_country_rank = 0;
+        long long stat_playcount = 0;
+        int stat_count_ssh = 0, stat_count_ss = 0, stat_count_sh = 0,
+            stat_count_s = 0, stat_count_a = 0, days = 0;
+        std::string out_path;
+    };
+
+    /*
+     * 解析以 '\n' 分隔的 48 个字段，直接在输入上逐个字段转换并写入 a
+     * a 可以是上一次解析用过的对象，每个字段都会被覆盖，字符串沿用原有的容量
+     * 参数缺失或取值越界时抛出 std::invalid_argument
+     */
+    inline void ParseCardArgs(const char* args, CardArgs& a) {
+        if (!args) throw std::invalid_argument("Empty card arguments");
+        size_t fields = 1;
+        for (const char* p = args; *p; ++p) fields += *p == '\n';
+        if (fields < 48) throw std::invalid_argument("Too few card arguments");
+
+        // 当前字段为 [begin, end)，rest 为下一字段的开头
+        const char *begin = args, *end = args, *rest = args;
+        char* stop = nullptr;
+        auto next = [&] {
+            begin = rest;
+            end = begin + strcspn(begin, "\n");
+            rest = *end ? end + 1 : end;
+        };
+        // 字段为空或只有空白时 strto* 会越过 '\n' 读到后面的字段，这时按 0 处理
+        auto str = [&](std::string& v) { next(), v.assign(begin, end); };
+        auto i32 = [&](int& v) {
+            next(), v = (int)strtol(begin, &stop, 10);
+            if (stop > end) v = 0;
+        };
+        auto i64 = [&](long long& v) {
+            next(), v = strtoll(begin, &stop, 10);
+            if (stop > end) v = 0;
+        };
+        auto f32 = [&](float& v) {
+            next(), v = strtof(begin, &stop);
+            if (stop > end) v = 0;
+        };
+        auto f64 = [&](double& v) {
+            next(), v = strtod(begin, &stop);
+            if (stop > end) v = 0;
+        };
+
+        str(a.dataColor), str(a.profileColor), str(a.signColor);
+        i32(a.mode), i32(a.user_id);
+        str(a.country), str(a.username), str(a.qq);
+        str(a.sign), str(a.background), str(a.profileEdge), str(a.dataEdge),
+            str(a.signEdge);
+        i32(a.opacity);
+        i32(a.count300), i32(a.count100), i32(a.count50), i32(a.playcount);
+        i64(a.total_score), i64(a.ranked_score), i64(a.total_hits);
+        f32(a.pp_raw);
+        i32(a.pp_country_rank), i32(a.pp_rank), i32(a.count_ssh), i32(a.count_ss),
+            i32(a.count_sh), i32(a.count_s), i32(a.count_a),
+            i32(a.total_seconds_played);
+        f32(a.level);
+        f64(a.accuracy);
+        i64(a.stat_total_score), i64(a.stat_ranked_score);
+        i32(a.stat_total_hits);
+        f64(a.stat_accuracy);
+        f32(a.stat_pp_raw), f32(a.stat_level);
+        i32(a.stat_pp_rank), i32(a.stat_pp_country_rank);
+        i64(a.stat_playcount);
+        i32(a.stat_count_ssh), i32(a.stat_count_ss), i32(a.stat_count_sh),
+            i32(a.stat_count_s), i32(a.stat_count_a), i32(a.days);
+        str(a.out_path);
+
+        if (a.mode < 0 || a.mode > 3) throw std::invalid_argument("Unknown mode");
+    }
+
+#define SAYOBOT_CARD_ARGS_MAGIC 0x41425953u // "SYBA"
+#define SAYOBOT_CARD_ARGS_VERSION 1
+
+#pragma pack(push, 1)
+    /*
+     * 二进制参数格式（小端）
+     * 固定长度的头部之后紧跟 string_count 个字符串，
+     * 每个字符串为 uint32 长度 + UTF-8 字节（不含结尾的 0），
+     * 顺序为 dataColor, profileColor, signColor, country, username, qq,
+     * sign, background, profileEdge, dataEdge, signEdge, out_path
+     * 新版本只在头部末尾追加字段，字符串区从 header_size 处开始
+     */
+    struct PersonalCardArgs {
+        uint32_t magic;
+        uint16_t version;
+        uint16_t header_size;
+        uint32_t total_size;
+        uint32_t string_count;
+
+        int64_t total_score, ranked_score, total_hits;
+        int64_t stat_total_score, stat_ranked_score, stat_playcount;
+
+        double pp_raw, level, accuracy;
+        double stat_accuracy, stat_pp_raw, stat_level;
+
+        int32_t mode, user_id, opacity;
+        int32_t count300, count100, count50, playcount;
+        int32_t pp_country_rank, pp_rank;
+        int32_t count_ssh, count_ss, count_sh, count_s, count_a;
+        int32_t total_seconds_played;
+        int32_t stat_total_hits, stat_pp_rank, stat_pp_country_rank;
+        int32_t stat_count_ssh, stat_count_ss, stat_count_sh, stat_count_s,
+            stat_count_a;
+        int32_t days;
+    };
+#pragma pack(pop)
+    static_assert(sizeof(PersonalCardArgs) == 208, "PersonalCardArgs layout changed");
+
+    /*
+     * 解析二进制参数并写入 a，与文本格式一样覆盖 a 的每个字段
+     * 长度、版本或字符串区越界时抛出 std::invalid_argument
+     */
+    inline void ParseCardArgs(const void* data, size_t length, CardArgs& a) {
+        if (!data || length < sizeof(PersonalCardArgs))
+            throw std::invalid_argument("Card arguments too short");
+        PersonalCardArgs h;
+        memcpy(&h, data, sizeof(h));
+        if (h.magic != SAYOBOT_CARD_ARGS_MAGIC)
+            throw std::invalid_argument("Bad card arguments magic");
+        if (h.version != SAYOBOT_CARD_ARGS_VERSION)
+            throw std::invalid_argument("Unsupported card arguments version");
+        if (h.header_size < sizeof(h) || h.total_size > length
+            || h.header_size > h.total_size)
+            throw std::invalid_argument("Bad card arguments size");
+
+        std::string* strings[] = {&a.dataColor,
+                                  &a.profileColor,
+                                  &a.signColor,
+                                  &a.country,
+                                  &a.username,
+                                  &a.qq,
+                                  &a.sign,
+                                  &a.background,
+                                  &a.profileEdge,
+                                  &a.dataEdge,
+                                  &a.signEdge,
+                                  &a.out_path};
+        const size_t count = sizeof(strings) / sizeof(strings[0]);
+        if (h.string_count < count)
+            throw std::invalid_argument("Too few card argument strings");
+
+        const char* base = static_cast<const char*>(data);
+        size_t offset = h.header_size;
+        for (size_t i = 0; i < count; ++i) {
+            uint32_t len;
+            if (h.total_size - offset < sizeof(len))
+                throw std::invalid_argument("Truncated card argument string");
+            memcpy(&len, base + offset, sizeof(len));
+            offset += sizeof(len);
+            if (h.total_size - offset < len)
+                throw std::invalid_argument("Truncated card argument string");
+            strings[i]->assign(base + offset, len);
+            offset += len;
+        }
+
+        a.total_score = h.total_score, a.ranked_score = h.ranked_score;
+        a.total_hits = h.total_hits;
+        a.stat_total_score = h.stat_total_score;
+        a.stat_ranked_score = h.stat_ranked_score;
+        a.stat_playcount = h.stat_playcount;
+        a.pp_raw = (float)h.pp_raw, a.level = (float)h.level;
+        a.accuracy = h.accuracy;
+        a.stat_accuracy = h.stat_accuracy;
+        a.stat_pp_raw = (float)h.stat_pp_raw, a.stat_level = (float)h.stat_level;
+        a.mode = h.mode, a.user_id = h.user_id, a.opacity = h.opacity;
+        a.count300 = h.count300, a.count100 = h.count100, a.count50 = h.count50;
+        a.playcount = h.playcount;
+        a.pp_country_rank = h.pp_country_rank, a.pp_rank = h.pp_rank;
+        a.count_ssh = h.count_ssh, a.count_ss = h.count_ss, a.count_sh = h.count_sh;
+        a.count_s = h.count_s, a.count_a = h.count_a;
+        a.total_seconds_played = h.total_seconds_played;
+        a.stat_total_hits = h.stat_total_hits, a.stat_pp_rank = h.stat_pp_rank;
+        a.stat_pp_country_rank = h.stat_pp_country_rank;
+        a.stat_count_ssh = h.stat_count_ssh, a.stat_count_ss = h.stat_count_ss;
+        a.stat_count_sh = h.stat_count_sh, a.stat_count_s = h.stat_count_s;
+        a.stat_count_a = h.stat_count_a;
+        a.days = h.days;
+
+        if (a.mode < 0 || a.mode > 3) throw std::invalid_argument("Unknown mode");
+    }
+} // namespace Sayobot
@@ -0,0 +1,231 @@
+#pragma once
+
+#include <sys/stat.h>
+#ifndef WIN32
+#include <dirent.h>
+#else
+#include <direct.h>
+#endif
+
+#include <algorithm>
+#include <cstdint>
+#include <cstdio>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <utility>
+#include <vector>
+
+#include "lru_cache.hpp"
+
+#define SAYOBOT_CARD_CACHE_MAGIC 0x43435953u // "SYCC"
+#define SAYOBOT_CARD_CACHE_VERSION 1
+
+namespace Sayobot {
+    /*
+     * 已编码卡片的缓存
+     * 键为卡片输入（不含当前时间）、粗粒度时间和编码设置的摘要，值为编码结果
+     * 内存中按 LRU 保存；设置了目录时同时写入磁盘，进程重启后仍然可用，
+     * 磁盘占用超过预算时删除最旧的文件
+     * 只在卡片上的时间按 granularity 秒取整时使用（见 Sayobot_SetCardCache）
+     */
+    class CardCache {
+    public:
+        static CardCache& Instance() {
+            static CardCache instance;
+            return instance;
+        }
+
+        struct Config {
+            size_t memory_limit = 0;
+            int64_t granularity = 0; // 卡片上的时间取整的秒数，0 为不取整
+            std::string dir;         // 为空时不使用磁盘
+            size_t disk_limit = 0;
+        };
+
+        void Configure(const Config& config) {
+            {
+                std::lock_guard<std::mutex> lock(mutex);
+                this->config = config;
+                disk_usage = config.dir.empty() ? 0 : ScanDisk(config.dir, 0);
+            }
+            encoded.SetLimit(config.memory_limit);
+            encoded.Clear();
+        }
+
+        /*
+         * 卡片上的时间取整的秒数，stored 返回是否设置了内存或磁盘缓存
+         * 每次渲染都要读取，只取这两项，不复制目录字符串
+         */
+        int64_t Granularity(bool& stored) {
+            std::lock_guard<std::mutex> lock(mutex);
+            stored = config.memory_limit || !config.dir.empty();
+            return config.granularity;
+        }
+
+        // 先查内存再查磁盘，磁盘命中时放回内存
+        std::shared_ptr<const std::string> Get(const std::string& digest) {
+            std::shared_ptr<const std::string> bytes;
+            if (encoded.Get(digest, bytes)) return bytes;
+            std::string dir;
+            {
+                std::lock_guard<std::mutex> lock(mutex);
+                dir = config.dir;
+            }
+            if (dir.empty()) return nullptr;
+            bytes = ReadFile(dir + '/' + digest + ".card");
+            if (bytes) encoded.Put(digest, bytes, bytes->size() + digest.size());
+            return bytes;
+        }
+
+        // 写文件和扫描目录时不持有 mutex，不阻塞读取设置的渲染线程
+        void Put(const std::string& digest, std::shared_ptr<const std::string> bytes) {
+            encoded.Put(digest, bytes, bytes->size() + digest.size());
+            std::string dir;
+            size_t limit;
+            {
+                std::lock_guard<std::mutex> lock(mutex);
+                dir = config.dir;
+                limit = config.disk_limit;
+            }
+            if (dir.empty()) return;
+            const size_t written = WriteFile(dir + '/' + digest + ".card", *bytes);
+            if (!written) return;
+            {
+                std::lock_guard<std::mutex> lock(mutex);
+                disk_usage += written;
+                // disk_limit 为 0 时不限制，不需要扫描
+                if (!limit || disk_usage <= limit) return;
+            }
+            // 同一时间只有一个线程扫描，扫描期间的写入留给下一次
+            std::unique_lock<std::mutex> scanning(scan_mutex, std::try_to_lock);
+            if (!scanning) return;
+            const size_t usage = ScanDisk(dir, limit);
+            std::lock_guard<std::mutex> lock(mutex);
+            if (config.dir == dir) disk_usage = usage;
+        }
+
+        void Clear() {
+            encoded.Clear();
+        }
+
+        size_t Usage() {
+            return encoded.Usage();
+        }
+
+        size_t Limit() {
+            return encoded.Limit();
+        }
+
+        // 创建缓存目录（已存在时什么也不做），返回它是否为可用的目录
+        static bool MakeDir(const std::string& dir) {
+            struct stat st;
+            if (stat(dir.c_str(), &st) != 0) {
+#ifndef WIN32
+                mkdir(dir.c_str(), 0755);
+#else
+                _mkdir(dir.c_str());
+#endif
+            }
+            return stat(dir.c_str(), &st) == 0 && (st.st_mode & S_IFMT) == S_IFDIR;
+        }
+
+        size_t DiskUsage() {
+            std::lock_guard<std::mutex> lock(mutex);
+            return disk_usage;
+        }
+
+    private:
+#pragma pack(push, 1)
+        struct FileHeader {
+            uint32_t magic;
+            uint32_t version;
+            uint64_t length;
+        };
+#pragma pack(pop)
+
+        CardCache() : encoded(0) {
+        }
+
+        static std::shared_ptr<const std::string> ReadFile(const std::string& path) {
+            FILE* file = fopen(path.c_str(), "rb");
+            if (!file) return nullptr;
+            FileHeader header;
+            std::shared_ptr<std::string> bytes;
+            if (fread(&header, sizeof(header), 1, file) == 1
+                && header.magic == SAYOBOT_CARD_CACHE_MAGIC
+                && header.version == SAYOBOT_CARD_CACHE_VERSION && header.length
+                && header.length < (1u << 30)) {
+                bytes = std::make_shared<std::string>((size_t)header.length, '\0');
+                if (fread(&(*bytes)[0], 1, bytes->size(), file) != bytes->size())
+                    bytes = nullptr;
+            }
+            fclose(file);
+            return bytes;
+        }
+
+        // 先写临时文件再改名，返回写入的字节数，失败返回 0
+        static size_t WriteFile(const std::string& path, const std::string& bytes) {
+            const std::string temp = path + ".tmp";
+            FILE* file = fopen(temp.c_str(), "wb");
+            if (!file) return 0;
+            const FileHeader header{
+                SAYOBOT_CARD_CACHE_MAGIC, SAYOBOT_CARD_CACHE_VERSION, bytes.size()};
+            bool ok = fwrite(&header, sizeof(header), 1, file) == 1
+                      && fwrite(bytes.data(), 1, bytes.size(), file) == bytes.size();
+            ok = fclose(file) == 0 && ok;
+            if (!ok || rename(temp.c_str(), path.c_str()) != 0) {
+                remove(temp.c_str());
+                return 0;
+            }
+            return sizeof(header) + bytes.size();
+        }
+
+        /*
+         * 统计磁盘缓存的占用
+         * limit 不为 0 且超出时按修改时间删除最旧的文件，直到占用不超过 limit 的 3/4
+         * Windows 上不统计，磁盘缓存不受预算限制
+         */
+        static size_t ScanDisk(const std::string& dir, size_t limit) {
+#ifdef WIN32
+            return 0;
+#else
+            struct File {
+                std::string path;
+                int64_t mtime;
+                size_t size;
+            };
+            std::vector<File> files;
+            size_t total = 0;
+            if (DIR* d = opendir(dir.c_str())) {
+                while (dirent* item = readdir(d)) {
+                    const std::string name = item->d_name;
+                    if (name.size() < 5 || name.compare(name.size() - 5, 5, ".card")) continue;
+                    const std::string path = dir + '/' + name;
+                    struct stat st;
+                    if (stat(path.c_str(), &st) != 0) continue;
+                    files.push_back(File{path, (int64_t)st.st_mtime, (size_t)st.st_size});
+                    total += (size_t)st.st_size;
+                }
+                closedir(d);
+            }
+            if (!limit || total <= limit) return total;
+            std::sort(files.begin(), files.end(), [](const File& a, const File& b) {
+                return a.mtime < b.mtime;
+            });
+            const size_t target = limit / 4 * 3;
+            for (const File& f : files) {
+                if (total <= target) break;
+                if (remove(f.path.c_str()) == 0) total -= f.size;
+            }
+            return total;
+#endif
+        }
+
+        LruCache<std::shared_ptr<const std::string>> encoded;
+        std::mutex mutex; // 保护 config、disk_usage
+        std::mutex scan_mutex;
+        Config config;
+        size_t disk_usage = 0;
+    };
+} // namespace Sayobot
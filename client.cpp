@@ -0,0 +1,378 @@
+/*
+ * 渲染服务的客户端库，由机器人通过 ffi 载入，取代直接载入 core
+ * 卡片和头像交给渲染服务 (sayobot_daemon) 处理，这里不依赖 Magick；
+ * 资料历史只是文件读写，仍在本进程中完成
+ * 与服务端的连接断开后，进行中的请求以错误结束，下一次提交时重新连接
+ */
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+#include <atomic>
+#include <cstdio>
+#include <cstring>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <unordered_map>
+
+#include "history_store.hpp"
+#include "render_ipc.hpp"
+#include "status.hpp"
+
+#ifndef SAYOBOT_API
+#define SAYOBOT_API
+#endif
+
+namespace Sayobot {
+    // 一次请求的设置和结果，与 core 中的 RenderContext 对应
+    class ClientRequest {
+    public:
+        bool Acquire() {
+            bool expected = false;
+            return busy.compare_exchange_strong(expected, true);
+        }
+
+        void Release() {
+            busy = false;
+        }
+
+        std::string error;
+        std::string output;
+        std::string format = "PNG";
+        size_t quality = 85;
+
+    private:
+        std::atomic<bool> busy{false};
+    };
+
+    class RenderClient {
+    public:
+        typedef void (*Callback)(ClientRequest* request, int status, void* user);
+
+        static RenderClient& Instance() {
+            static RenderClient* instance = new RenderClient();
+            return *instance;
+        }
+
+        RenderClient(const RenderClient&) = delete;
+        RenderClient& operator=(const RenderClient&) = delete;
+
+        // 记下服务端地址并连接，失败时抛出异常；已有的连接断开，其上的请求以错误结束
+        void Connect(const std::string& path) {
+            if (path.size() >= sizeof(sockaddr_un::sun_path))
+                throw std::invalid_argument("Socket path too long");
+            std::lock_guard<std::mutex> lock(connect_mutex);
+            this->path = path;
+            if (link) shutdown(link->fd, SHUT_RDWR);
+            link = Open();
+        }
+
+        /*
+         * 发送请求，完成后在读取线程上调用 callback(request, status, user)
+         * request 应已被调用方占用，调用 callback 前释放
+         * 发送失败时抛出异常，不调用 callback
+         */
+        void Submit(uint16_t type, const std::string& body, ClientRequest* request,
+                    Callback callback, void* user) {
+            std::shared_ptr<Link> link;
+            {
+                std::lock_guard<std::mutex> lock(connect_mutex);
+                if (!this->link || !this->link->open.load()) {
+                    if (path.empty()) throw std::runtime_error("Render daemon not configured");
+                    this->link = Open();
+                }
+                link = this->link;
+            }
+            const uint64_t id = next_id.fetch_add(1) + 1;
+            {
+                std::lock_guard<std::mutex> lock(link->pending_mutex);
+                link->pending[id] = Pending{type, request, callback, user};
+            }
+            try {
+                std::lock_guard<std::mutex> lock(link->write_mutex);
+                Ipc::WriteFrame(link->fd, type, 0, id, body.data(), body.size());
+            } catch (...) {
+                std::lock_guard<std::mutex> lock(link->pending_mutex);
+                if (!link->pending.erase(id)) return; // 读取线程已经以错误结束了这个请求
+                throw;
+            }
+        }
+
+    private:
+        struct Pending {
+            uint16_t type;
+            ClientRequest* request;
+            Callback callback;
+            void* user;
+        };
+
+        // 一次连接，由读取线程持有；断开后重新连接不等待旧的读取线程
+        // （它可能正在等待 ffi 回调回到调用 Submit 的线程）
+        struct Link {
+            explicit Link(int fd) : fd(fd) {
+            }
+
+            ~Link() {
+                close(fd);
+            }
+
+            const int fd;
+            std::atomic<bool> open{true};
+            std::mutex write_mutex;
+            std::mutex pending_mutex;
+            std::unordered_map<uint64_t, Pending> pending;
+            Ipc::SharedRing ring;
+        };
+
+        RenderClient() = default;
+
+        // 持有 connect_mutex 时调用
+        std::shared_ptr<Link> Open() {
+            const int fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+            if (fd < 0) throw std::runtime_error(std::string("socket: ") + strerror(errno));
+            std::shared_ptr<Link> link = std::make_shared<Link>(fd);
+            sockaddr_un address;
+            memset(&address, 0, sizeof(address));
+            address.sun_family = AF_UNIX;
+            strcpy(address.sun_path, path.c_str());
+            if (connect(fd, (sockaddr*)&address, sizeof(address)) != 0)
+                throw std::runtime_error("Cannot connect to render daemon at " + path + ": " +
+                                         strerror(errno));
+            const int shared_fd = Ipc::ReceiveHello(fd);
+            try {
+                link->ring.Attach(shared_fd);
+            } catch (...) {
+                close(shared_fd);
+                throw;
+            }
+            close(shared_fd);
+            std::thread([link] { Read(*link); }).detach();
+            return link;
+        }
+
+        static void Read(Link& link) {
+            Ipc::FrameHeader header;
+            std::string payload;
+            while (Ipc::ReadFrame(link.fd, header, payload)) {
+                Pending request;
+                {
+                    std::lock_guard<std::mutex> lock(link.pending_mutex);
+                    auto it = link.pending.find(header.id);
+                    if (it == link.pending.end()) {
+                        std::string discard; // 仍要释放共享内存中的空间
+                        if (header.type == Ipc::kRender && header.status == SAYOBOT_OK)
+                            ReadResult(link, payload, discard);
+                        continue;
+                    }
+                    request = it->second;
+                    link.pending.erase(it);
+                }
+                int status = header.status;
+                ClientRequest& r = *request.request;
+                r.error.clear();
+                r.output.clear();
+                if (status != SAYOBOT_OK) {
+                    r.error = payload;
+                } else if (request.type == Ipc::kRender && !ReadResult(link, payload, r.output)) {
+                    r.error = "Bad result from render daemon";
+                    status = SAYOBOT_ERROR;
+                } else if (request.type != Ipc::kRender) {
+                    r.output = payload;
+                }
+                r.Release();
+                if (request.callback) request.callback(&r, status, request.user);
+            }
+            link.open = false;
+            shutdown(link.fd, SHUT_RDWR);
+            // 服务端已断开：进行中的请求都以错误结束
+            std::unordered_map<uint64_t, Pending> lost;
+            {
+                std::lock_guard<std::mutex> lock(link.pending_mutex);
+                lost.swap(link.pending);
+            }
+            for (auto& item : lost) {
+                ClientRequest& r = *item.second.request;
+                r.error = "Render daemon disconnected";
+                r.output.clear();
+                r.Release();
+                if (item.second.callback)
+                    item.second.callback(&r, SAYOBOT_ERROR, item.second.user);
+            }
+        }
+
+        // 取出 kRender 的结果：共享内存中的位置，或随帧发送的图片
+        static bool ReadResult(Link& link, const std::string& payload, std::string& out) {
+            Ipc::ResultBody result;
+            if (payload.size() < sizeof(result)) return false;
+            memcpy(&result, payload.data(), sizeof(result));
+            if (result.offset != Ipc::kInline) return link.ring.Read(result, out);
+            if (payload.size() - sizeof(result) != result.length) return false;
+            out.assign(payload, sizeof(result), std::string::npos);
+            return true;
+        }
+
+        std::mutex connect_mutex;
+        std::string path;
+        std::shared_ptr<Link> link;
+        std::atomic<uint64_t> next_id{0};
+    };
+} // namespace Sayobot
+
+extern "C" {
+
+typedef Sayobot::ClientRequest SayobotClient_Request;
+typedef void (*SayobotClient_Callback)(SayobotClient_Request* request, int status, void* user);
+
+// 导出函数：连接渲染服务，成功返回空字符串，否则返回错误信息
+SAYOBOT_API const char* SayobotClient_Connect(const char* path) {
+    thread_local std::string error;
+    error.clear();
+    try {
+        if (!path || !*path) throw std::invalid_argument("Empty socket path");
+        Sayobot::RenderClient::Instance().Connect(path);
+    } catch (const std::exception& ex) {
+        error = ex.what();
+        if (error.empty()) error = "Unknown Error!";
+    }
+    return error.c_str();
+}
+
+// 导出函数：创建请求
+SAYOBOT_API SayobotClient_Request* SayobotClient_CreateRequest() {
+    return new SayobotClient_Request();
+}
+
+// 导出函数：销毁请求（不能在请求进行中销毁）
+SAYOBOT_API void SayobotClient_DestroyRequest(SayobotClient_Request* request) {
+    delete request;
+}
+
+// 导出函数：取得上一次请求的错误信息，成功时为空字符串
+SAYOBOT_API const char* SayobotClient_GetError(SayobotClient_Request* request) {
+    return request ? request->error.c_str() : "Invalid request";
+}
+
+// 导出函数：设置卡片的编码格式和质量，格式由渲染服务校验（见 Sayobot_SetOutputFormat）
+SAYOBOT_API int SayobotClient_SetOutputFormat(SayobotClient_Request* request,
+                                              const char* format, int quality) {
+    if (!request || !format || !*format || quality < 0) return SAYOBOT_ERROR;
+    if (!request->Acquire()) return SAYOBOT_BUSY;
+    request->format = format;
+    request->quality = static_cast<size_t>(quality);
+    request->Release();
+    return SAYOBOT_OK;
+}
+
+SAYOBOT_API size_t SayobotClient_GetOutputSize(SayobotClient_Request* request) {
+    return request ? request->output.length() : 0;
+}
+
+// 导出函数：把结果复制到调用方的缓冲区，返回结果的字节数，capacity 不足时不复制
+SAYOBOT_API size_t SayobotClient_CopyOutput(SayobotClient_Request* request, void* buffer,
+                                            size_t capacity) {
+    if (!request) return 0;
+    const size_t length = request->output.length();
+    if (buffer && length && capacity >= length)
+        memcpy(buffer, request->output.data(), length);
+    return length;
+}
+
+namespace {
+    // 占用 request 后发送，失败时写入错误信息并释放
+    int Submit(SayobotClient_Request* request, uint16_t type, const std::string& body,
+               SayobotClient_Callback callback, void* user) {
+        try {
+            Sayobot::RenderClient::Instance().Submit(type, body, request, callback, user);
+        } catch (const std::exception& ex) {
+            request->error = ex.what();
+            request->Release();
+            return SAYOBOT_ERROR;
+        }
+        return SAYOBOT_OK;
+    }
+} // namespace
+
+/*
+ * 导出函数：把二进制参数的卡片提交给渲染服务，完成后调用 callback(request, status, user)
+ * priority 为 0-2，0 最先渲染；服务端队列已满时 status 为 SAYOBOT_OVERLOADED
+ * 返回 SAYOBOT_OK；无法发送时返回 SAYOBOT_ERROR，不会调用 callback
+ */
+SAYOBOT_API int SayobotClient_SubmitCard(SayobotClient_Request* request, const void* data,
+                                         size_t length, int priority,
+                                         SayobotClient_Callback callback, void* user) {
+    if (!request || !data) return SAYOBOT_ERROR;
+    if (!request->Acquire()) return SAYOBOT_BUSY;
+    Sayobot::Ipc::RenderRequest head = {
+        priority, (uint32_t)request->quality, (uint32_t)request->format.size(), 0};
+    std::string body(reinterpret_cast<const char*>(&head), sizeof(head));
+    body += request->format;
+    body.append(static_cast<const char*>(data), length);
+    return Submit(request, Sayobot::Ipc::kRender, body, callback, user);
+}
+
+// 导出函数：把下载的头像交给渲染服务校验、保存，完成后调用 callback
+SAYOBOT_API int SayobotClient_SubmitAvatar(SayobotClient_Request* request, long long user_id,
+                                           const void* data, size_t length,
+                                           SayobotClient_Callback callback, void* user) {
+    if (!request || !data) return SAYOBOT_ERROR;
+    if (!request->Acquire()) return SAYOBOT_BUSY;
+    Sayobot::Ipc::AvatarRequest head = {user_id};
+    std::string body(reinterpret_cast<const char*>(&head), sizeof(head));
+    body.append(static_cast<const char*>(data), length);
+    return Submit(request, Sayobot::Ipc::kAvatar, body, callback, user);
+}
+
+// 导出函数：取得渲染服务的渲染指标，完成后结果 (JSON) 为请求的输出
+SAYOBOT_API int SayobotClient_SubmitStats(SayobotClient_Request* request,
+                                          SayobotClient_Callback callback, void* user) {
+    if (!request) return SAYOBOT_ERROR;
+    if (!request->Acquire()) return SAYOBOT_BUSY;
+    return Submit(request, Sayobot::Ipc::kStats, std::string(), callback, user);
+}
+
+// 导出函数：打开（不存在时创建）资料历史文件，成功返回空字符串，否则返回错误信息
+SAYOBOT_API const char* SayobotClient_OpenHistory(const char* path) {
+    thread_local std::string error;
+    error.clear();
+    try {
+        if (!path || !*path) throw std::invalid_argument("Empty history path");
+        Sayobot::HistoryStore::Instance().Open(path);
+    } catch (const std::exception& ex) {
+        error = ex.what();
+        if (error.empty()) error = "Unknown Error!";
+    }
+    return error.c_str();
+}
+
+// 导出函数：追加一次资料快照，参数同 Sayobot_HistoryAppend
+SAYOBOT_API const char* SayobotClient_HistoryAppend(long long user, int mode, long long time,
+                                                    const double* values, int count) {
+    thread_local std::string error;
+    error.clear();
+    try {
+        if (!values || count < 0) throw std::invalid_argument("Empty history values");
+        Sayobot::HistoryStore::Instance().Append(
+            (uint64_t)user,
+            mode,
+            Sayobot::HistorySnapshot::FromDoubles(time, values, (size_t)count));
+    } catch (const std::exception& ex) {
+        error = ex.what();
+        if (error.empty()) error = "Unknown Error!";
+    }
+    return error.c_str();
+}
+
+// 导出函数：查找时间早于 before 的最后一次快照，参数同 Sayobot_HistoryFind
+SAYOBOT_API int SayobotClient_HistoryFind(long long user, int mode, long long before,
+                                          double* values, int count, long long* time) {
+    if (!values || count < 0) return 0;
+    Sayobot::HistorySnapshot snapshot;
+    if (!Sayobot::HistoryStore::Instance().Find((uint64_t)user, mode, before, snapshot))
+        return 0;
+    snapshot.ToDoubles(values, (size_t)count);
+    if (time) *time = snapshot.time;
+    return 1;
+}
+}
@@ -9,10 +9,14 @@
 
 #include <cmath>
 #include <exception>
+#include <fstream>
+#include <memory>
+#include <mutex>
 #include <random>
 #include <regex>
 #include <sstream>
 #include <string>
+#include <thread>
 #include <vector>
 
 #ifndef WIN32
@@ -23,6 +27,26 @@
 #endif
 #include <Magick++.h>
 
+#include "asset_cache.hpp"
+#include "avatar_store.hpp"
+#include "buffer_pool.hpp"
+#include "card_args.hpp"
+#include "card_cache.hpp"
+#include "encode_profile.hpp"
+#include "history_store.hpp"
+#include "layout.hpp"
+#include "lru_cache.hpp"
+#include "magick_raster.hpp"
+#include "phash.hpp"
+#include "raster.hpp"
+#include "render_context.hpp"
+#include "resample.hpp"
+#include "scheduler.hpp"
+#include "scratch.hpp"
+#include "stage_timer.hpp"
+#include "text.hpp"
+#include "thread_pool.hpp"
+
 namespace Sayobot {
     struct TextStyle {
         TextStyle(const std::string& _color = "black", const double _pointsize = 12.0f,
@@ -44,50 +68,154 @@ namespace Sayobot {
         MagickCore::AlignType align;
     };
 
+    /*
+     * 画布
+     * 像素以预乘 RGBA8 保存在 Raster 中，贴图和文字直接在上面混合；
+     * Magick 只用于解码、编码，以及裁剪、旋转等不常用的操作
+     */
     class Image {
     public:
         Image() {
         }
 
+        // 创建全透明的画布
         void Create(const size_t& width, const size_t& height) {
-            this->image.size(Magick::Geometry(width, height));
-            // this->image.read("xc:#FFFFFF");
+            this->text.Clear();
+            this->raster.Reset(width, height);
+            this->origin_x = this->origin_y = 0;
+            Modified();
+        }
+
+        /*
+         * 取 from 的 [y0, y1) 行作为画布，用于分带绘制
+         * 之后的贴图和文字仍按 from 的坐标给出，只画出落在这几行中的部分，
+         * 结果与在 from 上绘制后取这几行逐像素相同；from 中不能有未画的文字
+         */
+        void AssignBand(const Image& from, size_t y0, size_t y1) {
+            BitmapView view = from.raster.View();
+            view.pixels = view.Row(y0);
+            view.height = y1 - y0;
+            this->text.Clear();
+            this->raster.Assign(view);
+            this->clip = Rect();
+            this->origin_x = from.origin_x;
+            this->origin_y = from.origin_y + (long)y0;
+            Modified();
+        }
+
+        // 把宽度相同的各带按顺序纵向拼成一张图
+        void Stack(std::vector<Image>& bands) {
+            size_t height = 0;
+            for (Image& band : bands) {
+                band.FlushText();
+                height += band.Height();
+            }
+            this->text.Clear();
+            this->raster.Allocate(bands.empty() ? 0 : bands[0].Width(), height);
+            this->origin_x = this->origin_y = 0;
+            size_t y = 0;
+            for (const Image& band : bands) {
+                if (band.Width() != Width()) throw std::invalid_argument("Band width mismatch");
+                const size_t bytes = band.raster.Height() * band.raster.Stride();
+                if (bytes) memcpy(this->raster.Row(y), band.raster.View().pixels, bytes);
+                y += band.Height();
+            }
+            Modified();
         }
 
         void ReadFromFile(const std::string& path) {
-            this->image.read(path);
+            Magick::Image image;
+            image.read(path);
+            Assign(image);
         }
 
         void ReadFromUrl(const std::string& url) {
-            this->image = Magick::Image(url);
+            Magick::Image image(url);
+            Assign(image);
         }
 
         void Crop(const Magick::Geometry& geometry) {
-            this->image.crop(geometry);
+            Magick::Image image = ToMagick();
+            image.crop(geometry);
+            Assign(image);
         }
 
         void Crop(const size_t width, const size_t height, const size_t x_offset,
                   const size_t y_offset) {
-            this->image.crop(Magick::Geometry(width, height, x_offset, y_offset));
+            Crop(Magick::Geometry(width, height, x_offset, y_offset));
         }
 
         void Rotate(const double degrees) {
-            this->image.rotate(degrees);
+            Magick::Image image = ToMagick();
+            image.rotate(degrees);
+            Assign(image);
         }
 
+        /*
+         * 在图上绘制文字
+         * 文字先进入批次，在下一次贴图、编码或保存前统一画到一张图层上，
+         * 字体和栅格化后的字形由 FontRegistry 跨卡片缓存
+         * 对齐方式按 textStyle.align 处理，(x_offset, y_offset) 为基线位置；
+         * gravity 保持旧版行为不参与排版
+         */
         void Drawtext(const std::string& str, const TextStyle& textStyle,
                       double x_offset, double y_offset) {
-            Magick::DrawableList drawableList;
-            drawableList.push_back(Magick::DrawableFillColor(textStyle.color));
-            std::string ext =
-                textStyle.font_family.substr(textStyle.font_family.find_last_of('.'));
-            drawableList.push_back(Magick::DrawableFont(textStyle.font_family));
-            drawableList.push_back(Magick::DrawablePointSize(textStyle.pointsize));
-            drawableList.push_back(Magick::DrawableText(x_offset, y_offset, str));
-            drawableList.push_back(Magick::DrawableGravity(textStyle.gravity));
-            drawableList.push_back(Magick::DrawableTextAlignment(textStyle.align));
-            this->image.draw(drawableList);
+            TextAlign align = TextAlign::Left;
+            if (textStyle.align == MagickCore::AlignType::CenterAlign)
+                align = TextAlign::Center;
+            else if (textStyle.align == MagickCore::AlignType::RightAlign)
+                align = TextAlign::Right;
+            Drawtext(str,
+                     FontRegistry::Instance().Get(textStyle.font_family),
+                     textStyle.pointsize,
+                     ParseColor(textStyle.color),
+                     x_offset,
+                     y_offset,
+                     align);
         }
+
+        // 以已经解析好的字体和颜色 (0xRRGGBBAA) 绘制文字，供布局重放使用
+        void Drawtext(const std::string& str, FontFace* face, double size,
+                      uint32_t color, double x_offset, double y_offset,
+                      TextAlign align = TextAlign::Left) {
+            this->text.Add(str, face, size, color, x_offset, y_offset, align);
+        }
+
+        // 最近一次 Drawtext 的文字在画布 (width x height) 内的区域，为空时返回 false
+        bool LastTextBounds(int width, int height, Rect& rect) {
+            int x0, y0, x1, y1;
+            if (!this->text.LastBounds(width, height, x0, y0, x1, y1)) return false;
+            rect = Rect{x0, y0, x1, y1};
+            return true;
+        }
+
+        // 把批次中的文字一次性画到画布上
+        void FlushText() {
+            if (this->text.Empty()) return;
+            Modified();
+            ScopedStage timer(StageText);
+            // 文字按绘制坐标排版，这里换算为画布上的行列
+            const int ox = (int)this->origin_x, oy = (int)this->origin_y;
+            int x0, y0, x1, y1;
+            if (this->text.Bounds(ox + (int)this->raster.Width(),
+                                  oy + (int)this->raster.Height(),
+                                  x0,
+                                  y0,
+                                  x1,
+                                  y1)) {
+                x0 = std::max(x0, ox) - ox, y0 = std::max(y0, oy) - oy;
+                x1 -= ox, y1 -= oy;
+                if (x0 < x1 && y0 < y1 && Clip(x0, y0, x1, y1))
+                    this->text.Render(this->raster.Row(y0) + (size_t)x0 * 4,
+                                      this->raster.Stride(),
+                                      x0 + ox,
+                                      y0 + oy,
+                                      x1 - x0,
+                                      y1 - y0);
+            }
+            this->text.Clear();
+        }
+
         /*
          在图上绘制文字
          * 参数列表:
@@ -113,6 +241,7 @@ namespace Sayobot {
                           MagickCore::GravityType::UndefinedGravity,
                       const MagickCore::AlignType align =
                           MagickCore::AlignType::UndefinedAlign) {
+            Magick::Image image = ToMagick();
             Magick::DrawableList drawableList;
             drawableList.push_back(Magick::DrawableFillColor(Color));
             drawableList.push_back(Magick::DrawableTextAlignment(align));
@@ -120,7 +249,8 @@ namespace Sayobot {
             drawableList.push_back(Magick::DrawablePointSize(size));
             drawableList.push_back(Magick::DrawableText(x_offset, y_offset, str));
             drawableList.push_back(Magick::DrawableGravity(gravity));
-            this->image.draw(drawableList);
+            image.draw(drawableList);
+            Assign(image);
         }
 
         /*
@@ -134,9 +264,19 @@ namespace Sayobot {
          */
         void DrawPic(Image& image, const size_t x_offset, const size_t y_offset,
                      size_t width = 0, size_t height = 0) {
-            if (width && height) image.resize(Magick::Geometry(width, height));
-            this->image.composite(
-                image.image, x_offset, y_offset, MagickCore::OverCompositeOp);
+            FlushText();
+            image.FlushText();
+            if (width && height) {
+                ScopedStage timer(StageResize);
+                image.resize(Magick::Geometry(width, height));
+            }
+            Modified();
+            ScopedStage timer(StageComposite);
+            BlendOver(this->raster,
+                      image.raster.View(),
+                      (long)x_offset - this->origin_x,
+                      (long)y_offset - this->origin_y,
+                      this->clip);
         }
 
         /*
@@ -150,38 +290,202 @@ namespace Sayobot {
          */
         void DrawPic(const std::string& path, size_t x_offset, size_t y_offset,
                      size_t width = 0, size_t height = 0) {
-            Magick::Image newImage;
-            newImage.read(path);
+            FlushText();
+            const long x = (long)x_offset - this->origin_x, y = (long)y_offset - this->origin_y;
+            if (width && height
+                && !Visible(Rect::Of(x, y, (long)width, (long)height)))
+                return;
+            // 解码和缩放的结果由 AssetCache 复用
+            const SharedBitmap bitmap = AssetCache::Instance().Get(path, width, height);
+            Modified();
+            ScopedStage timer(StageComposite, &path);
+            BlendOver(this->raster, bitmap.view, x, y, this->clip);
+        }
+
+        // 以布局编译时取得的素材句柄贴图，缩放尺寸取自句柄
+        void DrawPic(AssetCache::Handle& asset, size_t x_offset, size_t y_offset) {
+            FlushText();
+            const long x = (long)x_offset - this->origin_x, y = (long)y_offset - this->origin_y;
+            if (asset.width && asset.height
+                && !Visible(Rect::Of(x, y, (long)asset.width, (long)asset.height)))
+                return;
+            const SharedBitmap bitmap = AssetCache::Instance().Get(asset);
+            Modified();
+            ScopedStage timer(StageComposite, &asset.path);
+            BlendOver(this->raster, bitmap.view, x, y, this->clip);
+        }
 
-            if (width && height) newImage.resize(Magick::Geometry(width, height));
-            this->image.composite(
-                newImage, x_offset, y_offset, MagickCore::OverCompositeOp);
+        /*
+         * 在图上贴画上预乘 RGBA8 的位图
+         * width、height 不为 0 时按比例缩放到 (width, height) 以内，与 DrawPic 相同
+         */
+        void DrawBitmap(const BitmapView& bitmap, size_t x_offset, size_t y_offset,
+                        size_t width = 0, size_t height = 0) {
+            FlushText();
+            const long x = (long)x_offset - this->origin_x, y = (long)y_offset - this->origin_y;
+            // 缩放后的尺寸不超过 (width, height)
+            if (!Visible(Rect::Of(x,
+                                  y,
+                                  (long)(width && height ? width : bitmap.width),
+                                  (long)(width && height ? height : bitmap.height))))
+                return;
+            Modified();
+            const bool fits = (bitmap.width == width && bitmap.height <= height)
+                              || (bitmap.height == height && bitmap.width <= width);
+            if (width && height && !fits) {
+                Raster resized;
+                {
+                    ScopedStage timer(StageResize);
+                    resized = Resampler::Instance().ResizeToFit(bitmap, width, height);
+                }
+                ScopedStage timer(StageComposite);
+                BlendOver(
+                    this->raster, resized.Empty() ? bitmap : resized.View(), x, y, this->clip);
+                return;
+            }
+            ScopedStage timer(StageComposite);
+            BlendOver(this->raster, bitmap, x, y, this->clip);
         }
 
+        // 256 位感知哈希 (GetFullHash) 中随机位置的 length 个十六进制字符
         std::string GetRandomHash(int length = 16) {
+            const std::string hash = GetFullHash();
+            length = std::max(0, std::min(length, (int)hash.size()));
             std::default_random_engine random(time(NULL));
-            std::uniform_int_distribution<int> dist(0, 128);
-            int randint = dist(random);
-            return std::string(this->image.perceptualHash()).substr(randint, length);
+            std::uniform_int_distribution<int> dist(0, (int)hash.size() - length);
+            return hash.substr(dist(random), length);
         }
 
+        // 256 位感知哈希的十六进制表示
         std::string GetFullHash() {
-            return std::string(this->image.perceptualHash());
+            return GetPHash<4>().ToHex();
         }
         /*
          * 保存图片
+         * 不指定编码设置时格式由扩展名决定，质量为 100
+         */
+        void Save(const std::string& path, const EncodeProfile& profile = EncodeProfile()) {
+            if (profile.kind == EncodeProfile::PngNative) {
+                const Magick::Blob blob = Encode(profile);
+                std::ofstream file(path, std::ios::binary);
+                file.write(static_cast<const char*>(blob.data()), (std::streamsize)blob.length());
+                if (!file.good()) throw std::runtime_error("Cannot write " + path);
+                return;
+            }
+            Magick::Image image = ToMagick();
+            ScopedStage timer(StageEncode);
+            profile.Apply(image);
+            image.write(path);
+        }
+
+        /*
+         * 编码图片到内存
+         * 参数列表:
+         *** format (const std::string&) 编码格式 (PNG、WEBP、JPEG 等) 或编码设置名（见 EncodeProfile）
+         *** quality (size_t) 编码质量，PNG 时十位为 zlib 压缩等级，个位为过滤方式
          */
-        void Save(const std::string& path) {
-            this->image.quality(100);
-            this->image.write(path);
+        Magick::Blob Encode(const std::string& format, size_t quality) {
+            return Encode(EncodeProfile::Parse(format, quality));
+        }
+
+        // threads 为直接编码 PNG 时并行压缩的线程数
+        Magick::Blob Encode(const EncodeProfile& profile, size_t threads = 1) {
+            FlushText();
+            if (profile.kind == EncodeProfile::PngNative) {
+                ScopedStage timer(StageEncode);
+                const std::string png = PngWriter::Encode(
+                    this->raster.View(), profile.level, profile.filter, Z_DEFAULT_STRATEGY, threads);
+                return Magick::Blob(png.data(), png.size());
+            }
+            Magick::Image image = ToMagick();
+            ScopedStage timer(StageEncode);
+            Magick::Blob blob;
+            profile.Apply(image);
+            image.write(&blob);
+            return blob;
+        }
+
+        // 像素占用的字节数
+        size_t Bytes() const {
+            return this->raster.Bytes();
+        }
+
+        // 把像素内存归还 BufferPool，文字批次清空但保留容量
+        void ReleasePixels() {
+            this->raster = Raster();
+            this->text.Clear();
+            this->clip = Rect();
+            this->origin_x = this->origin_y = 0;
+            Modified();
         }
 
+        size_t Width() const {
+            return this->raster.Width();
+        }
+
+        size_t Height() const {
+            return this->raster.Height();
+        }
+
+        // 只给出宽高时用 Resampler 按比例缩放，带 !、%、>、< 等标志时交给 Magick
         void resize(const Magick::Geometry& geometry) {
-            this->image.resize(geometry);
+            if (!geometry.aspect() && !geometry.percent() && !geometry.greater()
+                && !geometry.less() && !geometry.fillArea() && !geometry.limitPixels()) {
+                resize(geometry.width(), geometry.height());
+                return;
+            }
+            Magick::Image image = ToMagick();
+            image.resize(geometry);
+            Assign(image);
         }
 
         void resize(size_t width, size_t height) {
-            this->image.resize(Magick::Geometry(width, height));
+            FlushText();
+            Raster resized = Resampler::Instance().ResizeToFit(this->raster.View(), width, height);
+            if (resized.Empty()) return;
+            this->raster = std::move(resized);
+            Modified();
+        }
+
+        /*
+         * 设置裁剪区域，之后的贴图和文字只画在区域内，rect 为空时取消裁剪
+         * 用于只重画卡片中变化的区域
+         */
+        void SetClip(const Rect& rect) {
+            FlushText();
+            this->clip = rect;
+        }
+
+        // 把 from 中 rect 区域的像素复制过来，两张图尺寸相同
+        void CopyRegion(const Image& from, const Rect& rect) {
+            FlushText();
+            CopyRect(this->raster, from.raster.View(), rect);
+            Modified();
+        }
+
+        // 转为 Magick 图片，批次中的文字会先画上去
+        Magick::Image ToMagick() {
+            FlushText();
+            return MagickFromBitmap(this->raster.View());
+        }
+
+        /*
+         * 感知哈希：缩小为 32x32 的灰度图后取低频 DCT 系数
+         * Words 为 1 时得到 64 位的 PHash64，为 4 时得到 PHash256
+         * 结果保存在图上，画布改变前再次调用不重新计算
+         */
+        template <size_t Words>
+        BasicPHash<Words> GetPHash() {
+            FlushText();
+            constexpr unsigned bit = Words == 1 ? 1 : 2;
+            BasicPHash<Words>& memo = PHashMemo<Words>();
+            if (!(this->phash_ready & bit)) {
+                float gray[32 * 32];
+                GrayBlock32(this->raster.View(), gray);
+                memo = PHashFromGray32<Words>(gray);
+                this->phash_ready |= bit;
+            }
+            return memo;
         }
 
         // 汉明距离：
@@ -198,13 +502,97 @@ namespace Sayobot {
         }
 
     private:
-        Magick::Image image;
+        // 画布坐标中的 rect 是否落在画布（和裁剪区域）内
+        bool Visible(const Rect& rect) const {
+            return rect.Intersects(this->raster.Bounds())
+                   && (this->clip.Empty() || this->clip.Intersects(rect));
+        }
+
+        // 把 [x0, x1) x [y0, y1) 限制在裁剪区域内，结果为空时返回 false
+        bool Clip(int& x0, int& y0, int& x1, int& y1) const {
+            if (this->clip.Empty()) return true;
+            x0 = std::max<int>(x0, (int)this->clip.x0);
+            y0 = std::max<int>(y0, (int)this->clip.y0);
+            x1 = std::min<int>(x1, (int)this->clip.x1);
+            y1 = std::min<int>(y1, (int)this->clip.y1);
+            return x0 < x1 && y0 < y1;
+        }
+
+        void Assign(Magick::Image& image) {
+            this->text.Clear();
+            this->raster = RasterFromMagick(image);
+            Modified();
+        }
+
+        // 画布的像素改变后调用，作废保存的感知哈希
+        void Modified() {
+            this->phash_ready = 0;
+        }
+
+        template <size_t Words>
+        BasicPHash<Words>& PHashMemo() {
+            static_assert(Words == 1 || Words == 4, "PHash64 or PHash256");
+            if constexpr (Words == 1)
+                return this->phash64;
+            else
+                return this->phash256;
+        }
+
+        Raster raster;
+        TextBatch text;
+        Rect clip;                   // 为空时不裁剪，画布坐标
+        long origin_x = 0, origin_y = 0; // 画布左上角对应的绘制坐标，见 AssignBand
+        PHash64 phash64;
+        PHash256 phash256;
+        unsigned phash_ready = 0; // 第 0、1 位分别表示 phash64、phash256 有效
     };
-} // namespace Sayobot
 
-#define BIG_POINTSIZE 54.0
-#define MID_POINTSIZE 43.0
-#define SMALL_POINTSIZE 29.0
+    /*
+     * 本线程复用的画布，文字批次等容量逐张卡片保留
+     * 像素内存在析构时归还 BufferPool，不随空闲的 Image 留在线程里
+     */
+    class ScratchImage {
+    public:
+        ScratchImage() = default;
+
+        ~ScratchImage() {
+            scratch->ReleasePixels();
+        }
+
+        ScratchImage(const ScratchImage&) = delete;
+        ScratchImage& operator=(const ScratchImage&) = delete;
+
+        Image& operator*() {
+            return *scratch;
+        }
+
+    private:
+        Scratch<Image> scratch;
+    };
+
+    /*
+     * 计算图片文件的感知哈希，失败时抛出异常
+     * .avatar 文件直接读取像素；其他文件由 Magick 解码，
+     * JPEG 在解码时就缩小到不小于 64x64（jpeg:size），哈希只需要 32x32
+     */
+    template <size_t Words>
+    BasicPHash<Words> HashImageFile(const std::string& path) {
+        float gray[32 * 32];
+        const std::string ext = ".avatar";
+        if (path.size() > ext.size()
+            && path.compare(path.size() - ext.size(), ext.size(), ext) == 0) {
+            const std::shared_ptr<const AvatarBitmap> bitmap = AvatarStore::Read(path);
+            if (!bitmap) throw std::runtime_error("Bad avatar file: " + path);
+            GrayBlock32(bitmap->View(), gray);
+        } else {
+            Magick::Image image;
+            image.defineValue("jpeg", "size", "64x64");
+            image.read(path);
+            GrayBlock32(RasterFromMagick(image).View(), gray);
+        }
+        return PHashFromGray32<Words>(gray);
+    }
+} // namespace Sayobot
 
 #ifndef SAYOBOT_API
 
@@ -221,423 +609,1750 @@ namespace Sayobot {
 
 typedef std::basic_string<char> string_t;
 
-string_t llToString(long long n) {
-    const char digit[4] = {' ', 'K', 'M', 'G'};
-    long double v = n;
-    int a = 0;
-    while (v > 1000.0) {
-        v /= 1000.0;
-        ++a;
-    }
-    char* buf = new char[20];
-    sprintfS(buf, 20, "%.2Lf", v);
-    string_t ret(buf);
-    delete[] buf;
-    return ret + digit[a];
-}
-
-string_t DoubleRound2(double a) {
-    char* buf = new char[20];
-    sprintfS(buf, 20, "%.2lf", a);
-    string_t ret(buf);
-    delete[] buf;
-    return ret;
-}
-
-std::string syb_png = "./png";
-std::string syb_font = "./fonts";
-
-struct {
+struct FontSet {
     std::string profile = "/10014.ttf";
     std::string data = "/10014.ttf";
     std::string sign = "/10014.ttf";
     std::string time = "/10014.ttf";
     std::string arrow = "/10014.ttf";
     std::string name = "/10014.ttf";
-} font_set;
-
-const std::vector<string_t> mode_str = {"/mode-osu-med.png",
-                                        "/mode-taiko-med.png",
-                                        "/mode-fruits-med.png",
-                                        "/mode-mania-med.png"};
-const std::vector<string_t> rank_str = {"/ranking-X-small.png",
-                                        "/ranking-XH-small.png",
-                                        "/ranking-S-small.png",
-                                        "/ranking-SH-small.png",
-                                        "/ranking-A-small.png"};
-const std::string arrowdownColor = "#000000";
-const std::string arrowupColor = "#000000";
-const std::string timeColor = "#000000";
+};
+
+std::string syb_png = "./png";
+std::string syb_font = "./fonts";
+FontSet font_set;
+// 通过 Sayobot_LoadLayout 载入的布局，为空时使用内置布局
+std::shared_ptr<const Sayobot::Layout> syb_layout;
+// 按当前路径和字体编译好的布局，设置改变时清空，下一次渲染时重新编译
+std::shared_ptr<const Sayobot::Layout> syb_compiled_layout;
+// 保护以上路径、字体和布局设置，渲染时只读取一份快照
+std::mutex syb_config_mutex;
+
+namespace Sayobot {
+    std::shared_ptr<const Layout> DefaultLayout() {
+        static const std::shared_ptr<const Layout> layout =
+            Layout::Parse(DefaultLayoutSource());
+        return layout;
+    }
+
+    // 取得编译好的布局（字体句柄已解析，{png} 已展开）
+    std::shared_ptr<const Layout> CurrentLayout() {
+        std::lock_guard<std::mutex> lock(syb_config_mutex);
+        if (syb_compiled_layout) return syb_compiled_layout;
+        const std::string font = syb_font;
+        const FontSet fonts = font_set;
+        const std::shared_ptr<const Layout> source =
+            syb_layout ? syb_layout : DefaultLayout();
+        syb_compiled_layout = source->Compile(syb_png, [&](const std::string& name) {
+            if (name == "profile") return font + fonts.profile;
+            if (name == "data") return font + fonts.data;
+            if (name == "sign") return font + fonts.sign;
+            if (name == "time") return font + fonts.time;
+            if (name == "arrow") return font + fonts.arrow;
+            if (name == "name") return font + fonts.name;
+            return std::string();
+        });
+        return syb_compiled_layout;
+    }
+
+    /*
+     * 底图缓存
+     * base 层只取决于用户的卡片设置，按设置缓存合成好的底图，
+     * 每张卡片从底图的副本开始绘制
+     */
+    LruCache<std::shared_ptr<const Image>>& BaseLayers() {
+        static LruCache<std::shared_ptr<const Image>> cache(256u << 20);
+        return cache;
+    }
+
+    // 素材文件的路径和修改时间，用于缓存键
+    void AppendStamp(std::string& out, const std::string& path) {
+        FileStamp stamp;
+        FileStamp::Of(path, stamp);
+        out += path;
+        out += '\n';
+        AppendInt(out, (long long)stamp.mtime);
+        out += ':';
+        AppendInt(out, (long long)stamp.fsize);
+        out += '\n';
+    }
+
+    // 收集 base 层要绘制的图片，images 的前 count 项有效，其余是留着复用的字符串
+    struct BaseLayerPlan {
+        std::vector<std::pair<const LayoutOp*, std::string>>& images;
+        size_t count = 0;
+
+        void DrawImage(const LayoutOp& op, const std::string& path) {
+            if (count == images.size()) images.emplace_back();
+            images[count].first = &op;
+            images[count++].second.assign(path);
+        }
+
+        void DrawText(const LayoutOp&, const std::string&, uint32_t) {
+        }
+
+        void DrawAvatar(const LayoutOp&, int64_t) {
+        }
+    };
+
+    // 在卡片上重放 card 层
+    struct CardPainter {
+        Image& image;
+        const std::vector<LayoutValue>& values;
+
+        void DrawImage(const LayoutOp& op, const std::string& path) {
+            try {
+                if (op.asset)
+                    image.DrawPic(*op.asset, op.x, op.y);
+                else
+                    image.DrawPic(path, op.x, op.y, op.width, op.height);
+            } catch (Magick::Exception&) {
+                if (!op.has_fallback) throw;
+                Scratch<std::string> fallback;
+                op.fallback.Format(values, *fallback);
+                image.DrawPic(*fallback, op.x, op.y, op.width, op.height);
+            }
+        }
+
+        // 头像取自头像库，不会因为下载失败的文件抛出异常
+        void DrawAvatar(const LayoutOp& op, int64_t user_id) {
+            const std::shared_ptr<const AvatarBitmap> avatar =
+                AvatarStore::Instance().Get(values[Field_png].s, user_id);
+            if (avatar) {
+                image.DrawBitmap(avatar->View(), op.x, op.y, op.width, op.height);
+                return;
+            }
+            if (!op.has_fallback) return;
+            Scratch<std::string> fallback;
+            op.fallback.Format(values, *fallback);
+            image.DrawPic(*fallback, op.x, op.y, op.width, op.height);
+        }
+
+        void DrawText(const LayoutOp& op, const std::string& text, uint32_t color) {
+            if (text.empty()) return;
+            image.Drawtext(text, op.face, op.size, color, op.x, op.y, op.align);
+        }
+    };
+
+    /*
+     * 取得底图，键中带上布局编号和各素材的修改时间，素材被替换后自动重建
+     * key_out 不为空时写入底图的缓存键
+     */
+    std::shared_ptr<const Image> GetBaseLayer(const Layout& layout,
+                                              const std::vector<LayoutValue>& values,
+                                              std::string* key_out = nullptr) {
+        Scratch<std::vector<std::pair<const LayoutOp*, std::string>>> images;
+        BaseLayerPlan plan{*images};
+        layout.Replay(0, values, plan);
+        Scratch<std::string> scratch;
+        std::string& key = key_out ? *key_out : *scratch;
+        key.clear();
+        AppendInt(key, (long long)layout.id);
+        key += '\n';
+        for (size_t i = 0; i < plan.count; ++i) AppendStamp(key, plan.images[i].second);
+        std::shared_ptr<const Image> cached;
+        if (BaseLayers().Get(key, cached)) {
+            Metrics::Instance().base_layer_cache.Hit();
+            return cached;
+        }
+        Metrics::Instance().base_layer_cache.Miss();
+        const std::shared_ptr<Image> base = std::make_shared<Image>();
+        base->Create(layout.width, layout.height);
+        for (size_t i = 0; i < plan.count; ++i) {
+            const LayoutOp& op = *plan.images[i].first;
+            if (op.asset)
+                base->DrawPic(*op.asset, op.x, op.y);
+            else
+                base->DrawPic(plan.images[i].second, op.x, op.y, op.width, op.height);
+        }
+        base->FlushText();
+        BaseLayers().Put(key, base, base->Bytes());
+        return base;
+    }
+
+    /*
+     * 未编码的卡片缓存
+     * 保存画好了除随时间变化的文字以外所有内容的卡片，键为 CardDigest
+     * 和底图缓存一样保存共享指针，复制像素不占用缓存的锁
+     */
+    LruCache<std::shared_ptr<const Image>>& UndatedCards() {
+        static LruCache<std::shared_ptr<const Image>> cache(128u << 20);
+        return cache;
+    }
+
+    // 把卡片用到的素材文件和它们的修改时间追加到 input，作为卡片缓存键的一部分
+    struct CardSources {
+        const std::vector<LayoutValue>& values;
+        std::string& input;
+        std::string& path;
+
+        void DrawImage(const LayoutOp& op, const std::string& path) {
+            AppendStamp(input, path);
+            AddFallback(op);
+        }
+
+        void DrawText(const LayoutOp&, const std::string&, uint32_t) {
+        }
+
+        void DrawAvatar(const LayoutOp& op, int64_t user_id) {
+            AvatarStore::AvatarPath(values[Field_png].s, user_id, path);
+            AppendStamp(input, path);
+            AvatarStore::LegacyPath(values[Field_png].s, user_id, path);
+            AppendStamp(input, path);
+            AddFallback(op);
+        }
+
+        void AddFallback(const LayoutOp& op) {
+            if (!op.has_fallback) return;
+            op.fallback.Format(values, path);
+            AppendStamp(input, path);
+        }
+    };
+
+    // 128 位摘要（两个不同初值的 FNV-1a），十六进制，写入 out（保留容量）
+    void Digest(const std::string& input, std::string& out) {
+        char buf[40];
+        const int length = snprintf(buf,
+                                    sizeof(buf),
+                                    "%016llx%016llx",
+                                    (unsigned long long)Fnv1a(input),
+                                    (unsigned long long)Fnv1a(input, 0x84222325cbf29ce4ull));
+        out.assign(buf, (size_t)length);
+    }
+
+    std::string Digest(const std::string& input) {
+        std::string out;
+        Digest(input, out);
+        return out;
+    }
+
+    /*
+     * 卡片缓存键：布局指纹、不随时间变化的字段值和所用素材的修改时间的摘要
+     * 布局的条件或图片依赖当前时间时 out 为空字符串，这样的卡片不缓存
+     */
+    void CardDigest(const Layout& layout, const std::vector<LayoutValue>& values,
+                    std::string& out) {
+        out.clear();
+        if (layout.clocked_structure) return;
+        Scratch<std::string> input_scratch, path;
+        std::string& input = *input_scratch;
+        input.assign(reinterpret_cast<const char*>(&layout.fingerprint),
+                     sizeof(layout.fingerprint));
+        for (size_t i = 0; i < values.size(); ++i) {
+            if (layout.clocked_fields[i]) continue;
+            const LayoutValue& v = values[i];
+            input += (char)v.kind;
+            if (v.kind == LayoutValue::String) {
+                input += v.s;
+                input += '\0';
+            } else if (v.kind == LayoutValue::Float) {
+                input.append(reinterpret_cast<const char*>(&v.f), sizeof(v.f));
+            } else {
+                input.append(reinterpret_cast<const char*>(&v.i), sizeof(v.i));
+            }
+        }
+        CardSources sources{values, input, *path};
+        layout.Replay(0, values, sources);
+        layout.Replay(1, values, sources);
+        Digest(input, out);
+    }
+
+    // card 层中一个绘制操作的内容和它在画布上占用的区域
+    struct DrawnOp {
+        size_t index; // 在 layout.ops 中的下标
+        std::string content;
+        Rect rect;
+    };
+
+    // 测量结果，前 count 项有效，其余是留着复用的字符串
+    struct DrawnOps {
+        std::vector<DrawnOp> items;
+        size_t count = 0;
+
+        DrawnOps() = default;
+        DrawnOps(DrawnOps&&) = default;
+        DrawnOps& operator=(DrawnOps&&) = default;
+
+        DrawnOps(const DrawnOps& other) {
+            *this = other;
+        }
+
+        // 只复制有效的项，已有的字符串容量保留
+        DrawnOps& operator=(const DrawnOps& other) {
+            if (this == &other) return *this;
+            count = 0;
+            for (const DrawnOp& op : other) {
+                DrawnOp& drawn = Add(op.index);
+                drawn.content.assign(op.content);
+                drawn.rect = op.rect;
+            }
+            return *this;
+        }
+
+        DrawnOp& Add(size_t index) {
+            if (count == items.size()) items.emplace_back();
+            DrawnOp& drawn = items[count++];
+            drawn.index = index;
+            drawn.content.clear();
+            drawn.rect = Rect();
+            return drawn;
+        }
+
+        void Clear() {
+            count = 0;
+        }
+
+        size_t Size() const {
+            return count;
+        }
+
+        DrawnOp& operator[](size_t i) {
+            return items[i];
+        }
+
+        const DrawnOp& operator[](size_t i) const {
+            return items[i];
+        }
+
+        DrawnOp* begin() {
+            return items.data();
+        }
+
+        DrawnOp* end() {
+            return items.data() + count;
+        }
+
+        const DrawnOp* begin() const {
+            return items.data();
+        }
+
+        const DrawnOp* end() const {
+            return items.data() + count;
+        }
+    };
+
+    /*
+     * 测量 card 层各操作的内容和区域
+     * 内容相同的操作画出的像素相同；图片内容取路径和修改时间，文字取文本和颜色
+     * 单独重放时用 batch 排版文字；绘制时经 MeasuringPainter 顺带测量，不再排版
+     * ops、batch 由调用方提供（通常借自 Scratch），逐张卡片复用
+     */
+    struct CardMeasure {
+        const Layout& layout;
+        const std::vector<LayoutValue>& values;
+        DrawnOps& ops;
+        TextBatch& batch;
+
+        void DrawImage(const LayoutOp& op, const std::string& path) {
+            DrawnOp& drawn = Add(op);
+            AppendStamp(drawn.content, path);
+            AddFallback(op, drawn);
+            if (op.width && op.height) {
+                drawn.rect = Rect::Of((long)op.x, (long)op.y, (long)op.width, (long)op.height);
+                return;
+            }
+            // 不缩放的图片取解码后的尺寸，读取失败时按整张画布处理
+            try {
+                const SharedBitmap bitmap = op.asset ? AssetCache::Instance().Get(*op.asset)
+                                                     : AssetCache::Instance().Get(path, 0, 0);
+                drawn.rect = Rect::Of(
+                    (long)op.x, (long)op.y, (long)bitmap.view.width, (long)bitmap.view.height);
+            } catch (Magick::Exception&) {
+                drawn.rect = Rect::Of(0, 0, (long)layout.width, (long)layout.height);
+            }
+        }
+
+        void DrawAvatar(const LayoutOp& op, int64_t user_id) {
+            DrawnOp& drawn = Add(op);
+            Scratch<std::string> path;
+            AvatarStore::AvatarPath(values[Field_png].s, user_id, *path);
+            AppendStamp(drawn.content, *path);
+            AvatarStore::LegacyPath(values[Field_png].s, user_id, *path);
+            AppendStamp(drawn.content, *path);
+            AddFallback(op, drawn);
+            drawn.rect = op.width && op.height
+                             ? Rect::Of((long)op.x, (long)op.y, (long)op.width, (long)op.height)
+                             : Rect::Of(0, 0, (long)layout.width, (long)layout.height);
+        }
+
+        void DrawText(const LayoutOp& op, const std::string& text, uint32_t color) {
+            if (text.empty()) return;
+            batch.Clear();
+            batch.Add(text, op.face, op.size, color, op.x, op.y, op.align);
+            Rect rect;
+            int x0, y0, x1, y1;
+            if (batch.Bounds((int)layout.width, (int)layout.height, x0, y0, x1, y1))
+                rect = Rect{x0, y0, x1, y1};
+            AddText(op, text, color, rect);
+        }
+
+        void AddText(const LayoutOp& op, const std::string& text, uint32_t color,
+                     const Rect& rect) {
+            DrawnOp& drawn = Add(op);
+            drawn.content = text;
+            drawn.content.append(reinterpret_cast<const char*>(&color), sizeof(color));
+            drawn.rect = rect;
+        }
+
+        DrawnOp& Add(const LayoutOp& op) {
+            return ops.Add((size_t)(&op - &layout.ops[0]));
+        }
+
+        void AddFallback(const LayoutOp& op, DrawnOp& drawn) {
+            if (!op.has_fallback) return;
+            Scratch<std::string> fallback;
+            op.fallback.Format(values, *fallback);
+            AppendStamp(drawn.content, *fallback);
+        }
+    };
+
+    // 绘制 card 层的同时测量，文字区域取自画布上刚加入的文字
+    struct MeasuringPainter {
+        CardPainter& painter;
+        CardMeasure& measure;
+
+        void DrawImage(const LayoutOp& op, const std::string& path) {
+            painter.DrawImage(op, path);
+            measure.DrawImage(op, path);
+        }
+
+        void DrawAvatar(const LayoutOp& op, int64_t user_id) {
+            painter.DrawAvatar(op, user_id);
+            measure.DrawAvatar(op, user_id);
+        }
+
+        void DrawText(const LayoutOp& op, const std::string& text, uint32_t color) {
+            if (text.empty()) return;
+            painter.DrawText(op, text, color);
+            Rect rect;
+            painter.image.LastTextBounds(
+                (int)measure.layout.width, (int)measure.layout.height, rect);
+            measure.AddText(op, text, color, rect);
+        }
+    };
+
+    // 用户上一张卡片的画布和各操作的测量结果
+    struct PreviousCard {
+        std::string base_key;
+        DrawnOps ops;
+        Image image;
+    };
+
+    /*
+     * 最近活跃用户的上一张卡片，键为布局编号、模式和用户名
+     * 同一用户连续刷新时通常只有几个数字变化，只重画变化的区域
+     * 第一次出现的用户只记下空指针作为标记，再次刷新时才保存整张卡片
+     */
+    LruCache<std::shared_ptr<const PreviousCard>>& PreviousCards() {
+        static LruCache<std::shared_ptr<const PreviousCard>> cache(64u << 20);
+        return cache;
+    }
+
+    /*
+     * 本线程留着复用的 PreviousCard
+     * 从缓存中替换下来、已没有别处引用的旧卡片放在这里，下一次保存时复用它的画布和字符串
+     */
+    std::shared_ptr<PreviousCard>& SparePreviousCard() {
+        thread_local std::shared_ptr<PreviousCard> spare;
+        return spare;
+    }
+
+    void PreviousCardKey(const Layout& layout, const std::vector<LayoutValue>& values,
+                         std::string& key) {
+        key.clear();
+        AppendInt(key, (long long)layout.id);
+        key += '\n';
+        AppendInt(key, values[Field_mode].i);
+        key += '\n';
+        key += values[Field_username].s;
+    }
+
+    /*
+     * 对比两次的测量结果，得到需要重画的区域
+     * 内容或位置变化、只在一边出现的操作，新旧区域都要重画；
+     * 互相重叠的区域合并，区域过多时合并为一个；结果写入 dirty（保留容量）
+     */
+    void DirtyRegions(const DrawnOps& before, const DrawnOps& after,
+                      std::vector<Rect>& dirty) {
+        dirty.clear();
+        size_t i = 0, j = 0;
+        while (i < before.Size() || j < after.Size()) {
+            if (j == after.Size()
+                || (i < before.Size() && before[i].index < after[j].index)) {
+                dirty.push_back(before[i++].rect);
+            } else if (i == before.Size() || after[j].index < before[i].index) {
+                dirty.push_back(after[j++].rect);
+            } else {
+                if (before[i].content != after[j].content || !(before[i].rect == after[j].rect)) {
+                    dirty.push_back(before[i].rect);
+                    dirty.push_back(after[j].rect);
+                }
+                ++i, ++j;
+            }
+        }
+        dirty.erase(std::remove_if(dirty.begin(),
+                                   dirty.end(),
+                                   [](const Rect& r) { return r.Empty(); }),
+                    dirty.end());
+        for (bool merged = true; merged;) {
+            merged = false;
+            for (size_t a = 0; a < dirty.size() && !merged; ++a) {
+                for (size_t b = a + 1; b < dirty.size(); ++b) {
+                    if (!dirty[a].Intersects(dirty[b])) continue;
+                    dirty[a] = dirty[a].Union(dirty[b]);
+                    dirty.erase(dirty.begin() + b);
+                    merged = true;
+                    break;
+                }
+            }
+        }
+        if (dirty.size() > 8) {
+            Rect all;
+            for (const Rect& r : dirty) all = all.Union(r);
+            dirty.assign(1, all);
+        }
+    }
+
+    // 在一个区域（横带或需要重画的区域）上重放 card 层，跳过测量区域与它不相交的操作
+    struct RegionPainter {
+        CardPainter painter;
+        const Layout& layout;
+        const std::vector<Rect>& rects; // 按 layout.ops 的下标
+        Rect region;
+
+        void DrawImage(const LayoutOp& op, const std::string& path) {
+            if (Visible(op)) painter.DrawImage(op, path);
+        }
+
+        void DrawAvatar(const LayoutOp& op, int64_t user_id) {
+            if (Visible(op)) painter.DrawAvatar(op, user_id);
+        }
+
+        void DrawText(const LayoutOp& op, const std::string& text, uint32_t color) {
+            if (Visible(op)) painter.DrawText(op, text, color);
+        }
+
+        bool Visible(const LayoutOp& op) const {
+            return rects[(size_t)(&op - &layout.ops[0])].Intersects(region);
+        }
+    };
+
+    // 把测量结果按 layout.ops 的下标展开，没有画出内容的操作区域为空
+    void OpRects(const Layout& layout, const DrawnOps& ops, std::vector<Rect>& rects) {
+        rects.assign(layout.ops.size(), Rect());
+        for (const DrawnOp& op : ops) rects[op.index] = op.rect;
+    }
+
+    /*
+     * 在上一张卡片上只重画变化的区域，成功时结果与完整绘制逐像素相同
+     * 底图变化或需要重画的面积超过画布的 60% 时返回 false，由调用方完整绘制
+     */
+    bool RenderIncremental(const Layout& layout, const std::vector<LayoutValue>& values,
+                           const PreviousCard& previous, const std::string& base_key,
+                           const Image& base, const DrawnOps& ops, Image& image) {
+        if (previous.base_key != base_key) return false;
+        Scratch<std::vector<Rect>> scratch;
+        std::vector<Rect>& dirty = *scratch;
+        DirtyRegions(previous.ops, ops, dirty);
+        uint64_t area = 0;
+        for (const Rect& r : dirty) area += (uint64_t)r.Intersect(Rect::Of(0, 0, (long)layout.width, (long)layout.height)).Area();
+        if (area * 5 > (uint64_t)layout.width * layout.height * 3) return false;
+        image = previous.image;
+        Scratch<std::vector<Rect>> rects;
+        OpRects(layout, ops, *rects);
+        // 每个区域只重放与它相交的操作
+        for (const Rect& r : dirty) {
+            image.CopyRegion(base, r);
+            image.SetClip(r);
+            RegionPainter painter{CardPainter{image, values}, layout, *rects, r};
+            layout.Replay(1, values, painter);
+            image.FlushText();
+        }
+        image.SetClip(Rect());
+        return true;
+    }
+
+    /*
+     * 把 card 层分成等高的横带，在线程池上并行绘制后拼接，结果与在 image 上直接绘制逐像素相同
+     * image 为已经画好底图的画布，ops 为 CardMeasure 的测量结果
+     * 跨越带边界的操作在相关的每条带上各画一次，只写入带内的像素
+     * 各带的 Image 和区域数组在本线程复用，带的像素画完后归还 BufferPool
+     */
+    void RenderBands(const Layout& layout, const std::vector<LayoutValue>& values,
+                     const DrawnOps& ops, ReplayClock clock, size_t threads,
+                     Image& image) {
+        image.FlushText();
+        const size_t height = image.Height();
+        const size_t count = std::min(threads * 2, std::max<size_t>(1, height / 64));
+        Scratch<std::vector<Rect>> rects;
+        OpRects(layout, ops, *rects);
+
+        Scratch<std::vector<Image>> scratch_bands;
+        Scratch<std::vector<std::exception_ptr>> scratch_errors;
+        std::vector<Image>& bands = *scratch_bands;
+        std::vector<std::exception_ptr>& errors = *scratch_errors;
+        bands.resize(count);
+        errors.assign(count, nullptr);
+        ThreadPool::Shared().ParallelFor(count, threads, [&](size_t i) {
+            const size_t y0 = height * i / count, y1 = height * (i + 1) / count;
+            try {
+                bands[i].AssignBand(image, y0, y1);
+                RegionPainter painter{CardPainter{bands[i], values},
+                                    layout,
+                                    *rects,
+                                    Rect::Of(0, (long)y0, (long)image.Width(), (long)(y1 - y0))};
+                layout.Replay(1, values, painter, clock);
+                bands[i].FlushText();
+            } catch (...) {
+                errors[i] = std::current_exception();
+            }
+        });
+        const auto release = [&bands] {
+            for (Image& band : bands) band.ReleasePixels();
+        };
+        for (std::exception_ptr& error : errors) {
+            if (!error) continue;
+            const std::exception_ptr first = std::move(error);
+            release();
+            std::rethrow_exception(first);
+        }
+        image.Stack(bands);
+        release();
+    }
+
+    /*
+     * 制作卡片，所有状态都在栈上，可以在多个线程上同时调用
+     * digest 不为空时，不随时间变化的部分取自（或存入）未编码的卡片缓存，
+     * 随时间变化的文字（页脚时间等）在最后补画
+     * 缓存了该用户的上一张卡片时，只重画与上一张不同的区域
+     * threads 大于 1 时，完整绘制按横带分到线程池的 threads 个线程上
+     */
+    void RenderPersonalCard(const Layout& layout, const std::vector<LayoutValue>& values,
+                            const std::string& digest, Image& image, size_t threads = 1) {
+        Scratch<std::string> base_key_scratch, key_scratch;
+        std::string& base_key = *base_key_scratch;
+        std::string& key = *key_scratch;
+        const std::shared_ptr<const Image> base = GetBaseLayer(layout, values, &base_key);
+        const bool track = PreviousCards().Limit() != 0;
+        std::shared_ptr<const PreviousCard> previous;
+        bool retain = false;
+        if (track) {
+            PreviousCardKey(layout, values, key);
+            retain = PreviousCards().Get(key, previous);
+            if (!retain) PreviousCards().Put(key, nullptr, key.size());
+        }
+        Scratch<DrawnOps> ops;
+        Scratch<TextBatch> batch;
+        ops->Clear();
+        CardMeasure measure{layout, values, *ops, *batch};
+        bool measured = false;
+        const auto measure_all = [&] {
+            if (measured) return;
+            layout.Replay(1, values, measure);
+            measured = true;
+        };
+        const auto remember = [&] {
+            if (!retain) return;
+            image.FlushText();
+            // 分两次重放时测量结果不按下标排列
+            std::sort(measure.ops.begin(),
+                      measure.ops.end(),
+                      [](const DrawnOp& a, const DrawnOp& b) { return a.index < b.index; });
+            // 复用本线程上次替换下来的卡片，画布和字符串的容量都保留
+            std::shared_ptr<PreviousCard> card = std::move(SparePreviousCard());
+            if (!card) card = std::make_shared<PreviousCard>();
+            card->base_key = base_key;
+            card->ops = measure.ops;
+            card->image = image;
+            const size_t bytes = card->image.Bytes() + card->ops.Size() * sizeof(DrawnOp);
+            std::shared_ptr<const PreviousCard> replaced = std::move(card);
+            previous.reset();
+            PreviousCards().Exchange(key, replaced, bytes);
+            // 换下来的卡片已不在缓存中，引用计数不会再增加；为 1 时只有这里引用它
+            if (replaced && replaced.use_count() == 1) {
+                std::atomic_thread_fence(std::memory_order_acquire);
+                SparePreviousCard() = std::const_pointer_cast<PreviousCard>(replaced);
+            }
+        };
+
+        std::shared_ptr<const Image> undated;
+        if (!digest.empty() && UndatedCards().Get(digest, undated)) {
+            Metrics::Instance().card_cache.Hit();
+            if (retain) measure_all();
+            image = *undated;
+            CardPainter painter{image, values};
+            layout.Replay(1, values, painter, ReplayClocked);
+            remember();
+            return;
+        }
+        if (!digest.empty()) Metrics::Instance().card_cache.Miss();
+
+        if (previous) {
+            measure_all();
+            if (RenderIncremental(
+                    layout, values, *previous, base_key, *base, measure.ops, image)) {
+                Metrics::Instance().incremental.Hit();
+                remember();
+                return;
+            }
+        }
+        if (track) Metrics::Instance().incremental.Miss();
+
+        // 从缓存的底图开始绘制，需要保存卡片而还没有测量时在绘制的同时测量
+        image = *base;
+        CardPainter painter{image, values};
+        MeasuringPainter measuring{painter, measure};
+        const bool measure_now = retain && !measured;
+        const auto paint = [&](ReplayClock clock) {
+            if (measure_now)
+                layout.Replay(1, values, measuring, clock);
+            else
+                layout.Replay(1, values, painter, clock);
+        };
+        if (threads > 1) {
+            // 分带前就要知道各操作的区域
+            measure_all();
+            const ReplayClock clock = digest.empty() ? ReplayAll : ReplayUnclocked;
+            RenderBands(layout, values, measure.ops, clock, threads, image);
+            if (!digest.empty()) {
+                UndatedCards().Put(
+                    digest, std::make_shared<const Image>(image), image.Bytes());
+                layout.Replay(1, values, painter, ReplayClocked);
+            }
+        } else if (digest.empty()) {
+            paint(ReplayAll);
+        } else {
+            paint(ReplayUnclocked);
+            image.FlushText();
+            UndatedCards().Put(
+                digest, std::make_shared<const Image>(image), image.Bytes());
+            paint(ReplayClocked);
+        }
+        remember();
+    }
+
+    // 单张卡片分带绘制、并行压缩的线程数，为 1 时不拆分
+    std::atomic<size_t>& BandThreads() {
+        static std::atomic<size_t> threads{1};
+        return threads;
+    }
+
+    // 正在进行的渲染数；同时有多张卡片在渲染时已经占满了线程，不再拆分单张卡片
+    std::atomic<size_t>& ActiveRenders() {
+        static std::atomic<size_t> count{0};
+        return count;
+    }
+
+    // 在 ctx 上完成一次渲染，成功返回 SAYOBOT_OK，错误信息写入 ctx.error
+    // parse(CardArgs&) 负责把调用方传入的参数解析到线程上复用的 CardArgs 中
+    // 参数中 out_path 为空时编码结果保存在 ctx.output，否则写入文件
+    // rendered 不为空时保留画好的卡片；encode 为 false 时不编码到 ctx.output
+    template <typename Parse>
+    int Render(RenderContext& ctx, Parse parse, Image* rendered = nullptr,
+               bool encode = true) {
+        ctx.error.clear();
+        ctx.trace_json.clear();
+        // 有新的输出时直接替换 ctx.output，没有时最后才清空（空的 Blob 也要分配引用计数）
+        bool output = false;
+        TraceLog trace;
+        const uint64_t begin = NowNs();
+        trace.begin_ns = begin;
+        if (ctx.trace) ThreadTrace() = &trace;
+        const size_t threads =
+            ActiveRenders().fetch_add(1) == 0 ? BandThreads().load(std::memory_order_relaxed) : 1;
+        try {
+            Scratch<CardArgs> scratch_args;
+            parse(*scratch_args);
+            const CardArgs& args = *scratch_args;
+            const std::shared_ptr<const Layout> layout = CurrentLayout();
+            bool stored = false;
+            const int64_t granularity = CardCache::Instance().Granularity(stored);
+            // 设置了时间粒度时，卡片上的时间取整，同一粒度内的结果可以直接复用
+            int64_t now = (int64_t)time(nullptr);
+            if (granularity > 0) now -= now % granularity;
+            Scratch<std::vector<LayoutValue>> scratch_values;
+            std::vector<LayoutValue>& values = *scratch_values;
+            layout->Evaluate(args, values, now);
+
+            const bool use_encoded = granularity > 0 && stored && args.out_path.empty()
+                                     && encode && !rendered;
+            Scratch<std::string> digest_scratch, encoded_scratch;
+            std::string& digest = *digest_scratch;
+            std::string& encoded_digest = *encoded_scratch;
+            digest.clear();
+            encoded_digest.clear();
+            if (use_encoded || UndatedCards().Limit()) CardDigest(*layout, values, digest);
+            if (use_encoded && !digest.empty()) {
+                Scratch<std::string> input;
+                input->assign(digest);
+                *input += '\n';
+                AppendInt(*input, now);
+                *input += '\n';
+                *input += ctx.format;
+                *input += '\n';
+                AppendInt(*input, ctx.quality);
+                Digest(*input, encoded_digest);
+                const std::shared_ptr<const std::string> bytes =
+                    CardCache::Instance().Get(encoded_digest);
+                if (bytes) {
+                    Metrics::Instance().card_cache.Hit();
+                    ctx.output = Magick::Blob(bytes->data(), bytes->size());
+                    output = true;
+                } else {
+                    Metrics::Instance().card_cache.Miss();
+                }
+            }
+            if (!output) {
+                ScratchImage scratch_image;
+                Image& image = *scratch_image;
+                const std::string none;
+                RenderPersonalCard(
+                    *layout, values, UndatedCards().Limit() ? digest : none, image, threads);
+                // 写入文件时只有指定了编码设置才覆盖按扩展名的默认行为
+                if (!args.out_path.empty()) {
+                    const EncodeProfile profile = EncodeProfile::Parse(ctx.format, ctx.quality);
+                    image.Save(args.out_path, profile.named ? profile : EncodeProfile());
+                } else if (encode) {
+                    const EncodeProfile profile = EncodeProfile::Parse(ctx.format, ctx.quality);
+                    ctx.output = image.Encode(profile, threads);
+                    output = true;
+                }
+                if (!encoded_digest.empty())
+                    CardCache::Instance().Put(
+                        encoded_digest,
+                        std::make_shared<const std::string>(
+                            static_cast<const char*>(ctx.output.data()), ctx.output.length()));
+                if (rendered) *rendered = std::move(image);
+            }
+        } catch (const std::exception& ex) {
+            ctx.error = ex.what();
+            if (ctx.error.empty()) ctx.error = "Unknown Error!";
+        } catch (...) {
+            ctx.error = "Unknown Error!";
+        }
+        if (!output && ctx.output.length()) ctx.output = Magick::Blob();
+        ActiveRenders().fetch_sub(1);
+        ThreadTrace() = nullptr;
+        if (ctx.trace) ctx.trace_json = trace.ToJson();
+        Metrics& metrics = Metrics::Instance();
+        metrics.render.Record(NowNs() - begin);
+        metrics.renders.fetch_add(1, std::memory_order_relaxed);
+        if (!ctx.error.empty()) metrics.errors.fetch_add(1, std::memory_order_relaxed);
+        return ctx.error.empty() ? SAYOBOT_OK : SAYOBOT_ERROR;
+    }
+
+    /*
+     * 渲染一批卡片，threads 为 0 时使用线程池的全部线程
+     * 全部成功返回 SAYOBOT_OK，否则返回 SAYOBOT_ERROR，各卡片的错误在各自的上下文中
+     */
+    int RenderBatchItems(RenderBatch& batch, size_t threads) {
+        const size_t n = batch.items.size();
+        const bool tiled = batch.columns > 0;
+        batch.tile.error.clear();
+        batch.tile.output = Magick::Blob();
+        std::vector<Image> tiles(tiled ? n : 0);
+        size_t tile_width = 0, tile_height = 0;
+        if (tiled) {
+            const std::shared_ptr<const Layout> layout = CurrentLayout();
+            tile_width = batch.tile_width ? batch.tile_width : layout->width;
+            tile_height = std::max<size_t>(
+                1, (layout->height * tile_width + layout->width / 2) / layout->width);
+        }
+
+        std::atomic<size_t> failed{0};
+        ThreadPool& pool = ThreadPool::Shared();
+        pool.ParallelFor(n, threads ? threads : pool.Size() + 1, [&](size_t i) {
+            RenderBatch::Item& item = batch.items[i];
+            Image* tile = tiled ? &tiles[i] : nullptr;
+            const auto parse = [&item](CardArgs& args) {
+                if (item.binary)
+                    ParseCardArgs(item.args.data(), item.args.size(), args);
+                else
+                    ParseCardArgs(item.args.c_str(), args);
+            };
+            const int status = Render(*item.ctx, parse, tile, batch.encode_items);
+            if (status != SAYOBOT_OK) {
+                failed.fetch_add(1, std::memory_order_relaxed);
+                return;
+            }
+            // 在工作线程上缩小，拼图时只保留缩小后的卡片
+            if (tile && tile->Width()) {
+                ScopedStage timer(StageResize);
+                tile->resize(tile_width, tile_height);
+            }
+        });
+
+        if (tiled && n) {
+            try {
+                const size_t rows = (n + batch.columns - 1) / batch.columns;
+                Image sheet;
+                sheet.Create(std::min(n, batch.columns) * tile_width, rows * tile_height);
+                for (size_t i = 0; i < n; ++i) {
+                    if (!tiles[i].Width()) continue; // 渲染失败的位置留空
+                    sheet.DrawPic(tiles[i],
+                                  (i % batch.columns) * tile_width,
+                                  (i / batch.columns) * tile_height);
+                }
+                batch.tile.output = sheet.Encode(batch.tile.format, batch.tile.quality);
+            } catch (const std::exception& ex) {
+                batch.tile.error = ex.what();
+            }
+        }
+        if (failed && batch.tile.error.empty())
+            batch.tile.error = std::to_string(failed.load()) + " of " + std::to_string(n)
+                               + " cards failed";
+        return failed || !batch.tile.error.empty() ? SAYOBOT_ERROR : SAYOBOT_OK;
+    }
+} // namespace Sayobot
+
+namespace Sayobot {
+    // 生成指标快照 (JSON)
+    std::string StatsJson() {
+        Metrics& m = Metrics::Instance();
+        char buf[256];
+        std::string out = "{";
+        snprintf(buf,
+                 sizeof(buf),
+                 "\"renders\":%llu,\"errors\":%llu,\"blend\":\"%s\",\"render\":",
+                 (unsigned long long)m.renders.load(std::memory_order_relaxed),
+                 (unsigned long long)m.errors.load(std::memory_order_relaxed),
+                 SelectBlendKernel().name);
+        out += buf;
+        m.render.AppendJson(out);
+        out += ",\"stages\":{";
+        for (int i = 0; i < StageCount; ++i) {
+            if (i) out += ',';
+            out += '"';
+            out += StageName(i);
+            out += "\":";
+            m.stages[i].AppendJson(out);
+        }
+        out += "},\"decode\":{";
+        for (int i = 0; i < AssetClassCount; ++i) {
+            if (i) out += ',';
+            out += '"';
+            out += AssetClassName(i);
+            out += "\":";
+            m.decode[i].AppendJson(out);
+        }
+        AssetCache& assets = AssetCache::Instance();
+        snprintf(buf,
+                 sizeof(buf),
+                 "},\"cache\":{\"asset\":{\"hits\":%llu,\"misses\":%llu,\"bytes\":%llu,"
+                 "\"limit\":%llu},",
+                 (unsigned long long)m.asset_cache.hits.load(std::memory_order_relaxed),
+                 (unsigned long long)m.asset_cache.misses.load(std::memory_order_relaxed),
+                 (unsigned long long)assets.Usage(),
+                 (unsigned long long)assets.Limit());
+        out += buf;
+        snprintf(
+            buf,
+            sizeof(buf),
+            "\"base_layer\":{\"hits\":%llu,\"misses\":%llu,\"bytes\":%llu,\"limit\":%llu},",
+            (unsigned long long)m.base_layer_cache.hits.load(std::memory_order_relaxed),
+            (unsigned long long)m.base_layer_cache.misses.load(std::memory_order_relaxed),
+            (unsigned long long)BaseLayers().Usage(),
+            (unsigned long long)BaseLayers().Limit());
+        out += buf;
+        snprintf(buf,
+                 sizeof(buf),
+                 "\"avatar\":{\"hits\":%llu,\"misses\":%llu},",
+                 (unsigned long long)m.avatar_cache.hits.load(std::memory_order_relaxed),
+                 (unsigned long long)m.avatar_cache.misses.load(std::memory_order_relaxed));
+        out += buf;
+        CardCache& cards = CardCache::Instance();
+        snprintf(buf,
+                 sizeof(buf),
+                 "\"card\":{\"hits\":%llu,\"misses\":%llu,\"bytes\":%llu,\"encoded_bytes\":%llu,"
+                 "\"disk_bytes\":%llu},",
+                 (unsigned long long)m.card_cache.hits.load(std::memory_order_relaxed),
+                 (unsigned long long)m.card_cache.misses.load(std::memory_order_relaxed),
+                 (unsigned long long)UndatedCards().Usage(),
+                 (unsigned long long)cards.Usage(),
+                 (unsigned long long)cards.DiskUsage());
+        out += buf;
+        snprintf(buf,
+                 sizeof(buf),
+                 "\"incremental\":{\"hits\":%llu,\"misses\":%llu,\"bytes\":%llu,"
+                 "\"limit\":%llu}},",
+                 (unsigned long long)m.incremental.hits.load(std::memory_order_relaxed),
+                 (unsigned long long)m.incremental.misses.load(std::memory_order_relaxed),
+                 (unsigned long long)PreviousCards().Usage(),
+                 (unsigned long long)PreviousCards().Limit());
+        out += buf;
+        snprintf(buf,
+                 sizeof(buf),
+                 "\"history\":{\"records\":%llu,\"series\":%llu},",
+                 (unsigned long long)HistoryStore::Instance().Records(),
+                 (unsigned long long)HistoryStore::Instance().SeriesCount());
+        out += buf;
+        RenderScheduler& scheduler = RenderScheduler::Instance();
+        snprintf(buf,
+                 sizeof(buf),
+                 "\"scheduler\":{\"queued\":%llu,\"running\":%llu,\"submitted\":%llu,"
+                 "\"coalesced\":%llu,\"rejected\":%llu,\"stolen\":%llu,\"completed\":%llu},",
+                 (unsigned long long)scheduler.Queued(),
+                 (unsigned long long)scheduler.Running(),
+                 (unsigned long long)scheduler.counters.submitted.load(),
+                 (unsigned long long)scheduler.counters.coalesced.load(),
+                 (unsigned long long)scheduler.counters.rejected.load(),
+                 (unsigned long long)scheduler.counters.stolen.load(),
+                 (unsigned long long)scheduler.counters.completed.load());
+        out += buf;
+        BufferPool& pool = BufferPool::Instance();
+        snprintf(buf,
+                 sizeof(buf),
+                 "\"pool\":{\"hits\":%llu,\"misses\":%llu,\"bytes\":%llu,\"limit\":%llu},",
+                 (unsigned long long)pool.hits.load(std::memory_order_relaxed),
+                 (unsigned long long)pool.misses.load(std::memory_order_relaxed),
+                 (unsigned long long)pool.Usage(),
+                 (unsigned long long)pool.Limit());
+        out += buf;
+        // ImageMagick 像素缓存占用的资源和线程数限制
+        snprintf(buf,
+                 sizeof(buf),
+                 "\"magick\":{\"memory\":%llu,\"map\":%llu,\"disk\":%llu,\"threads\":%llu}}",
+                 (unsigned long long)MagickCore::GetMagickResource(MagickCore::MemoryResource),
+                 (unsigned long long)MagickCore::GetMagickResource(MagickCore::MapResource),
+                 (unsigned long long)MagickCore::GetMagickResource(MagickCore::DiskResource),
+                 (unsigned long long)MagickCore::GetMagickResourceLimit(
+                     MagickCore::ThreadResource));
+        out += buf;
+        return out;
+    }
+} // namespace Sayobot
+
+typedef Sayobot::RenderContext Sayobot_Context;
+typedef void (*Sayobot_Callback)(Sayobot_Context* ctx, int status, void* user);
+typedef Sayobot::PHashIndex<1> Sayobot_HashIndex;
+typedef Sayobot::RenderBatch Sayobot_Batch;
+typedef void (*Sayobot_BatchCallback)(Sayobot_Batch* batch, int status, void* user);
 
 extern "C" {
 
-#define SAYOBOT_SET(k, lv) \
-    if (!strcmp(key, k)) return (value ? ((lv) = value).c_str() : (lv).c_str());
+// 修改设置后需要重新编译布局
+// 返回值在持有锁时复制到本线程的 result 中，其他线程随后修改设置也不会使它失效
+#define SAYOBOT_SET(k, lv)                                                             \
+    if (!strcmp(key, k)) {                                                            \
+        if (value) syb_compiled_layout.reset(), (lv) = value;                         \
+        result = (lv);                                                                \
+        return result.c_str();                                                        \
+    }
 
 // 导出函数：设置路径
 SAYOBOT_API const char* Sayobot_SetPath(const char* key, const char* value) {
+    thread_local std::string result;
+    std::lock_guard<std::mutex> lock(syb_config_mutex);
     SAYOBOT_SET("png", syb_png)
-    else SAYOBOT_SET("font", syb_font) else return NULL;
+    SAYOBOT_SET("font", syb_font)
+    return NULL;
 }
 
 // 导出函数：设置字体
 SAYOBOT_API const char* Sayobot_SetFont(const char* key, const char* value) {
+    thread_local std::string result;
+    std::lock_guard<std::mutex> lock(syb_config_mutex);
     SAYOBOT_SET("profile", font_set.profile)
-    else SAYOBOT_SET("data", font_set.data) else SAYOBOT_SET("sign", font_set.sign) else SAYOBOT_SET(
-        "time",
-        font_set
-            .time) else SAYOBOT_SET("arrow",
-                                    font_set
-                                        .arrow) else SAYOBOT_SET("name",
-                                                                 font_set
-                                                                     .name) else return NULL;
+    SAYOBOT_SET("data", font_set.data)
+    SAYOBOT_SET("sign", font_set.sign)
+    SAYOBOT_SET("time", font_set.time)
+    SAYOBOT_SET("arrow", font_set.arrow)
+    SAYOBOT_SET("name", font_set.name)
+    return NULL;
 }
 #undef SAYOBOT_SET
 
+/*
+ * 导出函数：载入布局文件，path 为 NULL 时恢复内置布局
+ * 成功返回空字符串，否则返回带行号的错误信息
+ * 布局在这里完成解析，字体在下一次渲染时按当时的设置绑定
+ */
+SAYOBOT_API const char* Sayobot_LoadLayout(const char* path) {
+    thread_local std::string error;
+    error.clear();
+    try {
+        std::shared_ptr<const Sayobot::Layout> layout;
+        if (path) {
+            std::ifstream file(path, std::ios::binary);
+            if (!file) throw std::runtime_error(std::string("Cannot open layout: ") + path);
+            std::stringstream source;
+            source << file.rdbuf();
+            layout = Sayobot::Layout::Parse(source.str());
+        }
+        std::lock_guard<std::mutex> lock(syb_config_mutex);
+        syb_layout = layout;
+        syb_compiled_layout.reset();
+    } catch (const std::exception& ex) {
+        error = ex.what();
+    }
+    return error.c_str();
+}
+
+/*
+ * 导出函数：载入素材包（由 sayobot_pack 生成），path 为 NULL 时取消
+ * 包中的路径相对于当前的 png 目录，之后修改 png 目录时包不再生效
+ * 成功返回空字符串，否则返回错误信息
+ */
+SAYOBOT_API const char* Sayobot_LoadAssetPack(const char* path) {
+    thread_local std::string error;
+    error.clear();
+    try {
+        std::shared_ptr<const Sayobot::AssetPack> pack;
+        if (path) pack = std::make_shared<const Sayobot::AssetPack>(path);
+        std::string root;
+        {
+            std::lock_guard<std::mutex> lock(syb_config_mutex);
+            root = syb_png;
+        }
+        Sayobot::AssetCache::Instance().SetPack(pack, root);
+    } catch (const std::exception& ex) {
+        error = ex.what();
+    }
+    return error.c_str();
+}
+
+// 导出函数：校验并保存下载的头像，成功返回空字符串，否则返回错误信息
+SAYOBOT_API const char* Sayobot_IngestAvatar(long long user_id, const void* data,
+                                             size_t length) {
+    thread_local std::string error;
+    error.clear();
+    try {
+        Sayobot::AvatarStore::Instance().Ingest(
+            Sayobot::CurrentLayout()->png, user_id, data, length);
+    } catch (const std::exception& ex) {
+        error = ex.what();
+        if (error.empty()) error = "Unknown Error!";
+    }
+    return error.c_str();
+}
+
+// 导出函数：由图片文件校验并保存头像，成功返回空字符串，否则返回错误信息
+SAYOBOT_API const char* Sayobot_IngestAvatarFile(long long user_id, const char* path) {
+    thread_local std::string error;
+    error.clear();
+    try {
+        if (!path) throw std::invalid_argument("Empty avatar path");
+        Sayobot::AvatarStore::Instance().IngestFile(
+            Sayobot::CurrentLayout()->png, user_id, path);
+    } catch (const std::exception& ex) {
+        error = ex.what();
+        if (error.empty()) error = "Unknown Error!";
+    }
+    return error.c_str();
+}
+
+// 导出函数：打开（不存在时创建）资料历史文件，成功返回空字符串，否则返回错误信息
+SAYOBOT_API const char* Sayobot_OpenHistory(const char* path) {
+    thread_local std::string error;
+    error.clear();
+    try {
+        if (!path || !*path) throw std::invalid_argument("Empty history path");
+        Sayobot::HistoryStore::Instance().Open(path);
+    } catch (const std::exception& ex) {
+        error = ex.what();
+        if (error.empty()) error = "Unknown Error!";
+    }
+    return error.c_str();
+}
+
+/*
+ * 导出函数：追加一次资料快照
+ * 参数列表:
+ *** user (long long) 用户编号
+ *** mode (int) 0-3
+ *** time (long long) 快照的 Unix 时间（秒）
+ *** values (const double*) 按 SAYOBOT_HISTORY_FIELDS 顺序的字段值，count 为个数
+ * 成功返回空字符串，否则返回错误信息
+ */
+SAYOBOT_API const char* Sayobot_HistoryAppend(long long user, int mode, long long time,
+                                              const double* values, int count) {
+    thread_local std::string error;
+    error.clear();
+    try {
+        if (!values || count < 0) throw std::invalid_argument("Empty history values");
+        Sayobot::HistoryStore::Instance().Append(
+            (uint64_t)user,
+            mode,
+            Sayobot::HistorySnapshot::FromDoubles(time, values, (size_t)count));
+    } catch (const std::exception& ex) {
+        error = ex.what();
+        if (error.empty()) error = "Unknown Error!";
+    }
+    return error.c_str();
+}
+
+/*
+ * 导出函数：查找时间早于 before 的最后一次快照
+ * 找到时把字段值写入 values（至多 count 个）、快照时间写入 time（可为 NULL），返回 1；
+ * 没有找到或历史文件没有打开时返回 0
+ */
+SAYOBOT_API int Sayobot_HistoryFind(long long user, int mode, long long before,
+                                    double* values, int count, long long* time) {
+    if (!values || count < 0) return 0;
+    Sayobot::HistorySnapshot snapshot;
+    if (!Sayobot::HistoryStore::Instance().Find((uint64_t)user, mode, before, snapshot))
+        return 0;
+    snapshot.ToDoubles(values, (size_t)count);
+    if (time) *time = snapshot.time;
+    return 1;
+}
+
+// 导出函数：设置内存中头像缓存的字节预算
+SAYOBOT_API void Sayobot_SetAvatarCacheLimit(unsigned long long bytes) {
+    Sayobot::AvatarStore::Instance().SetLimit(static_cast<size_t>(bytes));
+}
+
+// 导出函数：使素材缓存失效（path 为前缀，为空时清空全部）
+SAYOBOT_API void Sayobot_InvalidateCache(const char* path) {
+    const std::string prefix = path ? path : "";
+    Sayobot::AssetCache::Instance().Invalidate(prefix);
+    // 底图的键由所用素材的路径拼成
+    Sayobot::BaseLayers().EraseIf(
+        [&prefix](const std::string& key, const std::shared_ptr<const Sayobot::Image>&) {
+            return key.find(prefix) != std::string::npos;
+        });
+    // 卡片缓存的键是摘要，无法按路径筛选，全部清空
+    Sayobot::UndatedCards().Clear();
+    Sayobot::CardCache::Instance().Clear();
+    Sayobot::PreviousCards().Clear();
+}
+
+/*
+ * 导出函数：设置卡片缓存
+ * 参数列表:
+ *** memory_bytes 内存预算，为 0 时不缓存
+ *** granularity (long long) 卡片上的时间取整的秒数
+     为 0 时时间精确到秒，命中时只补画页脚等随时间变化的文字后重新编码；
+     大于 0 时同一时间段内相同的卡片直接返回缓存的编码结果，内存预算由两级缓存平分
+ *** dir (const char*) 已编码卡片的磁盘缓存目录，为 NULL 或空串时不使用磁盘
+ *** disk_bytes 磁盘预算，为 0 时不限制
+ * 成功返回空字符串，否则返回错误信息
+ */
+SAYOBOT_API const char* Sayobot_SetCardCache(unsigned long long memory_bytes,
+                                             long long granularity, const char* dir,
+                                             unsigned long long disk_bytes) {
+    thread_local std::string error;
+    error.clear();
+    Sayobot::CardCache::Config config;
+    config.granularity = granularity > 0 ? granularity : 0;
+    config.dir = dir ? dir : "";
+    config.disk_limit = static_cast<size_t>(disk_bytes);
+    if (!config.dir.empty() && !Sayobot::CardCache::MakeDir(config.dir)) {
+        error = "Cannot use card cache directory: " + config.dir;
+        return error.c_str();
+    }
+    const size_t memory = static_cast<size_t>(memory_bytes);
+    config.memory_limit = config.granularity ? memory / 2 : 0;
+    Sayobot::CardCache::Instance().Configure(config);
+    Sayobot::UndatedCards().SetLimit(config.granularity ? memory - memory / 2 : memory);
+    Sayobot::UndatedCards().Clear();
+    return error.c_str();
+}
+
+// 导出函数：设置素材缓存的字节预算
+SAYOBOT_API void Sayobot_SetCacheLimit(unsigned long long bytes) {
+    Sayobot::AssetCache::Instance().SetLimit(static_cast<size_t>(bytes));
+}
+
+// 导出函数：设置底图缓存的字节预算
+SAYOBOT_API void Sayobot_SetBaseLayerLimit(unsigned long long bytes) {
+    Sayobot::BaseLayers().SetLimit(static_cast<size_t>(bytes));
+}
+
+/*
+ * 导出函数：设置保存用户上一张卡片的字节预算
+ * 同一用户再次渲染时只重画变化的区域，为 0 时关闭
+ */
+SAYOBOT_API void Sayobot_SetIncrementalLimit(unsigned long long bytes) {
+    Sayobot::PreviousCards().SetLimit(static_cast<size_t>(bytes));
+    if (!bytes) Sayobot::PreviousCards().Clear();
+}
+
+// 导出函数：设置画布和暂存区复用池的字节预算，为 0 时不复用
+SAYOBOT_API void Sayobot_SetPoolLimit(unsigned long long bytes) {
+    Sayobot::BufferPool::Instance().SetLimit(static_cast<size_t>(bytes));
+}
+
+/*
+ * 导出函数：设置 ImageMagick 的资源限制，在初始化时调用
+ * 渲染已经按请求并行，Magick 只用于解码、编码，内部线程数通常设为 1
+ * 参数列表:
+ *** threads (int) Magick 内部（OpenMP）线程数，小于 1 时不修改
+ *** memory_bytes (long long) 像素缓存可用的堆内存，小于 0 时不修改
+ *** map_bytes (long long) 像素缓存可用的内存映射，小于 0 时不修改
+ *** disk_bytes (long long) 像素缓存可写入磁盘的字节数，小于 0 时不修改；
+     为 0 时像素缓存不落盘，超出内存限制的图片直接报错
+ */
+SAYOBOT_API void Sayobot_ConfigureMagick(int threads, long long memory_bytes,
+                                         long long map_bytes, long long disk_bytes) {
+    if (threads > 0)
+        Magick::ResourceLimits::thread(static_cast<MagickCore::MagickSizeType>(threads));
+    if (memory_bytes >= 0)
+        Magick::ResourceLimits::memory(static_cast<MagickCore::MagickSizeType>(memory_bytes));
+    if (map_bytes >= 0)
+        Magick::ResourceLimits::map(static_cast<MagickCore::MagickSizeType>(map_bytes));
+    if (disk_bytes >= 0)
+        Magick::ResourceLimits::disk(static_cast<MagickCore::MagickSizeType>(disk_bytes));
+}
+
 // 导出函数：以路径初始化（仅在Windows上或者部分Mac OS上需要）
 SAYOBOT_API void Sayobot_LoadMagic(const char* path) {
     Magick::InitializeMagick(path);
 }
 
 SAYOBOT_API const char* MakeString(int v) {
-    static char buff[200];
+    thread_local char buff[200];
     sprintf(buff, "%d", v);
     return buff;
 }
 
-// 导出函数：制作卡片
+// 导出函数：创建渲染上下文
+SAYOBOT_API Sayobot_Context* Sayobot_CreateContext() {
+    return new Sayobot_Context();
+}
+
+// 导出函数：销毁渲染上下文（不能在渲染进行中销毁）
+SAYOBOT_API void Sayobot_DestroyContext(Sayobot_Context* ctx) {
+    Sayobot_Free(ctx);
+}
+
+// 导出函数：取得上一次渲染的错误信息，成功时为空字符串
+SAYOBOT_API const char* Sayobot_GetError(Sayobot_Context* ctx) {
+    return ctx ? ctx->error.c_str() : "Invalid context";
+}
+
+/*
+ * 导出函数：设置编码格式和质量，对之后在 ctx 上的渲染生效
+ * format 可以是 Magick 格式名 (PNG、WEBP 等)，也可以是编码设置
+ * png-fast、png-small、png-palette[:颜色数]、webp[:质量]、jpeg[:质量]；
+ * 参数中指定了输出文件时，只有编码设置会覆盖按扩展名决定的格式
+ * 无法解析时返回 SAYOBOT_ERROR
+ */
+SAYOBOT_API int Sayobot_SetOutputFormat(Sayobot_Context* ctx, const char* format,
+                                        int quality) {
+    if (!ctx || !format || !*format || quality < 0) return SAYOBOT_ERROR;
+    try {
+        Sayobot::EncodeProfile::Parse(format, static_cast<size_t>(quality));
+    } catch (const std::exception&) {
+        return SAYOBOT_ERROR;
+    }
+    if (!ctx->Acquire()) return SAYOBOT_BUSY;
+    ctx->format = format;
+    ctx->quality = static_cast<size_t>(quality);
+    ctx->Release();
+    return SAYOBOT_OK;
+}
+
+// 导出函数：取得编码结果（由 ctx 持有，下一次渲染或销毁 ctx 前有效）
+SAYOBOT_API const void* Sayobot_GetOutput(Sayobot_Context* ctx, size_t* length) {
+    if (!ctx) return NULL;
+    if (length) *length = ctx->output.length();
+    return ctx->output.data();
+}
+
+SAYOBOT_API size_t Sayobot_GetOutputSize(Sayobot_Context* ctx) {
+    return ctx ? ctx->output.length() : 0;
+}
+
+// 导出函数：把编码结果复制到调用方的缓冲区
+// 返回结果的字节数，capacity 不足时不复制
+SAYOBOT_API size_t Sayobot_CopyOutput(Sayobot_Context* ctx, void* buffer,
+                                      size_t capacity) {
+    if (!ctx) return 0;
+    const size_t length = ctx->output.length();
+    if (buffer && length && capacity >= length)
+        memcpy(buffer, ctx->output.data(), length);
+    return length;
+}
+
+// 导出函数：取得渲染指标快照 (JSON)，返回的字符串在本线程下一次调用前有效
+SAYOBOT_API const char* Sayobot_GetStats() {
+    thread_local std::string stats;
+    stats = Sayobot::StatsJson();
+    return stats.c_str();
+}
+
+// 导出函数：清零渲染指标
+SAYOBOT_API void Sayobot_ResetStats() {
+    Sayobot::Metrics::Instance().Reset();
+}
+
+// 导出函数：开启或关闭 ctx 的跟踪模式，对之后在 ctx 上的渲染生效
+SAYOBOT_API int Sayobot_SetTrace(Sayobot_Context* ctx, int enable) {
+    if (!ctx) return SAYOBOT_ERROR;
+    if (!ctx->Acquire()) return SAYOBOT_BUSY;
+    ctx->trace = enable != 0;
+    ctx->Release();
+    return SAYOBOT_OK;
+}
+
+// 导出函数：取得上一次渲染的跟踪记录 (JSON 数组)，未开启跟踪时为空字符串
+SAYOBOT_API const char* Sayobot_GetTrace(Sayobot_Context* ctx) {
+    return ctx ? ctx->trace_json.c_str() : "";
+}
+
+// 导出函数：在当前线程上制作卡片，返回 SAYOBOT_OK / SAYOBOT_ERROR / SAYOBOT_BUSY
+SAYOBOT_API int Sayobot_RenderCard(Sayobot_Context* ctx, const char* args) {
+    if (!ctx) return SAYOBOT_ERROR;
+    if (!ctx->Acquire()) return SAYOBOT_BUSY;
+    int status = Sayobot::Render(
+        *ctx, [args](Sayobot::CardArgs& out) { Sayobot::ParseCardArgs(args, out); });
+    ctx->Release();
+    return status;
+}
+
+// 导出函数：在新线程上制作卡片，完成后调用 callback(ctx, status, user)
+// callback 返回后渲染线程不再访问 ctx，可以在 callback 中销毁 ctx
+SAYOBOT_API int Sayobot_RenderCardAsync(Sayobot_Context* ctx, const char* args,
+                                        Sayobot_Callback callback, void* user) {
+    if (!ctx || !args) return SAYOBOT_ERROR;
+    if (!ctx->Acquire()) return SAYOBOT_BUSY;
+    try {
+        std::thread([ctx, callback, user](std::string args) {
+            int status = Sayobot::Render(*ctx, [&args](Sayobot::CardArgs& out) {
+                Sayobot::ParseCardArgs(args.c_str(), out);
+            });
+            ctx->Release();
+            if (callback) callback(ctx, status, user);
+        },
+                    std::string(args))
+            .detach();
+    } catch (const std::exception& ex) {
+        ctx->error = ex.what();
+        ctx->Release();
+        return SAYOBOT_ERROR;
+    }
+    return SAYOBOT_OK;
+}
+
+// 导出函数：制作卡片（旧接口，每个线程各自保存错误信息）
 SAYOBOT_API const char* MakePersonalCard(const char* args) {
-    static std::string error_message;
+    thread_local Sayobot_Context ctx;
+    Sayobot::Render(
+        ctx, [args](Sayobot::CardArgs& out) { Sayobot::ParseCardArgs(args, out); });
+    return ctx.error.c_str();
+}
+
+// 导出函数：以二进制参数 (PersonalCardArgs) 在当前线程上制作卡片
+SAYOBOT_API int Sayobot_RenderCardBinary(Sayobot_Context* ctx, const void* data,
+                                         size_t length) {
+    if (!ctx) return SAYOBOT_ERROR;
+    if (!ctx->Acquire()) return SAYOBOT_BUSY;
+    int status = Sayobot::Render(*ctx, [data, length](Sayobot::CardArgs& out) {
+        Sayobot::ParseCardArgs(data, length, out);
+    });
+    ctx->Release();
+    return status;
+}
 
+// 导出函数：以二进制参数在新线程上制作卡片，data 在返回前已被复制
+SAYOBOT_API int Sayobot_RenderCardBinaryAsync(Sayobot_Context* ctx, const void* data,
+                                              size_t length, Sayobot_Callback callback,
+                                              void* user) {
+    if (!ctx || !data) return SAYOBOT_ERROR;
+    if (!ctx->Acquire()) return SAYOBOT_BUSY;
     try {
-        static char dataColor[10], profileColor[10], signColor[10];
-        static int mode, user_id;
-        static char country[10], username[50], qq[20];
-
-        // user_config
-        static char sign[50], background[10], profileEdge[10], dataEdge[10],
-            signEdge[10];
-        static int opacity;
-
-        // user_info
-        static int count300, count100, count50, playcount;
-        static long long total_score, ranked_score, total_hits;
-        static float pp_raw;
-        static int pp_country_rank, pp_rank, count_ssh, count_ss, count_sh, count_s,
-            count_a, total_seconds_played;
-        static float level;
-        static double accuracy;
-
-        // user_stat
-        static long long stat_total_score, stat_ranked_score;
-        static int stat_total_hits;
-        static double stat_accuracy;
-        static float stat_pp_raw, stat_level;
-        static int stat_pp_rank, stat_pp_country_rank;
-        static long long stat_playcount;
-        static int stat_count_ssh, stat_count_ss, stat_count_sh, stat_count_s,
-            stat_count_a, days;
-        static char out_path[100];
-
-        sscanf(
-            args,
-            "%[^\n]\n%[^\n]\n%[^\n]\n%d\n%d\n%[^\n]\n%[^\n]\n%[^\n]\n%[^\n]\n%[^\n]\n"
-            "%[^\n]\n%[^\n]\n%[^\n]\n%d\n%d\n%d\n%d\n%d\n%lld\n%lld\n"
-            "%lld\n%f\n%d\n%d\n%d\n%d\n%d\n%d\n%d\n%d\n"
-            "%f\n%lf\n%lld\n%lld\n%d\n%lf\n%f\n%f\n%d\n%d\n"
-            "%lld\n%d\n%d\n%d\n%d\n%d\n%d\n%[^\n]",
-            dataColor,
-            profileColor,
-            signColor,
-            &mode,
-            &user_id,
-            country,
-            username,
-            qq,
-            sign,
-            background,
-            profileEdge,
-            dataEdge,
-            signEdge,
-            &opacity,
-            &count300,
-            &count100,
-            &count50,
-            &playcount,
-            &total_score,
-            &ranked_score,
-            &total_hits,
-            &pp_raw,
-            &pp_country_rank,
-            &pp_rank,
-            &count_ssh,
-            &count_ss,
-            &count_sh,
-            &count_s,
-            &count_a,
-            &total_seconds_played,
-            &level,
-            &accuracy,
-            &stat_total_score,
-            &stat_ranked_score,
-            &stat_total_hits,
-            &stat_accuracy,
-            &stat_pp_raw,
-            &stat_level,
-            &stat_pp_rank,
-            &stat_pp_country_rank,
-            &stat_playcount,
-            &stat_count_ssh,
-            &stat_count_ss,
-            &stat_count_sh,
-            &stat_count_s,
-            &stat_count_a,
-            &days,
-            out_path);
-
-        char stemp[512];
-        int64_t itemp;
-        float ftemp;
-        double dtemp;
-        Sayobot::Image image;
-        image.Create(1080, 1920);
-#pragma region drawing
-        // 绘制背景
-        sprintf(stemp, "%s/stat/%s.png", syb_png.c_str(), background);
-        image.DrawPic(stemp, 0, 0);
-        // 不透明贴图
-        sprintf(stemp, "%s/fx%d.png", syb_png.c_str(), opacity);
-        image.DrawPic(stemp, 0, 0);
-        // 绘制个人信息框
-        sprintf(stemp, "%s/tk/%s.png", syb_png.c_str(), profileEdge);
-        image.DrawPic(stemp, 50, 20, 970, 600);
-        // 绘制数据框
-        for (int i = 0; i < 6; ++i) {
-            sprintf(stemp, "%s/tk/%s.png", syb_png.c_str(), dataEdge);
-            image.DrawPic(stemp, 56 + 33.5 * i, 980 + 140 * i, 820, 140);
-        }
-
-        // 绘制签名框
-        sprintf(stemp, "%s/tk/%s.png", syb_png.c_str(), signEdge);
-        image.DrawPic(stemp, 125, 570, 825, 150);
-        // 绘制头像
-        sprintfS(stemp, 512, "%s/avatars/%d.png", syb_png.c_str(), user_id);
-        try {
-            image.DrawPic(stemp, 165, 150, 350, 350);
-        } catch (Magick::Exception& ex) {
-            image.DrawPic(syb_png + "/no-avatar.png", 165, 150, 350, 350);
-        }
-        // 绘制模式图标
-        sprintf(stemp,
-                "%s/rank/%s%s",
-                syb_png.c_str(),
-                "sakura miku",
-                mode_str[(int)mode].c_str());
-        image.DrawPic(stemp, 165, 150, 80, 80);
-        // 绘制地球图标
-        image.DrawPic(syb_png + "/world/s.png", 510, 150, 100, 100);
-        // 绘制国旗
-        sprintf(stemp,
-                "%s/country/%s.png",
-                syb_png.c_str(),
-                (country && *country) ? country : "__");
-        image.DrawPic(stemp, 560, 425, 80, 80);
-
-        // 绘制rank图标
-        for (int i = 0; i < 5; ++i) {
-            sprintf(
-                stemp, "%s/rank/%s%s", syb_png.c_str(), "sakura miku", rank_str[i].c_str());
-            image.DrawPic(stemp, 165 + 120 * i, i % 2 ? 870 : 720, 82, 98);
-        }
-        Sayobot::TextStyle ts;
-        // 绘制天数
-        ts.color = timeColor;
-        ts.font_family = syb_font;
-        ts.font_family += font_set.time;
-        ts.pointsize = SMALL_POINTSIZE;
-        if (days != 0) {
-            sprintfS(stemp, 512, "compare with %u days ago", days);
-            image.Drawtext(stemp, ts, 30, 1840);
-        }
-        // 绘制时间
-        time_t tt;
-        time(&tt);
-        strftime(
-            stemp, 512, "%F %a %T by Sayobot with C++ & Magick++", localtime(&tt));
-        image.Drawtext(stemp, ts, 30, 1880);
-        // 绘制UID
-        ts.color = profileColor;
-        ts.font_family = syb_font;
-        ts.font_family += font_set.profile;
-        ts.pointsize = SMALL_POINTSIZE;
-        sprintf(stemp, "UID: %d", user_id);
-        image.Drawtext(stemp, ts, 585, 365);
-        // 绘制QQ号
-        sprintf(stemp, "QQ: %s", qq);
-        image.Drawtext(stemp, ts, 585, 395);
-        // 绘制国家/地区排名
-        itemp = pp_country_rank - stat_pp_country_rank;
-        ts.color = profileColor;
-        ts.font_family = syb_font;
-        ts.font_family += font_set.profile;
-        ts.pointsize = SMALL_POINTSIZE;
-        if (user_id == -1) {
-            sprintfS(stemp, 512, "#%d", pp_country_rank);
-        } else {
-            sprintfS(stemp,
-                     512,
-                     "#%d(%s%ld)",
-                     pp_country_rank,
-                     itemp > 0 ? "↓" : "↑",
-                     itemp < 0 ? -itemp : itemp);
-        }
-        image.Drawtext(stemp, ts, 660, 460);
-
-        // 设置Data区块字体
-        ts.color = dataColor;
-        ts.font_family = syb_font;
-        ts.font_family += font_set.data;
-        ts.pointsize = MID_POINTSIZE;
-        // 绘制pp
-        sprintf(stemp, "PPoint :     %.2f", pp_raw);
-        image.Drawtext(stemp, ts, 140, 1210);
-        // 绘制ranked score
-        sprintf(stemp, "Ranked Score : %s", llToString(ranked_score).c_str());
-        image.Drawtext(stemp, ts, 106, 1070);
-        // 绘制tth
-        sprintf(
-            stemp, "Total Hits :    %s", llToString(itemp + stat_total_hits).c_str());
-        image.Drawtext(stemp, ts, 240, 1630);
-        // 绘制pc
-        sprintfS(stemp, 512, "Playcount :    %d", playcount);
-        image.Drawtext(stemp, ts, 173, 1350);
-        // 绘制lv
-        sprintf(stemp, "Current Level :   %.2f", level);
-        image.Drawtext(stemp, ts, 274, 1770);
-        // 绘制acc
-        sprintf(stemp, "Hit Accuracy : %.2f%%", accuracy);
-        image.Drawtext(stemp, ts, 207, 1490);
-        if (user_id != -1) {
-            // 绘制pp变化
-            ftemp = pp_raw - stat_pp_raw;
-            ts.color = ftemp < 0 ? arrowdownColor.c_str() : arrowupColor.c_str();
-            sprintfS(stemp,
-                     512,
-                     "%s%s",
-                     ftemp < 0 ? "↓" : "↑",
-                     DoubleRound2(ftemp < 0 ? -ftemp : ftemp).c_str());
-            image.Drawtext(stemp, ts, 670, 1210);
-
-            // 绘制ranked score变化
-            itemp = ranked_score - stat_ranked_score;
-            ts.color = itemp < 0 ? arrowdownColor.c_str() : arrowupColor.c_str();
-
-            sprintfS(stemp,
-                     512,
-                     "%s%s",
-                     itemp < 0 ? "-" : "+",
-                     llToString(itemp < 0 ? -itemp : itemp).c_str());
-            image.Drawtext(stemp, ts, 626, 1070);
-            // 绘制tth变化
-            ts.color = itemp < 0 ? arrowdownColor.c_str() : arrowupColor.c_str();
-            itemp = count300 + count100 + count50 - stat_total_hits;
-            sprintfS(stemp,
-                     512,
-                     "%s%s",
-                     itemp < 0 ? "-" : "+",
-                     llToString(itemp < 0 ? -itemp : itemp).c_str());
-            image.Drawtext(stemp, ts, 780, 1630);
-
-            // 绘制pc变化
-            itemp = playcount - stat_playcount;
-            ts.color = itemp < 0 ? arrowdownColor.c_str() : arrowupColor.c_str();
-            sprintfS(stemp,
-                     512,
-                     "%s%ld",
-                     itemp < 0 ? "-" : "+",
-                     itemp < 0 ? -itemp : itemp);
-            image.Drawtext(stemp, ts, 713, 1350);
-
-            // 绘制acc变化
-            dtemp = accuracy - stat_accuracy;
-            ts.color = dtemp < 0 ? arrowdownColor.c_str() : arrowupColor.c_str();
-
-            sprintf(
-                stemp, "%s%.2f%%", dtemp < 0 ? "↓" : "↑", dtemp < 0 ? -dtemp : dtemp);
-            image.Drawtext(stemp, ts, 747, 1490);
-            // 绘制lv变化
-            dtemp = level - stat_level;
-            ts.color = dtemp < 0 ? arrowdownColor.c_str() : arrowupColor.c_str();
-
-            sprintf(
-                stemp, "%s%.2f", dtemp < 0 ? "-" : "+", dtemp < 0 ? -dtemp : dtemp);
-            image.Drawtext(stemp, ts, 814, 1770);
-            // 绘制rank差值
-            ts.color = profileColor;
-            ts.font_family = syb_font;
-            ts.font_family += font_set.name;
-            ts.pointsize = BIG_POINTSIZE;
-            itemp = count_ssh + count_ss - stat_count_ssh - stat_count_ss;
-            sprintf(stemp,
-                    "(%s%ld)",
-                    itemp < 0 ? "↓" : "↑",
-                    itemp < 0 ? 0 - itemp : itemp);
-            image.Drawtext(stemp, ts, 253, 860);
-
-            itemp = count_sh + count_s - stat_count_sh - stat_count_s;
-            sprintf(stemp,
-                    "(%s%ld)",
-                    itemp < 0 ? "↓" : "↑",
-                    itemp < 0 ? 0 - itemp : itemp);
-            image.Drawtext(stemp, ts, 494, 860);
-
-            itemp = count_a - stat_count_a;
-            sprintf(stemp,
-                    "(%s%ld)",
-                    itemp < 0 ? "↓" : "↑",
-                    itemp < 0 ? 0 - itemp : itemp);
-            image.Drawtext(stemp, ts, 735, 860);
-        }
-
-        // 绘制rank数量
-        const std::vector<int> count_rank = {
-            count_ss, count_ssh, count_s, count_sh, count_a};
-        ts.pointsize = BIG_POINTSIZE;
-        ts.color = profileColor;
-        for (int i = 0; i < 5; ++i) {
-            image.Drawtext(
-                std::to_string(count_rank[i]), ts, 253 + 120 * i, i % 2 ? 940 : 790);
-        }
-        // 绘制全球排名差值
-        itemp = pp_rank - stat_pp_rank;
-        sprintf(stemp, "(%s%ld)", itemp > 0 ? "↓" : "↑", itemp < 0 ? -itemp : itemp);
-        ts.color = itemp < 0 ? arrowdownColor.c_str() : arrowupColor.c_str();
-        ts.font_family = syb_font;
-        ts.font_family += font_set.arrow;
-        image.Drawtext(stemp, ts, 660, 270);
-
-        // 绘制全球排名
-        ts.color = profileColor;
-        ts.font_family = syb_font;
-        ts.font_family += font_set.name;
-        image.Drawtext(std::to_string(pp_rank), ts, 600, 220);
-        // 绘制名字
-        image.Drawtext(username, ts, 555, 325);
-        // 绘制签名
-        ts.color = signColor;
-        ts.font_family = syb_font;
-        ts.font_family += font_set.sign;
-        ts.gravity = MagickCore::GravityType::NorthGravity;
-        ts.align = MagickCore::AlignType::CenterAlign;
-        image.Drawtext(sign, ts, 540, 660);
-#pragma endregion
-        image.Save(out_path);
+        const char* bytes = static_cast<const char*>(data);
+        std::thread([ctx, callback, user](std::vector<char> args) {
+            int status = Sayobot::Render(*ctx, [&args](Sayobot::CardArgs& out) {
+                Sayobot::ParseCardArgs(args.data(), args.size(), out);
+            });
+            ctx->Release();
+            if (callback) callback(ctx, status, user);
+        },
+                    std::vector<char>(bytes, bytes + length))
+            .detach();
     } catch (const std::exception& ex) {
-        error_message = ex.what();
-        return error_message.c_str();
+        ctx->error = ex.what();
+        ctx->Release();
+        return SAYOBOT_ERROR;
+    }
+    return SAYOBOT_OK;
+}
+
+/*
+ * 导出函数：设置渲染队列
+ * 参数列表:
+ *** threads (int) 工作线程数，为 0 时取 CPU 核数；只在第一次提交任务前生效
+ *** max_depth (int) 排队任务数的上限，为 0 时不限制
+ */
+SAYOBOT_API void Sayobot_ConfigureScheduler(int threads, int max_depth) {
+    Sayobot::RenderScheduler::Instance().Configure(static_cast<size_t>(std::max(threads, 0)),
+                                                   static_cast<size_t>(std::max(max_depth, 0)));
+}
+
+/*
+ * 导出函数：设置单张卡片的并行度
+ * 只有一张卡片在渲染时，把它按横带分到线程池的 threads 个线程上绘制，PNG 分段并行压缩
+ * 参数列表:
+ *** threads (int) 线程数，为 0 或 1 时不拆分
+ */
+SAYOBOT_API void Sayobot_SetBandThreads(int threads) {
+    Sayobot::BandThreads().store(static_cast<size_t>(std::max(threads, 1)));
+}
+
+/*
+ * 导出函数：以二进制参数把卡片提交到渲染队列，完成后调用 callback(ctx, status, user)
+ * 参数、编码设置都相同的请求在完成前只渲染一次，结果复制到每个上下文
+ * priority 为 0-2，0 最先渲染
+ * 返回 SAYOBOT_OK；队列已满时返回 SAYOBOT_OVERLOADED，不会调用 callback
+ */
+SAYOBOT_API int Sayobot_SubmitCard(Sayobot_Context* ctx, const void* data, size_t length,
+                                   int priority, Sayobot_Callback callback, void* user) {
+    if (!ctx || !data) return SAYOBOT_ERROR;
+    if (!ctx->Acquire()) return SAYOBOT_BUSY;
+    int status;
+    try {
+        std::string args(static_cast<const char*>(data), length);
+        const std::string key = Sayobot::Digest(ctx->format + '\n' + std::to_string(ctx->quality)
+                                                + '\n' + (ctx->trace ? "1" : "0") + '\n' + args);
+        status = Sayobot::RenderScheduler::Instance().Submit(
+            key,
+            priority,
+            [args](Sayobot::RenderContext& job) {
+                return Sayobot::Render(
+                    job, [&args](Sayobot::CardArgs& out) {
+                        Sayobot::ParseCardArgs(args.data(), args.size(), out);
+                    });
+            },
+            Sayobot::RenderScheduler::Waiter{ctx, callback, user});
+        if (status == SAYOBOT_OVERLOADED) ctx->error = "Render queue is full";
+    } catch (const std::exception& ex) {
+        ctx->error = ex.what();
+        status = SAYOBOT_ERROR;
+    }
+    if (status != SAYOBOT_OK) ctx->Release();
+    return status;
+}
+
+// 导出函数：创建批量渲染任务
+SAYOBOT_API Sayobot_Batch* Sayobot_CreateBatch() {
+    return new Sayobot_Batch();
+}
+
+// 导出函数：销毁批量渲染任务，不能在渲染中销毁
+SAYOBOT_API void Sayobot_DestroyBatch(Sayobot_Batch* batch) {
+    Sayobot_Free(batch);
+}
+
+// 导出函数：添加一张卡片（文本参数，与 Sayobot_RenderCard 相同）
+SAYOBOT_API int Sayobot_BatchAdd(Sayobot_Batch* batch, const char* args) {
+    if (!batch || !args) return SAYOBOT_ERROR;
+    if (!batch->Acquire()) return SAYOBOT_BUSY;
+    batch->items.emplace_back();
+    batch->items.back().args = args;
+    batch->Release();
+    return SAYOBOT_OK;
+}
+
+// 导出函数：添加一张卡片（二进制参数 PersonalCardArgs），data 在返回前已被复制
+SAYOBOT_API int Sayobot_BatchAddBinary(Sayobot_Batch* batch, const void* data,
+                                       size_t length) {
+    if (!batch || !data) return SAYOBOT_ERROR;
+    if (!batch->Acquire()) return SAYOBOT_BUSY;
+    batch->items.emplace_back();
+    batch->items.back().args.assign(static_cast<const char*>(data), length);
+    batch->items.back().binary = true;
+    batch->Release();
+    return SAYOBOT_OK;
+}
+
+// 导出函数：清空批量渲染任务中的卡片和结果，保留拼图设置
+SAYOBOT_API int Sayobot_BatchClear(Sayobot_Batch* batch) {
+    if (!batch) return SAYOBOT_ERROR;
+    if (!batch->Acquire()) return SAYOBOT_BUSY;
+    batch->items.clear();
+    batch->tile.error.clear();
+    batch->tile.output = Magick::Blob();
+    batch->Release();
+    return SAYOBOT_OK;
+}
+
+/*
+ * 导出函数：设置拼图
+ * 参数列表:
+ *** columns (size_t) 每行的卡片数，为 0 时不拼图
+ *** tile_width (size_t) 每张卡片缩小后的宽度，为 0 时保持原尺寸
+ *** encode_items (int) 为 0 时只生成拼图，不编码单张卡片
+ * 拼图的编码格式通过 Sayobot_SetOutputFormat(Sayobot_BatchTile(batch), ...) 设置
+ */
+SAYOBOT_API int Sayobot_BatchSetTile(Sayobot_Batch* batch, size_t columns,
+                                     size_t tile_width, int encode_items) {
+    if (!batch) return SAYOBOT_ERROR;
+    if (!batch->Acquire()) return SAYOBOT_BUSY;
+    batch->columns = columns;
+    batch->tile_width = tile_width;
+    batch->encode_items = encode_items != 0;
+    batch->Release();
+    return SAYOBOT_OK;
+}
+
+SAYOBOT_API size_t Sayobot_BatchSize(Sayobot_Batch* batch) {
+    return batch ? batch->items.size() : 0;
+}
+
+// 导出函数：取得第 i 张卡片的上下文，用 Sayobot_GetError、Sayobot_CopyOutput 等读取结果
+// 上下文由批量渲染任务持有，不能单独销毁
+SAYOBOT_API Sayobot_Context* Sayobot_BatchItem(Sayobot_Batch* batch, size_t i) {
+    if (!batch || i >= batch->items.size()) return NULL;
+    return batch->items[i].ctx.get();
+}
+
+// 导出函数：取得拼图的上下文
+SAYOBOT_API Sayobot_Context* Sayobot_BatchTile(Sayobot_Batch* batch) {
+    return batch ? &batch->tile : NULL;
+}
+
+// 导出函数：在线程池上渲染所有卡片，完成后返回；threads 为 0 时使用全部线程
+SAYOBOT_API int Sayobot_RenderBatch(Sayobot_Batch* batch, size_t threads) {
+    if (!batch) return SAYOBOT_ERROR;
+    if (!batch->Acquire()) return SAYOBOT_BUSY;
+    int status = Sayobot::RenderBatchItems(*batch, threads);
+    batch->Release();
+    return status;
+}
+
+// 导出函数：在新线程上调度批量渲染，全部完成后调用 callback(batch, status, user)
+SAYOBOT_API int Sayobot_RenderBatchAsync(Sayobot_Batch* batch, size_t threads,
+                                         Sayobot_BatchCallback callback, void* user) {
+    if (!batch) return SAYOBOT_ERROR;
+    if (!batch->Acquire()) return SAYOBOT_BUSY;
+    try {
+        std::thread([batch, threads, callback, user] {
+            int status = Sayobot::RenderBatchItems(*batch, threads);
+            batch->Release();
+            if (callback) callback(batch, status, user);
+        }).detach();
+    } catch (const std::exception& ex) {
+        batch->tile.error = ex.what();
+        batch->Release();
+        return SAYOBOT_ERROR;
+    }
+    return SAYOBOT_OK;
+}
+
+// 导出函数：计算图片文件的 64 位感知哈希，失败返回 SAYOBOT_ERROR
+SAYOBOT_API int Sayobot_HashFile(const char* path, unsigned long long* hash) {
+    if (!path || !hash) return SAYOBOT_ERROR;
+    try {
+        *hash = Sayobot::HashImageFile<1>(path).words[0];
     } catch (...) {
-        return "Unknown Error!";
+        return SAYOBOT_ERROR;
     }
-    return "";
+    return SAYOBOT_OK;
+}
+
+/*
+ * 导出函数：在共享线程池上并行计算多个图片文件的感知哈希
+ * 参数列表:
+ *** paths (const char* const*) 文件路径，count 个
+ *** bits (int) 64 或 256
+ *** hashes (unsigned long long*) 结果，每个文件 bits / 64 个字
+ *** status (int*) 可为 NULL，每个文件的 SAYOBOT_OK / SAYOBOT_ERROR；失败的文件哈希为 0
+ *** threads (size_t) 线程数，为 0 时使用整个线程池
+ * 返回成功的文件数，参数不合法时返回 0
+ */
+SAYOBOT_API size_t Sayobot_HashFiles(const char* const* paths, size_t count, int bits,
+                                     unsigned long long* hashes, int* status,
+                                     size_t threads) {
+    if (!paths || !hashes || (bits != 64 && bits != 256)) return 0;
+    const size_t words = (size_t)bits / 64;
+    std::atomic<size_t> hashed{0};
+    Sayobot::ThreadPool& pool = Sayobot::ThreadPool::Shared();
+    pool.ParallelFor(count, threads ? threads : pool.Size() + 1, [&](size_t i) {
+        unsigned long long* out = hashes + i * words;
+        int result = SAYOBOT_OK;
+        try {
+            if (!paths[i]) throw std::invalid_argument("Empty path");
+            if (words == 1)
+                out[0] = Sayobot::HashImageFile<1>(paths[i]).words[0];
+            else {
+                const Sayobot::PHash256 hash = Sayobot::HashImageFile<4>(paths[i]);
+                std::copy(hash.words.begin(), hash.words.end(), out);
+            }
+            hashed.fetch_add(1);
+        } catch (...) {
+            std::fill(out, out + words, 0ull);
+            result = SAYOBOT_ERROR;
+        }
+        if (status) status[i] = result;
+    });
+    return hashed.load();
+}
+
+// 导出函数：两个 64 位感知哈希的汉明距离
+SAYOBOT_API int Sayobot_HashDistance(unsigned long long a, unsigned long long b) {
+    return Sayobot::Popcount64(a ^ b);
+}
+
+// 导出函数：创建近似重复图片索引
+SAYOBOT_API Sayobot_HashIndex* Sayobot_CreateHashIndex() {
+    return new Sayobot_HashIndex();
+}
+
+SAYOBOT_API void Sayobot_DestroyHashIndex(Sayobot_HashIndex* index) {
+    Sayobot_Free(index);
+}
+
+// 导出函数：加入一个哈希，id 由调用方决定（如图片在数据库中的编号）
+SAYOBOT_API void Sayobot_HashIndexInsert(Sayobot_HashIndex* index,
+                                         unsigned long long hash,
+                                         unsigned long long id) {
+    if (!index) return;
+    Sayobot::PHash64 h;
+    h.words[0] = hash;
+    index->Insert(h, id);
+}
+
+SAYOBOT_API size_t Sayobot_HashIndexSize(Sayobot_HashIndex* index) {
+    return index ? index->Size() : 0;
+}
+
+/*
+ * 导出函数：查找距离不超过 radius 的哈希，按距离从小到大排列
+ * 最多写入 capacity 个结果到 ids 和 distances（distances 可以为 NULL），
+ * 返回结果的总数
+ */
+SAYOBOT_API size_t Sayobot_HashIndexQuery(Sayobot_HashIndex* index,
+                                          unsigned long long hash, int radius,
+                                          unsigned long long* ids, int* distances,
+                                          size_t capacity) {
+    if (!index) return 0;
+    Sayobot::PHash64 h;
+    h.words[0] = hash;
+    const auto matches = index->Query(h, radius);
+    for (size_t i = 0; ids && i < matches.size() && i < capacity; ++i) {
+        ids[i] = matches[i].id;
+        if (distances) distances[i] = matches[i].distance;
+    }
+    return matches.size();
+}
+
+// 导出函数：保存索引到文件，成功返回空字符串，否则返回错误信息
+SAYOBOT_API const char* Sayobot_HashIndexSave(Sayobot_HashIndex* index,
+                                              const char* path) {
+    thread_local std::string error;
+    error.clear();
+    try {
+        if (!index || !path) throw std::invalid_argument("Invalid hash index or path");
+        index->Save(path);
+    } catch (const std::exception& ex) {
+        error = ex.what();
+    }
+    return error.c_str();
+}
+
+// 导出函数：从文件载入索引（替换当前内容），成功返回空字符串，否则返回错误信息
+SAYOBOT_API const char* Sayobot_HashIndexLoad(Sayobot_HashIndex* index,
+                                              const char* path) {
+    thread_local std::string error;
+    error.clear();
+    try {
+        if (!index || !path) throw std::invalid_argument("Invalid hash index or path");
+        index->Load(path);
+    } catch (const std::exception& ex) {
+        error = ex.what();
+    }
+    return error.c_str();
+}
 }
-}
\ No newline at end of file
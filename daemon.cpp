@@ -0,0 +1,288 @@
+/*
+ * 渲染服务
+ * 在独立进程中运行渲染，Magick 崩溃或内存失控不会影响机器人进程；
+ * 素材、字体、底图等缓存在多次请求之间保持
+ * 通过 Unix 域套接字接收请求（协议见 render_ipc.hpp），
+ * 卡片和头像在渲染队列的工作线程上处理，编码结果经共享内存交给客户端
+ *
+ * 用法: ./sayobot_daemon [--socket 路径] [--threads N] [--depth N] [--ring MB] [--bands N]
+ *                        [--png 素材目录] [--font 字体目录] [--layout 布局文件]
+ *                        [--pack 素材包]
+ */
+#include <signal.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+#include <cstdio>
+#include <cstdlib>
+#include <memory>
+#include <string>
+#include <thread>
+
+#include "core.cpp"
+#include "render_ipc.hpp"
+
+namespace {
+    struct DaemonOptions {
+        std::string socket = "./sayobot.sock";
+        int threads = 0;
+        int depth = 32;
+        int bands = 4; // 空闲时单张卡片的并行线程数
+        size_t ring_bytes = 64u << 20;
+        std::string png, font, layout, pack;
+    };
+
+    // 一个客户端连接，由读取线程和进行中的任务共同持有
+    struct Connection {
+        explicit Connection(int fd) : fd(fd) {
+        }
+
+        ~Connection() {
+            close(fd);
+        }
+
+        // 发送回复，连接已断开时丢弃
+        void Reply(uint16_t type, uint16_t status, uint64_t id, const std::string& body) {
+            std::lock_guard<std::mutex> lock(write_mutex);
+            try {
+                Sayobot::Ipc::WriteFrame(fd, type, status, id, body.data(), body.size());
+            } catch (const std::exception&) {
+                shutdown(fd, SHUT_RDWR);
+            }
+        }
+
+        // 发送渲染结果，图片优先写入共享内存
+        void ReplyImage(uint64_t id, const void* data, size_t length) {
+            std::lock_guard<std::mutex> lock(write_mutex);
+            try {
+                Sayobot::Ipc::ResultBody result;
+                if (ring.Write(data, length, result)) {
+                    Sayobot::Ipc::WriteFrame(fd, Sayobot::Ipc::kRender, SAYOBOT_OK, id, &result,
+                                             sizeof(result));
+                } else {
+                    result = {Sayobot::Ipc::kInline, length, 0};
+                    Sayobot::Ipc::WriteFrame(fd, Sayobot::Ipc::kRender, SAYOBOT_OK, id, &result,
+                                             sizeof(result), data, length);
+                }
+            } catch (const std::exception&) {
+                shutdown(fd, SHUT_RDWR);
+            }
+        }
+
+        const int fd;
+        std::mutex write_mutex;
+        Sayobot::Ipc::SharedRing ring;
+    };
+
+    // 队列中的一个请求，完成时由 OnComplete 回复并释放
+    struct Pending {
+        std::shared_ptr<Connection> connection;
+        uint64_t id;
+        uint16_t type;
+    };
+
+    void OnComplete(Sayobot_Context* ctx, int status, void* user) {
+        std::unique_ptr<Pending> pending(static_cast<Pending*>(user));
+        if (status == SAYOBOT_OK && pending->type == Sayobot::Ipc::kRender)
+            pending->connection->ReplyImage(pending->id, ctx->output.data(), ctx->output.length());
+        else
+            pending->connection->Reply(pending->type, (uint16_t)status, pending->id,
+                                       status == SAYOBOT_OK ? std::string() : ctx->error);
+        Sayobot_DestroyContext(ctx);
+    }
+
+    void HandleRender(const std::shared_ptr<Connection>& connection, uint64_t id,
+                      const std::string& payload) {
+        Sayobot::Ipc::RenderRequest request;
+        if (payload.size() < sizeof(request))
+            throw std::invalid_argument("Truncated render request");
+        memcpy(&request, payload.data(), sizeof(request));
+        if (request.format_length > payload.size() - sizeof(request))
+            throw std::invalid_argument("Truncated render request");
+        const std::string format = payload.substr(sizeof(request), request.format_length);
+        const char* args = payload.data() + sizeof(request) + request.format_length;
+        const size_t length = payload.size() - sizeof(request) - request.format_length;
+
+        std::unique_ptr<Sayobot_Context, void (*)(Sayobot_Context*)> ctx(
+            Sayobot_CreateContext(), Sayobot_DestroyContext);
+        if (!format.empty() &&
+            Sayobot_SetOutputFormat(ctx.get(), format.c_str(), (int)request.quality) != SAYOBOT_OK)
+            throw std::invalid_argument("Unknown output format: " + format);
+        std::unique_ptr<Pending> pending(new Pending{connection, id, Sayobot::Ipc::kRender});
+        const int status = Sayobot_SubmitCard(ctx.get(), args, length, request.priority,
+                                              OnComplete, pending.get());
+        if (status != SAYOBOT_OK) {
+            connection->Reply(Sayobot::Ipc::kRender, (uint16_t)status, id, ctx->error);
+            return;
+        }
+        // 已交给渲染队列，由 OnComplete 释放
+        ctx.release();
+        pending.release();
+    }
+
+    // 头像的解码和缩放同样经过 Magick，放在渲染队列的工作线程上
+    void HandleAvatar(const std::shared_ptr<Connection>& connection, uint64_t id,
+                      const std::string& payload) {
+        Sayobot::Ipc::AvatarRequest request;
+        if (payload.size() < sizeof(request))
+            throw std::invalid_argument("Truncated avatar request");
+        memcpy(&request, payload.data(), sizeof(request));
+        std::string data = payload.substr(sizeof(request));
+        const int64_t user = request.user;
+        const std::string key = "avatar\n" + std::to_string(user) + '\n' + Sayobot::Digest(data);
+
+        Sayobot_Context* ctx = Sayobot_CreateContext();
+        ctx->Acquire();
+        Pending* pending = new Pending{connection, id, Sayobot::Ipc::kAvatar};
+        const int status = Sayobot::RenderScheduler::Instance().Submit(
+            key,
+            1,
+            [user, data](Sayobot::RenderContext& job) {
+                const char* error = Sayobot_IngestAvatar(user, data.data(), data.size());
+                job.error = error;
+                return *error ? SAYOBOT_ERROR : SAYOBOT_OK;
+            },
+            Sayobot::RenderScheduler::Waiter{ctx, OnComplete, pending});
+        if (status != SAYOBOT_OK) {
+            connection->Reply(Sayobot::Ipc::kAvatar, (uint16_t)status, id, "Render queue is full");
+            delete pending;
+            Sayobot_DestroyContext(ctx);
+        }
+    }
+
+    void Serve(std::shared_ptr<Connection> connection, size_t ring_bytes) {
+        try {
+            const int shared_fd = connection->ring.Create(ring_bytes);
+            try {
+                std::lock_guard<std::mutex> lock(connection->write_mutex);
+                Sayobot::Ipc::SendHello(connection->fd, shared_fd);
+            } catch (...) {
+                close(shared_fd);
+                throw;
+            }
+            close(shared_fd);
+        } catch (const std::exception& ex) {
+            fprintf(stderr, "handshake failed: %s\n", ex.what());
+            return;
+        }
+
+        Sayobot::Ipc::FrameHeader header;
+        std::string payload;
+        while (Sayobot::Ipc::ReadFrame(connection->fd, header, payload)) {
+            try {
+                switch (header.type) {
+                case Sayobot::Ipc::kRender:
+                    HandleRender(connection, header.id, payload);
+                    break;
+                case Sayobot::Ipc::kAvatar:
+                    HandleAvatar(connection, header.id, payload);
+                    break;
+                case Sayobot::Ipc::kStats:
+                    connection->Reply(header.type, SAYOBOT_OK, header.id, Sayobot_GetStats());
+                    break;
+                default:
+                    throw std::invalid_argument("Unknown request type");
+                }
+            } catch (const std::exception& ex) {
+                connection->Reply(header.type, SAYOBOT_ERROR, header.id, ex.what());
+            }
+        }
+        shutdown(connection->fd, SHUT_RDWR);
+    }
+
+    char socket_path[sizeof(sockaddr_un::sun_path)];
+
+    void OnSignal(int) {
+        unlink(socket_path);
+        _exit(0);
+    }
+
+    DaemonOptions ParseOptions(int argc, char** argv) {
+        DaemonOptions options;
+        for (int i = 1; i < argc; ++i) {
+            const std::string arg = argv[i];
+            if (i + 1 >= argc) {
+                fprintf(stderr, "missing value for %s\n", arg.c_str());
+                exit(2);
+            }
+            const std::string value = argv[++i];
+            if (arg == "--socket") {
+                options.socket = value;
+            } else if (arg == "--threads") {
+                options.threads = atoi(value.c_str());
+            } else if (arg == "--depth") {
+                options.depth = atoi(value.c_str());
+            } else if (arg == "--bands") {
+                options.bands = atoi(value.c_str());
+            } else if (arg == "--ring") {
+                options.ring_bytes = (size_t)std::max(1, atoi(value.c_str())) << 20;
+            } else if (arg == "--png") {
+                options.png = value;
+            } else if (arg == "--font") {
+                options.font = value;
+            } else if (arg == "--layout") {
+                options.layout = value;
+            } else if (arg == "--pack") {
+                options.pack = value;
+            } else {
+                fprintf(stderr, "unknown option %s\n", arg.c_str());
+                exit(2);
+            }
+        }
+        if (options.socket.size() >= sizeof(socket_path)) {
+            fprintf(stderr, "socket path too long\n");
+            exit(2);
+        }
+        return options;
+    }
+} // namespace
+
+int main(int argc, char** argv) {
+    Magick::InitializeMagick(*argv);
+    const DaemonOptions options = ParseOptions(argc, argv);
+
+    // 渲染已经按请求并行，Magick 只用于解码、编码：单线程，像素缓存不落盘
+    Sayobot_ConfigureMagick(1, 512 << 20, 1024 << 20, 0);
+    Sayobot_ConfigureScheduler(options.threads, options.depth);
+    Sayobot_SetBandThreads(options.bands);
+    if (!options.png.empty()) Sayobot_SetPath("png", options.png.c_str());
+    if (!options.font.empty()) Sayobot_SetPath("font", options.font.c_str());
+    for (const std::string* file : {&options.layout, &options.pack}) {
+        if (file->empty()) continue;
+        const char* error = file == &options.layout ? Sayobot_LoadLayout(file->c_str())
+                                                    : Sayobot_LoadAssetPack(file->c_str());
+        if (*error) {
+            fprintf(stderr, "%s: %s\n", file->c_str(), error);
+            return 1;
+        }
+    }
+
+    const int listener = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    sockaddr_un address;
+    memset(&address, 0, sizeof(address));
+    address.sun_family = AF_UNIX;
+    strcpy(address.sun_path, options.socket.c_str());
+    strcpy(socket_path, options.socket.c_str());
+    unlink(socket_path);
+    if (listener < 0 || bind(listener, (sockaddr*)&address, sizeof(address)) != 0 ||
+        listen(listener, 16) != 0) {
+        perror(options.socket.c_str());
+        return 1;
+    }
+    signal(SIGPIPE, SIG_IGN);
+    signal(SIGINT, OnSignal);
+    signal(SIGTERM, OnSignal);
+    printf("listening on %s\n", socket_path);
+    fflush(stdout);
+
+    for (;;) {
+        const int fd = accept4(listener, nullptr, nullptr, SOCK_CLOEXEC);
+        if (fd < 0) {
+            if (errno == EINTR) continue;
+            perror("accept");
+            return 1;
+        }
+        std::thread(Serve, std::make_shared<Connection>(fd), options.ring_bytes).detach();
+    }
+}
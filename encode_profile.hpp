@@ -0,0 +1,91 @@
+#pragma once
+
+#include <cctype>
+#include <cstdlib>
+#include <stdexcept>
+#include <string>
+
+#include <Magick++.h>
+
+#include "png_writer.hpp"
+
+namespace Sayobot {
+    /*
+     * 编码设置，由 "名称[:参数]" 解析得到（见 Sayobot_SetOutputFormat）
+     *** png-fast        直接编码 PNG，zlib 等级 1，固定 Up 过滤
+     *** png-small       直接编码 PNG，zlib 等级 9，逐行选择过滤方式
+     *** png-palette[:n] 量化为至多 n 色（默认 256）的调色板 PNG
+     *** webp[:q]        WebP，q 为 100 时无损
+     *** jpeg[:q]        JPEG，丢弃透明度
+     * 其他名称按 Magick 格式名处理，质量取调用方给出的 quality
+     */
+    struct EncodeProfile {
+        enum Kind { Magick, PngNative, PngPalette };
+        Kind kind = Magick;
+        std::string format;   // Magick 格式名，为空时由文件扩展名决定
+        size_t quality = 100; // Magick 质量，PNG 时十位为 zlib 等级，个位为过滤方式
+        bool named = false;   // 是否为上面列出的编码设置
+        int level = 6;        // PngNative 的 zlib 等级
+        PngFilter filter = PngFilterUp;
+        size_t colors = 256;  // PngPalette 的颜色数
+
+        // 解析失败时抛出 std::invalid_argument
+        static EncodeProfile Parse(const std::string& spec, size_t quality) {
+            EncodeProfile profile;
+            const size_t colon = spec.find(':');
+            std::string name = spec.substr(0, colon);
+            for (char& c : name) c = (char)tolower((unsigned char)c);
+            long arg = -1;
+            if (colon != std::string::npos) {
+                const std::string text = spec.substr(colon + 1);
+                char* end = nullptr;
+                arg = strtol(text.c_str(), &end, 10);
+                if (text.empty() || *end || arg < 0)
+                    throw std::invalid_argument("Bad encoder parameter: " + spec);
+            }
+            profile.named = true;
+            if (name == "png-fast" || name == "png-small") {
+                if (arg >= 0) throw std::invalid_argument("Bad encoder parameter: " + spec);
+                profile.kind = PngNative;
+                profile.format = "PNG";
+                profile.level = name == "png-fast" ? 1 : 9;
+                profile.filter = name == "png-fast" ? PngFilterUp : PngFilterAdaptive;
+            } else if (name == "png-palette") {
+                if (arg == 0 || arg == 1 || arg > 256)
+                    throw std::invalid_argument("Palette size must be 2-256: " + spec);
+                profile.kind = PngPalette;
+                profile.format = "PNG";
+                profile.quality = 90;
+                if (arg > 0) profile.colors = (size_t)arg;
+            } else if (name == "webp" || name == "jpeg" || name == "jpg") {
+                if (arg > 100) throw std::invalid_argument("Quality must be 0-100: " + spec);
+                profile.format = name == "webp" ? "WEBP" : "JPEG";
+                profile.quality = arg >= 0 ? (size_t)arg : quality;
+            } else {
+                if (arg >= 0) throw std::invalid_argument("Unknown encoder: " + spec);
+                profile.named = false;
+                profile.format = spec;
+                profile.quality = quality;
+            }
+            return profile;
+        }
+
+        // 在 Magick 图片上应用编码设置（PngNative 不经过 Magick）
+        void Apply(Magick::Image& image) const {
+            if (!format.empty()) image.magick(format);
+            image.quality(quality);
+            if (kind == PngPalette) {
+                image.depth(8);
+                image.quantizeDither(false);
+                image.quantizeColors(colors);
+                image.quantize();
+                image.type(image.alpha() ? MagickCore::PaletteAlphaType
+                                         : MagickCore::PaletteType);
+            } else if (format == "WEBP" && quality >= 100) {
+                image.defineValue("webp", "lossless", "true");
+            } else if (format == "JPEG") {
+                image.alpha(false);
+            }
+        }
+    };
+} // namespace Sayobot
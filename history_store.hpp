@@ -0,0 +1,426 @@
+#pragma once
+
+#include <fcntl.h>
+#include <sys/stat.h>
+#ifndef WIN32
+#include <sys/file.h>
+#include <sys/mman.h>
+#include <unistd.h>
+#endif
+
+#include <algorithm>
+#include <cmath>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <mutex>
+#include <stdexcept>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+#define SAYOBOT_HISTORY_MAGIC 0x53485953u // "SYHS"
+#define SAYOBOT_HISTORY_VERSION 1
+
+/*
+ * 历史快照中保存的字段，顺序即接口中数组的顺序（main.ts 的 HISTORY_FIELDS）
+ * X(name, scale)：按 scale 倍取整后保存，小数字段的精度为 1 / scale
+ */
+#define SAYOBOT_HISTORY_FIELDS(X)   \
+    X(count300, 1)                  \
+    X(count100, 1)                  \
+    X(count50, 1)                   \
+    X(playcount, 1)                 \
+    X(ranked_score, 1)              \
+    X(total_score, 1)               \
+    X(pp_rank, 1)                   \
+    X(pp_country_rank, 1)           \
+    X(count_rank_ss, 1)             \
+    X(count_rank_ssh, 1)            \
+    X(count_rank_s, 1)              \
+    X(count_rank_sh, 1)             \
+    X(count_rank_a, 1)              \
+    X(total_seconds_played, 1)      \
+    X(level, 1000000)               \
+    X(pp_raw, 10000)                \
+    X(accuracy, 10000000)
+
+namespace Sayobot {
+    enum HistoryField {
+#define X(name, scale) History_##name,
+        SAYOBOT_HISTORY_FIELDS(X)
+#undef X
+        HistoryFieldCount
+    };
+
+    /*
+     * 历史文件格式（小端）
+     * HistoryHeader 之后是 count 条定长的 HistoryRecord，只在末尾追加
+     * 同一用户、模式的快照按时间先后组成一个序列：
+     * 序列的第一条和之后每隔 HistoryStore::kKeyInterval 条为关键帧，
+     * 由相邻的 HistoryKeyLow、HistoryKeyHigh 两条记录保存各字段的低、高 32 位；
+     * 其余快照为 HistoryDelta，保存与序列中上一条快照的差，差超出 int32 时改写关键帧
+     */
+#pragma pack(push, 1)
+    struct HistoryHeader {
+        uint32_t magic;
+        uint32_t version;
+        uint32_t record_size;
+        uint32_t reserved;
+        uint64_t count;
+    };
+
+    struct HistoryRecord {
+        uint64_t user;
+        int64_t time; // Unix 时间（秒）
+        uint8_t mode;
+        uint8_t kind;
+        uint16_t reserved;
+        int32_t values[HistoryFieldCount];
+    };
+#pragma pack(pop)
+    static_assert(sizeof(HistoryHeader) == 24, "HistoryHeader layout");
+    static_assert(sizeof(HistoryRecord) == 20 + 4 * HistoryFieldCount, "HistoryRecord layout");
+
+    enum HistoryKind { HistoryKeyLow = 1, HistoryKeyHigh, HistoryDelta };
+
+    // 一次快照：各字段按 scale 取整后的值
+    struct HistorySnapshot {
+        int64_t time = 0;
+        int64_t values[HistoryFieldCount] = {};
+
+        // 由接口传入的原始值（小数字段不取整）得到快照
+        static HistorySnapshot FromDoubles(int64_t time, const double* values, size_t count) {
+            static const double scales[HistoryFieldCount] = {
+#define X(name, scale) scale,
+                SAYOBOT_HISTORY_FIELDS(X)
+#undef X
+            };
+            HistorySnapshot s;
+            s.time = time;
+            for (size_t i = 0; i < HistoryFieldCount && i < count; ++i)
+                s.values[i] = std::isfinite(values[i]) ? std::llround(values[i] * scales[i]) : 0;
+            return s;
+        }
+
+        void ToDoubles(double* out, size_t count) const {
+            static const double scales[HistoryFieldCount] = {
+#define X(name, scale) scale,
+                SAYOBOT_HISTORY_FIELDS(X)
+#undef X
+            };
+            for (size_t i = 0; i < HistoryFieldCount && i < count; ++i)
+                out[i] = values[i] / scales[i];
+        }
+    };
+
+    /*
+     * 按用户、模式保存资料快照的历史库
+     * 文件以内存映射方式只追加写入；打开时扫描一遍建立各序列的时间索引，
+     * 按时间查找为二分查找，再从最近的关键帧起累加至多 kKeyInterval 条差值
+     * 同一文件只能由一个进程打开（flock）
+     */
+    class HistoryStore {
+    public:
+        static const size_t kKeyInterval = 64;
+
+        static HistoryStore& Instance() {
+            static HistoryStore instance;
+            return instance;
+        }
+
+        HistoryStore(const HistoryStore&) = delete;
+        HistoryStore& operator=(const HistoryStore&) = delete;
+
+        ~HistoryStore() {
+            Close();
+        }
+
+        // 打开（不存在时创建）历史文件，失败时抛出 std::runtime_error
+        void Open(const std::string& path) {
+            std::lock_guard<std::mutex> lock(mutex);
+            CloseLocked();
+            try {
+                Map(path);
+                Index();
+            } catch (...) {
+                CloseLocked();
+                throw;
+            }
+        }
+
+        void Close() {
+            std::lock_guard<std::mutex> lock(mutex);
+            CloseLocked();
+        }
+
+        bool IsOpen() {
+            std::lock_guard<std::mutex> lock(mutex);
+            return header != nullptr;
+        }
+
+        /*
+         * 追加一次快照，与序列中上一条相同时不写入
+         * 时间早于上一条时按上一条的时间记录，保证序列按时间有序
+         */
+        void Append(uint64_t user, int mode, HistorySnapshot snapshot) {
+            std::lock_guard<std::mutex> lock(mutex);
+            if (!header) throw std::runtime_error("History store is not open");
+            Series& series = this->series[Key(user, mode)];
+            if (!series.points.empty()) {
+                snapshot.time = std::max(snapshot.time, series.points.back().time);
+                if (!memcmp(series.last, snapshot.values, sizeof(series.last))) return;
+            }
+            HistoryRecord record;
+            memset(&record, 0, sizeof(record));
+            record.user = user;
+            record.time = snapshot.time;
+            record.mode = (uint8_t)mode;
+            bool key = series.points.empty() || series.since_key + 1 >= kKeyInterval;
+            if (!key) {
+                record.kind = HistoryDelta;
+                for (size_t i = 0; i < HistoryFieldCount && !key; ++i) {
+                    const int64_t delta = snapshot.values[i] - series.last[i];
+                    if (delta < INT32_MIN || delta > INT32_MAX)
+                        key = true;
+                    else
+                        record.values[i] = (int32_t)delta;
+                }
+            }
+            const uint64_t index = header->count;
+            if (key) {
+                record.kind = HistoryKeyLow;
+                for (size_t i = 0; i < HistoryFieldCount; ++i)
+                    record.values[i] = (int32_t)(uint32_t)(uint64_t)snapshot.values[i];
+                HistoryRecord high = record;
+                high.kind = HistoryKeyHigh;
+                for (size_t i = 0; i < HistoryFieldCount; ++i)
+                    high.values[i] = (int32_t)(uint32_t)((uint64_t)snapshot.values[i] >> 32);
+                Write(record);
+                Write(high);
+                series.since_key = 0;
+            } else {
+                Write(record);
+                ++series.since_key;
+            }
+            series.points.push_back(Point{snapshot.time, index});
+            memcpy(series.last, snapshot.values, sizeof(series.last));
+        }
+
+        // 查找时间早于 before 的最后一条快照，没有时返回 false
+        bool Find(uint64_t user, int mode, int64_t before, HistorySnapshot& out) {
+            std::lock_guard<std::mutex> lock(mutex);
+            auto it = series.find(Key(user, mode));
+            if (it == series.end()) return false;
+            const std::vector<Point>& points = it->second.points;
+            auto upper = std::lower_bound(
+                points.begin(), points.end(), before, [](const Point& p, int64_t t) {
+                    return p.time < t;
+                });
+            if (upper == points.begin()) return false;
+            size_t target = (size_t)(upper - points.begin()) - 1;
+            // 从最近的关键帧起累加差值
+            size_t first = target;
+            while (records[points[first].index].kind != HistoryKeyLow) --first;
+            Decode(points[first].index, out.values);
+            for (size_t i = first + 1; i <= target; ++i) {
+                const HistoryRecord& r = records[points[i].index];
+                for (size_t f = 0; f < HistoryFieldCount; ++f) out.values[f] += r.values[f];
+            }
+            out.time = points[target].time;
+            return true;
+        }
+
+        size_t Records() {
+            std::lock_guard<std::mutex> lock(mutex);
+            return header ? (size_t)header->count : 0;
+        }
+
+        size_t SeriesCount() {
+            std::lock_guard<std::mutex> lock(mutex);
+            return series.size();
+        }
+
+    private:
+        struct Point {
+            int64_t time;
+            uint64_t index; // 记录下标，关键帧为 HistoryKeyLow 的下标
+        };
+
+        struct Series {
+            std::vector<Point> points;
+            int64_t last[HistoryFieldCount] = {};
+            size_t since_key = 0; // 上一个关键帧之后的差值记录数
+        };
+
+        HistoryStore() = default;
+
+        static uint64_t Key(uint64_t user, int mode) {
+            return user << 2 | (uint64_t)(mode & 3);
+        }
+
+        void Decode(uint64_t index, int64_t* values) const {
+            const HistoryRecord& low = records[index];
+            const HistoryRecord& high = records[index + 1];
+            for (size_t i = 0; i < HistoryFieldCount; ++i)
+                values[i] = (int64_t)((uint64_t)(uint32_t)high.values[i] << 32
+                                      | (uint32_t)low.values[i]);
+        }
+
+        // 扫描全部记录，建立各序列的时间索引；从第一条不完整或无法识别的记录起丢弃
+        void Index() {
+            series.clear();
+            uint64_t valid = 0;
+            for (uint64_t i = 0; i < header->count;) {
+                const HistoryRecord& r = records[i];
+                Series& s = series[Key(r.user, r.mode)];
+                if (r.kind == HistoryKeyLow) {
+                    if (i + 1 >= header->count || records[i + 1].kind != HistoryKeyHigh) break;
+                    Decode(i, s.last);
+                    s.since_key = 0;
+                    s.points.push_back(Point{r.time, i});
+                    i += 2;
+                } else if (r.kind == HistoryDelta && !s.points.empty()) {
+                    for (size_t f = 0; f < HistoryFieldCount; ++f) s.last[f] += r.values[f];
+                    ++s.since_key;
+                    s.points.push_back(Point{r.time, i});
+                    ++i;
+                } else {
+                    break;
+                }
+                valid = i;
+            }
+            for (auto it = series.begin(); it != series.end();)
+                it = it->second.points.empty() ? series.erase(it) : std::next(it);
+            header->count = valid;
+        }
+
+#ifndef WIN32
+        void Map(const std::string& path) {
+            fd = open(path.c_str(), O_RDWR | O_CREAT, 0644);
+            if (fd < 0) throw std::runtime_error("Cannot open history store: " + path);
+            if (flock(fd, LOCK_EX | LOCK_NB) != 0)
+                throw std::runtime_error("History store is in use: " + path);
+            struct stat st;
+            if (fstat(fd, &st) != 0) throw std::runtime_error("Cannot stat " + path);
+            if (st.st_size == 0) {
+                Grow(1024);
+                *header = HistoryHeader{
+                    SAYOBOT_HISTORY_MAGIC, SAYOBOT_HISTORY_VERSION, sizeof(HistoryRecord), 0, 0};
+                return;
+            }
+            if ((size_t)st.st_size < sizeof(HistoryHeader))
+                throw std::runtime_error("Bad history store: " + path);
+            Remap(((size_t)st.st_size - sizeof(HistoryHeader)) / sizeof(HistoryRecord));
+            if (header->magic != SAYOBOT_HISTORY_MAGIC || header->version != SAYOBOT_HISTORY_VERSION
+                || header->record_size != sizeof(HistoryRecord) || header->count > capacity)
+                throw std::runtime_error("Bad history store: " + path);
+        }
+
+        // 把文件扩展到 capacity 条记录并重新映射
+        void Grow(size_t capacity) {
+            if (ftruncate(fd, (off_t)(sizeof(HistoryHeader) + capacity * sizeof(HistoryRecord))) != 0)
+                throw std::runtime_error("Cannot grow history store");
+            Remap(capacity);
+        }
+
+        void Remap(size_t capacity) {
+            Unmap();
+            const size_t size = sizeof(HistoryHeader) + capacity * sizeof(HistoryRecord);
+            void* mapped = mmap(nullptr, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+            if (mapped == MAP_FAILED) throw std::runtime_error("Cannot map history store");
+            mapped_size = size;
+            this->capacity = capacity;
+            header = static_cast<HistoryHeader*>(mapped);
+            records = reinterpret_cast<HistoryRecord*>(static_cast<char*>(mapped)
+                                                       + sizeof(HistoryHeader));
+        }
+
+        void Unmap() {
+            if (header) munmap(header, mapped_size);
+            header = nullptr;
+            records = nullptr;
+            mapped_size = 0;
+            capacity = 0;
+        }
+
+        // 先写记录再更新条数，进程中途退出时最多丢失最后一条
+        // 只有文件头的文件（如 Windows 上写出的空文件）映射后 capacity 为 0
+        void Write(const HistoryRecord& record) {
+            if (header->count >= capacity) Grow(std::max<size_t>(capacity * 2, 1024));
+            records[header->count] = record;
+            ++header->count;
+        }
+
+        void CloseLocked() {
+            if (header) msync(header, mapped_size, MS_ASYNC);
+            Unmap();
+            if (fd >= 0) close(fd);
+            fd = -1;
+            series.clear();
+        }
+
+        int fd = -1;
+        size_t mapped_size = 0;
+#else
+        // Windows 上把整个文件读入内存，追加时同时写入文件
+        void Map(const std::string& path) {
+            file = fopen(path.c_str(), "r+b");
+            if (!file) file = fopen(path.c_str(), "w+b");
+            if (!file) throw std::runtime_error("Cannot open history store: " + path);
+            fseek(file, 0, SEEK_END);
+            const size_t size = (size_t)ftell(file);
+            fseek(file, 0, SEEK_SET);
+            buffer.resize(std::max(size, sizeof(HistoryHeader)));
+            if (size && fread(buffer.data(), 1, size, file) != size)
+                throw std::runtime_error("Cannot read history store: " + path);
+            Rebind();
+            if (!size) {
+                *header = HistoryHeader{
+                    SAYOBOT_HISTORY_MAGIC, SAYOBOT_HISTORY_VERSION, sizeof(HistoryRecord), 0, 0};
+                return;
+            }
+            if (header->magic != SAYOBOT_HISTORY_MAGIC || header->version != SAYOBOT_HISTORY_VERSION
+                || header->record_size != sizeof(HistoryRecord)
+                || header->count > (size - sizeof(HistoryHeader)) / sizeof(HistoryRecord))
+                throw std::runtime_error("Bad history store: " + path);
+        }
+
+        void Rebind() {
+            header = reinterpret_cast<HistoryHeader*>(buffer.data());
+            records = reinterpret_cast<HistoryRecord*>(buffer.data() + sizeof(HistoryHeader));
+        }
+
+        void Write(const HistoryRecord& record) {
+            const size_t offset = sizeof(HistoryHeader) + header->count * sizeof(HistoryRecord);
+            buffer.resize(offset + sizeof(HistoryRecord));
+            Rebind();
+            records[header->count] = record;
+            ++header->count;
+            fseek(file, (long)offset, SEEK_SET);
+            fwrite(&record, sizeof(record), 1, file);
+            fseek(file, 0, SEEK_SET);
+            fwrite(header, sizeof(HistoryHeader), 1, file);
+            fflush(file);
+        }
+
+        void CloseLocked() {
+            if (file) fclose(file);
+            file = nullptr;
+            buffer.clear();
+            header = nullptr;
+            records = nullptr;
+            series.clear();
+        }
+
+        FILE* file = nullptr;
+        std::vector<char> buffer;
+#endif
+
+        std::mutex mutex;
+        HistoryHeader* header = nullptr;
+        HistoryRecord* records = nullptr;
+        size_t capacity = 0;
+        std::unordered_map<uint64_t, Series> series;
+    };
+} // namespace Sayobot
@@ -0,0 +1,1037 @@
+#pragma once
+
+#include <time.h>
+
+#include <atomic>
+#include <cmath>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <functional>
+#include <memory>
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+#include "asset_cache.hpp"
+#include "card_args.hpp"
+#include "scratch.hpp"
+#include "text.hpp"
+
+/*
+ * 卡片布局描述
+ *
+ * 布局文件按行书写，以 # 开头的行为注释，参数之间用空格分隔，
+ * 含空格的参数用双引号括起来。支持的语句:
+ *
+ *   canvas <宽> <高>
+ *   layer base|card
+ *       之后的图片画在哪一层。base 层只能使用卡片设置（背景、透明度、各个框），
+ *       按设置缓存；card 层每张卡片都会绘制
+ *   let <名字> = <表达式>
+ *       定义派生字段，表达式为字段和数字用 + - 连接（运算符两边要有空格）
+ *   image <x> <y> [<宽> <高>] <路径> [fallback <路径>]
+ *       贴图，路径中可以使用 {字段}；读取失败时改用 fallback
+ *   avatar <x> <y> <宽> <高> [fallback <路径>]
+ *       用户头像，取自头像库（见 avatar_store.hpp），没有可用的头像时改用 fallback
+ *   text <字体> <字号> <颜色> <x> <y> <格式> [left|center|right]
+ *       字体为 Sayobot_SetFont 中的名字 (profile/data/sign/time/arrow/name)，
+ *       颜色为颜色字符串、{字段}，或 {字段:负数颜色/非负颜色}
+ *   if <表达式> <==|!=|<|>|<=|>=> <表达式> ... [else ...] end
+ *
+ * 格式中的 {字段:格式} 会被替换，{{ 和 }} 表示花括号本身。格式可以是:
+ *   d        整数
+ *   .Nf      保留 N 位小数（浮点字段的默认格式为 .2f）
+ *   si       以 K/M/G 为单位，保留两位小数
+ *   arrow    负数为 ↓，否则为 ↑
+ *   arrowinv 正数为 ↓，否则为 ↑（排名类字段）
+ *   sign     负数为 -，否则为 +
+ *   以上数字格式前加 abs 表示取绝对值，如 abs.2f、abssi
+ * {now:<strftime 格式>} 为当前时间
+ */
+
+// 卡片字段：名字、类型、是否属于卡片设置（可以在 base 层使用）
+#define SAYOBOT_CARD_FIELDS(X)         \
+    X(dataColor, String, false)        \
+    X(profileColor, String, false)     \
+    X(signColor, String, false)        \
+    X(mode, Int, false)                \
+    X(user_id, Int, false)             \
+    X(country, String, false)          \
+    X(username, String, false)         \
+    X(qq, String, false)               \
+    X(sign, String, false)             \
+    X(background, String, true)        \
+    X(profileEdge, String, true)       \
+    X(dataEdge, String, true)          \
+    X(signEdge, String, true)          \
+    X(opacity, Int, true)              \
+    X(count300, Int, false)            \
+    X(count100, Int, false)            \
+    X(count50, Int, false)             \
+    X(playcount, Int, false)           \
+    X(total_score, Int, false)         \
+    X(ranked_score, Int, false)        \
+    X(total_hits, Int, false)          \
+    X(pp_raw, Float, false)            \
+    X(pp_country_rank, Int, false)     \
+    X(pp_rank, Int, false)             \
+    X(count_ssh, Int, false)           \
+    X(count_ss, Int, false)            \
+    X(count_sh, Int, false)            \
+    X(count_s, Int, false)             \
+    X(count_a, Int, false)             \
+    X(total_seconds_played, Int, false) \
+    X(level, Float, false)             \
+    X(accuracy, Float, false)          \
+    X(stat_total_score, Int, false)    \
+    X(stat_ranked_score, Int, false)   \
+    X(stat_total_hits, Int, false)     \
+    X(stat_accuracy, Float, false)     \
+    X(stat_pp_raw, Float, false)       \
+    X(stat_level, Float, false)        \
+    X(stat_pp_rank, Int, false)        \
+    X(stat_pp_country_rank, Int, false) \
+    X(stat_playcount, Int, false)      \
+    X(stat_count_ssh, Int, false)      \
+    X(stat_count_ss, Int, false)       \
+    X(stat_count_sh, Int, false)       \
+    X(stat_count_s, Int, false)        \
+    X(stat_count_a, Int, false)        \
+    X(days, Int, false)
+
+namespace Sayobot {
+    struct LayoutValue {
+        enum Kind { Int, Float, String } kind = Int;
+        int64_t i = 0;
+        double f = 0;
+        std::string s;
+
+        double Number() const {
+            return kind == Float ? f : (double)i;
+        }
+    };
+
+    enum LayoutField {
+#define X(name, kind, config) Field_##name,
+        SAYOBOT_CARD_FIELDS(X)
+#undef X
+        Field_png,          // 素材目录
+        Field_mode_name,    // osu / taiko / fruits / mania
+        Field_country_code, // 国家代码，为空时为 __
+        Field_now,          // 当前时间
+        FieldBuiltinCount
+    };
+
+    struct LayoutFieldDef {
+        std::string name;
+        LayoutValue::Kind kind;
+        bool config;
+    };
+
+    // FNV-1a，用于布局指纹和卡片缓存键
+    inline uint64_t Fnv1a(const void* data, size_t length,
+                          uint64_t hash = 14695981039346656037ull) {
+        const unsigned char* p = static_cast<const unsigned char*>(data);
+        for (size_t i = 0; i < length; ++i) hash = (hash ^ p[i]) * 1099511628211ull;
+        return hash;
+    }
+
+    inline uint64_t Fnv1a(const std::string& s, uint64_t hash = 14695981039346656037ull) {
+        return Fnv1a(s.data(), s.size(), hash);
+    }
+
+    inline const std::vector<LayoutFieldDef>& BuiltinLayoutFields() {
+        static const std::vector<LayoutFieldDef> fields = {
+#define X(name, kind, config) {#name, LayoutValue::kind, config},
+            SAYOBOT_CARD_FIELDS(X)
+#undef X
+            {"png", LayoutValue::String, true},
+            {"mode_name", LayoutValue::String, false},
+            {"country_code", LayoutValue::String, false},
+            {"now", LayoutValue::Int, false}};
+        return fields;
+    }
+
+    // 与旧版 llToString 相同：以 K/M/G 为单位保留两位小数，不足 1000 时末尾为空格
+    inline void FormatSI(long long n, std::string& out) {
+        const char digit[4] = {' ', 'K', 'M', 'G'};
+        long double v = n;
+        int a = 0;
+        while (v > 1000.0 && a < 3) {
+            v /= 1000.0;
+            ++a;
+        }
+        char buf[32];
+        snprintf(buf, sizeof(buf), "%.2Lf%c", v, digit[a]);
+        out += buf;
+    }
+
+    struct FormatSpec {
+        enum Kind { Default, Integer, Fixed, SI, Arrow, ArrowInv, Sign, Time };
+        Kind kind = Default;
+        bool abs = false;
+        int precision = 2;
+        std::string time_format;
+    };
+
+    // 由字段和数字常量通过 + - 组成的表达式
+    struct LayoutExpr {
+        struct Term {
+            int field = -1;
+            double constant = 0;
+            bool negative = false;
+        };
+        std::vector<Term> terms;
+
+        void Evaluate(const std::vector<LayoutValue>& values, LayoutValue& out) const {
+            if (terms.size() == 1 && terms[0].field >= 0 && !terms[0].negative) {
+                out = values[terms[0].field];
+                return;
+            }
+            bool is_float = false;
+            int64_t i = 0;
+            double f = 0;
+            for (const Term& t : terms) {
+                if (t.field < 0) {
+                    const double c = t.negative ? -t.constant : t.constant;
+                    if (c != std::floor(c)) is_float = true;
+                    i += (int64_t)c;
+                    f += c;
+                    continue;
+                }
+                const LayoutValue& v = values[t.field];
+                if (v.kind == LayoutValue::Float) is_float = true;
+                i += t.negative ? -v.i : v.i;
+                f += t.negative ? -v.Number() : v.Number();
+            }
+            out.s.clear();
+            out.kind = is_float ? LayoutValue::Float : LayoutValue::Int;
+            out.i = i;
+            out.f = f;
+        }
+
+        // 只有一个字段时直接返回字段的值，不复制字符串；否则计算到 scratch 中
+        const LayoutValue& Value(const std::vector<LayoutValue>& values,
+                                 LayoutValue& scratch) const {
+            if (terms.size() == 1 && terms[0].field >= 0 && !terms[0].negative)
+                return values[terms[0].field];
+            Evaluate(values, scratch);
+            return scratch;
+        }
+    };
+
+    // 含有 {字段:格式} 的字符串模板
+    struct LayoutTemplate {
+        struct Segment {
+            std::string literal;
+            int field = -1;
+            FormatSpec spec;
+        };
+        std::vector<Segment> segments;
+
+        bool Constant() const {
+            for (const Segment& s : segments)
+                if (s.field >= 0) return false;
+            return true;
+        }
+
+        template <typename Pred>
+        bool Any(Pred pred) const {
+            for (const Segment& s : segments)
+                if (s.field >= 0 && pred(s.field)) return true;
+            return false;
+        }
+
+        void Format(const std::vector<LayoutValue>& values, std::string& out) const {
+            out.clear();
+            for (const Segment& s : segments) {
+                if (s.field < 0)
+                    out += s.literal;
+                else
+                    FormatValue(values[s.field], s.spec, out);
+            }
+        }
+
+        static void FormatValue(const LayoutValue& v, const FormatSpec& spec,
+                                std::string& out) {
+            char buf[64];
+            if (spec.kind == FormatSpec::Time) {
+                const time_t t = (time_t)v.i;
+                struct tm tm;
+#ifdef WIN32
+                localtime_s(&tm, &t);
+#else
+                localtime_r(&t, &tm);
+#endif
+                const size_t n = strftime(buf, sizeof(buf), spec.time_format.c_str(), &tm);
+                out.append(buf, n);
+                return;
+            }
+            if (v.kind == LayoutValue::String) {
+                out += v.s;
+                return;
+            }
+            const bool negative = v.kind == LayoutValue::Float ? v.f < 0 : v.i < 0;
+            switch (spec.kind) {
+            case FormatSpec::Arrow:
+                out += negative ? "↓" : "↑";
+                return;
+            case FormatSpec::ArrowInv:
+                out += (v.kind == LayoutValue::Float ? v.f > 0 : v.i > 0) ? "↓" : "↑";
+                return;
+            case FormatSpec::Sign:
+                out += negative ? "-" : "+";
+                return;
+            default:
+                break;
+            }
+            const bool flip = spec.abs && negative;
+            const int64_t i = flip ? -v.i : v.i;
+            const double f = flip ? -v.f : v.f;
+            FormatSpec::Kind kind = spec.kind;
+            if (kind == FormatSpec::Default)
+                kind = v.kind == LayoutValue::Float ? FormatSpec::Fixed : FormatSpec::Integer;
+            switch (kind) {
+            case FormatSpec::Fixed:
+                snprintf(buf,
+                         sizeof(buf),
+                         "%.*f",
+                         spec.precision,
+                         v.kind == LayoutValue::Float ? f : (double)i);
+                break;
+            case FormatSpec::SI:
+                FormatSI(v.kind == LayoutValue::Float ? (long long)f : (long long)i, out);
+                return;
+            default:
+                AppendInt(out, v.kind == LayoutValue::Float ? (long long)f : (long long)i);
+                return;
+            }
+            out += buf;
+        }
+    };
+
+    struct LayoutOp {
+        enum Kind { Image, Text, If, Jump, Avatar };
+        enum Compare { Eq, Ne, Lt, Gt, Le, Ge };
+        Kind kind = Image;
+        int layer = 1; // 0 为 base 层，1 为 card 层
+        int line = 0;
+
+        // image / text 的位置
+        double x = 0, y = 0;
+
+        // image / avatar
+        size_t width = 0, height = 0;
+        LayoutTemplate path, fallback;
+        bool has_fallback = false;
+        std::shared_ptr<AssetCache::Handle> asset; // 编译后路径不含字段的 image 有效
+
+        // text
+        std::string font;
+        FontFace* face = nullptr; // 编译后有效
+        double size = 0;
+        uint32_t color = 0x000000FF;
+        int color_field = -1;     // 颜色取自字段
+        uint32_t negative_color = 0x000000FF;
+        bool color_by_sign = false;
+        TextAlign align = TextAlign::Left;
+        LayoutTemplate text;
+
+        // 文字内容或颜色随当前时间变化（用到 now 或由它派生的字段）
+        bool clocked = false;
+
+        // if：条件不成立时跳到 target；jump：无条件跳到 target
+        LayoutExpr lhs, rhs;
+        Compare compare = Eq;
+        size_t target = 0;
+
+        bool Test(const std::vector<LayoutValue>& values) const {
+            LayoutValue scratch_a, scratch_b;
+            const LayoutValue& a = lhs.Value(values, scratch_a);
+            const LayoutValue& b = rhs.Value(values, scratch_b);
+            if (a.kind == LayoutValue::String || b.kind == LayoutValue::String) {
+                const int c = a.s.compare(b.s);
+                switch (compare) {
+                case Eq: return c == 0;
+                case Ne: return c != 0;
+                case Lt: return c < 0;
+                case Gt: return c > 0;
+                case Le: return c <= 0;
+                default: return c >= 0;
+                }
+            }
+            const double x = a.Number(), y = b.Number();
+            switch (compare) {
+            case Eq: return x == y;
+            case Ne: return x != y;
+            case Lt: return x < y;
+            case Gt: return x > y;
+            case Le: return x <= y;
+            default: return x >= y;
+            }
+        }
+
+        uint32_t Color(const std::vector<LayoutValue>& values) const {
+            if (color_field < 0) return color;
+            const LayoutValue& v = values[color_field];
+            if (color_by_sign) return v.Number() < 0 ? negative_color : color;
+            return ParseColor(v.s);
+        }
+    };
+
+    // Replay 时按是否随时间变化筛选文字
+    enum ReplayClock { ReplayAll, ReplayUnclocked, ReplayClocked };
+
+    /*
+     * 解析后的卡片布局（显示列表）
+     * Parse 得到与字体、素材目录无关的布局，Compile 绑定字体句柄并展开 {png}，
+     * 路径固定的图片同时取得素材句柄，
+     * 渲染时只需计算字段值，再按顺序重放显示列表
+     */
+    class Layout {
+    public:
+        size_t width = 1080, height = 1920;
+        std::vector<LayoutFieldDef> fields; // 内置字段 + let 定义的字段
+        std::vector<LayoutExpr> lets;       // fields[FieldBuiltinCount + i] 的表达式
+        std::vector<LayoutOp> ops;
+        std::string png;                    // 编译时绑定的素材目录
+        uint64_t id = 0;                    // 每次编译得到不同的编号，用作底图缓存键
+        uint64_t source_hash = 0;           // 布局文本的哈希
+        uint64_t fingerprint = 0;           // 布局文本、素材目录和字体文件的哈希，跨进程不变
+        std::vector<char> clocked_fields;   // 每个字段是否随当前时间变化
+        // 条件、图片路径或头像用到了随时间变化的字段，这样的布局不能按字段缓存卡片
+        bool clocked_structure = false;
+
+        // 解析布局文本，出错时抛出 std::invalid_argument（带行号）
+        static std::shared_ptr<Layout> Parse(const std::string& source) {
+            std::shared_ptr<Layout> layout = std::make_shared<Layout>();
+            layout->fields = BuiltinLayoutFields();
+            Parser(*layout).Run(source);
+            layout->source_hash = Fnv1a(source);
+            layout->AnalyzeClock();
+            return layout;
+        }
+
+        /*
+         * 绑定字体和素材目录
+         * 参数列表:
+         *** png (const std::string&) 素材目录
+         *** font_path 由字体名得到字体文件路径，未知字体返回空字符串
+         */
+        std::shared_ptr<Layout> Compile(
+            const std::string& png,
+            const std::function<std::string(const std::string&)>& font_path) const {
+            std::shared_ptr<Layout> compiled = std::make_shared<Layout>(*this);
+            static std::atomic<uint64_t> serial{0};
+            compiled->png = png;
+            compiled->id = ++serial;
+            compiled->fingerprint = Fnv1a(png, source_hash);
+            for (LayoutOp& op : compiled->ops) {
+                if (op.kind == LayoutOp::Text) {
+                    const std::string file = font_path(op.font);
+                    if (file.empty())
+                        throw std::invalid_argument("line " + std::to_string(op.line)
+                                                    + ": unknown font " + op.font);
+                    compiled->fingerprint = Fnv1a(file + '\n', compiled->fingerprint);
+                    op.face = FontRegistry::Instance().Get(file);
+                    Bind(op.text, png);
+                } else if (op.kind == LayoutOp::Image) {
+                    Bind(op.path, png);
+                    Bind(op.fallback, png);
+                    // 路径固定的图片预先取得素材句柄，重放时不再格式化路径
+                    if (op.path.Constant() && !op.path.segments.empty())
+                        op.asset = std::make_shared<AssetCache::Handle>(
+                            op.path.segments[0].literal, op.width, op.height);
+                } else if (op.kind == LayoutOp::Avatar) {
+                    Bind(op.fallback, png);
+                }
+            }
+            return compiled;
+        }
+
+        // 计算本次渲染所有字段的值
+        void Evaluate(const CardArgs& a, std::vector<LayoutValue>& values) const {
+            Evaluate(a, values, (int64_t)time(nullptr));
+        }
+
+        // 以 now 作为当前时间计算字段的值
+        void Evaluate(const CardArgs& a, std::vector<LayoutValue>& values,
+                      int64_t now) const {
+            values.resize(fields.size());
+            static const char* const mode_names[] = {"osu", "taiko", "fruits", "mania"};
+#define X(name, kind, config) Set##kind(values[Field_##name], a.name);
+            SAYOBOT_CARD_FIELDS(X)
+#undef X
+            SetString(values[Field_png], png);
+            SetString(values[Field_mode_name], mode_names[a.mode & 3]);
+            SetString(values[Field_country_code], a.country.empty() ? "__" : a.country);
+            SetInt(values[Field_now], now);
+            for (size_t i = 0; i < lets.size(); ++i)
+                lets[i].Evaluate(values, values[FieldBuiltinCount + i]);
+        }
+
+        /*
+         * 按顺序重放 layer 层的显示列表
+         * visitor 需要提供:
+         *** DrawImage(const LayoutOp& op, const std::string& path)
+         *** DrawText(const LayoutOp& op, const std::string& text, uint32_t color)
+         *** DrawAvatar(const LayoutOp& op, int64_t user_id)
+         * 图片读取失败或没有头像时由 visitor 按 op.fallback 处理
+         * clock 为 ReplayUnclocked / ReplayClocked 时只重放不随时间变化 / 随时间变化的文字
+         */
+        template <typename Visitor>
+        void Replay(int layer, const std::vector<LayoutValue>& values, Visitor& visitor,
+                    ReplayClock clock = ReplayAll) const {
+            Scratch<std::string> scratch;
+            std::string& buffer = *scratch;
+            for (size_t i = 0; i < ops.size();) {
+                const LayoutOp& op = ops[i];
+                if (op.kind == LayoutOp::If) {
+                    i = op.Test(values) ? i + 1 : op.target;
+                    continue;
+                }
+                if (op.kind == LayoutOp::Jump) {
+                    i = op.target;
+                    continue;
+                }
+                if (op.layer == layer
+                    && (clock == ReplayAll || op.clocked == (clock == ReplayClocked))) {
+                    if (op.kind == LayoutOp::Image && op.asset) {
+                        visitor.DrawImage(op, op.asset->path);
+                    } else if (op.kind == LayoutOp::Image) {
+                        op.path.Format(values, buffer);
+                        visitor.DrawImage(op, buffer);
+                    } else if (op.kind == LayoutOp::Avatar) {
+                        visitor.DrawAvatar(op, values[Field_user_id].i);
+                    } else {
+                        op.text.Format(values, buffer);
+                        visitor.DrawText(op, buffer, op.Color(values));
+                    }
+                }
+                ++i;
+            }
+        }
+
+    private:
+        // 标记随当前时间变化的字段和文字，let 按定义顺序计算，一遍即可
+        void AnalyzeClock() {
+            clocked_fields.assign(fields.size(), 0);
+            clocked_fields[Field_now] = 1;
+            for (size_t i = 0; i < lets.size(); ++i)
+                for (const LayoutExpr::Term& t : lets[i].terms)
+                    if (t.field >= 0 && clocked_fields[t.field])
+                        clocked_fields[FieldBuiltinCount + i] = 1;
+            const auto clocked = [this](int field) { return clocked_fields[field] != 0; };
+            const auto clocked_expr = [this](const LayoutExpr& e) {
+                for (const LayoutExpr::Term& t : e.terms)
+                    if (t.field >= 0 && clocked_fields[t.field]) return true;
+                return false;
+            };
+            clocked_structure = false;
+            for (LayoutOp& op : ops) {
+                switch (op.kind) {
+                case LayoutOp::Text:
+                    op.clocked = op.text.Any(clocked)
+                                 || (op.color_field >= 0 && clocked(op.color_field));
+                    break;
+                case LayoutOp::If:
+                    if (clocked_expr(op.lhs) || clocked_expr(op.rhs)) clocked_structure = true;
+                    break;
+                case LayoutOp::Image:
+                case LayoutOp::Avatar:
+                    if (op.path.Any(clocked) || op.fallback.Any(clocked))
+                        clocked_structure = true;
+                    break;
+                default:
+                    break;
+                }
+            }
+        }
+
+        // values 可能是上一次渲染留下的，每个成员都要覆盖（字符串只清空，保留容量）
+        static void SetInt(LayoutValue& v, int64_t i) {
+            v.kind = LayoutValue::Int;
+            v.i = i;
+            v.f = 0;
+            v.s.clear();
+        }
+
+        static void SetFloat(LayoutValue& v, double f) {
+            v.kind = LayoutValue::Float;
+            v.f = f;
+            v.i = (int64_t)f;
+            v.s.clear();
+        }
+
+        static void SetString(LayoutValue& v, const std::string& s) {
+            v.kind = LayoutValue::String;
+            v.i = 0;
+            v.f = 0;
+            v.s = s;
+        }
+
+        // 把模板中的 {png} 替换为素材目录，并合并相邻的文字
+        static void Bind(LayoutTemplate& t, const std::string& png) {
+            std::vector<LayoutTemplate::Segment> segments;
+            for (LayoutTemplate::Segment& s : t.segments) {
+                if (s.field == Field_png) {
+                    s.field = -1;
+                    s.literal = png;
+                }
+                if (s.field < 0 && !segments.empty() && segments.back().field < 0)
+                    segments.back().literal += s.literal;
+                else
+                    segments.push_back(s);
+            }
+            t.segments.swap(segments);
+        }
+
+        class Parser {
+        public:
+            explicit Parser(Layout& layout) : layout(layout) {
+            }
+
+            void Run(const std::string& source) {
+                size_t begin = 0;
+                while (begin <= source.size()) {
+                    size_t end = source.find('\n', begin);
+                    if (end == std::string::npos) end = source.size();
+                    ++line;
+                    Statement(Tokenize(source.substr(begin, end - begin)));
+                    begin = end + 1;
+                }
+                if (!blocks.empty()) Fail("missing end");
+            }
+
+        private:
+            struct Block {
+                size_t if_index;
+                size_t jump_index; // else 前插入的跳转，没有 else 时为 npos
+            };
+
+            [[noreturn]] void Fail(const std::string& message) {
+                throw std::invalid_argument("line " + std::to_string(line) + ": "
+                                            + message);
+            }
+
+            std::vector<std::string> Tokenize(const std::string& text) {
+                std::vector<std::string> tokens;
+                size_t i = 0;
+                while (i < text.size()) {
+                    const char c = text[i];
+                    if (c == ' ' || c == '\t' || c == '\r') {
+                        ++i;
+                        continue;
+                    }
+                    if (c == '#' && tokens.empty()) break;
+                    std::string token;
+                    if (c == '"') {
+                        for (++i; i < text.size() && text[i] != '"'; ++i) {
+                            if (text[i] == '\\' && i + 1 < text.size()) ++i;
+                            token += text[i];
+                        }
+                        if (i == text.size()) Fail("unterminated string");
+                        ++i;
+                    } else {
+                        while (i < text.size() && text[i] != ' ' && text[i] != '\t'
+                               && text[i] != '\r')
+                            token += text[i++];
+                    }
+                    tokens.push_back(token);
+                }
+                return tokens;
+            }
+
+            static bool ParseNumber(const std::string& token, double& value) {
+                if (token.empty()) return false;
+                char* end = nullptr;
+                value = strtod(token.c_str(), &end);
+                return end && !*end;
+            }
+
+            double Number(const std::string& token) {
+                double value;
+                if (!ParseNumber(token, value)) Fail("expected number: " + token);
+                return value;
+            }
+
+            int Field(const std::string& name) {
+                for (size_t i = 0; i < layout.fields.size(); ++i)
+                    if (layout.fields[i].name == name) return (int)i;
+                Fail("unknown field: " + name);
+            }
+
+            LayoutExpr Expr(const std::vector<std::string>& tokens, size_t begin,
+                            size_t end) {
+                LayoutExpr expr;
+                bool negative = false;
+                bool expect_operand = true;
+                for (size_t i = begin; i < end; ++i) {
+                    const std::string& t = tokens[i];
+                    if (!expect_operand) {
+                        if (t != "+" && t != "-") Fail("expected + or -: " + t);
+                        negative = t == "-";
+                        expect_operand = true;
+                        continue;
+                    }
+                    LayoutExpr::Term term;
+                    term.negative = negative;
+                    if (!ParseNumber(t, term.constant)) {
+                        term.field = Field(t);
+                        if (layout.fields[term.field].kind == LayoutValue::String
+                            && end - begin != 1)
+                            Fail("string field in arithmetic: " + t);
+                    }
+                    expr.terms.push_back(term);
+                    expect_operand = false;
+                }
+                if (expect_operand) Fail("incomplete expression");
+                return expr;
+            }
+
+            FormatSpec Spec(int field, const std::string& text) {
+                FormatSpec spec;
+                if (field == Field_now) {
+                    spec.kind = FormatSpec::Time;
+                    spec.time_format = text.empty() ? "%F %T" : text;
+                    return spec;
+                }
+                std::string rest = text;
+                if (rest == "arrow") {
+                    spec.kind = FormatSpec::Arrow;
+                } else if (rest == "arrowinv") {
+                    spec.kind = FormatSpec::ArrowInv;
+                } else if (rest == "sign") {
+                    spec.kind = FormatSpec::Sign;
+                } else {
+                    if (!rest.compare(0, 3, "abs")) {
+                        spec.abs = true;
+                        rest = rest.substr(3);
+                    }
+                    if (rest.empty()) {
+                        spec.kind = FormatSpec::Default;
+                    } else if (rest == "d") {
+                        spec.kind = FormatSpec::Integer;
+                    } else if (rest == "si") {
+                        spec.kind = FormatSpec::SI;
+                    } else if (rest.size() >= 3 && rest[0] == '.'
+                               && rest.back() == 'f') {
+                        spec.kind = FormatSpec::Fixed;
+                        spec.precision = atoi(rest.c_str() + 1);
+                        if (spec.precision < 0 || spec.precision > 9)
+                            Fail("bad precision: " + text);
+                    } else {
+                        Fail("unknown format: " + text);
+                    }
+                }
+                return spec;
+            }
+
+            LayoutTemplate Template(const std::string& text) {
+                LayoutTemplate t;
+                std::string literal;
+                for (size_t i = 0; i < text.size(); ++i) {
+                    const char c = text[i];
+                    if ((c == '{' || c == '}') && i + 1 < text.size() && text[i + 1] == c) {
+                        literal += c;
+                        ++i;
+                        continue;
+                    }
+                    if (c == '}') Fail("unmatched } in " + text);
+                    if (c != '{') {
+                        literal += c;
+                        continue;
+                    }
+                    const size_t close = text.find('}', i);
+                    if (close == std::string::npos) Fail("unmatched { in " + text);
+                    const std::string inner = text.substr(i + 1, close - i - 1);
+                    const size_t colon = inner.find(':');
+                    LayoutTemplate::Segment s;
+                    s.field = Field(inner.substr(0, colon));
+                    s.spec = Spec(s.field,
+                                  colon == std::string::npos ? "" : inner.substr(colon + 1));
+                    if (!literal.empty()) {
+                        LayoutTemplate::Segment l;
+                        l.literal = literal;
+                        t.segments.push_back(l);
+                        literal.clear();
+                    }
+                    t.segments.push_back(s);
+                    i = close;
+                }
+                if (!literal.empty()) {
+                    LayoutTemplate::Segment l;
+                    l.literal = literal;
+                    t.segments.push_back(l);
+                }
+                return t;
+            }
+
+            bool ConfigOnly(const LayoutTemplate& t) {
+                return !t.Any([this](int f) { return !layout.fields[f].config; });
+            }
+
+            void Color(LayoutOp& op, const std::string& token) {
+                if (token.size() < 2 || token[0] != '{' || token.back() != '}') {
+                    op.color = ParseColor(token);
+                    return;
+                }
+                const std::string inner = token.substr(1, token.size() - 2);
+                const size_t colon = inner.find(':');
+                op.color_field = Field(inner.substr(0, colon));
+                if (colon == std::string::npos) {
+                    if (layout.fields[op.color_field].kind != LayoutValue::String)
+                        Fail("color field must be a string: " + inner);
+                    return;
+                }
+                const std::string colors = inner.substr(colon + 1);
+                const size_t slash = colors.find('/');
+                if (slash == std::string::npos) Fail("expected negative/positive colors");
+                op.color_by_sign = true;
+                op.negative_color = ParseColor(colors.substr(0, slash));
+                op.color = ParseColor(colors.substr(slash + 1));
+            }
+
+            void Statement(const std::vector<std::string>& t) {
+                if (t.empty()) return;
+                const std::string& cmd = t[0];
+                if (cmd == "canvas") {
+                    if (t.size() != 3) Fail("usage: canvas <width> <height>");
+                    layout.width = (size_t)Number(t[1]);
+                    layout.height = (size_t)Number(t[2]);
+                    if (!layout.width || !layout.height) Fail("empty canvas");
+                } else if (cmd == "layer") {
+                    if (t.size() != 2 || (t[1] != "base" && t[1] != "card"))
+                        Fail("usage: layer base|card");
+                    if (!blocks.empty()) Fail("layer inside if");
+                    layer = t[1] == "base" ? 0 : 1;
+                } else if (cmd == "let") {
+                    if (t.size() < 4 || t[2] != "=") Fail("usage: let <name> = <expr>");
+                    for (const LayoutFieldDef& f : layout.fields)
+                        if (f.name == t[1]) Fail("field already defined: " + t[1]);
+                    LayoutExpr expr = Expr(t, 3, t.size());
+                    bool is_float = false, config = true;
+                    for (const LayoutExpr::Term& term : expr.terms) {
+                        if (term.field < 0) {
+                            if (term.constant != std::floor(term.constant)) is_float = true;
+                            continue;
+                        }
+                        const LayoutFieldDef& f = layout.fields[term.field];
+                        if (f.kind == LayoutValue::Float) is_float = true;
+                        config = config && f.config;
+                    }
+                    LayoutValue::Kind kind = is_float ? LayoutValue::Float : LayoutValue::Int;
+                    if (expr.terms.size() == 1 && expr.terms[0].field >= 0)
+                        kind = layout.fields[expr.terms[0].field].kind;
+                    layout.fields.push_back(LayoutFieldDef{t[1], kind, config});
+                    layout.lets.push_back(expr);
+                } else if (cmd == "image") {
+                    LayoutOp op = NewOp(LayoutOp::Image);
+                    size_t n = t.size();
+                    if (n >= 3 && t[n - 2] == "fallback") {
+                        op.has_fallback = true;
+                        op.fallback = Template(t[n - 1]);
+                        n -= 2;
+                    }
+                    if (n != 4 && n != 6)
+                        Fail("usage: image <x> <y> [<w> <h>] <path> [fallback <path>]");
+                    op.x = Number(t[1]);
+                    op.y = Number(t[2]);
+                    if (n == 6) {
+                        op.width = (size_t)Number(t[3]);
+                        op.height = (size_t)Number(t[4]);
+                    }
+                    op.path = Template(t[n - 1]);
+                    if (layer == 0
+                        && (!ConfigOnly(op.path) || (op.has_fallback && !ConfigOnly(op.fallback))))
+                        Fail("base layer images may only use card settings");
+                    layout.ops.push_back(op);
+                } else if (cmd == "avatar") {
+                    if (layer == 0) Fail("avatar is not allowed in the base layer");
+                    LayoutOp op = NewOp(LayoutOp::Avatar);
+                    size_t n = t.size();
+                    if (n >= 3 && t[n - 2] == "fallback") {
+                        op.has_fallback = true;
+                        op.fallback = Template(t[n - 1]);
+                        n -= 2;
+                    }
+                    if (n != 5) Fail("usage: avatar <x> <y> <w> <h> [fallback <path>]");
+                    op.x = Number(t[1]);
+                    op.y = Number(t[2]);
+                    op.width = (size_t)Number(t[3]);
+                    op.height = (size_t)Number(t[4]);
+                    if (!op.width || !op.height) Fail("empty avatar size");
+                    layout.ops.push_back(op);
+                } else if (cmd == "text") {
+                    if (t.size() != 7 && t.size() != 8)
+                        Fail("usage: text <font> <size> <color> <x> <y> <format> [align]");
+                    if (layer == 0) Fail("text is not allowed in the base layer");
+                    LayoutOp op = NewOp(LayoutOp::Text);
+                    op.font = t[1];
+                    op.size = Number(t[2]);
+                    Color(op, t[3]);
+                    op.x = Number(t[4]);
+                    op.y = Number(t[5]);
+                    op.text = Template(t[6]);
+                    if (t.size() == 8) {
+                        if (t[7] == "left")
+                            op.align = TextAlign::Left;
+                        else if (t[7] == "center")
+                            op.align = TextAlign::Center;
+                        else if (t[7] == "right")
+                            op.align = TextAlign::Right;
+                        else
+                            Fail("unknown align: " + t[7]);
+                    }
+                    layout.ops.push_back(op);
+                } else if (cmd == "if") {
+                    if (layer == 0) Fail("if is not allowed in the base layer");
+                    static const char* const compares[] = {"==", "!=", "<", ">", "<=", ">="};
+                    size_t at = 0;
+                    int compare = -1;
+                    for (size_t i = 1; i < t.size() && compare < 0; ++i)
+                        for (int c = 0; c < 6; ++c)
+                            if (t[i] == compares[c]) {
+                                at = i;
+                                compare = c;
+                                break;
+                            }
+                    if (compare < 0) Fail("usage: if <expr> <compare> <expr>");
+                    LayoutOp op = NewOp(LayoutOp::If);
+                    op.lhs = Expr(t, 1, at);
+                    op.rhs = Expr(t, at + 1, t.size());
+                    op.compare = (LayoutOp::Compare)compare;
+                    blocks.push_back(Block{layout.ops.size(), std::string::npos});
+                    layout.ops.push_back(op);
+                } else if (cmd == "else") {
+                    if (t.size() != 1 || blocks.empty()
+                        || blocks.back().jump_index != std::string::npos)
+                        Fail("unexpected else");
+                    blocks.back().jump_index = layout.ops.size();
+                    layout.ops.push_back(NewOp(LayoutOp::Jump));
+                    layout.ops[blocks.back().if_index].target = layout.ops.size();
+                } else if (cmd == "end") {
+                    if (t.size() != 1 || blocks.empty()) Fail("unexpected end");
+                    const Block block = blocks.back();
+                    blocks.pop_back();
+                    if (block.jump_index == std::string::npos)
+                        layout.ops[block.if_index].target = layout.ops.size();
+                    else
+                        layout.ops[block.jump_index].target = layout.ops.size();
+                } else {
+                    Fail("unknown statement: " + cmd);
+                }
+            }
+
+            LayoutOp NewOp(LayoutOp::Kind kind) {
+                LayoutOp op;
+                op.kind = kind;
+                op.layer = layer;
+                op.line = line;
+                return op;
+            }
+
+            Layout& layout;
+            int line = 0;
+            int layer = 1;
+            std::vector<Block> blocks;
+        };
+    };
+
+    // 内置的默认布局，与旧版硬编码的卡片一致
+    inline const char* DefaultLayoutSource() {
+        return R"LAYOUT(# Sayobot 默认资料卡
+canvas 1080 1920
+
+layer base
+# 背景和不透明贴图
+image 0 0 "{png}/stat/{background}.png"
+image 0 0 "{png}/fx{opacity}.png"
+# 个人信息框
+image 50 20 970 600 "{png}/tk/{profileEdge}.png"
+# 数据框
+image 56 980 820 140 "{png}/tk/{dataEdge}.png"
+image 89.5 1120 820 140 "{png}/tk/{dataEdge}.png"
+image 123 1260 820 140 "{png}/tk/{dataEdge}.png"
+image 156.5 1400 820 140 "{png}/tk/{dataEdge}.png"
+image 190 1540 820 140 "{png}/tk/{dataEdge}.png"
+image 223.5 1680 820 140 "{png}/tk/{dataEdge}.png"
+# 签名框
+image 125 570 825 150 "{png}/tk/{signEdge}.png"
+# rank 图标
+image 165 720 82 98 "{png}/rank/sakura miku/ranking-X-small.png"
+image 285 870 82 98 "{png}/rank/sakura miku/ranking-XH-small.png"
+image 405 720 82 98 "{png}/rank/sakura miku/ranking-S-small.png"
+image 525 870 82 98 "{png}/rank/sakura miku/ranking-SH-small.png"
+image 645 720 82 98 "{png}/rank/sakura miku/ranking-A-small.png"
+
+layer card
+# 头像、模式图标、地球图标和国旗
+avatar 165 150 350 350 fallback "{png}/no-avatar.png"
+image 165 150 80 80 "{png}/rank/sakura miku/mode-{mode_name}-med.png"
+image 510 150 100 100 "{png}/world/s.png"
+image 560 425 80 80 "{png}/country/{country_code}.png"
+
+let d_country_rank = pp_country_rank - stat_pp_country_rank
+let d_pp_rank = pp_rank - stat_pp_rank
+let d_pp = pp_raw - stat_pp_raw
+let d_ranked_score = ranked_score - stat_ranked_score
+let d_total_hits = count300 + count100 + count50 - stat_total_hits
+let d_playcount = playcount - stat_playcount
+let d_accuracy = accuracy - stat_accuracy
+let d_level = level - stat_level
+let d_ss = count_ssh + count_ss - stat_count_ssh - stat_count_ss
+let d_s = count_sh + count_s - stat_count_sh - stat_count_s
+let d_a = count_a - stat_count_a
+
+# 天数和时间
+if days != 0
+text time 29 #000000 30 1840 "compare with {days} days ago"
+end
+text time 29 #000000 30 1880 "{now:%F %a %T} by Sayobot with C++ & Magick++"
+
+# UID、QQ 和国家/地区排名
+text profile 29 {profileColor} 585 365 "UID: {user_id}"
+text profile 29 {profileColor} 585 395 "QQ: {qq}"
+if user_id == -1
+text profile 29 {profileColor} 660 460 "#{pp_country_rank}"
+else
+text profile 29 {profileColor} 660 460 "#{pp_country_rank}({d_country_rank:arrowinv}{d_country_rank:abs})"
+end
+
+# 数据区块
+text data 43 {dataColor} 140 1210 "PPoint :     {pp_raw:.2f}"
+text data 43 {dataColor} 106 1070 "Ranked Score : {ranked_score:si}"
+text data 43 {dataColor} 240 1630 "Total Hits :    {total_hits:si}"
+text data 43 {dataColor} 173 1350 "Playcount :    {playcount}"
+text data 43 {dataColor} 274 1770 "Current Level :   {level:.2f}"
+text data 43 {dataColor} 207 1490 "Hit Accuracy : {accuracy:.2f}%"
+if user_id != -1
+text data 43 {d_pp:#000000/#000000} 670 1210 "{d_pp:arrow}{d_pp:abs.2f}"
+text data 43 {d_ranked_score:#000000/#000000} 626 1070 "{d_ranked_score:sign}{d_ranked_score:abssi}"
+text data 43 {d_total_hits:#000000/#000000} 780 1630 "{d_total_hits:sign}{d_total_hits:abssi}"
+text data 43 {d_playcount:#000000/#000000} 713 1350 "{d_playcount:sign}{d_playcount:abs}"
+text data 43 {d_accuracy:#000000/#000000} 747 1490 "{d_accuracy:arrow}{d_accuracy:abs.2f}%"
+text data 43 {d_level:#000000/#000000} 814 1770 "{d_level:sign}{d_level:abs.2f}"
+# rank 数量变化
+text name 54 {profileColor} 253 860 "({d_ss:arrow}{d_ss:abs})"
+text name 54 {profileColor} 494 860 "({d_s:arrow}{d_s:abs})"
+text name 54 {profileColor} 735 860 "({d_a:arrow}{d_a:abs})"
+end
+
+# rank 数量
+text name 54 {profileColor} 253 790 "{count_ss}"
+text name 54 {profileColor} 373 940 "{count_ssh}"
+text name 54 {profileColor} 493 790 "{count_s}"
+text name 54 {profileColor} 613 940 "{count_sh}"
+text name 54 {profileColor} 733 790 "{count_a}"
+
+# 全球排名、名字和签名
+text arrow 54 {d_pp_rank:#000000/#000000} 660 270 "({d_pp_rank:arrowinv}{d_pp_rank:abs})"
+text name 54 {profileColor} 600 220 "{pp_rank}"
+text name 54 {profileColor} 555 325 "{username}"
+text sign 54 {signColor} 540 660 "{sign}" center
+)LAYOUT";
+    }
+} // namespace Sayobot
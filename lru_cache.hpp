@@ -0,0 +1,127 @@
+#pragma once
+
+#include <cstddef>
+#include <list>
+#include <mutex>
+#include <string>
+#include <unordered_map>
+#include <utility>
+
+namespace Sayobot {
+    /*
+     * 线程安全的 LRU 缓存，以字符串为键，按调用方给出的字节数计入预算
+     * Value 需要可以廉价复制（Magick::Image 等引用计数对象）
+     */
+    template <typename Value>
+    class LruCache {
+    public:
+        explicit LruCache(size_t limit) : limit(limit) {
+        }
+
+        // 命中时把值复制到 out 并标记为最近使用
+        bool Get(const std::string& key, Value& out) {
+            std::lock_guard<std::mutex> lock(mutex);
+            auto it = index.find(key);
+            if (it == index.end()) return false;
+            entries.splice(entries.begin(), entries, it->second);
+            out = it->second->value;
+            return true;
+        }
+
+        // 放入缓存，超过预算的单个值不会被缓存
+        void Put(const std::string& key, const Value& value, size_t bytes) {
+            Value replaced = value;
+            Exchange(key, replaced, bytes);
+        }
+
+        /*
+         * 与 Put 相同，键已存在时原地替换，不再分配
+         * 返回后 value 为被替换下来的旧值（没有时为空值），或没能放入缓存的 value 本身，
+         * 都已不被缓存引用，调用方可以复用
+         */
+        void Exchange(const std::string& key, Value& value, size_t bytes) {
+            std::lock_guard<std::mutex> lock(mutex);
+            auto it = index.find(key);
+            if (it != index.end() && bytes <= limit) {
+                Entry& entry = *it->second;
+                entries.splice(entries.begin(), entries, it->second);
+                usage = usage - entry.bytes + bytes;
+                entry.bytes = bytes;
+                std::swap(entry.value, value);
+                Shrink();
+                return;
+            }
+            if (it != index.end()) Erase(it->second);
+            if (bytes > limit) return;
+            entries.push_front(Entry{key, std::move(value), bytes});
+            index[key] = entries.begin();
+            usage += bytes;
+            value = Value();
+            Shrink();
+        }
+
+        void Erase(const std::string& key) {
+            std::lock_guard<std::mutex> lock(mutex);
+            auto it = index.find(key);
+            if (it != index.end()) Erase(it->second);
+        }
+
+        // 删除所有 pred(key, value) 为 true 的项
+        template <typename Pred>
+        void EraseIf(Pred pred) {
+            std::lock_guard<std::mutex> lock(mutex);
+            for (auto it = entries.begin(); it != entries.end();) {
+                auto next = std::next(it);
+                if (pred(it->key, it->value)) Erase(it);
+                it = next;
+            }
+        }
+
+        void Clear() {
+            std::lock_guard<std::mutex> lock(mutex);
+            entries.clear();
+            index.clear();
+            usage = 0;
+        }
+
+        void SetLimit(size_t bytes) {
+            std::lock_guard<std::mutex> lock(mutex);
+            limit = bytes;
+            Shrink();
+        }
+
+        size_t Limit() {
+            std::lock_guard<std::mutex> lock(mutex);
+            return limit;
+        }
+
+        size_t Usage() {
+            std::lock_guard<std::mutex> lock(mutex);
+            return usage;
+        }
+
+    private:
+        struct Entry {
+            std::string key;
+            Value value;
+            size_t bytes;
+        };
+        typedef typename std::list<Entry>::iterator EntryIter;
+
+        void Erase(EntryIter it) {
+            usage -= it->bytes;
+            index.erase(it->key);
+            entries.erase(it);
+        }
+
+        void Shrink() {
+            while (usage > limit && !entries.empty()) Erase(std::prev(entries.end()));
+        }
+
+        std::mutex mutex;
+        std::list<Entry> entries; // 最近使用的在前
+        std::unordered_map<std::string, EntryIter> index;
+        size_t usage = 0;
+        size_t limit;
+    };
+} // namespace Sayobot
@@ -0,0 +1,39 @@
+#pragma once
+
+#include <cstdint>
+#include <cstring>
+
+#include <Magick++.h>
+
+#include "bitmap.hpp"
+#include "buffer_pool.hpp"
+#include "raster.hpp"
+
+namespace Sayobot {
+    // Magick 图片转为预乘 RGBA8
+    inline Raster RasterFromMagick(Magick::Image& image) {
+        Raster raster(image.columns(), image.rows());
+        if (raster.Empty()) return raster;
+        image.write(0,
+                    0,
+                    raster.Width(),
+                    raster.Height(),
+                    "RGBA",
+                    MagickCore::CharPixel,
+                    raster.Data());
+        Premultiply(raster.Data(), raster.Width() * raster.Height());
+        return raster;
+    }
+
+    // 预乘 RGBA8 转为 Magick 图片，只在解码、编码和缩放时使用
+    inline Magick::Image MagickFromBitmap(const BitmapView& bitmap) {
+        if (!bitmap.width || !bitmap.height) return Magick::Image();
+        ScratchBuffer pixels(bitmap.width * bitmap.height * 4);
+        for (size_t y = 0; y < bitmap.height; ++y)
+            memcpy(pixels.Data() + y * bitmap.width * 4, bitmap.Row(y), bitmap.width * 4);
+        // Magick 需要非预乘的 RGBA
+        Unpremultiply(pixels.Data(), bitmap.width * bitmap.height);
+        return Magick::Image(
+            bitmap.width, bitmap.height, "RGBA", MagickCore::CharPixel, pixels.Data());
+    }
+} // namespace Sayobot
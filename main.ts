@@ -1,31 +1,114 @@
-import os from 'os';
 import path from 'path';
 import superagent from 'superagent';
 import fs from 'fs-extra';
 import { App, getTargetId } from 'koishi-core';
 import { Collection, ObjectID } from 'mongodb';
-import sharp from 'sharp';
 import ffi from 'ffi-napi';
 import 'koishi-plugin-mongo';
 
 interface Lib {
-    MakePersonalCard: (args: string) => string,
-    Sayobot_SetPath: (key: string, dir: string) => any,
+    SayobotClient_Connect: (socketPath: string) => string,
+    SayobotClient_CreateRequest: () => Buffer,
+    SayobotClient_DestroyRequest: (request: Buffer) => void,
+    SayobotClient_GetError: (request: Buffer) => string,
+    SayobotClient_SetOutputFormat: (request: Buffer, format: string, quality: number) => number,
+    SayobotClient_GetOutputSize: (request: Buffer) => number,
+    SayobotClient_CopyOutput: (request: Buffer, buffer: Buffer, capacity: number) => number,
+    SayobotClient_SubmitCard: (request: Buffer, args: Buffer, length: number, priority: number, callback: Buffer, user: Buffer) => number,
+    SayobotClient_SubmitAvatar: (request: Buffer, userId: number, data: Buffer, length: number, callback: Buffer, user: Buffer) => number,
+    SayobotClient_SubmitStats: (request: Buffer, callback: Buffer, user: Buffer) => number,
+    SayobotClient_OpenHistory: (path: string) => string,
+    SayobotClient_HistoryAppend: (user: number, mode: number, time: number, values: Buffer, count: number) => string,
+    SayobotClient_HistoryFind: (user: number, mode: number, before: number, values: Buffer, count: number, time: Buffer) => number,
 }
 
-const sayobot: Lib = ffi.Library(path.resolve(__dirname, 'sayobot'), {
-    MakePersonalCard: ['string', ['string']],
-    Sayobot_SetPath: ['string', ['string', 'string']],
+// 渲染在独立的 sayobot_daemon 进程中进行，这里只载入它的客户端库
+const sayobot: Lib = ffi.Library(path.resolve(__dirname, 'sayobot_client'), {
+    SayobotClient_Connect: ['string', ['string']],
+    SayobotClient_CreateRequest: ['pointer', []],
+    SayobotClient_DestroyRequest: ['void', ['pointer']],
+    SayobotClient_GetError: ['string', ['pointer']],
+    SayobotClient_SetOutputFormat: ['int', ['pointer', 'string', 'int']],
+    SayobotClient_GetOutputSize: ['size_t', ['pointer']],
+    SayobotClient_CopyOutput: ['size_t', ['pointer', 'pointer', 'size_t']],
+    SayobotClient_SubmitCard: ['int', ['pointer', 'pointer', 'size_t', 'int', 'pointer', 'pointer']],
+    SayobotClient_SubmitAvatar: ['int', ['pointer', 'longlong', 'pointer', 'size_t', 'pointer', 'pointer']],
+    SayobotClient_SubmitStats: ['int', ['pointer', 'pointer', 'pointer']],
+    SayobotClient_OpenHistory: ['string', ['string']],
+    SayobotClient_HistoryAppend: ['string', ['longlong', 'int', 'longlong', 'pointer', 'int']],
+    SayobotClient_HistoryFind: ['int', ['longlong', 'int', 'longlong', 'pointer', 'int', 'pointer']],
 });
 
+// 渲染服务的地址；服务的线程数、排队上限等在启动 sayobot_daemon 时指定
+const DAEMON_SOCKET = process.env.SAYOBOT_SOCKET || path.resolve(__dirname, 'sayobot.sock');
+const SAYOBOT_OVERLOADED = 3;
+
+// 机器人自己读取的素材目录（检查框框、背景和头像文件），应与 sayobot_daemon 的 --png 指向同一份素材
 const PNG_PATH = path.resolve(__dirname, 'png');
-const FONT_PATH = path.resolve(__dirname, 'fonts');
-const BACK_PATH = path.resolve(__dirname, 'png', 'stat');
-const EDGE_PATH = path.resolve(__dirname, 'png', 'tk');
-const AVATAR_PATH = path.resolve(__dirname, 'png', 'avatars');
+const BACK_PATH = path.resolve(PNG_PATH, 'stat');
+const EDGE_PATH = path.resolve(PNG_PATH, 'tk');
+const AVATAR_PATH = path.resolve(PNG_PATH, 'avatars');
+
+// 卡片的编码设置（见 core 中的 EncodeProfile），在编码耗时和图片大小之间取舍
+const CARD_FORMAT = 'png-fast';
+
+// 持有回调的引用，避免请求完成前被 GC 回收
+const pendingCallbacks = new Set<Buffer>();
+
+interface RenderResult {
+    error: string,
+    image?: Buffer,
+}
+
+// 把请求交给渲染服务，不阻塞事件循环；结果从请求中取回
+function submit(setup: (request: Buffer) => void, send: (request: Buffer, callback: Buffer) => number): Promise<RenderResult> {
+    return new Promise((resolve) => {
+        const request = sayobot.SayobotClient_CreateRequest();
+        setup(request);
+        const finish = (status: number) => {
+            let result: RenderResult;
+            if (status === SAYOBOT_OVERLOADED) result = { error: '小夜忙不过来了，阁下等一会再试试吧' };
+            else if (status) result = { error: sayobot.SayobotClient_GetError(request) || 'Render failed' };
+            else {
+                const image = Buffer.alloc(sayobot.SayobotClient_GetOutputSize(request));
+                sayobot.SayobotClient_CopyOutput(request, image, image.length);
+                result = { error: '', image };
+            }
+            sayobot.SayobotClient_DestroyRequest(request);
+            resolve(result);
+        };
+        const callback = ffi.Callback('void', ['pointer', 'int', 'pointer'], (_request: Buffer, status: number) => {
+            pendingCallbacks.delete(callback);
+            finish(status);
+        });
+        pendingCallbacks.add(callback);
+        const status = send(request, callback);
+        if (status) {
+            pendingCallbacks.delete(callback);
+            finish(status);
+        }
+    });
+}
 
-sayobot.Sayobot_SetPath('png', PNG_PATH);
-sayobot.Sayobot_SetPath('font', FONT_PATH);
+// 制作卡片；同时请求同一张卡片时渲染服务只渲染一次
+function makePersonalCard(args: Buffer, priority = 0): Promise<RenderResult> {
+    return submit(
+        (request) => sayobot.SayobotClient_SetOutputFormat(request, CARD_FORMAT, 0),
+        (request, callback) => sayobot.SayobotClient_SubmitCard(request, args, args.length, priority, callback, null),
+    );
+}
+
+// 下载头像，由渲染服务校验、缩放后保存为 <uid>.avatar；返回错误信息，成功时为空字符串
+async function updateAvatar(account: number) {
+    const result = await superagent.get(`https://a.ppy.sh/${account}`).responseType('blob');
+    const body: Buffer = result.body;
+    if (!body || !body.length) return 'Empty avatar';
+    const { error } = await submit(
+        () => { },
+        (request, callback) => sayobot.SayobotClient_SubmitAvatar(request, account, body, body.length, callback, null),
+    );
+    return error;
+}
 
 interface GetUserResult {
     mode: number,
@@ -86,7 +169,8 @@ interface UserInfo {
     sign: string,
     nickname: string,
     Opacity: number,
-    history: HistoryColumn[],
+    history: HistoryColumn[], // 旧数据，已导入历史文件的用户读取时不再加载
+    historyMigrated?: boolean,
     // relative path
     ProfileEdge: string,
     DataEdge: string,
@@ -113,6 +197,88 @@ const DefaultUserInfo: UserInfo = {
     Background: '1',
 }
 
+// 资料历史保存在 core 的历史文件中，字段顺序与 core 中 SAYOBOT_HISTORY_FIELDS 保持一致
+const HISTORY_PATH = path.resolve(__dirname, 'history.db');
+const HISTORY_FIELDS = [
+    'count300', 'count100', 'count50', 'playcount', 'ranked_score', 'total_score',
+    'pp_rank', 'pp_country_rank', 'count_rank_ss', 'count_rank_ssh', 'count_rank_s',
+    'count_rank_sh', 'count_rank_a', 'total_seconds_played', 'level', 'pp_raw', 'accuracy',
+] as const;
+
+// time 为毫秒，返回错误信息，成功时为空字符串
+function appendHistory(user: number, mode: number, time: number, snapshot: GetUserResult) {
+    const values = Buffer.alloc(HISTORY_FIELDS.length * 8);
+    HISTORY_FIELDS.forEach((key, i) => values.writeDoubleLE(Number(snapshot[key]) || 0, i * 8));
+    return sayobot.SayobotClient_HistoryAppend(user, mode, Math.floor(time / 1000), values, HISTORY_FIELDS.length);
+}
+
+// 查找 before（毫秒）之前的最后一次快照
+function findHistory(user: number, mode: number, before: number): GetUserResult | undefined {
+    const values = Buffer.alloc(HISTORY_FIELDS.length * 8);
+    const time = Buffer.alloc(8);
+    if (!sayobot.SayobotClient_HistoryFind(user, mode, Math.floor(before / 1000), values, HISTORY_FIELDS.length, time)) return undefined;
+    const result: Partial<GetUserResult> = { mode };
+    HISTORY_FIELDS.forEach((key, i) => { result[key] = values.readDoubleLE(i * 8); });
+    return result as GetUserResult;
+}
+
+// 与 core 中 PersonalCardArgs 的布局保持一致
+const CARD_ARGS_MAGIC = 0x41425953;
+const CARD_ARGS_VERSION = 1;
+const CARD_ARGS_HEADER_SIZE = 208;
+
+function writeInt64(buf: Buffer, value: number, offset: number) {
+    const v = Math.trunc(value) || 0;
+    const hi = Math.floor(v / 0x100000000);
+    buf.writeUInt32LE(v - hi * 0x100000000, offset);
+    buf.writeInt32LE(hi, offset + 4);
+    return offset + 8;
+}
+
+function packCardArgs(
+    userInfo: UserInfo, mode: number, qq: string,
+    current: GetUserResult, stat: GetUserResult, day: number, out: string,
+) {
+    const strings = [
+        userInfo.DataFontColor, userInfo.ProfileFontColor, userInfo.SignFontColor,
+        current.country, current.username, qq, userInfo.sign, userInfo.Background,
+        userInfo.ProfileEdge, userInfo.DataEdge, userInfo.SignEdge, out,
+    ].map((str) => Buffer.from(`${str ?? ''}`, 'utf8'));
+    const currentTotal = current.count300 + current.count100 + current.count50;
+    const statTotal = stat.count300 + stat.count100 + stat.count50;
+    const size = strings.reduce((n, str) => n + 4 + str.length, CARD_ARGS_HEADER_SIZE);
+    const buf = Buffer.alloc(size);
+    let offset = 0;
+    offset = buf.writeUInt32LE(CARD_ARGS_MAGIC, offset);
+    offset = buf.writeUInt16LE(CARD_ARGS_VERSION, offset);
+    offset = buf.writeUInt16LE(CARD_ARGS_HEADER_SIZE, offset);
+    offset = buf.writeUInt32LE(size, offset);
+    offset = buf.writeUInt32LE(strings.length, offset);
+    for (const v of [
+        current.total_score, current.ranked_score, currentTotal,
+        stat.total_score, stat.ranked_score, stat.playcount,
+    ]) offset = writeInt64(buf, v, offset);
+    for (const v of [
+        current.pp_raw, current.level, current.accuracy,
+        stat.accuracy, stat.pp_raw, stat.level,
+    ]) offset = buf.writeDoubleLE(v || 0, offset);
+    for (const v of [
+        mode, userInfo.account, userInfo.Opacity,
+        current.count300, current.count100, current.count50, current.playcount,
+        current.pp_country_rank, current.pp_rank,
+        current.count_rank_ssh, current.count_rank_ss, current.count_rank_sh, current.count_rank_s, current.count_rank_a,
+        current.total_seconds_played,
+        statTotal, stat.pp_rank, stat.pp_country_rank,
+        stat.count_rank_ssh, stat.count_rank_ss, stat.count_rank_sh, stat.count_rank_s, stat.count_rank_a,
+        day,
+    ]) offset = buf.writeInt32LE(Math.trunc(v) || 0, offset);
+    for (const str of strings) {
+        offset = buf.writeUInt32LE(str.length, offset);
+        offset += str.copy(buf, offset);
+    }
+    return buf;
+}
+
 namespace Api {
     export const modes = { std: 0, taiko: 1, ctb: 2, mania: 3 }
 
@@ -161,6 +327,50 @@ export function apply(app: App) {
 
     app.on('connect', () => {
         const coll: Collection<UserInfo> = app.database.db.collection('osu');
+        const historyError = sayobot.SayobotClient_OpenHistory(HISTORY_PATH);
+        if (historyError) throw new Error(historyError);
+        // 渲染服务尚未启动时不影响其他指令，提交请求时会再次连接
+        const daemonError = sayobot.SayobotClient_Connect(DAEMON_SOCKET);
+        if (daemonError) console.warn(daemonError);
+
+        /*
+         * 把数据库中旧的 history 数组导入历史文件，每个用户只做一次；之后读取用户时不再加载 history
+         * 旧版本把查询到的玩家（可能是别人）的资料记在查询者名下，这里只导入用户名与该账号
+         * 当前用户名或绑定时的名字相同的记录；改名前的记录无法和别人的区分，不导入
+         * 先以条件更新占下 historyMigrated，同时执行的指令（包括其他进程）只有一个会导入；
+         * 本进程中同时读取同一用户的指令等待同一次导入完成
+         */
+        const migrations = new Map<number, Promise<void>>();
+        function migrateHistory(userInfo: UserInfo, username: string) {
+            let pending = migrations.get(userInfo._id);
+            if (!pending) {
+                pending = importHistory(userInfo, username).finally(() => migrations.delete(userInfo._id));
+                migrations.set(userInfo._id, pending);
+            }
+            return pending;
+        }
+
+        async function importHistory(userInfo: UserInfo, username: string) {
+            const id = userInfo._id;
+            const claimed = await coll.updateOne(
+                { _id: id, historyMigrated: { $ne: true } },
+                { $set: { historyMigrated: true } },
+            );
+            if (!claimed.modifiedCount) return;
+            const names = [username, userInfo.nickname].filter(Boolean).map((name) => name.toLowerCase());
+            try {
+                const doc = await coll.findOne({ _id: id }, { projection: { history: 1 } });
+                for (const item of doc?.history ?? []) {
+                    if (!names.includes((item.username ?? '').toLowerCase())) continue;
+                    const error = appendHistory(id, item.mode ?? 0, item._id.generationTime * 1000, item);
+                    if (error) throw new Error(error);
+                }
+            } catch (err) {
+                // 导入失败时放开标记，下次读取时重试
+                await update(id, { historyMigrated: false });
+                throw err;
+            }
+        }
 
         function update(id: number, $set: Partial<UserInfo>) {
             return coll.updateOne({ _id: id }, { $set });
@@ -247,9 +457,9 @@ export function apply(app: App) {
             .action(async ({ session }) => {
                 const userInfo = await coll.findOne({ _id: session.userId });
                 if (!userInfo) return '阁下还没绑定哦，用set把阁下的名字告诉我吧';
-                const w = fs.createWriteStream(path.join(AVATAR_PATH, `${userInfo.account}.png`));
-                superagent.get(`https://a.ppy.sh/${userInfo.account}`).pipe(w);
-                return '更新头像完成，如果阁下的头像还是没有更新，等一会再试试吧';
+                const error = await updateAvatar(userInfo.account).catch((e) => `${e}`);
+                if (error) return '头像更新失败惹，等一会再试试吧';
+                return '更新头像完成';
             });
 
         app.command('osu.stat [userId] [day]', '', { minInterval: 3000 })
@@ -264,82 +474,46 @@ export function apply(app: App) {
             .shortcut('!m', { prefix: false, fuzzy: true, options: { mode: 'mania' } })
             .action(async ({ session, options }, userId, _day) => {
                 let day = 0;
-                let image = path.resolve(os.tmpdir(), new ObjectID().toHexString() + '.png');
                 if (_day) {
                     day = parseInt(_day);
                     if (Number.isNaN(day)) return '天数必须是数字哦';
                 }
                 if (Api.modes[options.mode] === undefined) return '未知的模式';
                 let userInfo: UserInfo;
+                const projection = { projection: { history: 0 } };
                 if (userId) {
-                    userInfo = await coll.findOne({ _id: getTargetId(userId) });
+                    userInfo = await coll.findOne({ _id: getTargetId(userId) }, projection);
                     if (!userInfo) return '小夜还不认识这个人哦，阁下把他介绍给我吧';
                 } else {
-                    userInfo = await coll.findOne({ _id: session.userId });
+                    userInfo = await coll.findOne({ _id: session.userId }, projection);
                     if (!userInfo) return '阁下还没绑定哦，用！set把阁下的名字告诉我吧';
                 }
                 userInfo = { ...DefaultUserInfo, ...userInfo };
-                if (!fs.existsSync(path.join(AVATAR_PATH, `${userInfo.account}.png`))) {
-                    const result = await superagent.get(`https://a.ppy.sh/${userInfo.account}`);
-                    if (result.text) {
-                        fs.writeFileSync(path.join(AVATAR_PATH, `${userInfo.account}.png`), result.text);
-                    }
+                const current = await Api.getUser(userInfo.account, Api.modes[options.mode]);
+                if (!userInfo.historyMigrated) await migrateHistory(userInfo, current.username);
+                if (!fs.existsSync(path.join(AVATAR_PATH, `${userInfo.account}.avatar`))) {
+                    // 下载失败时卡片使用默认头像
+                    await updateAvatar(userInfo.account).catch(() => '');
                 }
                 if (day) {
-                    let found: HistoryColumn;
                     const search = new Date().getTime() - day * 3600 * 24 * 1000;
-                    for (let i = userInfo.history.length - 1; i >= 0; i--) {
-                        const item = userInfo.history[i];
-                        if (item._id.generationTime * 1000 < search) {
-                            found = item;
-                            break;
-                        }
-                    }
+                    const found = findHistory(userInfo._id, Api.modes[options.mode], search);
                     if (!found) return `小夜没有查到${userId ? '这个人' : '阁下'}${day}天前的信息`;
                     if (!found.playcount) return `${userId ? '这个人' : '阁下'}还没有玩过这个模式哦，赶紧去试试吧`;
-                    const current = await Api.getUser(userInfo.account, Api.modes[options.mode]);
-                    const currentTotal = current.count300 + current.count100 + current.count50;
-                    const foundTotal = found.count300 + found.count100 + found.count50;
-                    const result = sayobot.MakePersonalCard(
-                        [
-                            userInfo.DataFontColor, userInfo.ProfileFontColor, userInfo.SignFontColor,
-                            Api.modes[options.mode], userInfo.account, current.country, current.username, session.userId.toString(),
-                            userInfo.sign, userInfo.Background, userInfo.ProfileEdge, userInfo.DataEdge, userInfo.SignEdge,
-                            userInfo.Opacity, current.count300, current.count100, current.count50, current.playcount,
-                            current.total_score, current.ranked_score, currentTotal, current.pp_raw, current.pp_country_rank,
-                            current.pp_rank, current.count_rank_ssh, current.count_rank_ss, current.count_rank_sh, current.count_rank_s,
-                            current.count_rank_a, current.total_seconds_played, current.level, current.accuracy, found.total_score,
-                            found.ranked_score, foundTotal, found.accuracy, found.pp_raw, found.level,
-                            found.pp_rank, found.pp_country_rank, found.playcount, found.count_rank_ssh, found.count_rank_ss,
-                            found.count_rank_sh, found.count_rank_s, found.count_rank_a, day, image
-                        ].join('\n')
-                    );
-                    if (result) return result;
+                    const result = await makePersonalCard(packCardArgs(
+                        userInfo, Api.modes[options.mode], session.userId.toString(), current, found, day, '',
+                    ));
+                    if (result.error) return result.error;
+                    return `[CQ:image,file=base64://${result.image.toString('base64')}]`;
                 } else {
-                    const current = await Api.getUser(userInfo.account, Api.modes[options.mode]);
-                    const currentTotal = current.count300 + current.count100 + current.count50;
-                    await coll.updateOne({ _id: session.userId }, { $push: { history: { ...current, _id: new ObjectID() } } });
-                    const result = sayobot.MakePersonalCard(
-                        [
-                            userInfo.DataFontColor, userInfo.ProfileFontColor, userInfo.SignFontColor,
-                            Api.modes[options.mode], userInfo.account, current.country, current.username, session.userId.toString(),
-                            userInfo.sign, userInfo.Background, userInfo.ProfileEdge, userInfo.DataEdge, userInfo.SignEdge,
-                            userInfo.Opacity, current.count300, current.count100, current.count50, current.playcount,
-                            current.total_score, current.ranked_score, currentTotal, current.pp_raw, current.pp_country_rank,
-                            current.pp_rank, current.count_rank_ssh, current.count_rank_ss, current.count_rank_sh, current.count_rank_s,
-                            current.count_rank_a, current.total_seconds_played, current.level, current.accuracy, current.total_score,
-                            current.ranked_score, currentTotal, current.accuracy, current.pp_raw, current.level,
-                            current.pp_rank, current.pp_country_rank, current.playcount, current.count_rank_ssh, current.count_rank_ss,
-                            current.count_rank_sh, current.count_rank_s, current.count_rank_a, day, image,
-                        ].join('\n')
-                    );
-                    if (result) return result;
-                }
-                if (fs.existsSync(image)) {
-                    await sharp(image).png({ compressionLevel: 8 }).toFile(image + '.png');
-                    image = image + '.png';
+                    const error = appendHistory(userInfo._id, Api.modes[options.mode], new Date().getTime(), current);
+                    if (error) return error;
+                    const result = await makePersonalCard(packCardArgs(
+                        userInfo, Api.modes[options.mode], session.userId.toString(), current, current, day, '',
+                    ));
+                    if (result.error) return result.error;
+                    return `[CQ:image,file=base64://${result.image.toString('base64')}]`;
                 }
-                return `[CQ:image,file=file://${image}]`;
             });
 
         app.command('osu.help [category]', 'Get help')
@@ -349,6 +523,12 @@ export function apply(app: App) {
                 return `[CQ:image,file=file://${path.resolve(__dirname, 'png', 'help', `help-${category}.png`)}]`;
             });
 
+        app.command('osu.renderStats', '渲染统计', { hidden: true, authority: 4 })
+            .action(async () => {
+                const { error, image } = await submit(() => { }, (request, callback) => sayobot.SayobotClient_SubmitStats(request, callback, null));
+                return error || image!.toString();
+            });
+
         app.command('osu.download', '?', { hidden: true })
             .shortcut('好无聊啊', { prefix: false })
             .action(() => "Welcome to OSU! 点击下载osu客户端 https://txy1.sayobot.cn/osu.zip 点击在线游玩 http://game.osu.sh");
@@ -0,0 +1,230 @@
+#pragma once
+
+#include <atomic>
+#include <cstdint>
+#include <cstdio>
+#include <string>
+#include <vector>
+
+namespace Sayobot {
+    // 渲染的各个阶段
+    enum Stage { StageDecode, StageResize, StageComposite, StageText, StageEncode, StageCount };
+
+    inline const char* StageName(int stage) {
+        static const char* const names[StageCount] = {
+            "decode", "resize", "composite", "text", "encode"};
+        return stage >= 0 && stage < StageCount ? names[stage] : "unknown";
+    }
+
+    /*
+     * 无锁的延迟直方图
+     * 第 i 个桶统计 [2^(i-1), 2^i) 微秒的样本，第 0 个桶为不足 1 微秒
+     * 只用原子加，记录的开销与一次计数器自增相当
+     */
+    class Histogram {
+    public:
+        static const int kBuckets = 32;
+
+        void Record(uint64_t ns) {
+            const uint64_t us = ns / 1000;
+            int bucket = 0;
+            if (us) bucket = 64 - __builtin_clzll(us);
+            if (bucket >= kBuckets) bucket = kBuckets - 1;
+            buckets[bucket].fetch_add(1, std::memory_order_relaxed);
+            count.fetch_add(1, std::memory_order_relaxed);
+            sum_ns.fetch_add(ns, std::memory_order_relaxed);
+            uint64_t seen = max_ns.load(std::memory_order_relaxed);
+            while (ns > seen
+                   && !max_ns.compare_exchange_weak(seen, ns, std::memory_order_relaxed))
+                ;
+        }
+
+        void Reset() {
+            for (auto& b : buckets) b.store(0, std::memory_order_relaxed);
+            count.store(0, std::memory_order_relaxed);
+            sum_ns.store(0, std::memory_order_relaxed);
+            max_ns.store(0, std::memory_order_relaxed);
+        }
+
+        // 分位数的估计值（微秒），取所在桶的上界
+        uint64_t PercentileUs(double p) const {
+            const uint64_t total = count.load(std::memory_order_relaxed);
+            if (!total) return 0;
+            const uint64_t rank = (uint64_t)(p * (total - 1)) + 1;
+            uint64_t seen = 0;
+            for (int i = 0; i < kBuckets; ++i) {
+                seen += buckets[i].load(std::memory_order_relaxed);
+                if (seen >= rank) return i ? uint64_t(1) << i : 1;
+            }
+            return max_ns.load(std::memory_order_relaxed) / 1000;
+        }
+
+        // 形如 {"count":1,"sum_us":2,"p50_us":4,"p99_us":8,"max_us":5}
+        void AppendJson(std::string& out) const {
+            char buf[160];
+            snprintf(buf,
+                     sizeof(buf),
+                     "{\"count\":%llu,\"sum_us\":%llu,\"p50_us\":%llu,\"p99_us\":%llu,"
+                     "\"max_us\":%llu}",
+                     (unsigned long long)count.load(std::memory_order_relaxed),
+                     (unsigned long long)(sum_ns.load(std::memory_order_relaxed) / 1000),
+                     (unsigned long long)PercentileUs(0.5),
+                     (unsigned long long)PercentileUs(0.99),
+                     (unsigned long long)(max_ns.load(std::memory_order_relaxed) / 1000));
+            out += buf;
+        }
+
+    private:
+        std::atomic<uint64_t> buckets[kBuckets] = {};
+        std::atomic<uint64_t> count{0};
+        std::atomic<uint64_t> sum_ns{0};
+        std::atomic<uint64_t> max_ns{0};
+    };
+
+    // 命中/未命中计数
+    struct HitCounter {
+        std::atomic<uint64_t> hits{0};
+        std::atomic<uint64_t> misses{0};
+
+        void Hit() {
+            hits.fetch_add(1, std::memory_order_relaxed);
+        }
+
+        void Miss() {
+            misses.fetch_add(1, std::memory_order_relaxed);
+        }
+
+        void Reset() {
+            hits.store(0, std::memory_order_relaxed);
+            misses.store(0, std::memory_order_relaxed);
+        }
+    };
+
+    // 素材按所在目录分类统计解码时间
+    enum AssetClass {
+        AssetStat,
+        AssetFx,
+        AssetEdge,
+        AssetRank,
+        AssetCountry,
+        AssetWorld,
+        AssetAvatar,
+        AssetOther,
+        AssetClassCount
+    };
+
+    inline const char* AssetClassName(int c) {
+        static const char* const names[AssetClassCount] = {
+            "stat", "fx", "tk", "rank", "country", "world", "avatars", "other"};
+        return c >= 0 && c < AssetClassCount ? names[c] : "other";
+    }
+
+    inline AssetClass ClassifyAsset(const std::string& path) {
+        static const struct {
+            const char* dir;
+            AssetClass c;
+        } dirs[] = {{"/avatars/", AssetAvatar},
+                    {"/stat/", AssetStat},
+                    {"/tk/", AssetEdge},
+                    {"/rank/", AssetRank},
+                    {"/country/", AssetCountry},
+                    {"/world/", AssetWorld},
+                    {"/fx", AssetFx},
+                    {"no-avatar", AssetAvatar}};
+        for (const auto& d : dirs)
+            if (path.find(d.dir) != std::string::npos) return d.c;
+        return AssetOther;
+    }
+
+    /*
+     * 进程内的渲染指标
+     * 阶段耗时由 ScopedStage 记录，其余计数在对应的代码处累加
+     */
+    struct Metrics {
+        static Metrics& Instance() {
+            static Metrics instance;
+            return instance;
+        }
+
+        Histogram render;                  // 一次完整渲染（含解析参数和编码）
+        Histogram stages[StageCount];      // 按 Stage 编号
+        Histogram decode[AssetClassCount]; // 按素材分类的解码时间
+        std::atomic<uint64_t> renders{0};
+        std::atomic<uint64_t> errors{0};
+        HitCounter asset_cache;
+        HitCounter base_layer_cache;
+        HitCounter avatar_cache;
+        HitCounter card_cache; // 卡片缓存，含未编码和已编码两级
+        HitCounter incremental; // 在上一张卡片上只重画变化区域
+
+        void Reset() {
+            render.Reset();
+            for (auto& h : stages) h.Reset();
+            for (auto& h : decode) h.Reset();
+            renders.store(0, std::memory_order_relaxed);
+            errors.store(0, std::memory_order_relaxed);
+            asset_cache.Reset();
+            base_layer_cache.Reset();
+            avatar_cache.Reset();
+            card_cache.Reset();
+            incremental.Reset();
+        }
+    };
+
+    /*
+     * 单次渲染的跟踪记录
+     * 渲染线程上设置了 ThreadTrace() 时，每个阶段都会追加一条事件
+     */
+    struct TraceLog {
+        struct Event {
+            int stage;
+            std::string label;
+            uint64_t start_ns; // 相对于 begin_ns
+            uint64_t duration_ns;
+        };
+        uint64_t begin_ns = 0;
+        std::vector<Event> events;
+
+        // 形如 [{"stage":"decode","label":"...","start_us":0,"us":12}]
+        std::string ToJson() const {
+            std::string out = "[";
+            char buf[96];
+            for (size_t i = 0; i < events.size(); ++i) {
+                const Event& e = events[i];
+                if (i) out += ',';
+                out += "{\"stage\":\"";
+                out += StageName(e.stage);
+                out += "\",\"label\":\"";
+                AppendEscaped(e.label, out);
+                snprintf(buf,
+                         sizeof(buf),
+                         "\",\"start_us\":%llu,\"us\":%llu}",
+                         (unsigned long long)(e.start_ns / 1000),
+                         (unsigned long long)(e.duration_ns / 1000));
+                out += buf;
+            }
+            out += ']';
+            return out;
+        }
+
+        static void AppendEscaped(const std::string& s, std::string& out) {
+            for (const char c : s) {
+                if (c == '"' || c == '\\') {
+                    out += '\\';
+                    out += c;
+                } else if ((unsigned char)c < 0x20) {
+                    char buf[8];
+                    snprintf(buf, sizeof(buf), "\\u%04x", c);
+                    out += buf;
+                } else {
+                    out += c;
+                }
+            }
+        }
+    };
+
+    inline TraceLog*& ThreadTrace() {
+        thread_local TraceLog* trace = nullptr;
+        return trace;
+    }
+} // namespace Sayobot
@@ -0,0 +1,155 @@
+/*
+ * 素材打包工具
+ * 把素材目录中布局会用到的图片按布局要求的尺寸缩放，
+ * 转换为预乘的 RGBA8 写入一个素材包，由 Sayobot_LoadAssetPack 映射使用
+ *
+ * 用法: ./sayobot_pack <素材目录> <输出文件> [布局文件]
+ * 头像目录 (avatars) 随用户变化，不打包
+ */
+#include <dirent.h>
+
+#include <cstdio>
+#include <fstream>
+#include <set>
+#include <sstream>
+#include <string>
+#include <utility>
+#include <vector>
+
+#include "core.cpp"
+
+namespace {
+    // 列出 root 下所有 .png 文件（相对路径，以 / 开头）
+    void ListPng(const std::string& root, const std::string& relative,
+                 std::vector<std::string>& out) {
+        DIR* dir = opendir((root + relative).c_str());
+        if (!dir) return;
+        while (dirent* item = readdir(dir)) {
+            const std::string name = item->d_name;
+            if (name == "." || name == "..") continue;
+            const std::string path = relative + "/" + name;
+            struct stat st;
+            if (stat((root + path).c_str(), &st) != 0) continue;
+            if (S_ISDIR(st.st_mode)) {
+                if (path != "/avatars") ListPng(root, path, out);
+            } else if (name.size() > 4 && name.compare(name.size() - 4, 4, ".png") == 0) {
+                out.push_back(path);
+            }
+        }
+        closedir(dir);
+    }
+
+    /*
+     * 判断相对路径 path 能否由模板生成
+     * {png} 匹配空串，其余字段匹配不含 / 的任意字符串
+     */
+    bool Match(const std::vector<Sayobot::LayoutTemplate::Segment>& segments, size_t i,
+               const std::string& path, size_t pos) {
+        if (i == segments.size()) return pos == path.size();
+        const Sayobot::LayoutTemplate::Segment& s = segments[i];
+        if (s.field == Sayobot::Field_png) return Match(segments, i + 1, path, pos);
+        if (s.field < 0) {
+            return !path.compare(pos, s.literal.size(), s.literal)
+                   && Match(segments, i + 1, path, pos + s.literal.size());
+        }
+        for (size_t end = pos; end <= path.size(); ++end) {
+            if (Match(segments, i + 1, path, end)) return true;
+            if (end < path.size() && path[end] == '/') break;
+        }
+        return false;
+    }
+
+    // 布局中可能用到 path 的尺寸
+    std::set<std::pair<size_t, size_t>> SizesFor(const Sayobot::Layout& layout,
+                                                 const std::string& path) {
+        std::set<std::pair<size_t, size_t>> sizes;
+        for (const Sayobot::LayoutOp& op : layout.ops) {
+            if (op.kind == Sayobot::LayoutOp::Avatar) {
+                if (op.has_fallback && Match(op.fallback.segments, 0, path, 0))
+                    sizes.insert(std::make_pair(op.width, op.height));
+                continue;
+            }
+            if (op.kind != Sayobot::LayoutOp::Image) continue;
+            if (Match(op.path.segments, 0, path, 0)
+                || (op.has_fallback && Match(op.fallback.segments, 0, path, 0)))
+                sizes.insert(std::make_pair(op.width, op.height));
+        }
+        return sizes;
+    }
+} // namespace
+
+int main(int argc, char** argv) {
+    if (argc < 3) {
+        fprintf(stderr, "usage: %s <png dir> <output> [layout]\n", argv[0]);
+        return 2;
+    }
+    Magick::InitializeMagick(*argv);
+    std::string root = argv[1];
+    while (root.size() > 1 && root.back() == '/') root.pop_back();
+
+    std::shared_ptr<const Sayobot::Layout> layout;
+    try {
+        if (argc > 3) {
+            std::ifstream file(argv[3], std::ios::binary);
+            if (!file) throw std::runtime_error(std::string("Cannot open layout: ") + argv[3]);
+            std::stringstream source;
+            source << file.rdbuf();
+            layout = Sayobot::Layout::Parse(source.str());
+        } else {
+            layout = Sayobot::DefaultLayout();
+        }
+    } catch (const std::exception& ex) {
+        fprintf(stderr, "%s\n", ex.what());
+        return 1;
+    }
+
+    std::vector<std::string> files;
+    ListPng(root, "", files);
+    Sayobot::AssetPackWriter writer;
+    size_t bytes = 0;
+    for (const std::string& path : files) {
+        const auto sizes = SizesFor(*layout, path);
+        if (sizes.empty()) continue;
+        Sayobot::FileStamp stamp;
+        if (!Sayobot::FileStamp::Of(root + path, stamp)) continue;
+        Sayobot::Raster source;
+        try {
+            Magick::Image image;
+            image.read(root + path);
+            source = Sayobot::RasterFromMagick(image);
+        } catch (const Magick::Exception& ex) {
+            fprintf(stderr, "skip %s: %s\n", path.c_str(), ex.what());
+            continue;
+        }
+        for (const auto& size : sizes) {
+            // 与渲染时相同：按比例缩放到 (宽, 高) 以内
+            Sayobot::Raster resized;
+            if (size.first && size.second)
+                resized = Sayobot::Resampler::Instance().ResizeToFit(
+                    source.View(), size.first, size.second);
+            const Sayobot::Raster& image = resized.Empty() ? source : resized;
+            const size_t width = image.Width(), height = image.Height();
+            std::vector<uint8_t> pixels(image.Data(), image.Data() + image.Bytes());
+            bytes += pixels.size();
+            writer.Add(path,
+                       size.first,
+                       size.second,
+                       width,
+                       height,
+                       stamp.mtime,
+                       stamp.fsize,
+                       std::move(pixels));
+        }
+    }
+    try {
+        writer.Write(argv[2]);
+    } catch (const std::exception& ex) {
+        fprintf(stderr, "%s\n", ex.what());
+        return 1;
+    }
+    printf("packed %zu images (%.1f MB) from %zu files\n",
+           writer.Count(),
+           bytes / 1048576.0,
+           files.size());
+    return 0;
+}
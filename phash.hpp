@@ -0,0 +1,366 @@
+#pragma once
+
+#include <stdio.h>
+
+#include <algorithm>
+#include <array>
+#include <cmath>
+#include <cstdint>
+#include <cstring>
+#include <memory>
+#include <mutex>
+#include <shared_mutex>
+#include <stdexcept>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+#ifdef _MSC_VER
+#include <intrin.h>
+#endif
+#if defined(__SSE2__) || defined(_M_X64)
+#include <emmintrin.h>
+#define SAYOBOT_PHASH_SSE2
+#endif
+
+#include "bitmap.hpp"
+
+namespace Sayobot {
+    inline int Popcount64(uint64_t v) {
+#ifdef _MSC_VER
+        return (int)__popcnt64(v);
+#else
+        return __builtin_popcountll(v);
+#endif
+    }
+
+    /*
+     * 定长的感知哈希，Words 个 64 位字
+     * PHash64 对应 8x8 的低频 DCT 系数，PHash256 对应 16x16
+     */
+    template <size_t Words>
+    struct BasicPHash {
+        static constexpr size_t kWords = Words;
+        static constexpr size_t kBits = Words * 64;
+        std::array<uint64_t, Words> words{};
+
+        bool operator==(const BasicPHash& other) const {
+            return words == other.words;
+        }
+
+        bool operator!=(const BasicPHash& other) const {
+            return words != other.words;
+        }
+
+        // 第 i 个 16 位分段，多索引哈希按分段建表
+        uint16_t Chunk(size_t i) const {
+            return (uint16_t)(words[i / 4] >> (i % 4 * 16));
+        }
+
+        std::string ToHex() const {
+            std::string hex;
+            char buf[17];
+            for (uint64_t w : words) {
+                snprintf(buf, sizeof(buf), "%016llx", (unsigned long long)w);
+                hex += buf;
+            }
+            return hex;
+        }
+
+        // 解析 ToHex 的结果，长度或字符不对时返回 false
+        static bool FromHex(const std::string& hex, BasicPHash& out) {
+            if (hex.size() != Words * 16) return false;
+            for (size_t i = 0; i < Words; ++i) {
+                uint64_t w = 0;
+                for (size_t j = 0; j < 16; ++j) {
+                    const char c = hex[i * 16 + j];
+                    int d;
+                    if (c >= '0' && c <= '9')
+                        d = c - '0';
+                    else if (c >= 'a' && c <= 'f')
+                        d = c - 'a' + 10;
+                    else if (c >= 'A' && c <= 'F')
+                        d = c - 'A' + 10;
+                    else
+                        return false;
+                    w = w << 4 | (uint64_t)d;
+                }
+                out.words[i] = w;
+            }
+            return true;
+        }
+    };
+
+    typedef BasicPHash<1> PHash64;
+    typedef BasicPHash<4> PHash256;
+
+    // 两个哈希不同的位数
+    template <size_t Words>
+    inline int HammingDistance(const BasicPHash<Words>& a, const BasicPHash<Words>& b) {
+        int d = 0;
+        for (size_t i = 0; i < Words; ++i) d += Popcount64(a.words[i] ^ b.words[i]);
+        return d;
+    }
+
+    /*
+     * 把预乘 RGBA8 缩小为 32x32 的灰度块，写入 gray
+     * 整数运算：亮度取 77R + 150G + 29B，每格为覆盖的源像素的平均值；
+     * 源图小于 32 时相邻的格重复取同一行（列）
+     * 每个源像素只访问一次，不经过 Magick 的浮点缩放
+     */
+    inline void GrayBlock32(const BitmapView& bitmap, float* gray) {
+        constexpr size_t N = 32;
+        if (!bitmap.width || !bitmap.height) throw std::invalid_argument("Empty image");
+        size_t x0[N], x1[N], y0[N], y1[N];
+        for (size_t i = 0; i < N; ++i) {
+            x0[i] = i * bitmap.width / N;
+            x1[i] = std::max(x0[i] + 1, (i + 1) * bitmap.width / N);
+            y0[i] = i * bitmap.height / N;
+            y1[i] = std::max(y0[i] + 1, (i + 1) * bitmap.height / N);
+        }
+        // 先把一行转为亮度（编译器可以向量化），再按格求和
+        std::vector<uint32_t> luma(bitmap.width);
+        for (size_t j = 0; j < N; ++j) {
+            uint64_t sums[N] = {};
+            for (size_t y = y0[j]; y < y1[j]; ++y) {
+                const uint8_t* row = bitmap.Row(y);
+                for (size_t x = 0; x < bitmap.width; ++x)
+                    luma[x] = 77u * row[x * 4] + 150u * row[x * 4 + 1] + 29u * row[x * 4 + 2];
+                for (size_t i = 0; i < N; ++i) {
+                    uint64_t sum = 0;
+                    for (size_t x = x0[i]; x < x1[i]; ++x) sum += luma[x];
+                    sums[i] += sum;
+                }
+            }
+            const size_t rows = y1[j] - y0[j];
+            for (size_t i = 0; i < N; ++i)
+                gray[j * N + i] = (float)sums[i] / (float)(rows * (x1[i] - x0[i]) * 256);
+        }
+    }
+
+    // dst[i] += a * src[i]，n 为 4 的倍数；逐项先乘后加，与标量计算的结果相同
+    inline void MulAdd(float* dst, const float* src, float a, size_t n) {
+#ifdef SAYOBOT_PHASH_SSE2
+        const __m128 va = _mm_set1_ps(a);
+        for (size_t i = 0; i < n; i += 4)
+            _mm_storeu_ps(dst + i,
+                          _mm_add_ps(_mm_loadu_ps(dst + i), _mm_mul_ps(va, _mm_loadu_ps(src + i))));
+#else
+        for (size_t i = 0; i < n; ++i) dst[i] += a * src[i];
+#endif
+    }
+
+    /*
+     * 由 32x32 的灰度图计算 DCT 感知哈希
+     * 取左上角 K×K 个低频系数 (K = 8 或 16)，大于中位数的位记为 1，
+     * 中位数不计入直流分量
+     * 两次变换都按 K 个系数一组向量化：每读入一个样本，把它乘上一行余弦加到 K 个系数上
+     */
+    template <size_t Words>
+    BasicPHash<Words> PHashFromGray32(const float* gray) {
+        constexpr size_t N = 32;
+        constexpr size_t K = Words == 1 ? 8 : 16;
+        static_assert(K * K == Words * 64, "PHash must cover a square block");
+        // cosine[x * K + u] = cos((2x + 1) uπ / 2N)
+        static const std::vector<float> cosine = [] {
+            std::vector<float> table(N * K);
+            for (size_t x = 0; x < N; ++x)
+                for (size_t u = 0; u < K; ++u)
+                    table[x * K + u] =
+                        (float)std::cos((2.0 * x + 1.0) * u * 3.14159265358979323846 / (2.0 * N));
+            return table;
+        }();
+
+        // 先对行做变换，只保留前 K 个系数
+        float rows[N * K] = {};
+        for (size_t y = 0; y < N; ++y)
+            for (size_t x = 0; x < N; ++x)
+                MulAdd(rows + y * K, &cosine[x * K], gray[y * N + x], K);
+        float coef[K * K] = {};
+        for (size_t v = 0; v < K; ++v)
+            for (size_t y = 0; y < N; ++y)
+                MulAdd(coef + v * K, rows + y * K, cosine[y * K + v], K);
+
+        float sorted[K * K - 1];
+        std::copy(coef + 1, coef + K * K, sorted);
+        std::nth_element(sorted, sorted + (K * K - 1) / 2, sorted + K * K - 1);
+        const float median = sorted[(K * K - 1) / 2];
+
+        BasicPHash<Words> hash;
+        for (size_t i = 0; i < K * K; ++i)
+            if (coef[i] > median) hash.words[i / 64] |= uint64_t(1) << (i % 64);
+        return hash;
+    }
+
+    /*
+     * 近似重复图片的索引（多索引哈希）
+     * 把哈希切成 16 位的分段，每个分段一张表；
+     * 距离不超过 r 的哈希至少有一个分段的距离不超过 r / 分段数，
+     * 查询时只需在每张表中枚举这个范围内的分段值，再逐个核对完整距离
+     * 可以在多个线程上同时查询，插入时独占
+     */
+    template <size_t Words>
+    class PHashIndex {
+    public:
+        typedef BasicPHash<Words> Hash;
+        static constexpr size_t kChunks = Words * 4;
+
+        struct Match {
+            uint64_t id;
+            int distance;
+        };
+
+        void Insert(const Hash& hash, uint64_t id) {
+            std::unique_lock<std::shared_mutex> lock(mutex);
+            InsertLocked(hash, id);
+        }
+
+        size_t Size() const {
+            std::shared_lock<std::shared_mutex> lock(mutex);
+            return entries.size();
+        }
+
+        void Clear() {
+            std::unique_lock<std::shared_mutex> lock(mutex);
+            entries.clear();
+            for (auto& table : tables) table.clear();
+        }
+
+        // 查找距离不超过 radius 的哈希，按距离从小到大排列
+        std::vector<Match> Query(const Hash& hash, int radius) const {
+            std::vector<Match> matches;
+            if (radius < 0) return matches;
+            std::shared_lock<std::shared_mutex> lock(mutex);
+            const int chunk_radius = radius / (int)kChunks;
+            if (chunk_radius > 2) {
+                // 分段半径太大时枚举的代价超过线性扫描
+                for (const Entry& e : entries) {
+                    const int d = HammingDistance(e.hash, hash);
+                    if (d <= radius) matches.push_back(Match{e.id, d});
+                }
+            } else {
+                std::vector<uint32_t> candidates;
+                for (size_t c = 0; c < kChunks; ++c) {
+                    const uint16_t key = hash.Chunk(c);
+                    ForEachNeighbor(key, chunk_radius, [&](uint16_t k) {
+                        auto it = tables[c].find(k);
+                        if (it != tables[c].end())
+                            candidates.insert(
+                                candidates.end(), it->second.begin(), it->second.end());
+                    });
+                }
+                std::sort(candidates.begin(), candidates.end());
+                candidates.erase(std::unique(candidates.begin(), candidates.end()),
+                                 candidates.end());
+                for (uint32_t i : candidates) {
+                    const int d = HammingDistance(entries[i].hash, hash);
+                    if (d <= radius) matches.push_back(Match{entries[i].id, d});
+                }
+            }
+            std::sort(matches.begin(), matches.end(), [](const Match& a, const Match& b) {
+                return a.distance != b.distance ? a.distance < b.distance : a.id < b.id;
+            });
+            return matches;
+        }
+
+        /*
+         * 保存到文件，先写入临时文件再改名，写入过程中崩溃不会损坏旧文件
+         * 失败时抛出 std::runtime_error
+         */
+        void Save(const std::string& path) const {
+            std::shared_lock<std::shared_mutex> lock(mutex);
+            const std::string temp = path + ".tmp";
+            FILE* file = fopen(temp.c_str(), "wb");
+            if (!file) throw std::runtime_error("Cannot write hash index: " + path);
+            FileHeader header{kMagic, kVersion, (uint32_t)Words, 0, (uint64_t)entries.size()};
+            bool ok = fwrite(&header, sizeof(header), 1, file) == 1;
+            for (size_t i = 0; ok && i < entries.size(); ++i) {
+                ok = fwrite(entries[i].hash.words.data(), sizeof(uint64_t), Words, file)
+                         == Words
+                     && fwrite(&entries[i].id, sizeof(uint64_t), 1, file) == 1;
+            }
+            ok = fclose(file) == 0 && ok;
+            if (!ok || rename(temp.c_str(), path.c_str()) != 0) {
+                remove(temp.c_str());
+                throw std::runtime_error("Cannot write hash index: " + path);
+            }
+        }
+
+        // 从文件载入，替换当前内容；文件损坏时抛出 std::runtime_error 且不修改索引
+        void Load(const std::string& path) {
+            std::unique_ptr<FILE, int (*)(FILE*)> file(fopen(path.c_str(), "rb"), fclose);
+            if (!file) throw std::runtime_error("Cannot open hash index: " + path);
+            const size_t record = (Words + 1) * sizeof(uint64_t);
+            FileHeader header;
+            std::vector<Entry> loaded;
+            bool ok = fread(&header, sizeof(header), 1, file.get()) == 1
+                      && header.magic == kMagic && header.version == kVersion
+                      && header.words == Words;
+            // 条目数必须与文件大小一致，再按它分配
+            if (ok) {
+                const long position = ftell(file.get());
+                ok = position >= 0 && fseek(file.get(), 0, SEEK_END) == 0;
+                const long end = ok ? ftell(file.get()) : -1;
+                ok = ok && end >= position && fseek(file.get(), position, SEEK_SET) == 0
+                     && header.count == (uint64_t)(end - position) / record
+                     && (uint64_t)(end - position) % record == 0;
+            }
+            if (ok) {
+                loaded.resize((size_t)header.count);
+                for (size_t i = 0; ok && i < loaded.size(); ++i) {
+                    ok = fread(loaded[i].hash.words.data(), sizeof(uint64_t), Words, file.get())
+                             == Words
+                         && fread(&loaded[i].id, sizeof(uint64_t), 1, file.get()) == 1;
+                }
+            }
+            file.reset();
+            if (!ok) throw std::runtime_error("Bad hash index: " + path);
+
+            std::unique_lock<std::shared_mutex> lock(mutex);
+            entries.clear();
+            for (auto& table : tables) table.clear();
+            entries.reserve(loaded.size());
+            for (const Entry& e : loaded) InsertLocked(e.hash, e.id);
+        }
+
+    private:
+        struct Entry {
+            Hash hash;
+            uint64_t id;
+        };
+
+        struct FileHeader {
+            uint32_t magic;
+            uint32_t version;
+            uint32_t words;
+            uint32_t reserved;
+            uint64_t count;
+        };
+
+        static constexpr uint32_t kMagic = 0x48505953u; // "SYPH"
+        static constexpr uint32_t kVersion = 1;
+
+        void InsertLocked(const Hash& hash, uint64_t id) {
+            const uint32_t index = (uint32_t)entries.size();
+            entries.push_back(Entry{hash, id});
+            for (size_t c = 0; c < kChunks; ++c) tables[c][hash.Chunk(c)].push_back(index);
+        }
+
+        // 枚举与 key 距离不超过 radius (0..2) 的所有 16 位值
+        template <typename Fn>
+        static void ForEachNeighbor(uint16_t key, int radius, Fn fn) {
+            fn(key);
+            if (radius < 1) return;
+            for (int i = 0; i < 16; ++i) {
+                const uint16_t k1 = key ^ (uint16_t)(1u << i);
+                fn(k1);
+                if (radius < 2) continue;
+                for (int j = i + 1; j < 16; ++j) fn(k1 ^ (uint16_t)(1u << j));
+            }
+        }
+
+        mutable std::shared_mutex mutex;
+        std::vector<Entry> entries;
+        std::array<std::unordered_map<uint16_t, std::vector<uint32_t>>, kChunks> tables;
+    };
+} // namespace Sayobot
@@ -0,0 +1,294 @@
+#pragma once
+
+#include <zlib.h>
+
+#include <cstdint>
+#include <cstdlib>
+#include <cstring>
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+#include "bitmap.hpp"
+#include "buffer_pool.hpp"
+#include "thread_pool.hpp"
+
+namespace Sayobot {
+    // PNG 行过滤方式，PngFilterAdaptive 为每行选择差值绝对值之和最小的方式
+    enum PngFilter {
+        PngFilterNone,
+        PngFilterSub,
+        PngFilterUp,
+        PngFilterAverage,
+        PngFilterPaeth,
+        PngFilterAdaptive
+    };
+
+    /*
+     * 直接由预乘 RGBA8 编码 PNG，不经过 Magick
+     * 全部不透明时写 RGB，否则写非预乘的 RGBA；位深为 8，不写其他附加块
+     * 指定多个线程时按行分段并行过滤、压缩：每段是一个独立的 raw deflate 流，
+     * 以前一段末尾 32 KB 作为字典，除最后一段外以 Z_SYNC_FLUSH 结束，
+     * 拼接后加上 zlib 头和合并的 Adler-32，仍是一个合法的 zlib 流
+     */
+    class PngWriter {
+    public:
+        /*
+         * 参数列表:
+         *** bitmap (const BitmapView&) 预乘 RGBA8
+         *** level (int) zlib 压缩等级 0-9
+         *** filter (PngFilter) 行过滤方式
+         *** strategy (int) zlib 压缩策略（Z_DEFAULT_STRATEGY、Z_RLE 等）
+         *** threads (size_t) 在共享线程池上使用的线程数，每段至少 kMinSegmentRows 行
+         */
+        static std::string Encode(const BitmapView& bitmap, int level, PngFilter filter,
+                                  int strategy = Z_DEFAULT_STRATEGY, size_t threads = 1) {
+            if (!bitmap.width || !bitmap.height) throw std::invalid_argument("Empty image");
+            const size_t channels = Opaque(bitmap) ? 3 : 4;
+            const size_t segments = std::min(threads, bitmap.height / kMinSegmentRows);
+            const std::string idat =
+                segments > 1 ? DeflateSegments(bitmap, channels, level, filter, strategy, segments)
+                             : Deflate(bitmap, channels, level, filter, strategy);
+
+            std::string png("\x89PNG\r\n\x1a\n", 8);
+            png.reserve(8 + 25 + 12 + idat.size() + 12);
+            uint8_t ihdr[13];
+            Put32(ihdr, (uint32_t)bitmap.width);
+            Put32(ihdr + 4, (uint32_t)bitmap.height);
+            ihdr[8] = 8;                       // 位深
+            ihdr[9] = channels == 3 ? 2 : 6; // RGB / RGBA
+            ihdr[10] = ihdr[11] = ihdr[12] = 0;
+            AppendChunk(png, "IHDR", ihdr, sizeof(ihdr));
+            AppendChunk(png, "IDAT", idat.data(), idat.size());
+            AppendChunk(png, "IEND", nullptr, 0);
+            return png;
+        }
+
+    private:
+        static const size_t kMinSegmentRows = 64;
+        static const size_t kWindow = 32768;
+
+        // 逐行过滤、压缩为一个 zlib 流
+        static std::string Deflate(const BitmapView& bitmap, size_t channels, int level,
+                                   PngFilter filter, int strategy) {
+            const size_t row_bytes = bitmap.width * channels;
+
+            z_stream z;
+            memset(&z, 0, sizeof(z));
+            if (deflateInit2(&z, level, Z_DEFLATED, 15, 8, strategy) != Z_OK)
+                throw std::runtime_error("deflateInit failed");
+            ScratchBuffer idat(deflateBound(&z, (uLong)((row_bytes + 1) * bitmap.height)));
+            z.next_out = idat.Data();
+            z.avail_out = (uInt)idat.Size();
+
+            std::vector<uint8_t> prev(row_bytes), cur(row_bytes);
+            std::vector<uint8_t> out(row_bytes + 1), best(row_bytes + 1);
+            for (size_t y = 0; y < bitmap.height; ++y) {
+                ConvertRow(bitmap.Row(y), bitmap.width, channels, cur.data());
+                FilterBest(filter, cur.data(), y ? prev.data() : nullptr, row_bytes, channels,
+                           out.data(), best.data());
+                z.next_in = best.data();
+                z.avail_in = (uInt)best.size();
+                if (deflate(&z, Z_NO_FLUSH) != Z_OK) {
+                    deflateEnd(&z);
+                    throw std::runtime_error("deflate failed");
+                }
+                prev.swap(cur);
+            }
+            const int status = deflate(&z, Z_FINISH);
+            const size_t idat_size = z.total_out;
+            deflateEnd(&z);
+            if (status != Z_STREAM_END) throw std::runtime_error("deflate failed");
+            return std::string(reinterpret_cast<const char*>(idat.Data()), idat_size);
+        }
+
+        /*
+         * 分 segments 段并行压缩为一个 zlib 流
+         * 先并行过滤全部行（每段的第一行以前一段的最后一行为上一行），
+         * 再并行压缩各段，这时每段都能取到前一段的数据作为字典
+         */
+        static std::string DeflateSegments(const BitmapView& bitmap, size_t channels, int level,
+                                           PngFilter filter, int strategy, size_t segments) {
+            const size_t row_bytes = bitmap.width * channels;
+            const size_t line = row_bytes + 1;
+            ScratchBuffer filtered(line * bitmap.height);
+            std::vector<std::string> parts(segments);
+            std::vector<uLong> checks(segments);
+            std::vector<std::string> errors(segments);
+            const auto first_row = [&](size_t i) { return bitmap.height * i / segments; };
+
+            ThreadPool& pool = ThreadPool::Shared();
+            pool.ParallelFor(segments, segments, [&](size_t i) {
+                const size_t y0 = first_row(i), y1 = first_row(i + 1);
+                std::vector<uint8_t> prev(row_bytes), cur(row_bytes), out(line);
+                if (y0) ConvertRow(bitmap.Row(y0 - 1), bitmap.width, channels, prev.data());
+                for (size_t y = y0; y < y1; ++y) {
+                    ConvertRow(bitmap.Row(y), bitmap.width, channels, cur.data());
+                    uint8_t* dst = filtered.Data() + y * line;
+                    FilterBest(filter, cur.data(), y ? prev.data() : nullptr, row_bytes, channels,
+                               out.data(), dst);
+                    prev.swap(cur);
+                }
+            });
+            pool.ParallelFor(segments, segments, [&](size_t i) {
+                const size_t begin = first_row(i) * line, end = first_row(i + 1) * line;
+                const uint8_t* data = filtered.Data() + begin;
+                checks[i] = adler32(adler32(0, nullptr, 0), data, (uInt)(end - begin));
+                z_stream z;
+                memset(&z, 0, sizeof(z));
+                if (deflateInit2(&z, level, Z_DEFLATED, -15, 8, strategy) != Z_OK) {
+                    errors[i] = "deflateInit failed";
+                    return;
+                }
+                if (begin) {
+                    const size_t window = std::min(begin, kWindow);
+                    deflateSetDictionary(&z, data - window, (uInt)window);
+                }
+                std::string& part = parts[i];
+                part.resize(deflateBound(&z, (uLong)(end - begin)) + 16);
+                z.next_in = const_cast<Bytef*>(data);
+                z.avail_in = (uInt)(end - begin);
+                z.next_out = reinterpret_cast<Bytef*>(&part[0]);
+                z.avail_out = (uInt)part.size();
+                const bool last = i + 1 == segments;
+                const int status = deflate(&z, last ? Z_FINISH : Z_SYNC_FLUSH);
+                part.resize(z.total_out);
+                deflateEnd(&z);
+                if (status != (last ? Z_STREAM_END : Z_OK) || z.avail_in)
+                    errors[i] = "deflate failed";
+            });
+            for (const std::string& error : errors)
+                if (!error.empty()) throw std::runtime_error(error);
+
+            // zlib 头：CM = 8、32 KB 窗口，FLEVEL 按压缩等级
+            const int flevel = level < 0 ? 2 : level < 2 ? 0 : level < 6 ? 1 : level == 6 ? 2 : 3;
+            const uint8_t cmf = 0x78, flg = (uint8_t)(flevel << 6);
+            std::string idat;
+            size_t bytes = 6;
+            for (const std::string& part : parts) bytes += part.size();
+            idat.reserve(bytes);
+            idat += (char)cmf;
+            idat += (char)(flg + 31 - (cmf * 256 + flg) % 31);
+            uLong check = adler32(0, nullptr, 0);
+            for (size_t i = 0; i < segments; ++i) {
+                idat += parts[i];
+                check = adler32_combine(
+                    check, checks[i], (z_off_t)((first_row(i + 1) - first_row(i)) * line));
+            }
+            uint8_t tail[4];
+            Put32(tail, (uint32_t)check);
+            idat.append(reinterpret_cast<const char*>(tail), 4);
+            return idat;
+        }
+
+        // 按 filter 过滤一行写入 dst（line 字节），PngFilterAdaptive 时用 out 作为暂存
+        static void FilterBest(PngFilter filter, const uint8_t* cur, const uint8_t* prev,
+                               size_t n, size_t bpp, uint8_t* out, uint8_t* dst) {
+            if (filter != PngFilterAdaptive) {
+                FilterRow(filter, cur, prev, n, bpp, dst);
+                return;
+            }
+            uint64_t best_cost = UINT64_MAX;
+            for (int f = PngFilterNone; f <= PngFilterPaeth; ++f) {
+                FilterRow((PngFilter)f, cur, prev, n, bpp, out);
+                const uint64_t cost = Cost(out + 1, n);
+                if (cost < best_cost) {
+                    best_cost = cost;
+                    memcpy(dst, out, n + 1);
+                }
+            }
+        }
+
+        static bool Opaque(const BitmapView& bitmap) {
+            for (size_t y = 0; y < bitmap.height; ++y) {
+                const uint8_t* p = bitmap.Row(y);
+                for (size_t x = 0; x < bitmap.width; ++x)
+                    if (p[x * 4 + 3] != 255) return false;
+            }
+            return true;
+        }
+
+        // 预乘 RGBA8 转为非预乘的 RGB 或 RGBA
+        static void ConvertRow(const uint8_t* src, size_t width, size_t channels,
+                               uint8_t* dst) {
+            if (channels == 3) {
+                for (size_t x = 0; x < width; ++x, src += 4, dst += 3) {
+                    dst[0] = src[0];
+                    dst[1] = src[1];
+                    dst[2] = src[2];
+                }
+                return;
+            }
+            memcpy(dst, src, width * 4);
+            Unpremultiply(dst, width);
+        }
+
+        static uint8_t Paeth(int a, int b, int c) {
+            const int p = a + b - c;
+            const int pa = abs(p - a), pb = abs(p - b), pc = abs(p - c);
+            if (pa <= pb && pa <= pc) return (uint8_t)a;
+            return (uint8_t)(pb <= pc ? b : c);
+        }
+
+        // 过滤一行，out[0] 为过滤方式，prev 为空时按全 0 的上一行处理
+        static void FilterRow(PngFilter filter, const uint8_t* cur, const uint8_t* prev,
+                              size_t n, size_t bpp, uint8_t* out) {
+            out[0] = (uint8_t)filter;
+            uint8_t* o = out + 1;
+            switch (filter) {
+            case PngFilterSub:
+                for (size_t i = 0; i < n; ++i)
+                    o[i] = (uint8_t)(cur[i] - (i >= bpp ? cur[i - bpp] : 0));
+                break;
+            case PngFilterUp:
+                for (size_t i = 0; i < n; ++i) o[i] = (uint8_t)(cur[i] - (prev ? prev[i] : 0));
+                break;
+            case PngFilterAverage:
+                for (size_t i = 0; i < n; ++i) {
+                    const int a = i >= bpp ? cur[i - bpp] : 0, b = prev ? prev[i] : 0;
+                    o[i] = (uint8_t)(cur[i] - ((a + b) >> 1));
+                }
+                break;
+            case PngFilterPaeth:
+                for (size_t i = 0; i < n; ++i) {
+                    const int a = i >= bpp ? cur[i - bpp] : 0, b = prev ? prev[i] : 0;
+                    const int c = i >= bpp && prev ? prev[i - bpp] : 0;
+                    o[i] = (uint8_t)(cur[i] - Paeth(a, b, c));
+                }
+                break;
+            default:
+                out[0] = PngFilterNone;
+                memcpy(o, cur, n);
+                break;
+            }
+        }
+
+        // 以有符号字节的绝对值之和估计压缩后的大小
+        static uint64_t Cost(const uint8_t* p, size_t n) {
+            uint64_t sum = 0;
+            for (size_t i = 0; i < n; ++i) sum += (uint64_t)abs((int)(int8_t)p[i]);
+            return sum;
+        }
+
+        static void Put32(uint8_t* p, uint32_t v) {
+            p[0] = (uint8_t)(v >> 24);
+            p[1] = (uint8_t)(v >> 16);
+            p[2] = (uint8_t)(v >> 8);
+            p[3] = (uint8_t)v;
+        }
+
+        static void AppendChunk(std::string& png, const char* type, const void* data,
+                                size_t length) {
+            uint8_t head[8];
+            Put32(head, (uint32_t)length);
+            memcpy(head + 4, type, 4);
+            png.append(reinterpret_cast<const char*>(head), 8);
+            if (length) png.append(static_cast<const char*>(data), length);
+            uLong crc = crc32(0, head + 4, 4);
+            if (length) crc = crc32(crc, static_cast<const Bytef*>(data), (uInt)length);
+            uint8_t tail[4];
+            Put32(tail, (uint32_t)crc);
+            png.append(reinterpret_cast<const char*>(tail), 4);
+        }
+    };
+} // namespace Sayobot
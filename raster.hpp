@@ -0,0 +1,381 @@
+#pragma once
+
+#include <algorithm>
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <memory>
+#include <utility>
+#include <vector>
+
+#if defined(__x86_64__) || defined(_M_X64) || defined(__i386__)
+#define SAYOBOT_X86 1
+#include <immintrin.h>
+#elif defined(__ARM_NEON) || defined(__ARM_NEON__)
+#define SAYOBOT_NEON 1
+#include <arm_neon.h>
+#endif
+
+#include "bitmap.hpp"
+#include "buffer_pool.hpp"
+
+namespace Sayobot {
+    // 矩形区域 [x0, x1) x [y0, y1)
+    struct Rect {
+        long x0 = 0, y0 = 0, x1 = 0, y1 = 0;
+
+        bool Empty() const {
+            return x0 >= x1 || y0 >= y1;
+        }
+
+        long Area() const {
+            return Empty() ? 0 : (x1 - x0) * (y1 - y0);
+        }
+
+        bool operator==(const Rect& o) const {
+            return x0 == o.x0 && y0 == o.y0 && x1 == o.x1 && y1 == o.y1;
+        }
+
+        bool Intersects(const Rect& o) const {
+            return !Empty() && !o.Empty() && x0 < o.x1 && o.x0 < x1 && y0 < o.y1 && o.y0 < y1;
+        }
+
+        Rect Intersect(const Rect& o) const {
+            Rect r;
+            r.x0 = std::max(x0, o.x0);
+            r.y0 = std::max(y0, o.y0);
+            r.x1 = std::min(x1, o.x1);
+            r.y1 = std::min(y1, o.y1);
+            return r;
+        }
+
+        Rect Union(const Rect& o) const {
+            if (Empty()) return o;
+            if (o.Empty()) return *this;
+            Rect r;
+            r.x0 = std::min(x0, o.x0);
+            r.y0 = std::min(y0, o.y0);
+            r.x1 = std::max(x1, o.x1);
+            r.y1 = std::max(y1, o.y1);
+            return r;
+        }
+
+        static Rect Of(long x, long y, long width, long height) {
+            Rect r;
+            r.x0 = x;
+            r.y0 = y;
+            r.x1 = x + width;
+            r.y1 = y + height;
+            return r;
+        }
+    };
+
+    /*
+     * 预乘 RGBA8 的画布
+     * 1080x1920 的画布约 8 MB，只有 16 位 HDRI 像素缓存的四分之一
+     */
+    class Raster {
+    public:
+        Raster() {
+        }
+
+        Raster(size_t width, size_t height) {
+            Reset(width, height);
+        }
+
+        // 像素内存取自 BufferPool，析构时归还
+        Raster(const Raster& other) : width(other.width), height(other.height) {
+            pixels = BufferPool::Instance().Take(other.pixels.size());
+            pixels.assign(other.pixels.begin(), other.pixels.end());
+        }
+
+        Raster(Raster&& other) noexcept
+            : width(other.width), height(other.height), pixels(std::move(other.pixels)) {
+            other.width = other.height = 0;
+            other.pixels.clear();
+        }
+
+        Raster& operator=(const Raster& other) {
+            if (this == &other) return *this;
+            Reserve(other.pixels.size());
+            pixels.assign(other.pixels.begin(), other.pixels.end());
+            width = other.width;
+            height = other.height;
+            return *this;
+        }
+
+        Raster& operator=(Raster&& other) noexcept {
+            if (this == &other) return *this;
+            BufferPool::Instance().Give(std::move(pixels));
+            pixels = std::move(other.pixels);
+            width = other.width;
+            height = other.height;
+            other.width = other.height = 0;
+            other.pixels.clear();
+            return *this;
+        }
+
+        ~Raster() {
+            BufferPool::Instance().Give(std::move(pixels));
+        }
+
+        // 重设尺寸并清为全透明
+        void Reset(size_t width, size_t height) {
+            this->width = width;
+            this->height = height;
+            Reserve(width * height * 4);
+            pixels.assign(width * height * 4, 0);
+        }
+
+        // 重设尺寸，像素内容不确定，调用方负责写满
+        void Allocate(size_t width, size_t height) {
+            this->width = width;
+            this->height = height;
+            Reserve(width * height * 4);
+            pixels.resize(width * height * 4);
+        }
+
+        // 复制 view 的像素，尺寸与 view 相同
+        void Assign(const BitmapView& view) {
+            Allocate(view.width, view.height);
+            for (size_t y = 0; y < height; ++y) memcpy(Row(y), view.Row(y), Stride());
+        }
+
+        size_t Width() const {
+            return width;
+        }
+
+        size_t Height() const {
+            return height;
+        }
+
+        size_t Stride() const {
+            return width * 4;
+        }
+
+        bool Empty() const {
+            return !width || !height;
+        }
+
+        size_t Bytes() const {
+            return pixels.size();
+        }
+
+        uint8_t* Data() {
+            return pixels.data();
+        }
+
+        const uint8_t* Data() const {
+            return pixels.data();
+        }
+
+        uint8_t* Row(size_t y) {
+            return pixels.data() + y * Stride();
+        }
+
+        Rect Bounds() const {
+            return Rect::Of(0, 0, (long)width, (long)height);
+        }
+
+        BitmapView View() const {
+            BitmapView view;
+            view.width = width;
+            view.height = height;
+            view.stride = Stride();
+            view.pixels = pixels.data();
+            return view;
+        }
+
+    private:
+        // 容量不够时换一块池中的内存，原有内容不保留
+        void Reserve(size_t bytes) {
+            if (pixels.capacity() >= bytes) return;
+            BufferPool::Instance().Give(std::move(pixels));
+            pixels = BufferPool::Instance().Take(bytes);
+        }
+
+        size_t width = 0, height = 0;
+        PoolBytes pixels;
+    };
+
+    // 共享所有权的位图，owner 保证 view 指向的内存有效（如 Raster 或映射的素材包）
+    struct SharedBitmap {
+        BitmapView view;
+        std::shared_ptr<const void> owner;
+
+        explicit operator bool() const {
+            return view.pixels != nullptr;
+        }
+
+        static SharedBitmap Of(Raster raster) {
+            std::shared_ptr<const Raster> owned = std::make_shared<const Raster>(std::move(raster));
+            SharedBitmap bitmap;
+            bitmap.view = owned->View();
+            bitmap.owner = owned;
+            return bitmap;
+        }
+    };
+
+    // 一行 count 个预乘像素的 source-over: dst = src + dst * (255 - src.a) / 255
+    typedef void (*BlendRowFn)(uint8_t* dst, const uint8_t* src, size_t count);
+
+    inline void BlendRowScalar(uint8_t* dst, const uint8_t* src, size_t count) {
+        for (size_t i = 0; i < count; ++i, dst += 4, src += 4) {
+            const uint32_t a = src[3];
+            if (a == 255) {
+                memcpy(dst, src, 4);
+                continue;
+            }
+            if (!a && !(src[0] | src[1] | src[2])) continue;
+            const uint32_t inv = 255 - a;
+            for (int c = 0; c < 4; ++c) {
+                const uint32_t v = src[c] + Mul255(dst[c], inv);
+                dst[c] = (uint8_t)(v > 255 ? 255 : v);
+            }
+        }
+    }
+
+#ifdef SAYOBOT_X86
+    // 16 位分量的 x * y / 255，与 Mul255 的舍入相同
+    inline __m128i Div255Epi16(__m128i p) {
+        const __m128i t = _mm_add_epi16(p, _mm_set1_epi16(128));
+        return _mm_srli_epi16(_mm_add_epi16(t, _mm_srli_epi16(t, 8)), 8);
+    }
+
+    inline void BlendRowSse2(uint8_t* dst, const uint8_t* src, size_t count) {
+        const __m128i zero = _mm_setzero_si128();
+        const __m128i ones = _mm_set1_epi8((char)0xFF);
+        size_t i = 0;
+        for (; i + 4 <= count; i += 4) {
+            const __m128i s = _mm_loadu_si128(reinterpret_cast<const __m128i*>(src + i * 4));
+            // 四个像素都透明或都不透明时不需要计算
+            const int alpha_bits = _mm_movemask_epi8(_mm_cmpeq_epi8(
+                _mm_and_si128(s, _mm_set1_epi32((int)0xFF000000)), _mm_set1_epi32((int)0xFF000000)));
+            if ((alpha_bits & 0x8888) == 0x8888) {
+                _mm_storeu_si128(reinterpret_cast<__m128i*>(dst + i * 4), s);
+                continue;
+            }
+            if (_mm_movemask_epi8(_mm_cmpeq_epi8(s, zero)) == 0xFFFF) continue;
+            const __m128i d = _mm_loadu_si128(reinterpret_cast<const __m128i*>(dst + i * 4));
+            __m128i a = _mm_srli_epi32(s, 24);
+            a = _mm_or_si128(a, _mm_slli_epi32(a, 8));
+            a = _mm_or_si128(a, _mm_slli_epi32(a, 16));
+            const __m128i inv = _mm_xor_si128(a, ones);
+            const __m128i lo = Div255Epi16(
+                _mm_mullo_epi16(_mm_unpacklo_epi8(d, zero), _mm_unpacklo_epi8(inv, zero)));
+            const __m128i hi = Div255Epi16(
+                _mm_mullo_epi16(_mm_unpackhi_epi8(d, zero), _mm_unpackhi_epi8(inv, zero)));
+            _mm_storeu_si128(reinterpret_cast<__m128i*>(dst + i * 4),
+                             _mm_adds_epu8(s, _mm_packus_epi16(lo, hi)));
+        }
+        BlendRowScalar(dst + i * 4, src + i * 4, count - i);
+    }
+
+#if defined(__GNUC__)
+    __attribute__((target("avx2"))) inline __m256i Div255Epi16Avx2(__m256i p) {
+        const __m256i t = _mm256_add_epi16(p, _mm256_set1_epi16(128));
+        return _mm256_srli_epi16(_mm256_add_epi16(t, _mm256_srli_epi16(t, 8)), 8);
+    }
+
+    __attribute__((target("avx2"))) inline void BlendRowAvx2(uint8_t* dst,
+                                                              const uint8_t* src,
+                                                              size_t count) {
+        const __m256i zero = _mm256_setzero_si256();
+        const __m256i ones = _mm256_set1_epi8((char)0xFF);
+        const __m256i alpha_mask = _mm256_set1_epi32((int)0xFF000000);
+        size_t i = 0;
+        for (; i + 8 <= count; i += 8) {
+            const __m256i s =
+                _mm256_loadu_si256(reinterpret_cast<const __m256i*>(src + i * 4));
+            const unsigned opaque = (unsigned)_mm256_movemask_epi8(
+                _mm256_cmpeq_epi8(_mm256_and_si256(s, alpha_mask), alpha_mask));
+            if ((opaque & 0x88888888u) == 0x88888888u) {
+                _mm256_storeu_si256(reinterpret_cast<__m256i*>(dst + i * 4), s);
+                continue;
+            }
+            if (_mm256_testz_si256(s, s)) continue;
+            const __m256i d =
+                _mm256_loadu_si256(reinterpret_cast<const __m256i*>(dst + i * 4));
+            __m256i a = _mm256_srli_epi32(s, 24);
+            a = _mm256_or_si256(a, _mm256_slli_epi32(a, 8));
+            a = _mm256_or_si256(a, _mm256_slli_epi32(a, 16));
+            const __m256i inv = _mm256_xor_si256(a, ones);
+            const __m256i lo = Div255Epi16Avx2(_mm256_mullo_epi16(
+                _mm256_unpacklo_epi8(d, zero), _mm256_unpacklo_epi8(inv, zero)));
+            const __m256i hi = Div255Epi16Avx2(_mm256_mullo_epi16(
+                _mm256_unpackhi_epi8(d, zero), _mm256_unpackhi_epi8(inv, zero)));
+            _mm256_storeu_si256(reinterpret_cast<__m256i*>(dst + i * 4),
+                                _mm256_adds_epu8(s, _mm256_packus_epi16(lo, hi)));
+        }
+        BlendRowSse2(dst + i * 4, src + i * 4, count - i);
+    }
+#endif
+#endif
+
+#ifdef SAYOBOT_NEON
+    inline void BlendRowNeon(uint8_t* dst, const uint8_t* src, size_t count) {
+        size_t i = 0;
+        for (; i + 8 <= count; i += 8) {
+            const uint8x8x4_t s = vld4_u8(src + i * 4);
+            uint8x8x4_t d = vld4_u8(dst + i * 4);
+            const uint8x8_t inv = vmvn_u8(s.val[3]);
+            for (int c = 0; c < 4; ++c) {
+                const uint16x8_t p = vmull_u8(d.val[c], inv);
+                d.val[c] = vqadd_u8(s.val[c], vrshrn_n_u16(vrsraq_n_u16(p, p, 8), 8));
+            }
+            vst4_u8(dst + i * 4, d);
+        }
+        BlendRowScalar(dst + i * 4, src + i * 4, count - i);
+    }
+#endif
+
+    struct BlendKernel {
+        BlendRowFn row;
+        const char* name;
+    };
+
+    // 按 CPU 支持的指令集选择混合函数，只在第一次调用时检测
+    inline const BlendKernel& SelectBlendKernel() {
+        static const BlendKernel kernel = [] {
+#if defined(SAYOBOT_X86)
+#if defined(__GNUC__)
+            if (__builtin_cpu_supports("avx2")) return BlendKernel{BlendRowAvx2, "avx2"};
+#endif
+            return BlendKernel{BlendRowSse2, "sse2"};
+#elif defined(SAYOBOT_NEON)
+            return BlendKernel{BlendRowNeon, "neon"};
+#else
+            return BlendKernel{BlendRowScalar, "scalar"};
+#endif
+        }();
+        return kernel;
+    }
+
+    /*
+     * 把 src 以 source-over 画到 dst 的 (x, y) 处
+     * 超出画布或裁剪区域 clip 的部分被裁掉，clip 为空时只按画布裁剪
+     */
+    inline void BlendOver(Raster& dst, const BitmapView& src, long x, long y,
+                          const Rect& clip = Rect()) {
+        if (!src.pixels || dst.Empty()) return;
+        Rect area = Rect::Of(x, y, (long)src.width, (long)src.height).Intersect(dst.Bounds());
+        if (!clip.Empty()) area = area.Intersect(clip);
+        if (area.Empty()) return;
+        const BlendRowFn row = SelectBlendKernel().row;
+        const size_t w = (size_t)(area.x1 - area.x0);
+        for (long r = area.y0; r < area.y1; ++r)
+            row(dst.Row((size_t)r) + area.x0 * 4,
+                src.Row((size_t)(r - y)) + (area.x0 - x) * 4,
+                w);
+    }
+
+    // 把 src 中 rect 区域的像素复制到 dst 的同一位置，两者尺寸相同
+    inline void CopyRect(Raster& dst, const BitmapView& src, Rect rect) {
+        rect = rect.Intersect(dst.Bounds())
+                   .Intersect(Rect::Of(0, 0, (long)src.width, (long)src.height));
+        if (rect.Empty()) return;
+        const size_t bytes = (size_t)(rect.x1 - rect.x0) * 4;
+        for (long y = rect.y0; y < rect.y1; ++y)
+            memcpy(dst.Row((size_t)y) + rect.x0 * 4, src.Row((size_t)y) + rect.x0 * 4, bytes);
+    }
+} // namespace Sayobot
@@ -0,0 +1,76 @@
+#pragma once
+
+#include <atomic>
+#include <memory>
+#include <string>
+#include <vector>
+
+#include <Magick++.h>
+
+#include "status.hpp"
+
+namespace Sayobot {
+    /*
+     * 渲染上下文
+     * 由调用方创建并持有，一次渲染的错误信息等结果都保存在这里，
+     * 不同上下文之间没有共享的可变状态，可以在多个线程上同时渲染
+     * 同一个上下文同一时刻只能进行一次渲染
+     */
+    class RenderContext {
+    public:
+        // 尝试占用上下文，已经在渲染中时返回 false
+        bool Acquire() {
+            bool expected = false;
+            return busy.compare_exchange_strong(expected, true);
+        }
+
+        void Release() {
+            busy = false;
+        }
+
+        std::string error;
+        // 输出到内存时的编码结果和编码设置
+        Magick::Blob output;
+        std::string format = "PNG";
+        size_t quality = 85;
+        // 跟踪模式下记录上一次渲染各阶段的事件 (JSON 数组)
+        bool trace = false;
+        std::string trace_json;
+
+    private:
+        std::atomic<bool> busy{false};
+    };
+
+    /*
+     * 批量渲染
+     * 每组参数对应一个 RenderContext 保存各自的结果和错误，
+     * 所有卡片共享素材、字体和底图缓存，在共享线程池上并行渲染
+     * columns 不为 0 时，另外把所有卡片缩小为 tile_width 宽后按行拼成一张图，
+     * 结果保存在 tile 中（排行榜等）
+     */
+    class RenderBatch {
+    public:
+        struct Item {
+            std::string args; // 文本参数，或二进制的 PersonalCardArgs
+            bool binary = false;
+            std::unique_ptr<RenderContext> ctx{new RenderContext()};
+        };
+
+        bool Acquire() {
+            bool expected = false;
+            return busy.compare_exchange_strong(expected, true);
+        }
+
+        void Release() {
+            busy = false;
+        }
+
+        std::vector<Item> items;
+        size_t columns = 0, tile_width = 0;
+        bool encode_items = true; // 为 false 时只生成拼图，不编码单张卡片
+        RenderContext tile;
+
+    private:
+        std::atomic<bool> busy{false};
+    };
+} // namespace Sayobot
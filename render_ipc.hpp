@@ -0,0 +1,284 @@
+#pragma once
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+#include <atomic>
+#include <cerrno>
+#include <cstdint>
+#include <cstring>
+#include <stdexcept>
+#include <string>
+
+#include "status.hpp"
+
+namespace Sayobot {
+    /*
+     * 渲染服务 (daemon.cpp) 与客户端 (client.cpp) 之间的协议
+     * 两端通过 Unix 域套接字交换帧：定长的 FrameHeader 加 length 字节的内容
+     * 连接建立后服务端先发送 Hello 帧，并随帧传递一块共享内存的描述符，
+     * 之后编码好的图片写入这块共享内存（SharedRing），套接字上只传递位置
+     * 图片放不进共享内存时才随帧内联发送
+     * 每个请求由客户端分配 id，回复的帧带回同一个 id 和请求的类型，完成顺序不定
+     */
+    namespace Ipc {
+        const uint32_t kMagic = 0x31425953; // "SYB1"
+        const uint32_t kMaxPayload = 64u << 20;
+        const uint64_t kInline = UINT64_MAX; // ResultBody.offset：图片随帧发送
+
+        enum MessageType : uint16_t {
+            kHello = 1,
+            kRender = 2, // RenderRequest + 编码设置 + 二进制的 PersonalCardArgs
+            kAvatar = 3, // AvatarRequest + 头像文件内容
+            kStats = 4,  // 无内容，回复为渲染指标 (JSON)
+        };
+
+        struct FrameHeader {
+            uint32_t magic;
+            uint16_t type;
+            uint16_t status; // 回复的 SAYOBOT_OK 等，失败时内容为错误信息
+            uint64_t id;
+            uint32_t length;
+            uint32_t reserved;
+        };
+        static_assert(sizeof(FrameHeader) == 24, "FrameHeader layout");
+
+        struct RenderRequest {
+            int32_t priority;
+            uint32_t quality;
+            uint32_t format_length;
+            uint32_t reserved;
+        };
+
+        struct AvatarRequest {
+            int64_t user;
+        };
+
+        // kRender 成功时回复的内容；offset 为 kInline 时后面跟 length 字节的图片
+        struct ResultBody {
+            uint64_t offset; // 图片在共享内存数据区中的位置
+            uint64_t length;
+            uint64_t end; // 读取后写回 RingHeader::tail 的值
+        };
+
+        // 出错时抛出 std::runtime_error
+        inline void WriteAll(int fd, const void* data, size_t length) {
+            const char* p = static_cast<const char*>(data);
+            while (length) {
+                const ssize_t n = send(fd, p, length, MSG_NOSIGNAL);
+                if (n < 0 && errno == EINTR) continue;
+                if (n <= 0) throw std::runtime_error(std::string("send: ") + strerror(errno));
+                p += n;
+                length -= (size_t)n;
+            }
+        }
+
+        // 连接关闭时返回 false
+        inline bool ReadAll(int fd, void* data, size_t length) {
+            char* p = static_cast<char*>(data);
+            while (length) {
+                const ssize_t n = recv(fd, p, length, 0);
+                if (n < 0 && errno == EINTR) continue;
+                if (n <= 0) return false;
+                p += n;
+                length -= (size_t)n;
+            }
+            return true;
+        }
+
+        // 写一帧，内容分为两段（第二段可以为空），调用方负责同一连接上的写入互斥
+        inline void WriteFrame(int fd, uint16_t type, uint16_t status, uint64_t id,
+                               const void* a, size_t a_length, const void* b = nullptr,
+                               size_t b_length = 0) {
+            if (a_length + b_length > kMaxPayload) throw std::runtime_error("Frame too large");
+            FrameHeader header = {kMagic, type, status, id, (uint32_t)(a_length + b_length), 0};
+            WriteAll(fd, &header, sizeof(header));
+            if (a_length) WriteAll(fd, a, a_length);
+            if (b_length) WriteAll(fd, b, b_length);
+        }
+
+        // 读一帧，连接关闭或帧不合法时返回 false
+        inline bool ReadFrame(int fd, FrameHeader& header, std::string& payload) {
+            if (!ReadAll(fd, &header, sizeof(header))) return false;
+            if (header.magic != kMagic || header.length > kMaxPayload) return false;
+            payload.resize(header.length);
+            return !header.length || ReadAll(fd, &payload[0], header.length);
+        }
+
+        // 发送 Hello 帧，同时传递描述符
+        inline void SendHello(int fd, int shared_fd) {
+            FrameHeader header = {kMagic, kHello, 0, 0, 0, 0};
+            iovec iov = {&header, sizeof(header)};
+            char control[CMSG_SPACE(sizeof(int))];
+            memset(control, 0, sizeof(control));
+            msghdr msg;
+            memset(&msg, 0, sizeof(msg));
+            msg.msg_iov = &iov;
+            msg.msg_iovlen = 1;
+            msg.msg_control = control;
+            msg.msg_controllen = sizeof(control);
+            cmsghdr* cmsg = CMSG_FIRSTHDR(&msg);
+            cmsg->cmsg_level = SOL_SOCKET;
+            cmsg->cmsg_type = SCM_RIGHTS;
+            cmsg->cmsg_len = CMSG_LEN(sizeof(int));
+            memcpy(CMSG_DATA(cmsg), &shared_fd, sizeof(int));
+            ssize_t n;
+            do {
+                n = sendmsg(fd, &msg, MSG_NOSIGNAL);
+            } while (n < 0 && errno == EINTR);
+            if (n != (ssize_t)sizeof(header))
+                throw std::runtime_error(std::string("sendmsg: ") + strerror(errno));
+        }
+
+        // 接收 Hello 帧，返回随帧传递的描述符
+        inline int ReceiveHello(int fd) {
+            FrameHeader header;
+            iovec iov = {&header, sizeof(header)};
+            char control[CMSG_SPACE(sizeof(int))];
+            msghdr msg;
+            memset(&msg, 0, sizeof(msg));
+            msg.msg_iov = &iov;
+            msg.msg_iovlen = 1;
+            msg.msg_control = control;
+            msg.msg_controllen = sizeof(control);
+            ssize_t n;
+            do {
+                n = recvmsg(fd, &msg, MSG_CMSG_CLOEXEC);
+            } while (n < 0 && errno == EINTR);
+            cmsghdr* cmsg = CMSG_FIRSTHDR(&msg);
+            if (n != (ssize_t)sizeof(header) || header.magic != kMagic ||
+                header.type != kHello || !cmsg || cmsg->cmsg_type != SCM_RIGHTS)
+                throw std::runtime_error("Bad handshake from render daemon");
+            int shared_fd;
+            memcpy(&shared_fd, CMSG_DATA(cmsg), sizeof(int));
+            return shared_fd;
+        }
+
+        struct RingHeader {
+            uint32_t magic;
+            uint32_t reserved;
+            uint64_t capacity;
+            alignas(64) std::atomic<uint64_t> head; // 服务端写入的总字节数
+            alignas(64) std::atomic<uint64_t> tail; // 客户端读完的总字节数
+        };
+        static_assert(std::atomic<uint64_t>::is_always_lock_free,
+                      "RingHeader is shared between processes");
+
+        /*
+         * 共享内存中的单生产者、单消费者环形缓冲区
+         * 服务端在同一连接的写锁内写入图片并发出对应的帧，
+         * 客户端按帧的顺序读取，读完把 tail 推进到帧中的 end
+         * 一张图片总是连续存放，尾部放不下时跳过剩余部分从头写起
+         */
+        class SharedRing {
+        public:
+            SharedRing() = default;
+
+            SharedRing(const SharedRing&) = delete;
+            SharedRing& operator=(const SharedRing&) = delete;
+
+            ~SharedRing() {
+                Close();
+            }
+
+            // 服务端：创建数据区为 capacity 字节的共享内存，返回的描述符由调用方关闭
+            int Create(size_t capacity) {
+                static std::atomic<unsigned> serial{0};
+                const std::string name = "/sayobot-" + std::to_string(getpid()) + "-" +
+                                         std::to_string(serial.fetch_add(1));
+                const int fd = shm_open(name.c_str(), O_RDWR | O_CREAT | O_EXCL, 0600);
+                if (fd < 0) throw std::runtime_error(std::string("shm_open: ") + strerror(errno));
+                shm_unlink(name.c_str()); // 只通过描述符共享
+                const size_t size = sizeof(RingHeader) + capacity;
+                if (ftruncate(fd, (off_t)size) != 0) {
+                    close(fd);
+                    throw std::runtime_error(std::string("ftruncate: ") + strerror(errno));
+                }
+                try {
+                    Map(fd, size);
+                } catch (...) {
+                    close(fd);
+                    throw;
+                }
+                header->magic = kMagic;
+                header->capacity = capacity;
+                header->head.store(0);
+                header->tail.store(0);
+                return fd;
+            }
+
+            // 客户端：映射服务端传来的共享内存，不接管描述符
+            void Attach(int fd) {
+                struct stat st;
+                if (fstat(fd, &st) != 0 || (size_t)st.st_size <= sizeof(RingHeader))
+                    throw std::runtime_error("Bad shared memory from render daemon");
+                Map(fd, (size_t)st.st_size);
+                if (header->magic != kMagic ||
+                    header->capacity != size - sizeof(RingHeader)) {
+                    Close();
+                    throw std::runtime_error("Bad shared memory from render daemon");
+                }
+            }
+
+            void Close() {
+                if (base) munmap(base, size);
+                base = nullptr;
+                header = nullptr;
+                size = 0;
+            }
+
+            // 服务端：写入一张图片，空间不足时返回 false
+            bool Write(const void* data, size_t length, ResultBody& result) {
+                const uint64_t capacity = header->capacity;
+                if (!length || length > capacity) return false;
+                const uint64_t head = header->head.load(std::memory_order_relaxed);
+                const uint64_t tail = header->tail.load(std::memory_order_acquire);
+                const uint64_t position = head % capacity;
+                const uint64_t skip = capacity - position < length ? capacity - position : 0;
+                if (head + skip + length - tail > capacity) return false;
+                result.offset = skip ? 0 : position;
+                result.length = length;
+                result.end = head + skip + length;
+                memcpy(Data() + result.offset, data, length);
+                header->head.store(result.end, std::memory_order_release);
+                return true;
+            }
+
+            // 客户端：读取一张图片并释放其空间，位置不合法时返回 false
+            bool Read(const ResultBody& result, std::string& out) {
+                const uint64_t capacity = header->capacity;
+                if (result.offset > capacity || result.length > capacity - result.offset)
+                    return false;
+                out.assign(Data() + result.offset, result.length);
+                header->tail.store(result.end, std::memory_order_release);
+                return true;
+            }
+
+            explicit operator bool() const {
+                return header != nullptr;
+            }
+
+        private:
+            void Map(int fd, size_t size) {
+                void* p = mmap(nullptr, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+                if (p == MAP_FAILED)
+                    throw std::runtime_error(std::string("mmap: ") + strerror(errno));
+                base = p;
+                this->size = size;
+                header = static_cast<RingHeader*>(p);
+            }
+
+            char* Data() {
+                return static_cast<char*>(base) + sizeof(RingHeader);
+            }
+
+            void* base = nullptr;
+            size_t size = 0;
+            RingHeader* header = nullptr;
+        };
+    } // namespace Ipc
+} // namespace Sayobot
@@ -0,0 +1,325 @@
+#pragma once
+
+#include <algorithm>
+#include <cmath>
+#include <cstdint>
+#include <cstring>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <tuple>
+#include <vector>
+
+#include "bitmap.hpp"
+#include "raster.hpp"
+
+namespace Sayobot {
+    enum ResampleFilter {
+        FilterBox,      // 最近邻的平均，最快
+        FilterTriangle, // 双线性，用于小图标
+        FilterMitchell, // 与 ImageMagick 缩放带透明通道的图片时的默认滤镜相同
+        FilterLanczos3
+    };
+
+    /*
+     * 按比例缩放到 (width, height) 以内后的尺寸，与 Magick::Geometry(width, height) 相同
+     */
+    inline void FitSize(size_t src_width, size_t src_height, size_t width, size_t height,
+                        size_t& out_width, size_t& out_height) {
+        if (!src_width || !src_height || !width || !height) {
+            out_width = src_width;
+            out_height = src_height;
+            return;
+        }
+        const double scale = std::min((double)width / src_width, (double)height / src_height);
+        out_width = std::max<size_t>(1, (size_t)std::floor(scale * src_width + 0.5));
+        out_height = std::max<size_t>(1, (size_t)std::floor(scale * src_height + 0.5));
+    }
+
+    // 不指定滤镜时的选择：缩小到 128 像素以内的图标用双线性，其余用 Mitchell
+    inline ResampleFilter DefaultFilter(size_t src_width, size_t src_height, size_t width,
+                                        size_t height) {
+        if (width <= 128 && height <= 128 && width <= src_width && height <= src_height)
+            return FilterTriangle;
+        return FilterMitchell;
+    }
+
+    /*
+     * 一维缩放的权重表
+     * 目标的第 i 个像素 = sum(源[start[i] + k] * weights[i * taps + k]) >> 14
+     * 权重为 14 位定点数，每个像素的权重之和恰好为 1 << 14
+     */
+    struct ResampleWeights {
+        size_t taps = 0;
+        std::vector<uint32_t> start;
+        std::vector<int16_t> weights;
+    };
+
+    class Resampler {
+    public:
+        static Resampler& Instance() {
+            static Resampler instance;
+            return instance;
+        }
+
+        /*
+         * 缩放预乘 RGBA8 位图到恰好 (width, height)
+         * 权重表按 (源尺寸, 目标尺寸, 滤镜) 缓存，卡片上的尺寸固定，建好后一直复用
+         */
+        Raster Resize(const BitmapView& src, size_t width, size_t height,
+                      ResampleFilter filter) {
+            Raster out;
+            if (!src.width || !src.height || !width || !height) return out;
+            const std::shared_ptr<const ResampleWeights> horizontal =
+                Weights(src.width, width, filter);
+            const std::shared_ptr<const ResampleWeights> vertical =
+                Weights(src.height, height, filter);
+
+            // 先横向缩放每一行，再纵向缩放每一列
+            Raster temp(width, src.height);
+            for (size_t y = 0; y < src.height; ++y)
+                HorizontalRow(*horizontal, src.Row(y), temp.Row(y), width);
+            out.Reset(width, height);
+            const BitmapView rows = temp.View();
+            for (size_t y = 0; y < height; ++y)
+                VerticalRow(*vertical, y, rows, out.Row(y), width);
+            return out;
+        }
+
+        // 按比例缩放到 (width, height) 以内，不需要缩放时返回空的 Raster
+        Raster ResizeToFit(const BitmapView& src, size_t width, size_t height) {
+            size_t w, h;
+            FitSize(src.width, src.height, width, height, w, h);
+            if (w == src.width && h == src.height) return Raster();
+            return Resize(src, w, h, DefaultFilter(src.width, src.height, w, h));
+        }
+
+        size_t TableCount() {
+            std::lock_guard<std::mutex> lock(mutex);
+            return tables.size();
+        }
+
+    private:
+        Resampler() {
+        }
+
+        static double Evaluate(ResampleFilter filter, double x) {
+            x = std::fabs(x);
+            switch (filter) {
+            case FilterBox:
+                return x <= 0.5 ? 1.0 : 0.0;
+            case FilterTriangle:
+                return x < 1.0 ? 1.0 - x : 0.0;
+            case FilterMitchell: {
+                // B = C = 1/3
+                const double b = 1.0 / 3, c = 1.0 / 3;
+                if (x < 1.0)
+                    return ((12 - 9 * b - 6 * c) * x * x * x + (-18 + 12 * b + 6 * c) * x * x
+                            + (6 - 2 * b))
+                           / 6;
+                if (x < 2.0)
+                    return ((-b - 6 * c) * x * x * x + (6 * b + 30 * c) * x * x
+                            + (-12 * b - 48 * c) * x + (8 * b + 24 * c))
+                           / 6;
+                return 0.0;
+            }
+            case FilterLanczos3:
+                if (x < 1e-8) return 1.0;
+                if (x >= 3.0) return 0.0;
+                return 3.0 * std::sin(M_PI * x) * std::sin(M_PI * x / 3.0) / (M_PI * M_PI * x * x);
+            }
+            return 0.0;
+        }
+
+        static double Support(ResampleFilter filter) {
+            switch (filter) {
+            case FilterBox:
+                return 0.5;
+            case FilterTriangle:
+                return 1.0;
+            case FilterMitchell:
+                return 2.0;
+            case FilterLanczos3:
+                return 3.0;
+            }
+            return 1.0;
+        }
+
+        static std::shared_ptr<const ResampleWeights> Build(size_t in, size_t out,
+                                                            ResampleFilter filter) {
+            const double scale = (double)in / out;
+            const double filter_scale = std::max(scale, 1.0);
+            const double support = Support(filter) * filter_scale;
+            std::shared_ptr<ResampleWeights> table = std::make_shared<ResampleWeights>();
+            // taps 取偶数，SIMD 两个一组处理时不需要单独处理最后一个
+            table->taps = std::min<size_t>((size_t)std::ceil(support) * 2 + 2, in);
+            table->start.resize(out);
+            table->weights.assign(out * table->taps, 0);
+            std::vector<double> w(table->taps);
+            for (size_t i = 0; i < out; ++i) {
+                const double center = (i + 0.5) * scale;
+                const long lo = std::max((long)std::floor(center - support + 0.5), 0L);
+                const long hi = std::min((long)std::floor(center + support + 0.5), (long)in);
+                // 贴近右边界时整体左移，保证每个像素都有 taps 个可读的源像素
+                const long first = std::min(lo, (long)in - (long)table->taps);
+                double total = 0;
+                for (size_t k = 0; k < table->taps; ++k) {
+                    const long x = first + (long)k;
+                    w[k] = x >= lo && x < hi
+                               ? Evaluate(filter, (x - center + 0.5) / filter_scale)
+                               : 0.0;
+                    total += w[k];
+                }
+                table->start[i] = (uint32_t)first;
+                int16_t* fixed = &table->weights[i * table->taps];
+                if (total == 0) {
+                    // 滤镜范围内没有源像素（极端缩小时可能出现），取最近的一个
+                    const long x = std::min((long)center, (long)in - 1) - first;
+                    fixed[std::max(0L, std::min(x, (long)table->taps - 1))] = 1 << 14;
+                    continue;
+                }
+                int sum = 0;
+                size_t largest = 0;
+                for (size_t k = 0; k < table->taps; ++k) {
+                    fixed[k] = (int16_t)std::lround(w[k] / total * (1 << 14));
+                    sum += fixed[k];
+                    if (fixed[k] > fixed[largest]) largest = k;
+                }
+                // 舍入误差补到最大的权重上，使纯色区域保持不变
+                fixed[largest] = (int16_t)(fixed[largest] + (1 << 14) - sum);
+            }
+            return table;
+        }
+
+        std::shared_ptr<const ResampleWeights> Weights(size_t in, size_t out,
+                                                       ResampleFilter filter) {
+            const auto key = std::make_tuple(in, out, (int)filter);
+            std::lock_guard<std::mutex> lock(mutex);
+            std::shared_ptr<const ResampleWeights>& table = tables[key];
+            if (!table) table = Build(in, out, filter);
+            return table;
+        }
+
+        static uint8_t Clamp(int32_t v) {
+            v = (v + (1 << 13)) >> 14;
+            return (uint8_t)(v < 0 ? 0 : v > 255 ? 255 : v);
+        }
+
+        // 预乘像素的颜色不能超过 alpha（负权重可能造成溢出）
+        static void ClampPremultiplied(uint8_t* p) {
+            p[0] = std::min(p[0], p[3]);
+            p[1] = std::min(p[1], p[3]);
+            p[2] = std::min(p[2], p[3]);
+        }
+
+#ifdef SAYOBOT_X86
+        // 每个像素的 (a, a, a, 255)，颜色与它取最小值后不超过 alpha
+        static __m128i AlphaBound(__m128i pixels) {
+            __m128i alpha = _mm_srli_epi32(pixels, 24);
+            alpha = _mm_or_si128(alpha, _mm_slli_epi32(alpha, 8));
+            alpha = _mm_or_si128(alpha, _mm_slli_epi32(alpha, 16));
+            return _mm_or_si128(alpha, _mm_set1_epi32((int)0xFF000000));
+        }
+#endif
+
+        static void HorizontalRow(const ResampleWeights& table, const uint8_t* src,
+                                  uint8_t* dst, size_t width) {
+            for (size_t i = 0; i < width; ++i, dst += 4) {
+                const uint8_t* s = src + (size_t)table.start[i] * 4;
+                const int16_t* w = &table.weights[i * table.taps];
+                size_t k = 0;
+#ifdef SAYOBOT_X86
+                // 两个源像素一组：交错成 (c0, c1) 的 16 位对，与 (w0, w1) 做 madd
+                const __m128i zero = _mm_setzero_si128();
+                __m128i acc = _mm_setzero_si128();
+                for (; k + 2 <= table.taps; k += 2) {
+                    const __m128i p = _mm_unpacklo_epi8(
+                        _mm_loadl_epi64(reinterpret_cast<const __m128i*>(s + k * 4)), zero);
+                    const __m128i pairs = _mm_unpacklo_epi16(p, _mm_srli_si128(p, 8));
+                    const __m128i weights =
+                        _mm_set1_epi32((int)((uint16_t)w[k] | ((uint32_t)(uint16_t)w[k + 1] << 16)));
+                    acc = _mm_add_epi32(acc, _mm_madd_epi16(pairs, weights));
+                }
+                for (; k < table.taps; ++k) {
+                    int32_t pixel;
+                    memcpy(&pixel, s + k * 4, 4);
+                    const __m128i p = _mm_unpacklo_epi8(_mm_cvtsi32_si128(pixel), zero);
+                    acc = _mm_add_epi32(acc,
+                                        _mm_madd_epi16(_mm_unpacklo_epi16(p, zero),
+                                                       _mm_set1_epi32((uint16_t)w[k])));
+                }
+                acc = _mm_srai_epi32(_mm_add_epi32(acc, _mm_set1_epi32(1 << 13)), 14);
+                const __m128i packed16 = _mm_packs_epi32(acc, acc);
+                __m128i packed = _mm_packus_epi16(packed16, packed16);
+                packed = _mm_min_epu8(packed, AlphaBound(packed));
+                const int32_t pixel = _mm_cvtsi128_si32(packed);
+                memcpy(dst, &pixel, 4);
+#else
+                int32_t sum[4] = {0, 0, 0, 0};
+                for (; k < table.taps; ++k)
+                    for (int c = 0; c < 4; ++c) sum[c] += s[k * 4 + c] * w[k];
+                for (int c = 0; c < 4; ++c) dst[c] = Clamp(sum[c]);
+                ClampPremultiplied(dst);
+#endif
+            }
+        }
+
+        static void VerticalRow(const ResampleWeights& table, size_t y, const BitmapView& src,
+                                uint8_t* dst, size_t width) {
+            const size_t first = table.start[y];
+            const int16_t* w = &table.weights[y * table.taps];
+            const size_t bytes = width * 4;
+            size_t x = 0;
+#ifdef SAYOBOT_X86
+            // 一次处理 8 个字节（2 个像素），两行一组做 madd
+            const __m128i zero = _mm_setzero_si128();
+            const __m128i round = _mm_set1_epi32(1 << 13);
+            for (; x + 8 <= bytes; x += 8) {
+                __m128i lo = round, hi = round;
+                size_t k = 0;
+                for (; k + 2 <= table.taps; k += 2) {
+                    const __m128i a = _mm_unpacklo_epi8(
+                        _mm_loadl_epi64(
+                            reinterpret_cast<const __m128i*>(src.Row(first + k) + x)),
+                        zero);
+                    const __m128i b = _mm_unpacklo_epi8(
+                        _mm_loadl_epi64(
+                            reinterpret_cast<const __m128i*>(src.Row(first + k + 1) + x)),
+                        zero);
+                    const __m128i weights =
+                        _mm_set1_epi32((int)((uint16_t)w[k] | ((uint32_t)(uint16_t)w[k + 1] << 16)));
+                    lo = _mm_add_epi32(lo, _mm_madd_epi16(_mm_unpacklo_epi16(a, b), weights));
+                    hi = _mm_add_epi32(hi, _mm_madd_epi16(_mm_unpackhi_epi16(a, b), weights));
+                }
+                if (k < table.taps) {
+                    const __m128i a = _mm_unpacklo_epi8(
+                        _mm_loadl_epi64(
+                            reinterpret_cast<const __m128i*>(src.Row(first + k) + x)),
+                        zero);
+                    const __m128i weights = _mm_set1_epi32((uint16_t)w[k]);
+                    lo = _mm_add_epi32(lo, _mm_madd_epi16(_mm_unpacklo_epi16(a, zero), weights));
+                    hi = _mm_add_epi32(hi, _mm_madd_epi16(_mm_unpackhi_epi16(a, zero), weights));
+                }
+                const __m128i packed16 =
+                    _mm_packs_epi32(_mm_srai_epi32(lo, 14), _mm_srai_epi32(hi, 14));
+                __m128i packed = _mm_packus_epi16(packed16, packed16);
+                packed = _mm_min_epu8(packed, AlphaBound(packed));
+                _mm_storel_epi64(reinterpret_cast<__m128i*>(dst + x), packed);
+            }
+#endif
+            for (; x < bytes; x += 4) {
+                int32_t sum[4] = {0, 0, 0, 0};
+                for (size_t k = 0; k < table.taps; ++k) {
+                    const uint8_t* s = src.Row(first + k) + x;
+                    for (int c = 0; c < 4; ++c) sum[c] += s[c] * w[k];
+                }
+                for (int c = 0; c < 4; ++c) dst[x + c] = Clamp(sum[c]);
+                ClampPremultiplied(dst + x);
+            }
+        }
+
+        std::mutex mutex;
+        std::map<std::tuple<size_t, size_t, int>, std::shared_ptr<const ResampleWeights>>
+            tables;
+    };
+} // namespace Sayobot
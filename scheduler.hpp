@@ -0,0 +1,238 @@
+#pragma once
+
+#include <algorithm>
+#include <atomic>
+#include <condition_variable>
+#include <cstdint>
+#include <deque>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <unordered_map>
+#include <vector>
+
+#include "render_context.hpp"
+
+namespace Sayobot {
+    /*
+     * 渲染任务队列
+     * 固定数量的工作线程，每个线程有按优先级分开的双端队列：
+     * 从自己队列的头部取任务，空闲时从其他线程队列的尾部窃取，总是先取高优先级的任务
+     * 键相同的任务在完成前只渲染一次，结果分发给所有等待的上下文；
+     * 排队（未开始）的任务数达到上限时新任务直接被拒绝
+     */
+    class RenderScheduler {
+    public:
+        static const int kPriorities = 3; // 0 最高
+
+        typedef void (*Callback)(RenderContext* ctx, int status, void* user);
+        // 在任务自己的上下文上完成渲染，返回 SAYOBOT_OK / SAYOBOT_ERROR
+        typedef std::function<int(RenderContext&)> Work;
+
+        struct Waiter {
+            RenderContext* ctx;
+            Callback callback;
+            void* user;
+        };
+
+        struct Counters {
+            std::atomic<uint64_t> submitted{0};
+            std::atomic<uint64_t> coalesced{0}; // 并入已有任务的请求
+            std::atomic<uint64_t> rejected{0};  // 队列已满被拒绝的请求
+            std::atomic<uint64_t> stolen{0};
+            std::atomic<uint64_t> completed{0};
+        };
+
+        static RenderScheduler& Instance() {
+            static RenderScheduler instance;
+            return instance;
+        }
+
+        RenderScheduler(const RenderScheduler&) = delete;
+        RenderScheduler& operator=(const RenderScheduler&) = delete;
+
+        ~RenderScheduler() {
+            {
+                std::lock_guard<std::mutex> lock(mutex);
+                stopping = true;
+            }
+            ready.notify_all();
+            for (auto& worker : workers)
+                if (worker->thread.joinable()) worker->thread.join();
+        }
+
+        /*
+         * 设置工作线程数和排队上限
+         * 线程在第一次提交任务时启动，之后线程数不再改变，只有排队上限生效
+         * 参数为 0 时分别取 CPU 核数和不限制
+         */
+        void Configure(size_t threads, size_t max_depth) {
+            std::lock_guard<std::mutex> lock(mutex);
+            if (workers.empty()) this->threads = threads;
+            this->max_depth = max_depth;
+        }
+
+        /*
+         * 提交任务，waiter.ctx 应已被调用方占用，完成后由这里释放并调用 callback
+         * 返回 SAYOBOT_OK，或在队列已满时返回 SAYOBOT_OVERLOADED（不调用 callback）
+         */
+        int Submit(const std::string& key, int priority, Work work, const Waiter& waiter) {
+            priority = std::max(0, std::min(priority, kPriorities - 1));
+            counters.submitted.fetch_add(1, std::memory_order_relaxed);
+            {
+                std::lock_guard<std::mutex> lock(mutex);
+                Start();
+                auto it = inflight.find(key);
+                if (it != inflight.end()) {
+                    Job& job = *it->second;
+                    job.waiters.push_back(waiter);
+                    counters.coalesced.fetch_add(1, std::memory_order_relaxed);
+                    // 高优先级的请求并入时，在高优先级队列中再放一份，先被取到的一份生效
+                    if (priority < job.priority && !job.started.load()) {
+                        job.priority = priority;
+                        Push(it->second, priority);
+                    }
+                    return SAYOBOT_OK;
+                }
+                if (max_depth && queued.load() >= max_depth) {
+                    counters.rejected.fetch_add(1, std::memory_order_relaxed);
+                    return SAYOBOT_OVERLOADED;
+                }
+                std::shared_ptr<Job> job = std::make_shared<Job>();
+                job->key = key;
+                job->work = std::move(work);
+                job->priority = priority;
+                job->waiters.push_back(waiter);
+                job->ctx.format = waiter.ctx->format;
+                job->ctx.quality = waiter.ctx->quality;
+                job->ctx.trace = waiter.ctx->trace;
+                inflight[key] = job;
+                queued.fetch_add(1);
+                Push(job, priority);
+            }
+            ready.notify_one();
+            return SAYOBOT_OK;
+        }
+
+        size_t Queued() const {
+            return queued.load();
+        }
+
+        size_t Running() const {
+            return running.load();
+        }
+
+        Counters counters;
+
+    private:
+        struct Job {
+            std::string key;
+            Work work;
+            int priority = 0;
+            std::atomic<bool> started{false};
+            std::vector<Waiter> waiters; // 由 mutex 保护
+            RenderContext ctx;
+        };
+
+        struct Worker {
+            std::mutex mutex;
+            std::deque<std::shared_ptr<Job>> queues[kPriorities];
+            std::thread thread;
+        };
+
+        RenderScheduler() = default;
+
+        // 持有 mutex 时调用
+        void Start() {
+            if (!workers.empty()) return;
+            const size_t n =
+                threads ? threads : std::max(1u, std::thread::hardware_concurrency());
+            for (size_t i = 0; i < n; ++i) workers.emplace_back(new Worker());
+            for (size_t i = 0; i < n; ++i)
+                workers[i]->thread = std::thread([this, i] { Loop(i); });
+        }
+
+        // 持有 mutex 时调用，轮流放入各线程的队列
+        void Push(const std::shared_ptr<Job>& job, int priority) {
+            Worker& worker = *workers[next_worker++ % workers.size()];
+            std::lock_guard<std::mutex> lock(worker.mutex);
+            worker.queues[priority].push_back(job);
+        }
+
+        // 从 worker 的队列中取出一个还没开始的任务，owner 为 true 时取头部，否则取尾部
+        std::shared_ptr<Job> Take(Worker& worker, int priority, bool owner) {
+            std::lock_guard<std::mutex> lock(worker.mutex);
+            std::deque<std::shared_ptr<Job>>& queue = worker.queues[priority];
+            while (!queue.empty()) {
+                std::shared_ptr<Job> job;
+                if (owner) {
+                    job = std::move(queue.front());
+                    queue.pop_front();
+                } else {
+                    job = std::move(queue.back());
+                    queue.pop_back();
+                }
+                if (!job->started.exchange(true)) return job;
+            }
+            return nullptr;
+        }
+
+        std::shared_ptr<Job> Next(size_t self) {
+            const size_t n = workers.size();
+            for (int p = 0; p < kPriorities; ++p) {
+                if (std::shared_ptr<Job> job = Take(*workers[self], p, true)) return job;
+                for (size_t k = 1; k < n; ++k) {
+                    if (std::shared_ptr<Job> job = Take(*workers[(self + k) % n], p, false)) {
+                        counters.stolen.fetch_add(1, std::memory_order_relaxed);
+                        return job;
+                    }
+                }
+            }
+            return nullptr;
+        }
+
+        void Loop(size_t self) {
+            for (;;) {
+                std::shared_ptr<Job> job = Next(self);
+                if (!job) {
+                    std::unique_lock<std::mutex> lock(mutex);
+                    ready.wait(lock, [this] { return stopping || queued.load() > 0; });
+                    if (stopping && !queued.load()) return;
+                    continue;
+                }
+                queued.fetch_sub(1);
+                running.fetch_add(1);
+                const int status = job->work(job->ctx);
+                running.fetch_sub(1);
+                std::vector<Waiter> waiters;
+                {
+                    std::lock_guard<std::mutex> lock(mutex);
+                    auto it = inflight.find(job->key);
+                    if (it != inflight.end() && it->second == job) inflight.erase(it);
+                    waiters.swap(job->waiters);
+                }
+                counters.completed.fetch_add(1, std::memory_order_relaxed);
+                for (const Waiter& w : waiters) {
+                    w.ctx->error = job->ctx.error;
+                    w.ctx->output = job->ctx.output;
+                    w.ctx->trace_json = job->ctx.trace_json;
+                    w.ctx->Release();
+                    if (w.callback) w.callback(w.ctx, status, w.user);
+                }
+            }
+        }
+
+        std::mutex mutex;
+        std::condition_variable ready;
+        std::vector<std::unique_ptr<Worker>> workers;
+        std::unordered_map<std::string, std::shared_ptr<Job>> inflight;
+        std::atomic<size_t> queued{0};
+        std::atomic<size_t> running{0};
+        size_t threads = 0;
+        size_t max_depth = 0;
+        size_t next_worker = 0;
+        bool stopping = false;
+    };
+} // namespace Sayobot
@@ -0,0 +1,70 @@
+#pragma once
+
+#include <cstddef>
+#include <string>
+#include <utility>
+#include <vector>
+
+namespace Sayobot {
+    /*
+     * 线程内复用的临时对象（格式化用的字符串、字段值数组等）
+     * 借出时取本线程空闲的一个，析构时连同容量一起归还，
+     * 稳定运行时渲染路径上的这些临时对象不再分配内存；可以嵌套借用
+     * 借到的对象内容不确定，由使用方清空或覆盖
+     */
+    template <typename T>
+    class Scratch {
+    public:
+        Scratch() {
+            std::vector<T>& free = Free();
+            if (free.empty()) return;
+            value = std::move(free.back());
+            free.pop_back();
+        }
+
+        ~Scratch() {
+            std::vector<T>& free = Free();
+            if (free.size() < kMaxFree) free.push_back(std::move(value));
+        }
+
+        Scratch(const Scratch&) = delete;
+        Scratch& operator=(const Scratch&) = delete;
+
+        T& operator*() {
+            return value;
+        }
+
+        T* operator->() {
+            return &value;
+        }
+
+    private:
+        static const size_t kMaxFree = 8;
+
+        static std::vector<T>& Free() {
+            thread_local std::vector<T> free = [] {
+                std::vector<T> v;
+                v.reserve(kMaxFree);
+                return v;
+            }();
+            return free;
+        }
+
+        T value;
+    };
+
+    // 把整数的十进制表示追加到 out，在栈上转换，不产生临时字符串
+    inline void AppendInt(std::string& out, long long value) {
+        char buf[24];
+        char* const end = buf + sizeof(buf);
+        char* p = end;
+        unsigned long long v =
+            value < 0 ? 0ull - (unsigned long long)value : (unsigned long long)value;
+        do {
+            *--p = (char)('0' + v % 10);
+            v /= 10;
+        } while (v);
+        if (value < 0) *--p = '-';
+        out.append(p, (size_t)(end - p));
+    }
+} // namespace Sayobot
@@ -0,0 +1,60 @@
+#pragma once
+
+#include <chrono>
+#include <cstdint>
+#include <string>
+
+#include "metrics.hpp"
+
+namespace Sayobot {
+    // 当前线程在各阶段累计花费的时间（纳秒）
+    struct StageTimes {
+        uint64_t ns[StageCount] = {};
+    };
+
+    inline StageTimes& ThreadStageTimes() {
+        thread_local StageTimes times;
+        return times;
+    }
+
+    inline uint64_t NowNs() {
+        return (uint64_t)std::chrono::duration_cast<std::chrono::nanoseconds>(
+                   std::chrono::steady_clock::now().time_since_epoch())
+            .count();
+    }
+
+    /*
+     * 在作用域内计时，结束时计入当前线程的 stage 和进程的 Metrics
+     * 参数列表:
+     *** stage (Stage) 所属阶段
+     *** 可选 label 跟踪模式下事件的说明（如素材路径）
+     *** 可选 extra 额外记录的直方图（如按素材分类的解码时间）
+     */
+    class ScopedStage {
+    public:
+        explicit ScopedStage(Stage stage, const std::string* label = nullptr,
+                             Histogram* extra = nullptr)
+            : stage(stage), label(label), extra(extra), begin(NowNs()) {
+        }
+
+        ~ScopedStage() {
+            const uint64_t end = NowNs();
+            const uint64_t ns = end - begin;
+            ThreadStageTimes().ns[stage] += ns;
+            Metrics::Instance().stages[stage].Record(ns);
+            if (extra) extra->Record(ns);
+            if (TraceLog* trace = ThreadTrace())
+                trace->events.push_back(TraceLog::Event{
+                    stage, label ? *label : std::string(), begin - trace->begin_ns, ns});
+        }
+
+        ScopedStage(const ScopedStage&) = delete;
+        ScopedStage& operator=(const ScopedStage&) = delete;
+
+    private:
+        Stage stage;
+        const std::string* label;
+        Histogram* extra;
+        uint64_t begin;
+    };
+} // namespace Sayobot
@@ -0,0 +1,7 @@
+#pragma once
+
+// 导出函数和渲染服务协议共用的状态码
+#define SAYOBOT_OK 0
+#define SAYOBOT_ERROR 1
+#define SAYOBOT_BUSY 2
+#define SAYOBOT_OVERLOADED 3 // 渲染队列已满
@@ -0,0 +1,395 @@
+#pragma once
+
+#include <ft2build.h>
+#include FT_FREETYPE_H
+
+#include <algorithm>
+#include <cmath>
+#include <cstdint>
+#include <cstring>
+#include <memory>
+#include <mutex>
+#include <stdexcept>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+#include "bitmap.hpp"
+
+namespace Sayobot {
+    // 解析颜色字符串为 0xRRGGBBAA，支持 #RGB、#RGBA、#RRGGBB、#RRGGBBAA 和常用颜色名
+    // 无法识别时（如 "default"）返回黑色
+    inline uint32_t ParseColor(const std::string& color) {
+        if (!color.empty() && color[0] == '#') {
+            uint32_t v = 0;
+            size_t digits = 0;
+            for (size_t i = 1; i < color.size(); ++i, ++digits) {
+                const char c = color[i];
+                uint32_t d;
+                if (c >= '0' && c <= '9')
+                    d = c - '0';
+                else if (c >= 'a' && c <= 'f')
+                    d = c - 'a' + 10;
+                else if (c >= 'A' && c <= 'F')
+                    d = c - 'A' + 10;
+                else
+                    return 0x000000FF;
+                v = v << 4 | d;
+            }
+            switch (digits) {
+            case 3:
+                v = v << 4 | 0xF;
+                // fallthrough
+            case 4:
+                return (v >> 12 & 0xF) * 0x11000000u + (v >> 8 & 0xF) * 0x110000u
+                       + (v >> 4 & 0xF) * 0x1100u + (v & 0xF) * 0x11u;
+            case 6:
+                return v << 8 | 0xFF;
+            case 8:
+                return v;
+            default:
+                return 0x000000FF;
+            }
+        }
+        static const std::unordered_map<std::string, uint32_t> names = {
+            {"black", 0x000000FF},
+            {"white", 0xFFFFFFFF},
+            {"red", 0xFF0000FF},
+            {"green", 0x008000FF},
+            {"blue", 0x0000FFFF},
+            {"yellow", 0xFFFF00FF},
+            {"gray", 0x808080FF},
+            {"grey", 0x808080FF},
+            {"pink", 0xFFC0CBFF},
+            {"transparent", 0x00000000},
+            {"none", 0x00000000}};
+        auto it = names.find(color);
+        return it == names.end() ? 0x000000FF : it->second;
+    }
+
+    // 解码一个 UTF-8 字符，非法字节按 U+FFFD 处理
+    inline uint32_t NextCodepoint(const char*& p, const char* end) {
+        const unsigned char c = *p++;
+        if (c < 0x80) return c;
+        int extra = c >= 0xF0 ? 3 : c >= 0xE0 ? 2 : c >= 0xC0 ? 1 : -1;
+        if (extra < 0) return 0xFFFD;
+        uint32_t cp = c & (0x3F >> extra);
+        for (int i = 0; i < extra; ++i) {
+            if (p == end || (*p & 0xC0) != 0x80) return 0xFFFD;
+            cp = cp << 6 | (*p++ & 0x3F);
+        }
+        return cp;
+    }
+
+    // 栅格化后的字形：8 位覆盖率位图和排版信息
+    struct Glyph {
+        uint32_t index = 0;   // 字体内的字形编号，用于字距调整
+        int left = 0;         // 位图相对笔位置的水平偏移
+        int top = 0;          // 位图顶部相对基线的高度
+        int width = 0, rows = 0;
+        long advance = 0;     // 26.6 定点数
+        std::vector<uint8_t> coverage;
+    };
+
+    /*
+     * 一个字体文件
+     * FT_Face 本身不是线程安全的，栅格化时持有锁，
+     * 栅格化结果按 (字号, 字符) 缓存，跨调用、跨卡片复用
+     */
+    class FontFace {
+    public:
+        FontFace(FT_Library library, const std::string& path) {
+            if (FT_New_Face(library, path.c_str(), 0, &face))
+                throw std::runtime_error("Cannot load font: " + path);
+        }
+
+        ~FontFace() {
+            FT_Done_Face(face);
+        }
+
+        FontFace(const FontFace&) = delete;
+        FontFace& operator=(const FontFace&) = delete;
+
+        // size 为像素字号（72 DPI 下与 pointsize 相同）
+        std::shared_ptr<const Glyph> GetGlyph(uint32_t codepoint, double size) {
+            const long size26 = std::lround(size * 64);
+            const uint64_t key = (uint64_t)size26 << 32 | codepoint;
+            std::lock_guard<std::mutex> lock(mutex);
+            auto it = glyphs.find(key);
+            if (it != glyphs.end()) return it->second;
+
+            SetSize(size26);
+            auto glyph = std::make_shared<Glyph>();
+            glyph->index = FT_Get_Char_Index(face, codepoint);
+            if (!FT_Load_Glyph(face, glyph->index, FT_LOAD_DEFAULT)
+                && !FT_Render_Glyph(face->glyph, FT_RENDER_MODE_NORMAL)) {
+                const FT_GlyphSlot slot = face->glyph;
+                const FT_Bitmap& bitmap = slot->bitmap;
+                glyph->left = slot->bitmap_left;
+                glyph->top = slot->bitmap_top;
+                glyph->width = bitmap.width;
+                glyph->rows = bitmap.rows;
+                glyph->advance = slot->advance.x;
+                glyph->coverage.resize((size_t)bitmap.width * bitmap.rows);
+                for (unsigned int y = 0; y < bitmap.rows; ++y) {
+                    memcpy(glyph->coverage.data() + (size_t)y * bitmap.width,
+                           bitmap.buffer + (ptrdiff_t)y * bitmap.pitch,
+                           bitmap.width);
+                }
+            }
+            // 字形缓存超出上限时整体丢弃，正在使用的字形由 shared_ptr 保持
+            cached_bytes += glyph->coverage.size() + sizeof(Glyph);
+            if (cached_bytes > max_cached_bytes) {
+                glyphs.clear();
+                kernings.clear();
+                cached_bytes = glyph->coverage.size() + sizeof(Glyph);
+            }
+            glyphs.emplace(key, glyph);
+            return glyph;
+        }
+
+        // 两个字形之间的字距调整，26.6 定点数
+        long Kerning(uint32_t left, uint32_t right, double size) {
+            if (!FT_HAS_KERNING(face) || !left || !right) return 0;
+            const long size26 = std::lround(size * 64);
+            const uint64_t key = (uint64_t)size26 << 32 | (left & 0xFFFF) << 16
+                                 | (right & 0xFFFF);
+            std::lock_guard<std::mutex> lock(mutex);
+            auto it = kernings.find(key);
+            if (it != kernings.end()) return it->second;
+            SetSize(size26);
+            FT_Vector delta;
+            long kerning = 0;
+            if (!FT_Get_Kerning(face, left, right, FT_KERNING_DEFAULT, &delta))
+                kerning = delta.x;
+            kernings.emplace(key, kerning);
+            return kerning;
+        }
+
+    private:
+        void SetSize(long size26) {
+            if (size26 == current_size) return;
+            FT_Set_Char_Size(face, 0, size26, 72, 72);
+            current_size = size26;
+        }
+
+        FT_Face face = nullptr;
+        std::mutex mutex;
+        long current_size = 0;
+        std::unordered_map<uint64_t, std::shared_ptr<const Glyph>> glyphs;
+        std::unordered_map<uint64_t, long> kernings;
+        size_t cached_bytes = 0;
+        const size_t max_cached_bytes = 16u << 20;
+    };
+
+    /*
+     * 已加载的字体，按路径共享
+     * 字体在进程生命周期内不会被释放，取得的指针一直有效
+     */
+    class FontRegistry {
+    public:
+        static FontRegistry& Instance() {
+            static FontRegistry instance;
+            return instance;
+        }
+
+        FontFace* Get(const std::string& path) {
+            std::lock_guard<std::mutex> lock(mutex);
+            auto it = faces.find(path);
+            if (it != faces.end()) return it->second.get();
+            auto face = std::unique_ptr<FontFace>(new FontFace(library, path));
+            FontFace* result = face.get();
+            faces.emplace(path, std::move(face));
+            return result;
+        }
+
+    private:
+        FontRegistry() {
+            if (FT_Init_FreeType(&library))
+                throw std::runtime_error("Cannot initialize FreeType");
+        }
+
+        ~FontRegistry() {
+            faces.clear();
+            FT_Done_FreeType(library);
+        }
+
+        FT_Library library = nullptr;
+        std::mutex mutex;
+        std::unordered_map<std::string, std::unique_ptr<FontFace>> faces;
+    };
+
+    enum class TextAlign { Left, Center, Right };
+
+    /*
+     * 一张卡片上待绘制的所有文字
+     * 先收集文字，最后一次性画到一张透明图层上（预乘 RGBA8），
+     * 由调用方把图层合成到画布上
+     */
+    class TextBatch {
+    public:
+        TextBatch() = default;
+        TextBatch(TextBatch&&) = default;
+        TextBatch& operator=(TextBatch&&) = default;
+
+        TextBatch(const TextBatch& other) {
+            *this = other;
+        }
+
+        // 只复制有效的 Run，已有的字符串容量保留
+        TextBatch& operator=(const TextBatch& other) {
+            if (this == &other) return *this;
+            count = 0;
+            for (size_t i = 0; i < other.count; ++i) {
+                const Run& run = other.runs[i];
+                Add(run.text, run.face, run.size, run.color, run.x, run.y, run.align);
+            }
+            placed = other.placed;
+            laid_out = other.laid_out;
+            return *this;
+        }
+
+        // (x, y) 为基线起点，居中、右对齐时为基线的中点、终点
+        void Add(const std::string& text, FontFace* face, double size, uint32_t color,
+                 double x, double y, TextAlign align = TextAlign::Left) {
+            // 清空后保留各 Run 的字符串，逐张卡片复用，不再分配
+            if (count == runs.size()) runs.emplace_back();
+            Run& run = runs[count++];
+            run.text.assign(text);
+            run.face = face;
+            run.size = size;
+            run.color = color;
+            run.x = x;
+            run.y = y;
+            run.align = align;
+        }
+
+        bool Empty() const {
+            return !count;
+        }
+
+        void Clear() {
+            count = 0;
+            placed.clear();
+            laid_out = 0;
+        }
+
+        // 所有文字在画布 (width x height) 内的包围盒，为空时返回 false
+        bool Bounds(int width, int height, int& x0, int& y0, int& x1, int& y1) {
+            Layout();
+            return Box(0, width, height, x0, y0, x1, y1);
+        }
+
+        // 最后加入的一段文字的包围盒，用于绘制时顺带测量
+        bool LastBounds(int width, int height, int& x0, int& y0, int& x1, int& y1) {
+            if (!count) return false;
+            Layout();
+            return Box(runs[count - 1].first, width, height, x0, y0, x1, y1);
+        }
+
+        /*
+         * 把文字画到预乘 RGBA8 图层上
+         * 参数列表:
+         *** pixels (uint8_t*) 图层左上角，每行 stride 字节
+         *** origin_x, origin_y (int) 图层左上角在画布上的坐标
+         *** width, height (int) 图层尺寸
+         */
+        void Render(uint8_t* pixels, size_t stride, int origin_x, int origin_y,
+                    int width, int height) {
+            Layout();
+            for (const Placed& p : placed) {
+                const Glyph& g = *p.glyph;
+                const int gx0 = std::max(p.x, origin_x);
+                const int gy0 = std::max(p.y, origin_y);
+                const int gx1 = std::min(p.x + g.width, origin_x + width);
+                const int gy1 = std::min(p.y + g.rows, origin_y + height);
+                const uint32_t r = p.color >> 24, gr = p.color >> 16 & 0xFF,
+                               b = p.color >> 8 & 0xFF, a = p.color & 0xFF;
+                for (int y = gy0; y < gy1; ++y) {
+                    const uint8_t* src =
+                        g.coverage.data() + (size_t)(y - p.y) * g.width + (gx0 - p.x);
+                    uint8_t* dst = pixels + (size_t)(y - origin_y) * stride
+                                   + (size_t)(gx0 - origin_x) * 4;
+                    for (int x = gx0; x < gx1; ++x, ++src, dst += 4) {
+                        if (!*src) continue;
+                        const uint32_t sa = Mul255(*src, a);
+                        const uint32_t inv = 255 - sa;
+                        dst[0] = Mul255(r, sa) + Mul255(dst[0], inv);
+                        dst[1] = Mul255(gr, sa) + Mul255(dst[1], inv);
+                        dst[2] = Mul255(b, sa) + Mul255(dst[2], inv);
+                        dst[3] = sa + Mul255(dst[3], inv);
+                    }
+                }
+            }
+        }
+
+    private:
+        struct Run {
+            std::string text;
+            FontFace* face = nullptr;
+            double size = 0;
+            uint32_t color = 0;
+            double x = 0, y = 0;
+            TextAlign align = TextAlign::Left;
+            size_t first = 0; // 排版后第一个字形在 placed 中的下标
+        };
+
+        // 已经确定位置的字形，(x, y) 为位图左上角
+        struct Placed {
+            std::shared_ptr<const Glyph> glyph;
+            int x, y;
+            uint32_t color;
+        };
+
+        void Layout() {
+            if (laid_out == count) return;
+            for (size_t i = laid_out; i < count; ++i) {
+                Run& run = runs[i];
+                const size_t first = run.first = placed.size();
+                long pen = 0; // 26.6
+                uint32_t previous = 0;
+                const char* p = run.text.data();
+                const char* end = p + run.text.size();
+                while (p < end) {
+                    const uint32_t codepoint = NextCodepoint(p, end);
+                    auto glyph = run.face->GetGlyph(codepoint, run.size);
+                    pen += run.face->Kerning(previous, glyph->index, run.size);
+                    placed.push_back(Placed{glyph, (int)(pen >> 6), 0, run.color});
+                    pen += glyph->advance;
+                    previous = glyph->index;
+                }
+                double origin = run.x;
+                if (run.align == TextAlign::Center)
+                    origin -= pen / 128.0;
+                else if (run.align == TextAlign::Right)
+                    origin -= pen / 64.0;
+                const int ox = (int)std::lround(origin);
+                const int baseline = (int)std::lround(run.y);
+                for (size_t j = first; j < placed.size(); ++j) {
+                    placed[j].x += ox + placed[j].glyph->left;
+                    placed[j].y = baseline - placed[j].glyph->top;
+                }
+            }
+            laid_out = count;
+        }
+
+        // 从第 from 个字形起的包围盒
+        bool Box(size_t from, int width, int height, int& x0, int& y0, int& x1,
+                 int& y1) const {
+            x0 = width, y0 = height, x1 = 0, y1 = 0;
+            for (size_t i = from; i < placed.size(); ++i) {
+                const Placed& p = placed[i];
+                x0 = std::min(x0, std::max(p.x, 0));
+                y0 = std::min(y0, std::max(p.y, 0));
+                x1 = std::max(x1, std::min(p.x + p.glyph->width, width));
+                y1 = std::max(y1, std::min(p.y + p.glyph->rows, height));
+            }
+            return x0 < x1 && y0 < y1;
+        }
+
+        std::vector<Run> runs; // 前 count 个有效
+        std::vector<Placed> placed;
+        size_t count = 0;
+        size_t laid_out = 0;
+    };
+} // namespace Sayobot
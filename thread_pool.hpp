@@ -0,0 +1,167 @@
+#pragma once
+
+#include <algorithm>
+#include <atomic>
+#include <condition_variable>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+namespace Sayobot {
+    /*
+     * 固定大小的线程池
+     * 进程内共享一个，线程数默认等于 CPU 核数
+     * 任务不能抛出异常，也不应在任务中等待其他任务
+     * 稳定运行时 ParallelFor 不分配内存：状态对象在池中复用，任务队列保留容量
+     */
+    class ThreadPool {
+    public:
+        static ThreadPool& Shared() {
+            static ThreadPool pool(std::max(1u, std::thread::hardware_concurrency()));
+            return pool;
+        }
+
+        explicit ThreadPool(size_t threads) {
+            for (size_t i = 0; i < threads; ++i) workers.emplace_back([this] { Work(); });
+        }
+
+        ThreadPool(const ThreadPool&) = delete;
+        ThreadPool& operator=(const ThreadPool&) = delete;
+
+        ~ThreadPool() {
+            {
+                std::lock_guard<std::mutex> lock(mutex);
+                stopping = true;
+            }
+            ready.notify_all();
+            for (std::thread& worker : workers) worker.join();
+        }
+
+        void Submit(std::function<void()> task) {
+            {
+                std::lock_guard<std::mutex> lock(mutex);
+                // 队列满时先挪掉已经取走的任务，不让容量跟着提交总数增长
+                if (head && tasks.size() == tasks.capacity()) {
+                    tasks.erase(tasks.begin(), tasks.begin() + (long)head);
+                    head = 0;
+                }
+                tasks.push_back(std::move(task));
+            }
+            ready.notify_one();
+        }
+
+        size_t Size() const {
+            return workers.size();
+        }
+
+        /*
+         * 在至多 count 个线程上（包括调用线程）运行 body(i)，i 取遍 [0, n)，全部完成后返回
+         * 调用线程也参与执行；还没开始的辅助任务在调用线程做完后直接放弃，
+         * 线程池被占满（包括在任务中嵌套调用）时不会死锁
+         */
+        template <typename Body>
+        void ParallelFor(size_t n, size_t count, const Body& body) {
+            if (!n) return;
+            count = std::max<size_t>(1, std::min(std::min(count, n), Size() + 1));
+            ForState* state = TakeState();
+            state->n = n;
+            state->body = &body;
+            state->call = [](const void* body, size_t i) {
+                (*static_cast<const Body*>(body))(i);
+            };
+            for (size_t t = 1; t < count; ++t) {
+                state->refs.fetch_add(1);
+                // 只捕获两个指针，std::function 不需要分配
+                Submit([this, state] { Help(state); });
+            }
+            state->Loop();
+            {
+                std::unique_lock<std::mutex> lock(state->mutex);
+                state->closed = true;
+                state->done.wait(lock, [state] { return !state->active; });
+            }
+            Release(state);
+        }
+
+    private:
+        void Work() {
+            for (;;) {
+                std::function<void()> task;
+                {
+                    std::unique_lock<std::mutex> lock(mutex);
+                    ready.wait(lock, [this] { return stopping || head < tasks.size(); });
+                    if (head == tasks.size()) return;
+                    task = std::move(tasks[head]);
+                    if (++head == tasks.size()) tasks.clear(), head = 0;
+                }
+                task();
+            }
+        }
+
+        // 一次 ParallelFor 的共享状态，调用线程和各辅助任务都放手后回到 idle 中
+        struct ForState {
+            std::mutex mutex;
+            std::condition_variable done;
+            std::atomic<size_t> next{0};
+            std::atomic<size_t> refs{0};
+            size_t n = 0;
+            size_t active = 0;
+            bool closed = false;
+            const void* body = nullptr;
+            void (*call)(const void*, size_t) = nullptr;
+
+            void Loop() {
+                for (size_t i; (i = next.fetch_add(1)) < n;) call(body, i);
+            }
+        };
+
+        ForState* TakeState() {
+            ForState* state;
+            {
+                std::lock_guard<std::mutex> lock(mutex);
+                if (idle.empty()) {
+                    state = new ForState;
+                } else {
+                    state = idle.back().release();
+                    idle.pop_back();
+                }
+            }
+            state->next = 0;
+            state->refs = 1;
+            state->active = 0;
+            state->closed = false;
+            return state;
+        }
+
+        void Release(ForState* state) {
+            if (state->refs.fetch_sub(1) != 1) return;
+            std::lock_guard<std::mutex> lock(mutex);
+            idle.emplace_back(state);
+        }
+
+        void Help(ForState* state) {
+            bool run;
+            {
+                std::lock_guard<std::mutex> lock(state->mutex);
+                run = !state->closed;
+                if (run) ++state->active;
+            }
+            if (run) {
+                state->Loop();
+                std::lock_guard<std::mutex> lock(state->mutex);
+                if (!--state->active) state->done.notify_one();
+            }
+            Release(state);
+        }
+
+        std::vector<std::thread> workers;
+        std::mutex mutex;
+        std::condition_variable ready;
+        std::vector<std::function<void()>> tasks; // [head, size) 为排队中的任务
+        size_t head = 0;
+        std::vector<std::unique_ptr<ForState>> idle;
+        bool stopping = false;
+    };
+} // namespace Sayobot